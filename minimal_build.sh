@@ -20,9 +20,9 @@ echo '#define WAYPIPE_VERSION "minimal"' > config-waypipe.h
 echo "Compiling..."
 gcc -D_DEFAULT_SOURCE -Os -I. -I../protocols/ -lpthread -o waypipe protocols.c \
     ../src/bench.c ../src/client.c ../src/dmabuf.c ../src/handlers.c \
-    ../src/interval.c ../src/kernel.c ../src/mainloop.c ../src/parsing.c \
-    ../src/platform.c ../src/server.c ../src/shadow.c ../src/util.c \
-    ../src/video.c ../src/waypipe.c
+    ../src/interval.c ../src/kernel.c ../src/mainloop.c ../src/mux.c \
+    ../src/parsing.c ../src/platform.c ../src/server.c ../src/shadow.c \
+    ../src/util.c ../src/video.c ../src/waypipe.c
 
 cd ..
 echo "Done. See ./build-minimal/waypipe"
@@ -290,6 +290,20 @@ def load_msg_data(func_name, func, for_export):
     gap_ends.append(0)
     gap_codes = [str(g * 4 + e) for g, e in zip(gaps, gap_ends)]
 
+    # Strings and arrays split the payload into runs of fixed-size words;
+    # a run includes the length prefix of the string/array that ends it
+    base_words = 0
+    check_sig = [0]
+    for arg_name, arg_type, arg_interface in w_args:
+        if arg_type == "fd":
+            continue
+        base_words += 1
+        check_sig[-1] += 1
+        if arg_type in ("string", "array"):
+            check_sig.append(arg_type)
+            check_sig.append(0)
+    check_sig = tuple(check_sig) if len(check_sig) > 1 else None
+
     is_destructor = "type" in func.attrib and func.attrib["type"] == "destructor"
     is_request = item.tag == "request"
     short_name = func.attrib["name"]
@@ -303,11 +317,47 @@ def load_msg_data(func_name, func, for_export):
         is_destructor,
         num_fd_args,
         for_export,
+        base_words,
+        check_sig,
+    )
+
+
+def write_check(ostream, check_name, check_sig):
+    """
+    Write a straight-line validator for a message signature with strings or
+    arrays, equivalent to walking the gap codes in size_check. The caller
+    has already ensured that the payload has at least base_words words.
+    """
+    W = lambda *x: print(*x, file=ostream)
+    W(
+        "static bool {}(const uint32_t *payload, unsigned int length) {{".format(
+            check_name
+        )
     )
+    W("\tuint32_t pos = {};".format(check_sig[0]))
+    W("\tuint32_t n;")
+    for k in range(1, len(check_sig), 2):
+        arg_type, run = check_sig[k], check_sig[k + 1]
+        if k > 1:
+            W("\tif (pos > length) return false;")
+        W("\tn = (payload[pos - 1] >> 2) + ((payload[pos - 1] & 0x3) != 0);")
+        if arg_type == "string":
+            W(
+                "\tif (pos + n - 1 < length && !has_empty_bytes(payload[pos + n - 1])) return false;"
+            )
+        W("\tpos += n + {};".format(run))
+    W("\treturn pos <= length;")
+    W("}")
 
 
 def write_interface(
-    ostream, iface_name, func_data, gap_code_array, new_obj_array, dest_name
+    ostream,
+    iface_name,
+    func_data,
+    gap_code_array,
+    new_obj_array,
+    check_names,
+    dest_name,
 ):
     reqs, evts = [], []
     for x in func_data:
@@ -332,6 +382,8 @@ def write_interface(
             is_destructor,
             num_fd_args,
             for_export,
+            base_words,
+            check_sig,
         ) = x
         msg_names.append(short_name)
 
@@ -339,6 +391,8 @@ def write_interface(
         mda.append(
             "gaps_{} + {}".format(dest_name, get_offset(gap_code_array, gap_codes))
         )
+        mda.append(str(base_words))
+        mda.append(check_names[check_sig] if check_sig is not None else "NULL")
         if len(new_objs) > 0:
             mda.append(
                 "objt_{} + {}".format(dest_name, get_offset(new_obj_array, new_objs))
@@ -475,6 +529,25 @@ if __name__ == "__main__":
                 W("\t" + ",\n\t".join(gap_code_array))
                 W("};")
 
+            # Messages with the same layout of strings and arrays share
+            # one validator
+            check_names = {}
+            for iface_name, func_data in interface_data:
+                for x in func_data:
+                    check_sig = x[9]
+                    if check_sig is not None and check_sig not in check_names:
+                        check_names[check_sig] = "check_{}_{}".format(
+                            dest_name, len(check_names)
+                        )
+            if len(check_names) > 0:
+                W("static bool has_empty_bytes(uint32_t v) {")
+                W(
+                    "\treturn ((v & 0xFF) == 0) || ((v & 0xFF00) == 0) || ((v & 0xFF0000) == 0) || ((v & 0xFF000000) == 0);"
+                )
+                W("}")
+            for check_sig, check_name in check_names.items():
+                write_check(ostream, check_name, check_sig)
+
             for iface_name, func_data in interface_data:
                 write_interface(
                     ostream,
@@ -482,6 +555,7 @@ if __name__ == "__main__":
                     func_data,
                     gap_code_array,
                     new_obj_array,
+                    check_names,
                     dest_name,
                 )
 
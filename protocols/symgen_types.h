@@ -6,6 +6,7 @@ struct context;
 struct message_tracker;
 struct wp_object;
 typedef void (*wp_callfn_t)(struct context *ctx, const uint32_t *payload, const int *fds, struct message_tracker *mt);
+typedef bool (*wp_checkfn_t)(const uint32_t *payload, unsigned int length);
 #define GAP_CODE_END 0x0
 #define GAP_CODE_OBJ 0x1
 #define GAP_CODE_ARR 0x2
@@ -15,6 +16,12 @@ struct msg_data {
 	 * (Note: 16-bit length is sufficient since message lengths also 16-bit)
 	 * Lowest 2 bits indicate if what follows is end/obj/array/string */
 	const uint16_t* gaps;
+	/* Number of 4-byte blocks in the message, not counting the contents
+	 * of strings and arrays; for other messages, this is the exact size */
+	const uint16_t base_words;
+	/* Generated validator for the strings and arrays of a message with at
+	 * least base_words blocks; null if the message has none */
+	const wp_checkfn_t check;
 	/* Pointer to new object types, can be null if none indicated */
 	const struct wp_interface **new_objs;
 	/* Function pointer to parse + invoke do_ handler */
@@ -352,6 +352,113 @@ static struct bench_result run_sub_bench(bool first,
 	return res;
 }
 
+/* Collect an update for the shadow, run all of its tasks, and return the
+ * time taken in seconds */
+static float time_update(struct thread_pool *pool, struct shadow_fd *sfd)
+{
+	struct transfer_queue transfer_data;
+	memset(&transfer_data, 0, sizeof(struct transfer_queue));
+	pthread_mutex_init(&transfer_data.async_recv_queue.lock, NULL);
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_REALTIME, &t0);
+	collect_update(pool, sfd, &transfer_data, false);
+	start_parallel_work(pool, &transfer_data.async_recv_queue);
+	while (1) {
+		uint8_t flush[64];
+		(void)read(pool->selfpipe_r, flush, sizeof(flush));
+
+		bool done = false;
+		struct task_data task;
+		if (request_work_task(pool, &task, &done)) {
+			run_task(&task, &pool->threads[0]);
+
+			pthread_mutex_lock(&pool->work_mutex);
+			pool->tasks_in_progress--;
+			pthread_mutex_unlock(&pool->work_mutex);
+		} else if (done) {
+			break;
+		} else {
+			struct timespec delay_time = {
+					.tv_sec = 0, .tv_nsec = 10000};
+			nanosleep(&delay_time, NULL);
+		}
+	}
+	transfer_load_async(&transfer_data);
+	finish_update(sfd);
+	cleanup_transfer_queue(&transfer_data);
+	clock_gettime(CLOCK_REALTIME, &t1);
+	return 1.0f * (float)(t1.tv_sec - t0.tv_sec) +
+	       1e-9f * (float)(t1.tv_nsec - t0.tv_nsec);
+}
+
+/* Compare the two ways to update a buffer whose damage is unknown, but
+ * which has only changed in a few places: diffing all of it against the
+ * mirror, or only diffing the blocks whose hashes changed */
+static void run_unknown_damage_bench(
+		int n_worker_threads, size_t test_size, const void *image)
+{
+	struct thread_pool pool;
+	setup_thread_pool(&pool, COMP_NONE, 0, n_worker_threads);
+	struct fd_translation_map map;
+	setup_translation_map(&map, false);
+
+	struct render_data render;
+	memset(&render, 0, sizeof(render));
+	render.disabled = true;
+	render.drm_fd = 1;
+	render.av_disabled = true;
+
+	/* One buffer is always scanned in full, the other only by block */
+	struct shadow_fd *sfds[2];
+	for (int k = 0; k < 2; k++) {
+		struct wmsg_open_file file_msg;
+		file_msg.remote_id = k;
+		file_msg.file_size = (uint32_t)test_size;
+		file_msg.size_and_type = transfer_header(
+				sizeof(struct wmsg_open_file), WMSG_OPEN_FILE);
+		struct bytebuf msg = {.size = sizeof(struct wmsg_open_file),
+				.data = (char *)&file_msg};
+		(void)apply_update(&map, &pool, &render, WMSG_OPEN_FILE, k,
+				&msg);
+		sfds[k] = get_shadow_for_rid(&map, k);
+		memcpy(sfds[k]->mem_local, image, test_size);
+		memcpy(sfds[k]->mem_mirror, image, test_size);
+	}
+	/* Record the initial block hashes */
+	sfds[1]->is_dirty = true;
+	sfds[1]->dirty_unverified = true;
+	damage_everything(&sfds[1]->damage);
+	(void)time_update(&pool, sfds[1]);
+
+	const int nchanges = 4;
+	float samples[2][NSAMPLES];
+	int iter = 0;
+	for (; !shutdown_flag && iter < NSAMPLES; iter++) {
+		for (int j = 0; j < nchanges; j++) {
+			size_t pos = (size_t)rand() % test_size;
+			sfds[0]->mem_local[pos] ^= 0x5a;
+			sfds[1]->mem_local[pos] ^= 0x5a;
+		}
+		for (int k = 0; k < 2; k++) {
+			sfds[k]->is_dirty = true;
+			sfds[k]->dirty_unverified = k == 1;
+			damage_everything(&sfds[k]->damage);
+			samples[k][iter] = time_update(&pool, sfds[k]);
+		}
+	}
+
+	cleanup_thread_pool(&pool);
+	cleanup_translation_map(&map);
+	if (iter == 0) {
+		return;
+	}
+	qsort(samples[0], (size_t)iter, sizeof(float), float_compare);
+	qsort(samples[1], (size_t)iter, sizeof(float), float_compare);
+	printf("Update with unknown damage and %d changed bytes: full scan %f sec, block hash check %f sec\n",
+			nchanges, samples[0][iter / 2], samples[1][iter / 2]);
+}
+
 int run_bench(float bandwidth_mBps, uint32_t test_size, int n_worker_threads)
 {
 	/* 4MB test image - 1024x1024x4. Any smaller, and unrealistic caching
@@ -436,6 +543,11 @@ int run_bench(float bandwidth_mBps, uint32_t test_size, int n_worker_threads)
 	free(tresults);
 	free(iresults);
 
+	if (!shutdown_flag) {
+		run_unknown_damage_bench(
+				n_worker_threads, test_size, vid_image);
+	}
+
 	free(vid_image);
 	free(text_image);
 	return EXIT_SUCCESS;
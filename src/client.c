@@ -159,6 +159,11 @@ static void apply_conn_header(uint32_t header, struct main_config *config)
 			config->no_gpu = true;
 		}
 	}
+	if (config) {
+		config->remote_resync = (header & CONN_RESYNC_BIT) != 0;
+		config->remote_blobs = (header & CONN_BLOBS_BIT) != 0;
+		config->remote_local = (header & CONN_LOCAL_BIT) != 0;
+	}
 	// todo: consider allowing to disable video encoding
 }
 
@@ -442,6 +447,10 @@ void send_new_connection_fd(
 		struct conn_map *connmap, uint32_t key[static 3], int new_fd)
 {
 	for (int i = 0; i < connmap->count; i++) {
+		if (connmap->data[i].token.header & CONN_MUX_BIT) {
+			/* Multiplexed channels can not be replaced */
+			continue;
+		}
 		if (key_match(connmap->data[i].token.key, key)) {
 			if (send_one_fd(connmap->data[i].linkfd, new_fd) ==
 					-1) {
@@ -457,7 +466,8 @@ static void handle_new_client_connection(int cwd_fd, struct pollfd *other_fds,
 		int n_other_fds, int chanclient, struct conn_map *connmap,
 		const struct main_config *config,
 		const struct socket_path disp_path,
-		const struct connection_token *conn_id)
+		const struct connection_token *conn_id,
+		struct connection_threads *conn_threads)
 {
 	bool reconnectable = conn_id->header & CONN_RECONNECTABLE_BIT;
 
@@ -476,6 +486,48 @@ static void handle_new_client_connection(int cwd_fd, struct pollfd *other_fds,
 			goto fail_cc;
 		}
 	}
+	if (conn_threads) {
+		/* The caller closes chanclient, so give the thread its own
+		 * copy */
+		int display_fd = -1, chanfd = -1;
+		if (connect_to_socket(cwd_fd, disp_path, NULL, &display_fd) ==
+				-1) {
+			goto fail_thread;
+		}
+		chanfd = dup(chanclient);
+		if (chanfd == -1) {
+			wp_error("Failed to duplicate connection: %s",
+					strerror(errno));
+			goto fail_thread;
+		}
+		struct main_config mod_config = *config;
+		apply_conn_header(conn_id->header, &mod_config);
+		if (start_connection_thread(conn_threads, chanfd, display_fd,
+				    linkfds[1], &mod_config, true) == -1) {
+			goto fail_thread;
+		}
+		if (reconnectable) {
+			/* The thread has ended once its link hangs up */
+			connmap->data[connmap->count++] =
+					(struct conn_addr){.linkfd = linkfds[0],
+							.token = *conn_id,
+							.pid = 0};
+		}
+		return;
+	fail_thread:
+		if (display_fd != -1) {
+			checked_close(display_fd);
+		}
+		if (chanfd != -1) {
+			checked_close(chanfd);
+		}
+		if (reconnectable) {
+			checked_close(linkfds[0]);
+			checked_close(linkfds[1]);
+		}
+		return;
+	}
+
 	pid_t npid = fork();
 	if (npid == 0) {
 		// Run forked process, with the only shared
@@ -526,7 +578,77 @@ fail_cc:
 	checked_close(chanclient);
 	return;
 }
+
+/** Fork a process (or start a thread, if conn_threads is not null) to split
+ * a multiplexed channel connection into one socket per stream; these are sent
+ * back over the link tracked in `connmap`, and then handled like newly
+ * accepted connections. The caller closes chanclient. */
+static void handle_new_mux_connection(int cwd_fd, struct pollfd *other_fds,
+		int n_other_fds, int chanclient, struct conn_map *connmap,
+		const struct connection_token *conn_id,
+		struct connection_threads *conn_threads)
+{
+	if (buf_ensure_size(connmap->count + 1, sizeof(struct conn_addr),
+			    &connmap->size, (void **)&connmap->data) == -1) {
+		wp_error("Failed to allocate space to track connection");
+		return;
+	}
+	int linkfds[2] = {-1, -1};
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, linkfds) == -1) {
+		wp_error("Failed to create socketpair: %s", strerror(errno));
+		return;
+	}
+	if (conn_threads) {
+		int chanfd = dup(chanclient);
+		if (chanfd == -1) {
+			wp_error("Failed to duplicate connection: %s",
+					strerror(errno));
+			checked_close(linkfds[0]);
+			checked_close(linkfds[1]);
+			return;
+		}
+		if (start_mux_thread(conn_threads, chanfd, linkfds[1], true) ==
+				-1) {
+			checked_close(chanfd);
+			checked_close(linkfds[0]);
+			checked_close(linkfds[1]);
+			return;
+		}
+		connmap->data[connmap->count++] = (struct conn_addr){
+				.linkfd = linkfds[0],
+				.token = *conn_id,
+				.pid = 0};
+		return;
+	}
+	pid_t npid = fork();
+	if (npid == 0) {
+		for (int i = 0; i < n_other_fds; i++) {
+			if (other_fds[i].fd != chanclient) {
+				checked_close(other_fds[i].fd);
+			}
+		}
+		checked_close(linkfds[0]);
+		for (int i = 0; i < connmap->count; i++) {
+			checked_close(connmap->data[i].linkfd);
+		}
+		checked_close(cwd_fd);
+		int rc = run_channel_mux(chanclient, linkfds[1], true);
+		check_unclosed_fds();
+		exit(rc);
+	} else if (npid == -1) {
+		wp_error("Fork failure: %s", strerror(errno));
+		checked_close(linkfds[0]);
+		checked_close(linkfds[1]);
+		return;
+	}
+	checked_close(linkfds[1]);
+	connmap->data[connmap->count++] = (struct conn_addr){
+			.linkfd = linkfds[0], .token = *conn_id, .pid = npid};
+}
+
 #define NUM_INCOMPLETE_CONNECTIONS 63
+/* Poll list space for the links to multiplexing processes */
+#define NUM_MUX_CONNECTIONS 8
 
 static void drop_incoming_connection(struct pollfd *fds,
 		struct connection_token *tokens, uint8_t *bytes_read, int index,
@@ -547,6 +669,25 @@ static void drop_incoming_connection(struct pollfd *fds,
 	bytes_read[incomplete - 1] = 0;
 }
 
+static void add_incoming_connection(struct pollfd *fds,
+		struct connection_token *tokens, uint8_t *bytes_read,
+		int *incomplete, int chanclient)
+{
+	if (*incomplete == NUM_INCOMPLETE_CONNECTIONS) {
+		wp_error("Dropping oldest incomplete connection (out of %d)",
+				NUM_INCOMPLETE_CONNECTIONS);
+		drop_incoming_connection(
+				fds, tokens, bytes_read, 0, *incomplete);
+		(*incomplete)--;
+	}
+	fds[*incomplete].fd = chanclient;
+	fds[*incomplete].events = POLLIN;
+	fds[*incomplete].revents = 0;
+	memset(&tokens[*incomplete], 0, sizeof(struct connection_token));
+	bytes_read[*incomplete] = 0;
+	(*incomplete)++;
+}
+
 static int run_multi_client(int cwd_fd, int channelsock, pid_t *eol_pid,
 		const struct main_config *config,
 		const struct socket_path disp_path)
@@ -556,7 +697,7 @@ static int run_multi_client(int cwd_fd, int channelsock, pid_t *eol_pid,
 	/* Keep track of the main socket, and all connections which have not
 	 * yet fully provided their connection token. If we run out of space,
 	 * the oldest incomplete connection gets dropped */
-	struct pollfd fds[NUM_INCOMPLETE_CONNECTIONS + 1];
+	struct pollfd fds[NUM_INCOMPLETE_CONNECTIONS + NUM_MUX_CONNECTIONS + 2];
 	struct connection_token tokens[NUM_INCOMPLETE_CONNECTIONS];
 	uint8_t bytes_read[NUM_INCOMPLETE_CONNECTIONS];
 	int incomplete = 0;
@@ -567,7 +708,23 @@ static int run_multi_client(int cwd_fd, int channelsock, pid_t *eol_pid,
 	fds[0].events = POLLIN;
 	fds[0].revents = 0;
 
+	/* Created before any connection process is forked, so that all of
+	 * them share it */
+	struct main_config conn_config = *config;
+	conn_config.blob_cache = create_blob_cache();
+	config = &conn_config;
+
 	int retcode = EXIT_SUCCESS;
+	struct connection_threads conn_threads;
+	bool threaded = false;
+	if (config->single_process) {
+		if (setup_connection_threads(&conn_threads, config) == -1) {
+			retcode = EXIT_FAILURE;
+			shutdown_flag = true;
+		} else {
+			threaded = true;
+		}
+	}
 	while (!shutdown_flag) {
 		int status = -1;
 		if (wait_for_pid_and_clean(
@@ -578,7 +735,28 @@ static int run_multi_client(int cwd_fd, int channelsock, pid_t *eol_pid,
 			break;
 		}
 
-		int r = poll(fds, 1 + (nfds_t)incomplete, -1);
+		/* Links to multiplexing processes go after the incomplete
+		 * connections */
+		int mux_links[NUM_MUX_CONNECTIONS];
+		short mux_revents[NUM_MUX_CONNECTIONS];
+		int nmux = 0;
+		for (int i = 0; i < connmap.count; i++) {
+			if (connmap.data[i].token.header & CONN_MUX_BIT) {
+				mux_links[nmux] = connmap.data[i].linkfd;
+				fds[1 + incomplete + nmux].fd = mux_links[nmux];
+				fds[1 + incomplete + nmux].events = POLLIN;
+				fds[1 + incomplete + nmux].revents = 0;
+				nmux++;
+			}
+		}
+
+		/* Then the pipe written to when a connection thread ends */
+		int wake_idx = 1 + incomplete + nmux;
+		fds[wake_idx].fd = threaded ? conn_threads.wake_r : -1;
+		fds[wake_idx].events = POLLIN;
+		fds[wake_idx].revents = 0;
+
+		int r = poll(fds, (nfds_t)wake_idx + 1, -1);
 		if (r == -1) {
 			if (errno == EINTR) {
 				// If SIGCHLD, we will check the child.
@@ -591,6 +769,12 @@ static int run_multi_client(int cwd_fd, int channelsock, pid_t *eol_pid,
 			// Nothing to read
 			continue;
 		}
+		for (int i = 0; i < nmux; i++) {
+			mux_revents[i] = fds[1 + incomplete + i].revents;
+		}
+		bool thread_ended = fds[wake_idx].revents & POLLIN;
+		/* Links made below are only polled from the next iteration */
+		int nmux_links = nmux;
 
 		for (int i = 0; i < incomplete; i++) {
 			if (!(fds[i + 1].revents & POLLIN)) {
@@ -636,6 +820,27 @@ static int run_multi_client(int cwd_fd, int channelsock, pid_t *eol_pid,
 				continue;
 			}
 			/* Validate connection token key */
+			if (tokens[i].header & CONN_MUX_BIT) {
+				if (nmux_links == NUM_MUX_CONNECTIONS) {
+					wp_error("Rejecting multiplexed connection, already have %d",
+							NUM_MUX_CONNECTIONS);
+					drop_incoming_connection(fds + 1,
+							tokens, bytes_read, i,
+							incomplete);
+					incomplete--;
+					continue;
+				}
+				handle_new_mux_connection(cwd_fd, fds,
+						1 + incomplete, cur_fd,
+						&connmap, &tokens[i],
+						threaded ? &conn_threads
+							 : NULL);
+				nmux_links++;
+				drop_incoming_connection(fds + 1, tokens,
+						bytes_read, i, incomplete);
+				incomplete--;
+				continue;
+			}
 			if (tokens[i].header & CONN_UPDATE_BIT) {
 				send_new_connection_fd(&connmap, tokens[i].key,
 						cur_fd);
@@ -650,7 +855,8 @@ static int run_multi_client(int cwd_fd, int channelsock, pid_t *eol_pid,
 			 * reconnections. */
 			handle_new_client_connection(cwd_fd, fds,
 					1 + incomplete, cur_fd, &connmap,
-					config, disp_path, &tokens[i]);
+					config, disp_path, &tokens[i],
+					threaded ? &conn_threads : NULL);
 			drop_incoming_connection(fds + 1, tokens, bytes_read, i,
 					incomplete);
 			incomplete--;
@@ -680,20 +886,35 @@ static int run_multi_client(int cwd_fd, int channelsock, pid_t *eol_pid,
 				continue;
 			}
 
-			if (incomplete == NUM_INCOMPLETE_CONNECTIONS) {
-				wp_error("Dropping oldest incomplete connection (out of %d)",
-						NUM_INCOMPLETE_CONNECTIONS);
-				drop_incoming_connection(fds + 1, tokens,
-						bytes_read, 0, incomplete);
-				incomplete--;
+			add_incoming_connection(fds + 1, tokens, bytes_read,
+					&incomplete, chanclient);
+		}
+
+		/* Streams split off multiplexed channels start just like
+		 * newly accepted connections */
+		for (int i = 0; i < nmux; i++) {
+			if (!(mux_revents[i] & POLLIN)) {
+				continue;
+			}
+			int stream = recv_one_fd(mux_links[i]);
+			if (stream < 0) {
+				continue;
+			}
+			if (set_nonblocking(stream) == -1) {
+				wp_error("Error making new stream nonblocking: %s",
+						strerror(errno));
+				checked_close(stream);
+				continue;
 			}
-			fds[1 + incomplete].fd = chanclient;
-			fds[1 + incomplete].events = POLLIN;
-			fds[1 + incomplete].revents = 0;
-			memset(&tokens[incomplete], 0,
-					sizeof(struct connection_token));
-			bytes_read[incomplete] = 0;
-			incomplete++;
+			add_incoming_connection(fds + 1, tokens, bytes_read,
+					&incomplete, stream);
+		}
+
+		/* Only now, as this may close links listed in mux_links */
+		if (thread_ended) {
+			char tmp[64];
+			(void)read(conn_threads.wake_r, tmp, sizeof(tmp));
+			clean_ended_threads(&connmap);
 		}
 	}
 	for (int i = 0; i < incomplete; i++) {
@@ -705,6 +926,13 @@ static int run_multi_client(int cwd_fd, int channelsock, pid_t *eol_pid,
 	}
 	free(connmap.data);
 	checked_close(channelsock);
+	if (threaded) {
+		/* Unlike forked processes, the threads end with this one */
+		cleanup_connection_threads(&conn_threads);
+	}
+	if (conn_config.blob_cache) {
+		destroy_blob_cache(conn_config.blob_cache);
+	}
 	return retcode;
 }
 
@@ -94,6 +94,14 @@ struct obj_wl_surface {
 	uint32_t attached_buffer_id; /* protocol object id */
 	int32_t scale;
 	int32_t transform;
+	/* Application read cycle in which a buffer was last committed */
+	uint32_t commit_cycle;
+};
+
+struct obj_wl_callback {
+	struct wp_object base;
+	/* Surface that requested this frame callback; 0 for other callbacks */
+	uint32_t surface_id;
 };
 
 struct obj_wlr_screencopy_frame {
@@ -214,6 +222,7 @@ static const struct wp_interface *const non_global_interfaces[] = {
 		&intf_gtk_primary_selection_offer,
 		&intf_gtk_primary_selection_source,
 		&intf_wl_buffer,
+		&intf_wl_callback,
 		&intf_wl_data_offer,
 		&intf_wl_data_source,
 		&intf_wl_display,
@@ -318,6 +327,8 @@ struct wp_object *create_wp_object(uint32_t id, const struct wp_interface *type)
 		sz = sizeof(struct obj_wl_buffer);
 	} else if (type == &intf_wl_surface) {
 		sz = sizeof(struct obj_wl_surface);
+	} else if (type == &intf_wl_callback) {
+		sz = sizeof(struct obj_wl_callback);
 	} else if (type == &intf_zwlr_screencopy_frame_v1) {
 		sz = sizeof(struct obj_wlr_screencopy_frame);
 	} else if (type == &intf_wp_presentation) {
@@ -376,16 +387,302 @@ void do_wl_display_evt_delete_id(struct context *ctx, uint32_t id)
 		destroy_wp_object(obj);
 	}
 }
+
+struct registry_cache *create_registry_cache(void)
+{
+	struct registry_cache *cache = create_shared_memory(sizeof(*cache));
+	if (!cache) {
+		wp_error("Failed to map registry cache: %s", strerror(errno));
+		return NULL;
+	}
+	if (init_shared_mutex(&cache->lock) == -1) {
+		wp_error("Failed to create registry cache lock");
+		destroy_shared_memory(cache, sizeof(*cache));
+		return NULL;
+	}
+	return cache;
+}
+void destroy_registry_cache(struct registry_cache *cache)
+{
+	pthread_mutex_destroy(&cache->lock);
+	destroy_shared_memory(cache, sizeof(*cache));
+}
+static void lock_registry_cache(struct registry_cache *cache)
+{
+	if (lock_shared_mutex(&cache->lock)) {
+		/* A connection process died while changing the list */
+		cache->valid = false;
+	}
+}
+
+void setup_registry_shortcut(
+		struct registry_shortcut *rs, struct registry_cache *cache)
+{
+	memset(rs, 0, sizeof(*rs));
+	rs->cache = cache;
+}
+void cleanup_registry_shortcut(struct registry_shortcut *rs)
+{
+	if (rs->subscribed) {
+		lock_registry_cache(rs->cache);
+		rs->cache->subscribers--;
+		pthread_mutex_unlock(&rs->cache->lock);
+	}
+	free(rs->expected);
+	free(rs->learned);
+	free(rs->replies);
+}
+
+static int find_global(const struct cached_global *list, int n, uint32_t name)
+{
+	for (int i = 0; i < n; i++) {
+		if (list[i].name == name) {
+			return i;
+		}
+	}
+	return -1;
+}
+static void remove_global(struct cached_global *list, int *n, uint32_t name)
+{
+	int i = find_global(list, *n, name);
+	if (i >= 0) {
+		list[i] = list[*n - 1];
+		(*n)--;
+	}
+}
+/** Returns false if the interface name is too long to be stored */
+static bool fill_global(struct cached_global *dst, uint32_t name,
+		const char *interface, uint32_t version)
+{
+	size_t len = strlen(interface);
+	if (len >= sizeof(dst->interface)) {
+		return false;
+	}
+	dst->name = name;
+	dst->version = version;
+	memset(dst->interface, 0, sizeof(dst->interface));
+	memcpy(dst->interface, interface, len);
+	return true;
+}
+static bool same_global(const struct cached_global *a, const char *interface,
+		uint32_t version)
+{
+	return a->version == version && !strcmp(a->interface, interface);
+}
+
+/** Write a wl_registry.global event, returning its length in words */
+static int write_global_event(uint32_t *msg, uint32_t registry_id,
+		const struct cached_global *global)
+{
+	uint32_t len = (uint32_t)strlen(global->interface) + 1;
+	int words = 5 + (int)((len + 3) / 4);
+	msg[0] = registry_id;
+	msg[1] = message_header_2(4 * (uint32_t)words, 0);
+	msg[2] = global->name;
+	msg[3] = len;
+	memset(&msg[4], 0, 4 * (size_t)(words - 5));
+	memcpy(&msg[4], global->interface, len);
+	msg[words - 1] = global->version;
+	return words;
+}
+
+static int queue_reply(struct registry_shortcut *rs, const uint32_t *msg,
+		int words)
+{
+	int len = 4 * words;
+	if (buf_ensure_size(rs->replies_len + len, 1, &rs->replies_size,
+			    (void **)&rs->replies) == -1) {
+		wp_error("Failed to allocate space for locally answered events");
+		return -1;
+	}
+	memcpy(rs->replies + rs->replies_len, msg, (size_t)len);
+	rs->replies_len += len;
+	return 0;
+}
+
 void do_wl_display_req_get_registry(
 		struct context *ctx, struct wp_object *registry)
 {
-	(void)ctx;
-	(void)registry;
+	struct registry_shortcut *rs = &ctx->g->registry;
+	if (ctx->on_display_side || !rs->cache || rs->registry_id) {
+		return;
+	}
+	rs->registry_id = registry->obj_id;
+	rs->sync_allowed = true;
+
+	lock_registry_cache(rs->cache);
+	int n = rs->cache->nglobals;
+	bool usable = rs->cache->valid && rs->cache->subscribers > 0 && n > 0;
+	size_t list_size = (size_t)n * sizeof(struct cached_global);
+	if (usable) {
+		rs->expected = malloc(list_size);
+		if (rs->expected) {
+			memcpy(rs->expected, rs->cache->globals, list_size);
+			rs->nexpected = n;
+		}
+	}
+	uint32_t serial = rs->cache->sync_serial;
+	pthread_mutex_unlock(&rs->cache->lock);
+	if (!rs->expected) {
+		return;
+	}
+
+	/* Reserve all the space needed, so the answer is never partial */
+	int max_words = 5 + (int)sizeof(rs->expected[0].interface) / 4;
+	if (buf_ensure_size(rs->replies_len + 4 * (3 + n * max_words), 1,
+			    &rs->replies_size, (void **)&rs->replies) == -1) {
+		wp_error("Failed to allocate space for cached globals");
+		free(rs->expected);
+		rs->expected = NULL;
+		rs->nexpected = 0;
+		return;
+	}
+	for (int i = 0; i < n; i++) {
+		uint32_t msg[5 + sizeof(rs->expected[0].interface) / 4];
+		int words = write_global_event(
+				msg, rs->registry_id, &rs->expected[i]);
+		(void)queue_reply(rs, msg, words);
+	}
+	rs->answered = true;
+	rs->sync_serial = serial;
+	wp_debug("Answered registry %u with %d cached globals",
+			rs->registry_id, n);
 }
 void do_wl_display_req_sync(struct context *ctx, struct wp_object *callback)
 {
-	(void)ctx;
-	(void)callback;
+	struct registry_shortcut *rs = &ctx->g->registry;
+	if (ctx->on_display_side || !rs->registry_id || rs->sync_id) {
+		return;
+	}
+	rs->sync_id = callback->obj_id;
+	if (!rs->answered || !rs->sync_allowed) {
+		/* The roundtrip also waits for replies to other requests */
+		return;
+	}
+	/* The callback is not deleted here, so its id is not reused before
+	 * the compositor's own done event (which is then dropped) arrives */
+	uint32_t msg[3] = {rs->sync_id, message_header_2(12, 0),
+			rs->sync_serial};
+	if (queue_reply(rs, msg, 3) == 0) {
+		rs->sync_answered = true;
+	}
+}
+
+/** Called once the compositor has sent all the initial globals of the
+ * registry. Globals which were sent from the cache but do not exist are
+ * removed, and the globals seen update the cache */
+static void complete_registry_listing(
+		struct context *ctx, uint32_t callback_data)
+{
+	struct registry_shortcut *rs = &ctx->g->registry;
+	rs->complete = true;
+	if (rs->sync_answered) {
+		ctx->drop_this_msg = true;
+	}
+	if (rs->answered && rs->nexpected > 0) {
+		wp_debug("Removing %d cached globals that no longer exist",
+				rs->nexpected);
+	}
+	for (int i = 0; i < rs->nexpected; i++) {
+		uint32_t msg[3] = {rs->registry_id, message_header_2(12, 1),
+				rs->expected[i].name};
+		(void)queue_reply(rs, msg, 3);
+	}
+	free(rs->expected);
+	rs->expected = NULL;
+	rs->nexpected = 0;
+
+	lock_registry_cache(rs->cache);
+	struct registry_cache *cache = rs->cache;
+	if (!cache->valid || cache->subscribers == 0) {
+		/* No other connection has kept the list current */
+		bool fits = !rs->learned_overflow &&
+			    rs->nlearned <= REGISTRY_CACHE_MAX_GLOBALS;
+		if (fits) {
+			size_t list_size = (size_t)rs->nlearned *
+					   sizeof(struct cached_global);
+			memcpy(cache->globals, rs->learned, list_size);
+			cache->nglobals = rs->nlearned;
+		}
+		cache->valid = fits;
+		cache->sync_serial = callback_data;
+	}
+	cache->subscribers++;
+	pthread_mutex_unlock(&cache->lock);
+	rs->subscribed = true;
+
+	free(rs->learned);
+	rs->learned = NULL;
+	rs->nlearned = 0;
+	rs->learned_size = 0;
+}
+
+/** Track a global sent by the compositor to the application, after it may
+ * have been filtered or changed */
+static void track_registry_global(struct context *ctx, uint32_t name,
+		const char *interface, uint32_t version)
+{
+	struct registry_shortcut *rs = &ctx->g->registry;
+	if (ctx->on_display_side || !rs->cache ||
+			ctx->obj->obj_id != rs->registry_id ||
+			ctx->drop_this_msg) {
+		return;
+	}
+	if (rs->complete) {
+		if (!rs->subscribed) {
+			return;
+		}
+		lock_registry_cache(rs->cache);
+		struct registry_cache *cache = rs->cache;
+		int n = cache->nglobals;
+		if (find_global(cache->globals, n, name) != -1) {
+			/* already known */
+		} else if (n == REGISTRY_CACHE_MAX_GLOBALS ||
+				!fill_global(&cache->globals[n], name,
+						interface, version)) {
+			cache->valid = false;
+		} else {
+			cache->nglobals++;
+		}
+		pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+
+	if (buf_ensure_size(rs->nlearned + 1, sizeof(struct cached_global),
+			    &rs->learned_size,
+			    (void **)&rs->learned) == -1 ||
+			!fill_global(&rs->learned[rs->nlearned], name,
+					interface, version)) {
+		rs->learned_overflow = true;
+	} else {
+		rs->nlearned++;
+	}
+
+	if (!rs->answered) {
+		return;
+	}
+	int i = find_global(rs->expected, rs->nexpected, name);
+	if (i == -1) {
+		/* A new global, which the application should see */
+		return;
+	}
+	bool same = same_global(&rs->expected[i], interface, version);
+	remove_global(rs->expected, &rs->nexpected, name);
+	if (same) {
+		/* Already sent from the cache */
+		ctx->drop_this_msg = true;
+	} else if (ctx->message_available_space >= ctx->message_length + 12) {
+		/* The global sent from the cache had the same name but a
+		 * different interface or version, so replace it */
+		memmove(ctx->message + 3, ctx->message,
+				(size_t)ctx->message_length);
+		ctx->message[0] = rs->registry_id;
+		ctx->message[1] = message_header_2(12, 1);
+		ctx->message[2] = name;
+		ctx->message_length += 12;
+	} else {
+		wp_error("Not enough space to replace cached global %u", name);
+	}
 }
 
 void do_wl_registry_evt_global(struct context *ctx, uint32_t name,
@@ -438,13 +735,27 @@ void do_wl_registry_evt_global(struct context *ctx, uint32_t name,
 		ctx->drop_this_msg = true;
 	}
 
-	(void)name;
+	/* The version may have been lowered above */
 	(void)version;
+	track_registry_global(ctx, name, interface,
+			ctx->message[ctx->message_length / 4 - 1]);
 }
 void do_wl_registry_evt_global_remove(struct context *ctx, uint32_t name)
 {
-	(void)ctx;
-	(void)name;
+	struct registry_shortcut *rs = &ctx->g->registry;
+	if (ctx->on_display_side || !rs->cache ||
+			ctx->obj->obj_id != rs->registry_id) {
+		return;
+	}
+	if (!rs->complete) {
+		remove_global(rs->learned, &rs->nlearned, name);
+		/* The application saw the global, from the cache */
+		remove_global(rs->expected, &rs->nexpected, name);
+	} else if (rs->subscribed) {
+		lock_registry_cache(rs->cache);
+		remove_global(rs->cache->globals, &rs->cache->nglobals, name);
+		pthread_mutex_unlock(&rs->cache->lock);
+	}
 }
 
 void do_wl_registry_req_bind(struct context *ctx, uint32_t name,
@@ -755,6 +1066,7 @@ void do_wl_surface_req_commit(struct context *ctx)
 		/* commit signifies a client-side update only */
 		return;
 	}
+	surface->commit_cycle = ctx->g->pacing.cycles_read;
 	struct wp_object *obj =
 			tracker_get(ctx->tracker, surface->attached_buffer_id);
 	if (!obj) {
@@ -785,7 +1097,7 @@ void do_wl_surface_req_commit(struct context *ctx)
 			}
 
 			// detailed damage tracking is not yet supported
-			sfd->is_dirty = true;
+			mark_shadow_dirty(&ctx->g->map, sfd);
 			damage_everything(&sfd->damage);
 		}
 		return;
@@ -803,7 +1115,7 @@ void do_wl_surface_req_commit(struct context *ctx)
 		wp_error("fd associated with surface is not file-like");
 		return;
 	}
-	sfd->is_dirty = true;
+	mark_shadow_dirty(&ctx->g->map, sfd);
 	int bpp = get_shm_bytes_per_pixel(buf->shm_format);
 	if (bpp == -1) {
 		wp_error("Encountered unknown/planar/subsampled wl_shm format %x; marking entire buffer",
@@ -892,6 +1204,9 @@ backup:
 		full_surface_damage.width = buf->shm_stride * buf->shm_height;
 		merge_damage_records(&sfd->damage, 1, &full_surface_damage,
 				ctx->g->threads.diff_alignment_bits);
+		/* most of this region is usually unchanged, so only diff the
+		 * blocks of it whose contents have changed */
+		sfd->dirty_unverified = true;
 	}
 	rotate_damage_lists(surface);
 	return;
@@ -948,6 +1263,49 @@ void do_wl_surface_req_set_buffer_scale(struct context *ctx, int32_t scale)
 	struct obj_wl_surface *surface = (struct obj_wl_surface *)ctx->obj;
 	surface->scale = scale;
 }
+void do_wl_surface_req_frame(struct context *ctx, struct wp_object *callback)
+{
+	struct obj_wl_callback *cb = (struct obj_wl_callback *)callback;
+	cb->surface_id = ctx->obj->obj_id;
+}
+void do_wl_callback_evt_done(struct context *ctx, uint32_t callback_data)
+{
+	struct registry_shortcut *rs = &ctx->g->registry;
+	if (!ctx->on_display_side && rs->cache && rs->sync_id &&
+			ctx->obj->obj_id == rs->sync_id && !rs->complete) {
+		complete_registry_listing(ctx, callback_data);
+		return;
+	}
+	struct obj_wl_callback *cb = (struct obj_wl_callback *)ctx->obj;
+	if (ctx->on_display_side || !cb->surface_id) {
+		return;
+	}
+	struct frame_pacing *pacing = &ctx->g->pacing;
+	if (!pacing->holding) {
+		struct wp_object *obj =
+				tracker_get(ctx->tracker, cb->surface_id);
+		if (!obj || obj->type != &intf_wl_surface) {
+			return;
+		}
+		struct obj_wl_surface *surface = (struct obj_wl_surface *)obj;
+		if ((int32_t)(surface->commit_cycle - pacing->cycles_written) <=
+				0) {
+			return;
+		}
+		/* The last frame committed on the surface has not yet been
+		 * written to the channel; rendering another one now would
+		 * only make the queue longer. */
+		pacing->holding = true;
+		pacing->hold_cycle = surface->commit_cycle;
+	}
+	/* Events are delivered in order, so this and all later events wait
+	 * until the frame is on its way; parsing then resumes here */
+	if ((int32_t)(pacing->hold_cycle - pacing->cycles_written) > 0) {
+		ctx->defer_this_msg = true;
+		return;
+	}
+	pacing->holding = false;
+}
 void do_wl_keyboard_evt_keymap(
 		struct context *ctx, uint32_t format, int fd, uint32_t size)
 {
@@ -973,6 +1331,7 @@ void do_wl_keyboard_evt_keymap(
 	 * Mark the shadow structure as owned by the protocol, so it can be
 	 * automatically deleted as soon as the fd has been transferred. */
 	sfd->has_owner = true;
+	share_immutable_file(&ctx->g->map, sfd);
 	(void)format;
 }
 
@@ -1030,10 +1389,11 @@ void do_wl_shm_pool_req_resize(struct context *ctx, int32_t size)
 		// this protocol message was received
 		return;
 	}
-	/* The display side will be updated already via buffer update msg */
-	if (!ctx->on_display_side) {
-		extend_shm_shadow(&ctx->g->threads, the_shm_pool->owned_buffer,
-				(size_t)size);
+	/* The display side will be updated already via buffer update msg,
+	 * unless the file is shared */
+	if (!ctx->on_display_side || the_shm_pool->owned_buffer->passthrough) {
+		extend_shm_shadow(&ctx->g->map, &ctx->g->threads,
+				the_shm_pool->owned_buffer, (size_t)size);
 	}
 }
 void do_wl_shm_pool_req_create_buffer(struct context *ctx, struct wp_object *id,
@@ -1102,7 +1462,7 @@ void do_zwlr_screencopy_frame_v1_evt_ready(struct context *ctx,
 		// The display side performs the update
 		return;
 	}
-	sfd->is_dirty = true;
+	mark_shadow_dirty(&ctx->g->map, sfd);
 	/* The protocol guarantees that the buffer attributes match
 	 * those of the written frame */
 	const struct ext_interval interval = {.start = buffer->shm_offset,
@@ -1271,7 +1631,7 @@ void do_wl_drm_req_create_prime_buffer(struct context *ctx,
 	buf->dmabuf_strides[0] = (uint32_t)stride0;
 	buf->unique_id = ctx->g->tracker.buffer_seqno++;
 
-	if (ctx->on_display_side) {
+	if (ctx->on_display_side && !sfd->passthrough) {
 		/* the new dmabuf being created is not guaranteed to
 		 * have the original offset/stride parameters, so reset
 		 * them */
@@ -1471,7 +1831,7 @@ void do_zwp_linux_buffer_params_v1_req_create(struct context *ctx,
 		if (!sfd) {
 			continue;
 		}
-		if (ctx->on_display_side) {
+		if (ctx->on_display_side && !sfd->passthrough) {
 			/* the new dmabuf being created is not guaranteed to
 			 * have the original offset/stride parameters, so reset
 			 * them */
@@ -1686,6 +2046,7 @@ void do_zwp_linux_dmabuf_feedback_v1_evt_format_table(
 	 * increase the protocol refcount, so that as soon as it gets
 	 * transferred it is destroyed */
 	sfd->has_owner = true;
+	share_immutable_file(&ctx->g->map, sfd);
 
 	struct obj_zwp_linux_dmabuf_feedback *obj =
 			(struct obj_zwp_linux_dmabuf_feedback *)ctx->obj;
@@ -1899,7 +2260,7 @@ void do_zwlr_export_dmabuf_frame_v1_evt_ready(struct context *ctx,
 	for (uint32_t i = 0; i < frame->nobjects; i++) {
 		struct shadow_fd *sfd = frame->objects[i].buffer;
 		if (sfd) {
-			sfd->is_dirty = true;
+			mark_shadow_dirty(&ctx->g->map, sfd);
 			damage_everything(&sfd->damage);
 		}
 	}
@@ -1986,6 +2347,7 @@ void do_zwlr_gamma_control_v1_req_set_gamma(struct context *ctx, int fd)
 	 * increase the protocol refcount, so that as soon as it gets
 	 * transferred it is destroyed */
 	sfd->has_owner = true;
+	share_immutable_file(&ctx->g->map, sfd);
 }
 
 #define MSGNO_XDG_TOPLEVEL_REQ_SET_TITLE 2
@@ -46,13 +46,127 @@ struct main_config {
 	uint32_t vsock_port;
 	bool vsock_to_host;
 	const char *title_prefix;
+	/* Minimum size of messages to send with MSG_ZEROCOPY; 0 disables */
+	size_t zerocopy_threshold;
+	/* Stop reading from the program and its pipes while more than this
+	 * many bytes of messages are queued; 0 means no limit */
+	size_t max_queue_bytes;
+	/* Longest time to delay acknowledging received messages, when no
+	 * other message is sent; 0 acknowledges immediately */
+	uint32_t ack_delay_ms;
+	/* Once more than this many bytes of sent messages are held for a
+	 * possible replay after reconnecting, move the rest to a file in
+	 * $XDG_RUNTIME_DIR; 0 keeps everything in memory */
+	size_t replay_mem_bytes;
+	/* Once the mirrors of buffers take more than this many bytes in a
+	 * process, drop those which have not been used recently; 0 means
+	 * no limit */
+	size_t mirror_mem_bytes;
+	/* Acknowledge as soon as this many bytes were received */
+	size_t ack_bytes;
+	/* The other side handles WMSG_BUFFER_HASHES, so file updates need
+	 * not be kept for replay after a reconnection */
+	bool remote_resync;
+	/* The other side handles WMSG_BLOB_HASHES and WMSG_OPEN_BLOB */
+	bool remote_blobs;
+	/* If not null, the files received for immutable protocol objects by
+	 * all connections of this process tree */
+	struct blob_cache *blob_cache;
+	/* The other side handles WMSG_OPEN_LOCAL */
+	bool remote_local;
+	/* Carry all application connections over one channel connection */
+	bool multiplex;
+	/* Run each application connection on a thread of this process,
+	 * instead of in a forked process */
+	bool single_process;
+	/* If not null, the worker threads shared by all connections of this
+	 * process */
+	struct worker_group *shared_workers;
+	/* Share a registry cache between the connections of a server */
+	bool cache_registry;
+	/* If not null, answer the first registry listing of an application
+	 * from the globals that earlier connections have seen */
+	struct registry_cache *registry_cache;
 };
+/** Application side state used to pace frame callbacks. Each read from the
+ * application starts a new cycle; once all messages produced in a cycle
+ * have been written to the channel, `cycles_written` catches up. While a
+ * surface's last committed frame is still queued, parsing of the events to
+ * the application stops at its `wl_callback.done`, so that the application
+ * renders no faster than the channel can carry its frames. */
+struct frame_pacing {
+	uint32_t cycles_read;
+	uint32_t cycles_written;
+	/* Set while events are held back, until `hold_cycle` is written */
+	bool holding;
+	uint32_t hold_cycle;
+};
+
+#define REGISTRY_CACHE_MAX_GLOBALS 256
+
+struct cached_global {
+	uint32_t name;
+	uint32_t version;
+	char interface[64];
+};
+
+/** The compositor's globals, as seen by the connections of one waypipe
+ * server; this is placed in memory shared by all connection processes. */
+struct registry_cache {
+	/* Process-shared and robust, since connections run in forked
+	 * processes */
+	pthread_mutex_t lock;
+	/* Number of connections whose registry updates `globals` when the
+	 * compositor adds or removes a global. While there are none, the
+	 * list may be out of date. */
+	int subscribers;
+	/* False if the list is incomplete, e.g. had too many globals */
+	bool valid;
+	/* Value for the wl_callback.done event of a locally answered sync */
+	uint32_t sync_serial;
+	int nglobals;
+	struct cached_global globals[REGISTRY_CACHE_MAX_GLOBALS];
+};
+
+/** Application side state for answering the first registry listing and the
+ * roundtrip which follows it from the registry cache, without waiting for
+ * the compositor; its actual reply is then checked against what was sent */
+struct registry_shortcut {
+	struct registry_cache *cache;
+	/* The first wl_registry created, and the first wl_display.sync after
+	 * it; the globals of the registry are all received once the sync is
+	 * done */
+	uint32_t registry_id;
+	uint32_t sync_id;
+	/* No requests other than on wl_display since the registry was made */
+	bool sync_allowed;
+	/* Whether the registry and the sync were answered from the cache */
+	bool answered, sync_answered;
+	/* The serial for a locally answered sync, from the cache */
+	uint32_t sync_serial;
+	bool complete;
+	bool subscribed;
+	/* Globals sent from the cache which the compositor has not yet
+	 * confirmed; those still left once complete are removed */
+	struct cached_global *expected;
+	int nexpected;
+	/* Globals sent by the compositor until complete */
+	struct cached_global *learned;
+	int nlearned, learned_size;
+	bool learned_overflow;
+	/* Events to send to the program before any more from the channel */
+	char *replies;
+	int replies_len, replies_size;
+};
+
 struct globals {
 	const struct main_config *config;
 	struct fd_translation_map map;
 	struct render_data render;
 	struct message_tracker tracker;
 	struct thread_pool threads;
+	struct frame_pacing pacing;
+	struct registry_shortcut registry;
 };
 
 /** Main processing loop
@@ -66,6 +180,50 @@ struct globals {
 int main_interface_loop(int chanfd, int progfd, int linkfd,
 		const struct main_config *config, bool display_side);
 
+/** Application connections run by threads of one process, all sharing the
+ * same worker threads */
+struct connection_threads {
+	struct worker_group workers;
+	pthread_mutex_t lock;
+	int count;
+	/* A byte is written to wake_w whenever a connection thread ends */
+	int wake_r, wake_w;
+};
+
+int setup_connection_threads(struct connection_threads *threads,
+		const struct main_config *config);
+/** Run main_interface_loop for the connection on a new thread; on success,
+ * the thread takes ownership of chanfd, progfd, and linkfd. Returns -1 on
+ * failure. */
+int start_connection_thread(struct connection_threads *threads, int chanfd,
+		int progfd, int linkfd, const struct main_config *config,
+		bool display_side);
+/** Like start_connection_thread, but running run_channel_mux */
+int start_mux_thread(struct connection_threads *threads, int chanfd,
+		int linkfd, bool display_side);
+/** Wait until all connection threads have ended; if shutdown_flag is set,
+ * tell them to stop first */
+void cleanup_connection_threads(struct connection_threads *threads);
+
+/** Create a registry cache in memory that forked processes share; returns
+ * NULL on failure */
+struct registry_cache *create_registry_cache(void);
+void destroy_registry_cache(struct registry_cache *cache);
+void setup_registry_shortcut(
+		struct registry_shortcut *rs, struct registry_cache *cache);
+void cleanup_registry_shortcut(struct registry_shortcut *rs);
+
+/** Relay between a channel connection carrying many streams, and one local
+ * socket per stream.
+ *
+ * chanfd: connected socket to the channel
+ * linkfd: on the application side, provides sockets for new streams; on the
+ *         display side, receives sockets for new streams
+ *
+ * Returns either EXIT_SUCCESS or EXIT_FAILURE (if exit caused by an error.)
+ */
+int run_channel_mux(int chanfd, int linkfd, bool display_side);
+
 /** Act as a Wayland server */
 int run_server(int cwd_fd, struct socket_path socket_path,
 		const char *display_suffix, const char *control_path,
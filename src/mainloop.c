@@ -30,26 +30,33 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#ifdef HAS_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+#ifdef HAS_TIMERFD
+#include <sys/timerfd.h>
+#endif
+
 // The maximum number of fds libwayland can recvmsg at once
 #define MAX_LIBWAY_FDS 28
-static ssize_t iovec_read(
-		int conn, char *buf, size_t buflen, struct int_window *fds)
+/* Read into `vecs`, appending any file descriptors received to `fds` */
+static ssize_t recv_with_fds(int conn, struct iovec *vecs, int nvec,
+		struct int_window *fds)
 {
 	char cmsgdata[(CMSG_LEN(MAX_LIBWAY_FDS * sizeof(int32_t)))] = {0};
-	struct iovec the_iovec;
-	the_iovec.iov_len = buflen;
-	the_iovec.iov_base = buf;
 	struct msghdr msg = {0};
 	msg.msg_name = NULL;
 	msg.msg_namelen = 0;
-	msg.msg_iov = &the_iovec;
-	msg.msg_iovlen = 1;
+	msg.msg_iov = vecs;
+	msg.msg_iovlen = (size_t)nvec;
 	msg.msg_control = &cmsgdata;
 	msg.msg_controllen = sizeof(cmsgdata);
 	msg.msg_flags = 0;
@@ -86,6 +93,14 @@ static ssize_t iovec_read(
 	}
 	return ret;
 }
+static ssize_t iovec_read(
+		int conn, char *buf, size_t buflen, struct int_window *fds)
+{
+	struct iovec the_iovec;
+	the_iovec.iov_len = buflen;
+	the_iovec.iov_base = buf;
+	return recv_with_fds(conn, &the_iovec, 1, fds);
+}
 
 static ssize_t iovec_write(int conn, const char *buf, size_t buflen,
 		const int *fds, int numfds, int *nfds_written)
@@ -136,6 +151,36 @@ static ssize_t iovec_write(int conn, const char *buf, size_t buflen,
 	ssize_t ret = sendmsg(conn, &msg, 0);
 	return ret;
 }
+/* Write `vecs`, passing `fd` along with their first byte */
+static ssize_t writev_with_fd(
+		int conn, const struct iovec *vecs, int nvec, int fd)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} uc;
+	memset(uc.buf, 0, sizeof(uc.buf));
+	struct msghdr msg = {0};
+	msg.msg_iov = (struct iovec *)vecs;
+	msg.msg_iovlen = (size_t)nvec;
+	msg.msg_control = uc.buf;
+	msg.msg_controllen = sizeof(uc.buf);
+	struct cmsghdr *frst = CMSG_FIRSTHDR(&msg);
+	frst->cmsg_level = SOL_SOCKET;
+	frst->cmsg_type = SCM_RIGHTS;
+	frst->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(frst), &fd, sizeof(int));
+	return sendmsg(conn, &msg, 0);
+}
+static bool is_unix_socket(int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr *)&addr, &len) == -1) {
+		return false;
+	}
+	return addr.ss_family == AF_UNIX;
+}
 
 static int translate_fds(struct fd_translation_map *map,
 		struct render_data *render, struct thread_pool *threads,
@@ -175,6 +220,43 @@ static void untranslate_ids(struct fd_translation_map *map, int nids,
 	}
 }
 
+/** State for sending large transfer blocks with MSG_ZEROCOPY */
+struct zerocopy_state {
+	/** Blocks of at least this size are sent without copying them into
+	 * the socket buffer; 0 if zerocopy sends are disabled or unsupported
+	 * by the channel */
+	size_t threshold;
+	/** The notification id the kernel will assign to the next zerocopy
+	 * send on the channel */
+	uint32_t next_id;
+	/** Number of zerocopy sends whose completion has not been reported */
+	uint32_t n_outstanding;
+	/** The kernel reported copying zerocopy send data; this is kept
+	 * across reconnections, which use the same route */
+	bool copied;
+};
+
+/** File to which written, but not yet acknowledged, messages are moved
+ * once too many are held in memory (see main_config::replay_mem_bytes) */
+struct replay_spill {
+	/** -1 if messages are only kept in memory */
+	int fd;
+	/** Bytes of the file in use; blocks are appended after this */
+	size_t end;
+	/** Number of blocks of the transfer queue stored in the file */
+	int nblocks;
+	/** Set when writing to the file failed; cleared once it is empty */
+	bool write_failed;
+};
+
+/* Space left before the protocol data read from the program, for the
+ * WMSG_PROTOCOL transfer header */
+#define PROTO_HEADER_SPACE ((int)sizeof(uint32_t))
+/* Most bytes of protocol data to read from the program before handling it */
+#define PROGREAD_BATCH_SIZE 65536
+/* Stop reading from the program once this many file descriptors arrived */
+#define PROGREAD_MAX_FDS (4 * MAX_LIBWAY_FDS)
+
 enum wm_state { WM_WAITING_FOR_PROGRAM, WM_WAITING_FOR_CHANNEL, WM_TERMINAL };
 /** This state corresponds to the in-progress transfer from the program
  * (compositor or application) and its pipes/buffers to the channel. */
@@ -182,9 +264,11 @@ struct way_msg_state {
 	enum wm_state state;
 
 	/** Window zone contains the message data which has been read
-	 * but not yet parsed/copied to proto_write */
+	 * but not yet parsed. The first PROTO_HEADER_SPACE bytes are reserved,
+	 * so that once parsed the buffer can be sent as a WMSG_PROTOCOL
+	 * transfer without copying the messages */
 	struct char_window proto_read;
-	/** Buffer of complete protocol messages to be written to the channel */
+	/** Workspace for messages that are being edited by their handlers */
 	struct char_window proto_write;
 
 	/** Queue of fds to be used by protocol parser */
@@ -197,6 +281,39 @@ struct way_msg_state {
 	int total_written;
 	/** Maximum chunk size to writev at once*/
 	int max_iov;
+	struct zerocopy_state zerocopy;
+
+	/** Message number of the first message produced after the most
+	 * recently completed read cycle. Reading the program resumes while
+	 * that cycle's messages are still being written to the channel, but
+	 * the next cycle is only completed once all messages before this
+	 * number have been written, so at most one cycle's worth of data is
+	 * queued behind the one being prepared. */
+	uint32_t cycle_end_msgno;
+	/** Number of the read cycle (see frame_pacing::cycles_read) which
+	 * ends at cycle_end_msgno */
+	uint32_t cycle_end_number;
+
+	/** Set while reading from the program is paused, because too much
+	 * data is queued (see main_config::max_queue_bytes) */
+	bool reads_paused;
+	struct replay_spill spill;
+
+	/** Written messages before this number have already been checked
+	 * for buffer data to release (see release_written_updates) */
+	uint32_t released_msgno;
+	/** Files whose released updates may not have arrived before the
+	 * last reconnection, and which should be checked by hashes */
+	int *resync_rids;
+	int nresync_rids, resync_rids_size;
+	/** Set once this side has told the other that it handles
+	 * WMSG_BUFFER_HASHES */
+	bool resync_announced;
+	/** Set once this side has sent its WMSG_BLOB_HASHES message */
+	bool blobs_announced;
+	/** Set once this side has sent a WMSG_OPEN_LOCAL to check whether
+	 * file descriptors can be passed */
+	bool local_probe_sent;
 
 	/** Transfers to send after the compute queue is empty */
 	int ntrailing;
@@ -205,9 +322,20 @@ struct way_msg_state {
 	/** Statically allocated message acknowledgement messages; due
 	 * to the way they are updated out of order, at most two are needed */
 	struct wmsg_ack ack_msgs[2];
+
+	/** Lock protecting the shared state, held while this state machine
+	 * advances; it is released while running compression tasks and
+	 * while writing to the channel */
+	pthread_mutex_t *state_lock;
 };
 
-enum cm_state { CM_WAITING_FOR_PROGRAM, CM_WAITING_FOR_CHANNEL, CM_TERMINAL };
+enum cm_state {
+	CM_WAITING_FOR_PROGRAM,
+	CM_WAITING_FOR_CHANNEL,
+	/* Protocol messages are held back for frame pacing */
+	CM_WAITING_FOR_FRAME,
+	CM_TERMINAL
+};
 /** This state corresponds to the in-progress transfer from the channel
  * to the program and the buffers/pipes on which will be written. */
 struct chan_msg_state {
@@ -220,13 +348,37 @@ struct chan_msg_state {
 	struct int_window transf_fds;
 	/**< FD queue for the protocol parser */
 	struct int_window proto_fds;
+	/** If set, the WMSG_PROTOCOL message at the start of `recv` has only
+	 * been parsed up to `proto_resume`, as the message there is held
+	 * until frame_pacing::hold_cycle is written. It stays in `recv`, and
+	 * so do all channel messages after it, to keep their order. */
+	bool proto_held;
+	int proto_resume;
 
 #define RECV_GOAL_READ_SIZE 131072
-	char *recv_buffer; // ring-like buffer for message data
-	size_t recv_size;
-	size_t recv_start; // (recv_buffer+rev_start) should be a message header
-	size_t recv_end;   // last byte read from channel, always >=recv_start
+/* Uncompressed fills at least this large are read straight into the mirror
+ * of their file or DMABUF, instead of into `recv` */
+#define DIRECT_FILL_MIN_SIZE 65536
+	/* Data read from the channel, starting with a message header; since
+	 * the ring is mirrored, each message in it is contiguous */
+	struct mirrored_ring recv;
 	int recv_unhandled_messages; // number of messages to parse
+	/* The channel is a Unix socket, which may pass file descriptors for
+	 * WMSG_OPEN_LOCAL; they are added to the map's `passed_fds` */
+	bool recv_fds;
+
+	/* If set, the data of the fill with `fill_header` is being read
+	 * directly; `fill_read` of its `fill_size` bytes, including padding,
+	 * have arrived. If the target was closed meanwhile, the data is
+	 * dropped. */
+	bool direct_fill, fill_dropped;
+	struct wmsg_buffer_fill fill_header;
+	size_t fill_read, fill_size;
+	char fill_padding[4];
+
+	/** Lock protecting the shared state, held while this state machine
+	 * advances; it is released while decompressing buffer updates */
+	pthread_mutex_t *state_lock;
 };
 
 /** State used by both forward and reverse messages */
@@ -243,8 +395,102 @@ struct cross_state {
 	/* Which was the last message number sent to the other application which
 	 * was acknowledged by that side? */
 	uint32_t last_confirmed_msgno;
+	/* How many bytes of messages were received since the last
+	 * acknowledgement was sent? */
+	size_t unacked_bytes;
+	/* Is the other side known to handle WMSG_BUFFER_HASHES? */
+	bool remote_resync;
+	/* Is the other side known to handle WMSG_BLOB_HASHES? */
+	bool remote_blobs;
+	/* Is the other side known to handle WMSG_OPEN_LOCAL, over a channel
+	 * that might pass file descriptors? */
+	bool remote_local;
+	/* WMSG_BUFFER_RESEND messages produced by the channel thread, to be
+	 * queued for the other side, and those received from it, to be
+	 * handled by the main thread */
+	struct bytebuf *resend_out, *resend_in;
+	int nresend_out, resend_out_size;
+	int nresend_in, resend_in_size;
 };
 
+static int push_resend_msg(struct bytebuf **list, int *count, int *size,
+		struct bytebuf msg)
+{
+	if (buf_ensure_size(*count + 1, sizeof(struct bytebuf), size,
+			    (void **)list) == -1) {
+		wp_error("Failed to allocate resend message list");
+		free(msg.data);
+		return ERR_NOMEM;
+	}
+	(*list)[(*count)++] = msg;
+	return 0;
+}
+
+/* Count a message received from the other side, other than WMSG_RESTART and
+ * WMSG_ACK_NBLOCKS. Returns false if it was already received before a
+ * reconnection, and should be ignored. */
+static bool count_received_message(struct cross_state *cxs, size_t size)
+{
+	cxs->last_received_msgno++;
+	cxs->unacked_bytes += size;
+	if (msgno_gt(cxs->newest_received_msgno, cxs->last_received_msgno)) {
+		/* Skip packet, as we already received it */
+		wp_debug("Ignoring replayed message %d (newest=%d)",
+				cxs->last_received_msgno,
+				cxs->newest_received_msgno);
+		return false;
+	}
+	cxs->newest_received_msgno = cxs->last_received_msgno;
+	return true;
+}
+
+/* Parse the messages of the WMSG_PROTOCOL message `packet` into
+ * `proto_write`, starting at `cmsg->proto_resume`. If a frame callback is
+ * held (see frame_pacing), parsing stops there, and `proto_held` is set */
+static int parse_chanmsg_protocol(struct chan_msg_state *cmsg,
+		struct globals *g, bool display_side, char *packet)
+{
+	/* While by construction, the provided message buffer should be
+	 * aligned with individual message boundaries, it is not
+	 * guaranteed that all file descriptors provided will be used by
+	 * the messages. This makes fd handling more complicated. */
+	int protosize = (int)(transfer_size(*(uint32_t *)packet) -
+			      sizeof(uint32_t));
+	// TODO: have message editing routines ensure size, so
+	// that this limit can be tighter
+	if (buf_ensure_size(protosize + 1024, 1, &cmsg->proto_write.size,
+			    (void **)&cmsg->proto_write.data) == -1) {
+		wp_error("Allocation failure for message workspace");
+		return ERR_NOMEM;
+	}
+	cmsg->proto_write.zone_end = 0;
+	cmsg->proto_write.zone_start = 0;
+
+	struct char_window src;
+	src.data = packet + sizeof(uint32_t);
+	src.zone_start = cmsg->proto_resume;
+	src.zone_end = protosize;
+	src.size = protosize;
+	parse_and_prune_messages(g, display_side, display_side, &src,
+			&cmsg->proto_write, &cmsg->proto_fds);
+	cmsg->proto_held = src.zone_start != src.zone_end && g->pacing.holding;
+	cmsg->proto_resume = src.zone_start;
+	if (src.zone_start != src.zone_end && !cmsg->proto_held) {
+		wp_error("did not expect partial messages over channel, only parsed %d/%d bytes",
+				src.zone_start, src.zone_end);
+		return ERR_FATAL;
+	}
+	/* Update file descriptor queue; those for the held messages remain */
+	struct int_window *fds = &cmsg->proto_fds;
+	if (fds->zone_end > fds->zone_start) {
+		memmove(fds->data, fds->data + fds->zone_start,
+				sizeof(int) * (size_t)(fds->zone_end -
+							      fds->zone_start));
+	}
+	fds->zone_end -= fds->zone_start;
+	fds->zone_start = 0;
+	return 0;
+}
 static int interpret_chanmsg(struct chan_msg_state *cmsg,
 		struct cross_state *cxs, struct globals *g, bool display_side,
 		char *packet)
@@ -286,20 +532,54 @@ static int interpret_chanmsg(struct chan_msg_state *cmsg,
 			cxs->last_confirmed_msgno = ackm->messages_received;
 		}
 		return 0;
-	} else {
-		cxs->last_received_msgno++;
-		if (msgno_gt(cxs->newest_received_msgno,
-				    cxs->last_received_msgno)) {
-			/* Skip packet, as we already received it */
-			wp_debug("Ignoring replayed message %d (newest=%d)",
-					cxs->last_received_msgno,
-					cxs->newest_received_msgno);
-			return 0;
-		}
-		cxs->newest_received_msgno = cxs->last_received_msgno;
+	} else if (!count_received_message(cxs, unpadded_size)) {
+		return 0;
 	}
 
-	if (type == WMSG_INJECT_RIDS) {
+	if (type == WMSG_BUFFER_HASHES) {
+		/* Only Waypipe instances that understand the reply send this */
+		cxs->remote_resync = true;
+		wp_debug("Received WMSG_BUFFER_HASHES for RID=%d (len %zu)",
+				((const struct wmsg_basic *)packet)->remote_id,
+				unpadded_size);
+		struct bytebuf msg = {.data = packet, .size = unpadded_size};
+		struct bytebuf reply;
+		int ret = check_buffer_hashes(&g->map, &msg, &reply);
+		if (ret < 0 || !reply.data) {
+			return ret;
+		}
+		return push_resend_msg(&cxs->resend_out, &cxs->nresend_out,
+				&cxs->resend_out_size, reply);
+	} else if (type == WMSG_BLOB_HASHES) {
+		/* Only sent by instances that handle WMSG_OPEN_BLOB */
+		cxs->remote_blobs = true;
+		struct bytebuf msg = {.data = packet, .size = unpadded_size};
+		return add_remote_blobs(&g->map, &msg);
+	} else if (type == WMSG_OPEN_LOCAL &&
+			unpadded_size >= sizeof(struct wmsg_basic) &&
+			((const struct wmsg_basic *)packet)->remote_id == 0) {
+		/* Only sent by instances that handle WMSG_OPEN_LOCAL */
+		int fd = take_passed_fd(&g->map);
+		if (fd == -1) {
+			wp_debug("File descriptors can not be passed over the channel");
+			return 0;
+		}
+		checked_close(fd);
+		wp_debug("Other side is on the same host, passing files and DMABUFs directly");
+		g->map.local_fds = true;
+		cxs->remote_local = true;
+		return 0;
+	} else if (type == WMSG_BUFFER_RESEND) {
+		struct bytebuf copy = {.data = malloc(unpadded_size),
+				.size = unpadded_size};
+		if (!copy.data) {
+			wp_error("Failed to allocate resend request copy");
+			return ERR_NOMEM;
+		}
+		memcpy(copy.data, packet, unpadded_size);
+		return push_resend_msg(&cxs->resend_in, &cxs->nresend_in,
+				&cxs->resend_in_size, copy);
+	} else if (type == WMSG_INJECT_RIDS) {
 		const int32_t *fds = &((const int32_t *)packet)[1];
 		int nfds = (int)((unpadded_size - sizeof(uint32_t)) /
 				 sizeof(int32_t));
@@ -331,46 +611,11 @@ static int interpret_chanmsg(struct chan_msg_state *cmsg,
 		}
 		return 0;
 	} else if (type == WMSG_PROTOCOL) {
-		/* While by construction, the provided message buffer should be
-		 * aligned with individual message boundaries, it is not
-		 * guaranteed that all file descriptors provided will be used by
-		 * the messages. This makes fd handling more complicated. */
 		int protosize = (int)(unpadded_size - sizeof(uint32_t));
 		wp_debug("Received WMSG_PROTOCOL with %d bytes of messages",
 				protosize);
-		// TODO: have message editing routines ensure size, so
-		// that this limit can be tighter
-		if (buf_ensure_size(protosize + 1024, 1,
-				    &cmsg->proto_write.size,
-				    (void **)&cmsg->proto_write.data) == -1) {
-			wp_error("Allocation failure for message workspace");
-			return ERR_NOMEM;
-		}
-		cmsg->proto_write.zone_end = 0;
-		cmsg->proto_write.zone_start = 0;
-
-		struct char_window src;
-		src.data = packet + sizeof(uint32_t);
-		src.zone_start = 0;
-		src.zone_end = protosize;
-		src.size = protosize;
-		parse_and_prune_messages(g, display_side, display_side, &src,
-				&cmsg->proto_write, &cmsg->proto_fds);
-		if (src.zone_start != src.zone_end) {
-			wp_error("did not expect partial messages over channel, only parsed %d/%d bytes",
-					src.zone_start, src.zone_end);
-			return ERR_FATAL;
-		}
-		/* Update file descriptor queue */
-		if (cmsg->proto_fds.zone_end > cmsg->proto_fds.zone_start) {
-			memmove(cmsg->proto_fds.data,
-					cmsg->proto_fds.data +
-							cmsg->proto_fds.zone_start,
-					sizeof(int) * (size_t)(cmsg->proto_fds.zone_end >
-								      cmsg->proto_fds.zone_start));
-			cmsg->proto_fds.zone_end -= cmsg->proto_fds.zone_start;
-		}
-		return 0;
+		cmsg->proto_resume = 0;
+		return parse_chanmsg_protocol(cmsg, g, display_side, packet);
 	} else {
 		if (unpadded_size < sizeof(struct wmsg_basic)) {
 			wp_error("Message is too small to contain header+RID, %d bytes",
@@ -386,140 +631,252 @@ static int interpret_chanmsg(struct chan_msg_state *cmsg,
 		wp_debug("Received %s for RID=%d (len %d)",
 				wmsg_type_to_str(type), op_header->remote_id,
 				unpadded_size);
-		return apply_update(&g->map, &g->threads, &g->render, type,
-				op_header->remote_id, &msg);
+
+		if (type == WMSG_BUFFER_FILL) {
+			int ret = decompress_fill_in_place(&g->map, &g->threads,
+					&g->threads.recv_thread, &msg);
+			if (ret != 0) {
+				return ret < 0 ? ret : 0;
+			}
+		}
+
+		/* Decompression only uses data private to this thread, so
+		 * the other direction can make progress meanwhile. Copying
+		 * the result into the shadow still holds the lock, since the
+		 * main thread may diff, resize or destroy it at any time. */
+		struct bytebuf payload = {.data = NULL, .size = 0};
+		if (type == WMSG_BUFFER_FILL || type == WMSG_BUFFER_DIFF) {
+			pthread_mutex_unlock(cmsg->state_lock);
+			decompress_update(&g->threads, &g->threads.recv_thread,
+					type, &msg, &payload);
+			pthread_mutex_lock(cmsg->state_lock);
+		}
+		return apply_decompressed_update(&g->map, &g->threads,
+				&g->render, type, op_header->remote_id, &msg,
+				&payload);
 	}
 }
 
-static int advance_chanmsg_chanread(struct chan_msg_state *cmsg,
-		struct cross_state *cxs, int chanfd, bool display_side,
-		struct globals *g)
+/* Read from the channel into `vec`; on success, `*nread` is set to the
+ * number of bytes read, which is zero if the read would block */
+static int read_channel(struct chan_msg_state *cmsg, int chanfd,
+		struct iovec *vec, int nvec, struct globals *g, size_t *nread)
 {
-	/* Setup read operation to be able to read a minimum number of bytes,
-	 * wrapping around as early as overlap conditions permit */
-	if (cmsg->recv_unhandled_messages == 0) {
-		struct iovec vec[2];
-		memset(vec, 0, sizeof(vec));
-		int nvec;
-		if (cmsg->recv_start == cmsg->recv_end) {
-			/* A fresh packet */
-			cmsg->recv_start = 0;
-			cmsg->recv_end = 0;
-			nvec = 1;
-			vec[0].iov_base = cmsg->recv_buffer;
-			vec[0].iov_len = (size_t)(cmsg->recv_size / 2);
-		} else if (cmsg->recv_end <
-				cmsg->recv_start + sizeof(uint32_t)) {
-			/* Didn't quite finish reading the header */
-			int recvsz = (int)cmsg->recv_size;
-			if (buf_ensure_size((int)cmsg->recv_end +
-							    RECV_GOAL_READ_SIZE,
-					    1, &recvsz,
-					    (void **)&cmsg->recv_buffer) ==
-					-1) {
-				wp_error("Allocation failure, resizing receive buffer failed");
-				return ERR_NOMEM;
-			}
-			cmsg->recv_size = (size_t)recvsz;
+	*nread = 0;
+	ssize_t r = cmsg->recv_fds ? recv_with_fds(chanfd, vec, nvec,
+					     &g->map.passed_fds)
+				   : readv(chanfd, vec, nvec);
+	if (r == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+		wp_debug("Read would block");
+		return 0;
+	} else if (r == 0 || (r == -1 && errno == ECONNRESET)) {
+		wp_debug("Channel connection closed");
+		return ERR_DISCONN;
+	} else if (r == -1) {
+		wp_error("chanfd read failure: %s", strerror(errno));
+		return ERR_FATAL;
+	}
+	*nread = (size_t)r;
+	return 0;
+}
 
-			nvec = 1;
-			vec[0].iov_base = cmsg->recv_buffer + cmsg->recv_end;
-			vec[0].iov_len = RECV_GOAL_READ_SIZE;
-		} else {
-			/* Continuing an old packet; space made available last
-			 * time */
-			uint32_t *header = (uint32_t *)&cmsg->recv_buffer
-							   [cmsg->recv_start];
-			size_t sz = alignz(transfer_size(*header), 4);
-
-			size_t read_end = cmsg->recv_start + sz;
-			bool wraparound =
-					cmsg->recv_start >= RECV_GOAL_READ_SIZE;
-			if (!wraparound) {
-				read_end = maxu(read_end,
-						cmsg->recv_end +
-								RECV_GOAL_READ_SIZE);
-			}
-			int recvsz = (int)cmsg->recv_size;
-			if (buf_ensure_size((int)read_end, 1, &recvsz,
-					    (void **)&cmsg->recv_buffer) ==
-					-1) {
-				wp_error("Allocation failure, resizing receive buffer failed");
-				return ERR_NOMEM;
-			}
-			cmsg->recv_size = (size_t)recvsz;
-
-			nvec = 1;
-			vec[0].iov_base = cmsg->recv_buffer + cmsg->recv_end;
-			vec[0].iov_len = read_end - cmsg->recv_end;
-			if (wraparound) {
-				nvec = 2;
-				vec[1].iov_base = cmsg->recv_buffer;
-				vec[1].iov_len = cmsg->recv_start;
-			}
+/* If the incomplete message in `recv` is a large uncompressed fill,
+ * move what was read of its data into the mirror of its file or DMABUF, and
+ * read the rest straight there */
+static void start_direct_fill(struct chan_msg_state *cmsg,
+		struct cross_state *cxs, struct globals *g)
+{
+	size_t avail = cmsg->recv.len;
+	if (g->threads.compression != COMP_NONE ||
+			avail < sizeof(struct wmsg_buffer_fill)) {
+		return;
+	}
+	const char *packet = ring_head(&cmsg->recv);
+	uint32_t size_and_type = *(const uint32_t *)packet;
+	size_t size = transfer_size(size_and_type);
+	if (transfer_type(size_and_type) != WMSG_BUFFER_FILL ||
+			size < DIRECT_FILL_MIN_SIZE ||
+			alignz(size, 4) <= avail) {
+		return;
+	}
+	/* Replayed messages are skipped */
+	if (msgno_gt(cxs->newest_received_msgno,
+			    cxs->last_received_msgno + 1)) {
+		return;
+	}
+	struct wmsg_buffer_fill *header = &cmsg->fill_header;
+	memcpy(header, packet, sizeof(struct wmsg_buffer_fill));
+	size_t data_size = size - sizeof(struct wmsg_buffer_fill);
+	if (header->start > header->end ||
+			header->end - header->start != data_size) {
+		/* The usual path reports the error */
+		return;
+	}
+	char *target = begin_fill_in_place(&g->map, header);
+	if (!target) {
+		return;
+	}
+	size_t have = avail - sizeof(struct wmsg_buffer_fill);
+	memcpy(target, packet + sizeof(struct wmsg_buffer_fill),
+			minu(have, data_size));
+	wp_debug("Reading %zu bytes of fill for RID=%d directly", data_size,
+			header->remote_id);
+
+	cmsg->direct_fill = true;
+	cmsg->fill_dropped = false;
+	cmsg->fill_read = have;
+	cmsg->fill_size = alignz(size, 4) - sizeof(struct wmsg_buffer_fill);
+	ring_consume(&cmsg->recv, avail);
+}
+
+/* Continue reading a fill into the mirror of its file or DMABUF. The start
+ * of the messages after it is read into `recv`, which is empty meanwhile */
+static int advance_direct_fill(struct chan_msg_state *cmsg,
+		struct cross_state *cxs, int chanfd, struct globals *g)
+{
+	size_t data_size = cmsg->fill_header.end - cmsg->fill_header.start;
+	/* The main thread may have closed or resized the target meanwhile */
+	char *target = NULL;
+	if (!cmsg->fill_dropped) {
+		target = begin_fill_in_place(&g->map, &cmsg->fill_header);
+		if (!target) {
+			wp_debug("RID=%d was closed while receiving a fill for it, dropping the rest",
+					cmsg->fill_header.remote_id);
+			cmsg->fill_dropped = true;
 		}
+	}
 
-		ssize_t r = readv(chanfd, vec, nvec);
-		if (r == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-			wp_debug("Read would block");
-			return 0;
-		} else if (r == 0 || (r == -1 && errno == ECONNRESET)) {
-			wp_debug("Channel connection closed");
-			return ERR_DISCONN;
-		} else if (r == -1) {
-			wp_error("chanfd read failure: %s", strerror(errno));
-			return ERR_FATAL;
+	struct iovec vec[3];
+	int nvec = 0;
+	if (cmsg->fill_read < data_size) {
+		size_t left = data_size - cmsg->fill_read;
+		if (target) {
+			vec[nvec].iov_base = target + cmsg->fill_read;
+			vec[nvec].iov_len = left;
 		} else {
-			if (nvec == 2 && (size_t)r >= vec[0].iov_len) {
-				/* Complete parsing this message */
-				int cm_ret = interpret_chanmsg(cmsg, cxs, g,
-						display_side,
-						cmsg->recv_buffer +
-								cmsg->recv_start);
-				if (cm_ret < 0) {
-					return cm_ret;
-				}
+			vec[nvec].iov_base = cmsg->recv.data;
+			vec[nvec].iov_len = minu(left, cmsg->recv.size);
+		}
+		nvec++;
+	}
+	size_t pad_read = maxu(cmsg->fill_read, data_size) - data_size;
+	if (cmsg->fill_size - data_size > pad_read) {
+		vec[nvec].iov_base = cmsg->fill_padding;
+		vec[nvec].iov_len = cmsg->fill_size - data_size - pad_read;
+		nvec++;
+	}
+	if (target || cmsg->fill_read >= data_size) {
+		vec[nvec].iov_base = ring_tail(&cmsg->recv);
+		vec[nvec].iov_len = cmsg->recv.size;
+		nvec++;
+	}
+
+	size_t r;
+	int ret = read_channel(cmsg, chanfd, vec, nvec, g, &r);
+	if (ret < 0 || r == 0) {
+		return ret;
+	}
+	size_t in_fill = minu(r, cmsg->fill_size - cmsg->fill_read);
+	cmsg->fill_read += in_fill;
+	if (cmsg->fill_read < cmsg->fill_size) {
+		return 0;
+	}
 
-				cmsg->recv_start = 0;
-				cmsg->recv_end = (size_t)r - vec[0].iov_len;
+	cmsg->direct_fill = false;
+	cmsg->recv.len = r - in_fill;
+	wp_debug("Received WMSG_BUFFER_FILL for RID=%d (len %zu), directly",
+			cmsg->fill_header.remote_id,
+			data_size + sizeof(struct wmsg_buffer_fill));
+	(void)count_received_message(
+			cxs, data_size + sizeof(struct wmsg_buffer_fill));
+	if (!cmsg->fill_dropped) {
+		finish_fill_in_place(&g->map, &cmsg->fill_header);
+	}
+	return 0;
+}
 
-				if (cmsg->proto_write.zone_start <
-						cmsg->proto_write.zone_end) {
-					goto next_stage;
-				}
-			} else {
-				cmsg->recv_end += (size_t)r;
-			}
+static int advance_chanmsg_chanread(struct chan_msg_state *cmsg,
+		struct cross_state *cxs, int chanfd, bool display_side,
+		struct globals *g)
+{
+	if (!cmsg->direct_fill && cmsg->recv_unhandled_messages == 0) {
+		start_direct_fill(cmsg, cxs, g);
+	}
+
+	if (cmsg->direct_fill) {
+		int ret = advance_direct_fill(cmsg, cxs, chanfd, g);
+		if (ret < 0) {
+			return ret;
+		}
+	} else if (cmsg->recv_unhandled_messages == 0) {
+		/* Only an incomplete message can be left in the ring; make
+		 * sure it fits, and read as much as there is space for */
+		struct mirrored_ring *ring = &cmsg->recv;
+		size_t goal = RECV_GOAL_READ_SIZE;
+		if (ring->len >= sizeof(uint32_t)) {
+			uint32_t header = *(uint32_t *)ring_head(ring);
+			goal = maxu(goal, alignz(transfer_size(header), 4));
+		}
+		if (ring_reserve(ring, goal) == -1) {
+			wp_error("Allocation failure, resizing receive buffer failed");
+			return ERR_NOMEM;
+		}
+		struct iovec vec;
+		vec.iov_base = ring_tail(ring);
+		vec.iov_len = ring->size - ring->len;
+
+		size_t r;
+		int ret = read_channel(cmsg, chanfd, &vec, 1, g, &r);
+		if (ret < 0 || r == 0) {
+			return ret;
 		}
+		ring->len += r;
 	}
 
 	/* Recount unhandled messages */
+	struct mirrored_ring *ring = &cmsg->recv;
 	cmsg->recv_unhandled_messages = 0;
-	size_t i = cmsg->recv_start;
-	while (i + sizeof(uint32_t) <= cmsg->recv_end) {
-		uint32_t *header = (uint32_t *)&cmsg->recv_buffer[i];
+	size_t i = 0;
+	while (i + sizeof(uint32_t) <= ring->len) {
+		uint32_t *header = (uint32_t *)(ring_head(ring) + i);
 		size_t sz = alignz(transfer_size(*header), 4);
 		if (sz == 0) {
 			wp_error("Encountered malformed zero size packet");
 			return ERR_FATAL;
 		}
 		i += sz;
-		if (i > cmsg->recv_end) {
+		if (i > ring->len) {
 			break;
 		}
 		cmsg->recv_unhandled_messages++;
 	}
 
 	while (cmsg->recv_unhandled_messages > 0) {
-		char *packet_start = &cmsg->recv_buffer[cmsg->recv_start];
+		char *packet_start = ring_head(ring);
 		uint32_t *header = (uint32_t *)packet_start;
 		size_t sz = transfer_size(*header);
-		int cm_ret = interpret_chanmsg(
-				cmsg, cxs, g, display_side, packet_start);
+		int cm_ret;
+		if (cmsg->proto_held) {
+			/* Continue with the messages that were held back */
+			cm_ret = parse_chanmsg_protocol(
+					cmsg, g, display_side, packet_start);
+		} else {
+			cm_ret = interpret_chanmsg(cmsg, cxs, g, display_side,
+					packet_start);
+		}
 		if (cm_ret < 0) {
 			return cm_ret;
 		}
-		cmsg->recv_start += alignz(sz, 4);
+		if (cmsg->proto_held) {
+			if (cmsg->proto_write.zone_start <
+					cmsg->proto_write.zone_end) {
+				goto next_stage;
+			}
+			wp_debug("Holding protocol messages for frame pacing");
+			cmsg->state = CM_WAITING_FOR_FRAME;
+			return 0;
+		}
+		ring_consume(ring, alignz(sz, 4));
 		cmsg->recv_unhandled_messages--;
 
 		if (cmsg->proto_write.zone_start < cmsg->proto_write.zone_end) {
@@ -609,8 +966,8 @@ static int advance_chanmsg_transfer(struct globals *g,
 	return 0;
 }
 
-static void clear_old_transfers(
-		struct transfer_queue *td, uint32_t inclusive_cutoff)
+static void clear_old_transfers(struct transfer_queue *td,
+		struct replay_spill *spill, uint32_t inclusive_cutoff)
 {
 	for (int i = 0; i < td->end; i++) {
 		if (td->vecs[i].iov_len == 0) {
@@ -623,8 +980,15 @@ static void clear_old_transfers(
 		if (!msgno_gt(inclusive_cutoff, td->meta[i].msgno)) {
 			break;
 		}
-		if (!td->meta[i].static_alloc) {
+		if (td->meta[i].zerocopy_pending > 0) {
+			/* The kernel may still read from this block */
+			break;
+		}
+		if (td->meta[i].spilled) {
+			spill->nblocks--;
+		} else if (!td->meta[i].static_alloc) {
 			free(td->vecs[i].iov_base);
+			td->queued_bytes -= td->vecs[i].iov_len;
 		}
 		td->vecs[i].iov_base = NULL;
 		td->vecs[i].iov_len = 0;
@@ -637,11 +1001,269 @@ static void clear_old_transfers(
 		td->start -= k;
 		td->end -= k;
 	}
+	if (spill->nblocks == 0 && spill->end > 0) {
+		/* Everything in the file was acknowledged; start over */
+		if (ftruncate(spill->fd, 0) == -1) {
+			wp_error("Failed to truncate replay spill file: %s",
+					strerror(errno));
+		}
+		spill->end = 0;
+		spill->write_failed = false;
+	}
+}
+
+/* Messages smaller than this are not worth moving to the spill file */
+#define SPILL_MIN_BLOCK 4096
+
+/* While more than `max_bytes` of messages are held in memory, move the
+ * oldest of those which were written and await acknowledgement to the spill
+ * file. They are only read again if a reconnection requires a replay. */
+static void spill_written_transfers(
+		struct way_msg_state *wmsg, size_t max_bytes)
+{
+	struct transfer_queue *td = &wmsg->transfers;
+	struct replay_spill *spill = &wmsg->spill;
+	int nmoved = 0;
+	for (int i = 0; i < td->start && td->queued_bytes > max_bytes &&
+			!spill->write_failed;
+			i++) {
+		struct transfer_block_meta *meta = &td->meta[i];
+		if (meta->static_alloc || meta->spilled ||
+				meta->zerocopy_pending > 0 ||
+				td->vecs[i].iov_len < SPILL_MIN_BLOCK) {
+			continue;
+		}
+		const char *data = td->vecs[i].iov_base;
+		size_t len = td->vecs[i].iov_len;
+		size_t done = 0;
+		while (done < len) {
+			ssize_t wr = pwrite(spill->fd, data + done, len - done,
+					(off_t)(spill->end + done));
+			if (wr == -1 && errno == EINTR) {
+				continue;
+			} else if (wr <= 0) {
+				wp_error("Failed to write to replay spill file, keeping messages in memory: %s",
+						wr == -1 ? strerror(errno)
+							 : "no progress");
+				spill->write_failed = true;
+				break;
+			}
+			done += (size_t)wr;
+		}
+		if (spill->write_failed) {
+			break;
+		}
+		free(td->vecs[i].iov_base);
+		td->vecs[i].iov_base = NULL;
+		td->queued_bytes -= len;
+		meta->spilled = true;
+		meta->spill_offset = spill->end;
+		spill->end += len;
+		spill->nblocks++;
+		nmoved++;
+	}
+	if (nmoved > 0) {
+		wp_debug("Moved %d messages to the replay spill file, which now holds %d (%zu bytes)",
+				nmoved, spill->nblocks, spill->end);
+	}
+}
+
+/* Read back the spilled blocks among the next `count` to write */
+static int restore_spilled_transfers(
+		struct transfer_queue *td, struct replay_spill *spill, int count)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	int nrestored = 0;
+	for (int i = td->start; i < td->end && i < td->start + count; i++) {
+		struct transfer_block_meta *meta = &td->meta[i];
+		if (!meta->spilled) {
+			continue;
+		}
+		size_t len = td->vecs[i].iov_len;
+		size_t skip = meta->spill_offset % page;
+		void *map = mmap(NULL, len + skip, PROT_READ, MAP_SHARED,
+				spill->fd, (off_t)(meta->spill_offset - skip));
+		if (map == MAP_FAILED) {
+			wp_error("Failed to map replay spill file: %s",
+					strerror(errno));
+			return ERR_FATAL;
+		}
+		char *data = malloc(len);
+		if (!data) {
+			munmap(map, len + skip);
+			wp_error("Failed to allocate %zu bytes to restore a spilled message",
+					len);
+			return ERR_NOMEM;
+		}
+		memcpy(data, (const char *)map + skip, len);
+		munmap(map, len + skip);
+
+		td->vecs[i].iov_base = data;
+		td->queued_bytes += len;
+		if (td->queued_bytes > td->peak_queued_bytes) {
+			td->peak_queued_bytes = td->queued_bytes;
+		}
+		meta->spilled = false;
+		spill->nblocks--;
+		nrestored++;
+	}
+	if (nrestored > 0) {
+		wp_debug("Read %d messages back from the replay spill file",
+				nrestored);
+	}
+	return 0;
+}
+
+static void setup_zerocopy(
+		int chanfd, struct zerocopy_state *zc, size_t threshold)
+{
+	zc->threshold = 0;
+	zc->next_id = 0;
+	zc->n_outstanding = 0;
+	if (threshold == 0 || chanfd == -1 || zc->copied) {
+		return;
+	}
+#ifdef HAS_ZEROCOPY
+	int one = 1;
+	if (setsockopt(chanfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) ==
+			-1) {
+		wp_debug("Channel does not support zerocopy sends, using regular writes: %s",
+				strerror(errno));
+		return;
+	}
+	zc->threshold = threshold;
+#else
+	(void)chanfd;
+#endif
+}
+
+#ifdef HAS_ZEROCOPY
+static void mark_zerocopy_complete(struct transfer_queue *td,
+		struct zerocopy_state *zc, uint32_t lo, uint32_t hi)
+{
+	uint32_t m = hi - lo + 1;
+	for (int i = 0; i < td->end; i++) {
+		struct transfer_block_meta *meta = &td->meta[i];
+		if (meta->zerocopy_pending == 0) {
+			continue;
+		}
+		/* Size of the intersection of [lo, lo + m) with the ids used
+		 * by the block, computed modulo 2^32 */
+		uint32_t s = meta->zerocopy_first, n = meta->zerocopy_sent;
+		uint32_t overlap = 0;
+		if (s - lo < m) {
+			overlap = m - (s - lo) < n ? m - (s - lo) : n;
+		} else if (lo - s < n) {
+			overlap = n - (lo - s) < m ? n - (lo - s) : m;
+		}
+		if (overlap > meta->zerocopy_pending) {
+			wp_error("Unexpected zerocopy completion [%" PRIu32
+				 ",%" PRIu32 "] for block %d",
+					lo, hi, i);
+			overlap = meta->zerocopy_pending;
+		}
+		meta->zerocopy_pending -= overlap;
+		zc->n_outstanding -= overlap;
+	}
+}
+#endif
+
+/* Process zerocopy completion notifications from the socket error queue,
+ * so that the blocks they cover can be freed */
+static int reap_zerocopy_completions(
+		int chanfd, struct transfer_queue *td, struct zerocopy_state *zc)
+{
+#ifdef HAS_ZEROCOPY
+	while (zc->n_outstanding > 0) {
+		union {
+			char buf[CMSG_SPACE(sizeof(struct sock_extended_err) +
+					    128)];
+			struct cmsghdr align;
+		} control;
+		struct msghdr msg = {0};
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if (recvmsg(chanfd, &msg, MSG_ERRQUEUE) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			wp_error("Failed to read zerocopy notifications: %s",
+					strerror(errno));
+			return -1;
+		}
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			struct sock_extended_err serr;
+			if (cmsg->cmsg_len < CMSG_LEN(sizeof(serr))) {
+				continue;
+			}
+			memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+			if (serr.ee_errno != 0 ||
+					serr.ee_origin !=
+							SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+			if ((serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) &&
+					zc->threshold > 0) {
+				/* Pinning pages costs more than a copy */
+				wp_debug("Kernel copied zerocopy send data, disabling zerocopy sends");
+				zc->threshold = 0;
+				zc->copied = true;
+			}
+			mark_zerocopy_complete(
+					td, zc, serr.ee_info, serr.ee_data);
+		}
+	}
+#else
+	(void)chanfd;
+	(void)td;
+	(void)zc;
+#endif
+	return 0;
+}
+
+static bool is_zerocopy_block(const struct transfer_queue *td, int i,
+		const struct zerocopy_state *zc)
+{
+	return zc->threshold > 0 && !td->meta[i].static_alloc &&
+	       td->vecs[i].iov_len >= zc->threshold;
+}
+
+/* Write (the rest of) the block at td->start using MSG_ZEROCOPY */
+static ssize_t write_zerocopy_block(int chanfd, struct transfer_queue *td,
+		struct zerocopy_state *zc)
+{
+#ifdef HAS_ZEROCOPY
+	struct msghdr msg = {0};
+	msg.msg_iov = &td->vecs[td->start];
+	msg.msg_iovlen = 1;
+	ssize_t wr = sendmsg(chanfd, &msg, MSG_ZEROCOPY);
+	if (wr == -1 && errno == ENOBUFS) {
+		/* Too many notifications outstanding; copy this time */
+		return writev(chanfd, &td->vecs[td->start], 1);
+	} else if (wr == -1) {
+		return -1;
+	}
+
+	struct transfer_block_meta *meta = &td->meta[td->start];
+	if (meta->zerocopy_pending == 0) {
+		meta->zerocopy_first = zc->next_id;
+		meta->zerocopy_sent = 0;
+	}
+	meta->zerocopy_pending++;
+	meta->zerocopy_sent++;
+	zc->next_id++;
+	zc->n_outstanding++;
+	return wr;
+#else
+	(void)zc;
+	return writev(chanfd, &td->vecs[td->start], 1);
+#endif
 }
 
 /* Returns 0 sucessful -1 if fatal error, -2 if closed */
 static int partial_write_transfer(int chanfd, struct transfer_queue *td,
-		int *total_written, int max_iov)
+		struct zerocopy_state *zc, int *total_written, int max_iov)
 {
 	// Waiting for channel write to complete
 	if (td->start < td->end) {
@@ -652,10 +1274,37 @@ static int partial_write_transfer(int chanfd, struct transfer_queue *td,
 				orig_base + td->partial_write_amt;
 		td->vecs[td->start].iov_len = orig_len - td->partial_write_amt;
 		int count = min(max_iov, td->end - td->start);
-		ssize_t wr = writev(chanfd, &td->vecs[td->start], count);
+		/* A file descriptor is passed with the first byte of its block,
+		 * so the write stops before the next block that has one */
+		int first = td->start;
+		int pass_fd = td->partial_write_amt == 0
+					      ? td->meta[first].passed_fd
+					      : -1;
+		for (int i = 1; i < count; i++) {
+			if (td->meta[first + i].passed_fd != -1) {
+				count = i;
+				break;
+			}
+		}
+		ssize_t wr;
+		if (pass_fd != -1) {
+			wr = writev_with_fd(chanfd, &td->vecs[first], count,
+					pass_fd);
+		} else if (is_zerocopy_block(td, td->start, zc)) {
+			wr = write_zerocopy_block(chanfd, td, zc);
+		} else {
+			/* Stop the writev before the next large block, so
+			 * that it can be sent without copying */
+			for (int i = 1; i < count; i++) {
+				if (is_zerocopy_block(td, td->start + i, zc)) {
+					count = i;
+					break;
+				}
+			}
+			wr = writev(chanfd, &td->vecs[td->start], count);
+		}
 		td->vecs[td->start].iov_base = orig_base;
 		td->vecs[td->start].iov_len = orig_len;
-
 		if (wr == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
 			return 0;
 		} else if (wr == -1 &&
@@ -667,6 +1316,11 @@ static int partial_write_transfer(int chanfd, struct transfer_queue *td,
 			return ERR_FATAL;
 		}
 
+		if (pass_fd != -1 && wr > 0) {
+			checked_close(pass_fd);
+			td->meta[first].passed_fd = -1;
+		}
+
 		size_t uwr = (size_t)wr;
 		*total_written += (int)wr;
 		while (uwr > 0 && td->start < td->end) {
@@ -688,6 +1342,14 @@ static int partial_write_transfer(int chanfd, struct transfer_queue *td,
 				td->start++;
 			}
 		}
+		uint32_t sent = td->last_msgno;
+		if (td->start < td->end) {
+			sent = td->meta[td->start].msgno +
+			       (td->partial_write_amt > 0 ? 1 : 0);
+		}
+		if (msgno_gt(sent, td->sent_msgno)) {
+			td->sent_msgno = sent;
+		}
 	}
 	return 0;
 }
@@ -754,6 +1416,11 @@ static int inject_acknowledge(
 		wmsg->transfers.vecs[next_slot].iov_base = queued_msg;
 		wmsg->transfers.meta[next_slot].msgno = ack_msgno;
 		wmsg->transfers.meta[next_slot].static_alloc = true;
+		wmsg->transfers.meta[next_slot].zerocopy_pending = 0;
+		wmsg->transfers.meta[next_slot].zerocopy_first = 0;
+		wmsg->transfers.meta[next_slot].zerocopy_sent = 0;
+		wmsg->transfers.meta[next_slot].spilled = false;
+		wmsg->transfers.meta[next_slot].passed_fd = -1;
 		wmsg->transfers.end++;
 	}
 
@@ -763,28 +1430,300 @@ static int inject_acknowledge(
 			sizeof(struct wmsg_ack), WMSG_ACK_NBLOCKS);
 	queued_msg->messages_received = cxs->last_received_msgno;
 	cxs->last_acked_msgno = cxs->last_received_msgno;
+	cxs->unacked_bytes = 0;
 	return 0;
 }
 
-static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
-		struct cross_state *cxs, struct globals *g, int chanfd,
-		bool display_side)
+/* Write as much of the transfer queue to the channel as possible, after
+ * dropping confirmed transfers and acknowledging received messages */
+static int write_queued_transfers(struct way_msg_state *wmsg,
+		struct cross_state *cxs, int chanfd)
 {
-	const char *progdesc = display_side ? "compositor" : "application";
-
-	/* Copy the data in the transfer queue to the write queue. */
-	(void)transfer_load_async(&wmsg->transfers);
-
+	if (reap_zerocopy_completions(
+			    chanfd, &wmsg->transfers, &wmsg->zerocopy) == -1) {
+		return ERR_FATAL;
+	}
 	// First, clear out any transfers that are no longer needed
-	clear_old_transfers(&wmsg->transfers, cxs->last_confirmed_msgno);
+	clear_old_transfers(&wmsg->transfers, &wmsg->spill,
+			cxs->last_confirmed_msgno);
 
 	/* Acknowledge the other side's transfers as soon as possible */
 	if (cxs->last_acked_msgno != cxs->last_received_msgno) {
 		(void)inject_acknowledge(wmsg, cxs);
 	}
 
-	int ret = partial_write_transfer(chanfd, &wmsg->transfers,
-			&wmsg->total_written, wmsg->max_iov);
+	if (wmsg->spill.nblocks > 0) {
+		/* Replaying after a reconnection */
+		int rret = restore_spilled_transfers(&wmsg->transfers,
+				&wmsg->spill, wmsg->max_iov);
+		if (rret < 0) {
+			return rret;
+		}
+	}
+
+	/* The transfer queue is only used by this thread */
+	pthread_mutex_unlock(wmsg->state_lock);
+	int ret = partial_write_transfer(chanfd, &wmsg->transfers,
+			&wmsg->zerocopy, &wmsg->total_written, wmsg->max_iov);
+	pthread_mutex_lock(wmsg->state_lock);
+	return ret;
+}
+
+static bool has_unwritten_transfers(const struct way_msg_state *wmsg)
+{
+	return wmsg->transfers.start < wmsg->transfers.end;
+}
+
+/* Returns true if the queued messages take more than `max_bytes`, in which
+ * case nothing more should be read from the program or its pipes until
+ * acknowledgements from the other side free enough space */
+static bool update_read_pause(struct way_msg_state *wmsg,
+		const struct cross_state *cxs, size_t max_bytes)
+{
+	if (max_bytes == 0) {
+		return false;
+	}
+	clear_old_transfers(&wmsg->transfers, &wmsg->spill,
+			cxs->last_confirmed_msgno);
+	bool over = wmsg->transfers.queued_bytes > max_bytes;
+	if (over && !wmsg->reads_paused) {
+		wp_debug("Pausing reads: %zu bytes queued, limit is %zu",
+				wmsg->transfers.queued_bytes, max_bytes);
+	} else if (!over && wmsg->reads_paused) {
+		wp_debug("Resuming reads: %zu bytes queued",
+				wmsg->transfers.queued_bytes);
+	}
+	wmsg->reads_paused = over;
+	return over;
+}
+
+/* Returns true if the block holds an empty WMSG_BUFFER_HASHES message that
+ * replaced a released buffer update */
+static bool is_released_update(const struct transfer_queue *td, int i)
+{
+	if (td->meta[i].static_alloc || td->meta[i].spilled ||
+			td->vecs[i].iov_len != sizeof(struct wmsg_buffer_hashes)) {
+		return false;
+	}
+	const struct wmsg_buffer_hashes *header = td->vecs[i].iov_base;
+	return transfer_type(header->size_and_type) == WMSG_BUFFER_HASHES &&
+	       header->buffer_size == 0 && header->remote_id != 0;
+}
+
+/* Returns true if the block is a WMSG_INJECT_RIDS message passing the file
+ * or pipe with the given id */
+static bool passes_rid(const struct iovec *vec, int rid)
+{
+	const uint32_t *msg = vec->iov_base;
+	if (vec->iov_len < sizeof(uint32_t) ||
+			transfer_type(msg[0]) != WMSG_INJECT_RIDS) {
+		return false;
+	}
+	const int32_t *rids = (const int32_t *)(msg + 1);
+	size_t nrids = (vec->iov_len - sizeof(uint32_t)) / sizeof(int32_t);
+	for (size_t i = 0; i < nrids; i++) {
+		if (rids[i] == rid) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Returns true if a message passing the file with the given id is queued
+ * or has not been acknowledged yet */
+static bool has_unacked_pass(const struct way_msg_state *wmsg, int rid)
+{
+	const struct transfer_queue *td = &wmsg->transfers;
+	for (int i = 0; i < td->end; i++) {
+		if (!td->meta[i].static_alloc && !td->meta[i].spilled &&
+				passes_rid(&td->vecs[i], rid)) {
+			return true;
+		}
+	}
+	for (int i = 0; i < wmsg->ntrailing; i++) {
+		if (passes_rid(&wmsg->trailing[i], rid)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Once written, updates to files need not be kept for replay, since after
+ * a reconnection the files can be compared by hashes instead. Their data is
+ * replaced with empty WMSG_BUFFER_HASHES messages, which do nothing but keep
+ * the message numbering of a replay intact.
+ *
+ * The hashes are only compared after the replay, so an update must be kept
+ * if a replayed protocol message could use the file: that is, if the file
+ * is controlled by protocol handlers (like shm pools, whose commits follow
+ * each update, and keymaps), or if the message passing it is unacknowledged.
+ * Otherwise the program could be handed a zeroed or stale file, and nothing
+ * would tell it when the contents are fixed. */
+static void release_written_updates(
+		struct fd_translation_map *map, struct way_msg_state *wmsg)
+{
+	struct transfer_queue *td = &wmsg->transfers;
+	if (td->start == 0) {
+		return;
+	}
+	/* Acknowledgements share the number of the message after them, so
+	 * take the first number not yet written */
+	uint32_t resume = td->start < td->end ? td->meta[td->start].msgno
+					      : td->last_msgno;
+	for (int i = td->start - 1;
+			i >= 0 && msgno_gt(td->meta[i].msgno,
+						  wmsg->released_msgno);
+			i--) {
+		if (td->meta[i].static_alloc || td->meta[i].spilled ||
+				td->vecs[i].iov_len <=
+						sizeof(struct wmsg_buffer_hashes)) {
+			continue;
+		}
+		const struct wmsg_basic *header = td->vecs[i].iov_base;
+		enum wmsg_type type = transfer_type(header->size_and_type);
+		if (type != WMSG_BUFFER_FILL && type != WMSG_BUFFER_DIFF) {
+			continue;
+		}
+		struct shadow_fd *sfd =
+				get_shadow_for_rid(map, header->remote_id);
+		if (!sfd || sfd->type != FDC_FILE || sfd->has_owner ||
+				sfd->file_readonly ||
+				has_unacked_pass(wmsg, sfd->remote_id)) {
+			continue;
+		}
+		struct wmsg_buffer_hashes *empty =
+				td->meta[i].zerocopy_pending > 0
+						? NULL
+						: calloc(1, sizeof(*empty));
+		if (!empty) {
+			/* Check again once the kernel is done with it */
+			resume = td->meta[i].msgno;
+			continue;
+		}
+		empty->size_and_type = transfer_header(
+				sizeof(*empty), WMSG_BUFFER_HASHES);
+		empty->remote_id = header->remote_id;
+		td->queued_bytes -= td->vecs[i].iov_len - sizeof(*empty);
+		free(td->vecs[i].iov_base);
+		td->vecs[i].iov_base = empty;
+		td->vecs[i].iov_len = sizeof(*empty);
+	}
+	wmsg->released_msgno = resume;
+}
+
+/* Once the other side is known to handle it, list the files this side has
+ * cached; the waypipe-client goes first, even with an empty list, to tell
+ * the waypipe-server that it can reply with its own */
+static int queue_blob_list(struct globals *g, struct way_msg_state *wmsg,
+		struct cross_state *cxs, bool display_side)
+{
+	if (!cxs->remote_blobs || wmsg->blobs_announced) {
+		return 0;
+	}
+	wmsg->blobs_announced = true;
+	if (!display_side && !g->map.blob_cache) {
+		return 0;
+	}
+	size_t size;
+	void *msg = make_blob_list(g->map.blob_cache, &size);
+	if (!msg) {
+		return ERR_NOMEM;
+	}
+	transfer_add(&wmsg->transfers, size, msg);
+	return 0;
+}
+
+/* If the other side handles WMSG_OPEN_LOCAL, send one with a file
+ * descriptor attached; should it arrive, both sides share a host. The
+ * waypipe-client checks first, and the waypipe-server replies once its own
+ * check has succeeded. */
+static int queue_local_probe(struct way_msg_state *wmsg,
+		const struct cross_state *cxs)
+{
+	if (!cxs->remote_local || wmsg->local_probe_sent) {
+		return 0;
+	}
+	wmsg->local_probe_sent = true;
+	int fd = create_anon_file();
+	if (fd == -1) {
+		wp_error("Failed to create file to pass: %s", strerror(errno));
+		return 0;
+	}
+	struct wmsg_open_local *probe = calloc(1, sizeof(*probe));
+	if (!probe) {
+		checked_close(fd);
+		return ERR_NOMEM;
+	}
+	probe->size_and_type =
+			transfer_header(sizeof(*probe), WMSG_OPEN_LOCAL);
+	if (transfer_add_fd(&wmsg->transfers, sizeof(*probe), probe, fd) ==
+			-1) {
+		free(probe);
+		return ERR_NOMEM;
+	}
+	return 0;
+}
+
+/* Queue the messages used to resynchronize files after a reconnection */
+static int queue_resync_messages(struct globals *g,
+		struct way_msg_state *wmsg, struct cross_state *cxs)
+{
+	if (g->config->remote_resync && !wmsg->resync_announced) {
+		struct wmsg_buffer_hashes *empty = calloc(1, sizeof(*empty));
+		if (!empty) {
+			return ERR_NOMEM;
+		}
+		empty->size_and_type = transfer_header(
+				sizeof(*empty), WMSG_BUFFER_HASHES);
+		transfer_add(&wmsg->transfers, sizeof(*empty), empty);
+		wmsg->resync_announced = true;
+	}
+	for (int i = 0; i < cxs->nresend_out; i++) {
+		transfer_add(&wmsg->transfers, cxs->resend_out[i].size,
+				cxs->resend_out[i].data);
+	}
+	cxs->nresend_out = 0;
+	int ret = 0;
+	for (int i = 0; i < cxs->nresend_in; i++) {
+		if (ret == 0) {
+			ret = resend_buffer_regions(&g->map, &g->threads,
+					&cxs->resend_in[i]);
+		}
+		free(cxs->resend_in[i].data);
+	}
+	cxs->nresend_in = 0;
+	for (int i = 0; i < wmsg->nresync_rids; i++) {
+		struct shadow_fd *sfd =
+				get_shadow_for_rid(&g->map, wmsg->resync_rids[i]);
+		if (!sfd || sfd->type != FDC_FILE ||
+				(!sfd->mem_mirror && !sfd->evicted_hashes) ||
+				sfd->only_here) {
+			continue;
+		}
+		size_t size;
+		void *msg = make_buffer_hashes(sfd, &size);
+		if (!msg) {
+			ret = ERR_NOMEM;
+			break;
+		}
+		wp_debug("Sending hashes of RID=%d to check its copy",
+				sfd->remote_id);
+		transfer_add(&wmsg->transfers, size, msg);
+	}
+	wmsg->nresync_rids = 0;
+	return ret;
+}
+
+static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
+		struct cross_state *cxs, struct globals *g, int chanfd,
+		bool display_side)
+{
+	const char *progdesc = display_side ? "compositor" : "application";
+
+	/* Copy the data in the transfer queue to the write queue. */
+	(void)transfer_load_async(&wmsg->transfers);
+
+	int ret = write_queued_transfers(wmsg, cxs, chanfd);
 	if (ret < 0) {
 		return ret;
 	}
@@ -795,7 +1734,9 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 
 	/* Run a task ourselves, making use of the main thread */
 	if (has_task) {
+		pthread_mutex_unlock(wmsg->state_lock);
 		run_task(&task, &g->threads.threads[0]);
+		pthread_mutex_lock(wmsg->state_lock);
 
 		pthread_mutex_lock(&g->threads.work_mutex);
 		g->threads.tasks_in_progress--;
@@ -825,16 +1766,17 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 		memset(wmsg->trailing, 0, sizeof(wmsg->trailing));
 	}
 
-	if (wmsg->transfers.start == wmsg->transfers.end && is_done) {
-		for (struct shadow_fd_link *lcur = g->map.link.l_next,
-					   *lnxt = lcur->l_next;
-				lcur != &g->map.link;
-				lcur = lnxt, lnxt = lcur->l_next) {
-			/* Note: finish_update() may delete `cur` */
-			struct shadow_fd *cur = (struct shadow_fd *)lcur;
-			finish_update(cur);
-			destroy_shadow_if_unreferenced(cur);
-		}
+	/* Once all work for this cycle is done, the remaining messages can
+	 * be written while the next cycle is read and diffed, as long as the
+	 * previous cycle has been fully written. */
+	const struct transfer_queue *td = &wmsg->transfers;
+	bool prev_cycle_written =
+			!has_unwritten_transfers(wmsg) ||
+			msgno_gt(td->meta[td->start].msgno,
+					wmsg->cycle_end_msgno);
+	if (is_done && wmsg->ntrailing == 0 && prev_cycle_written) {
+		finish_pending_updates(&g->map);
+		evict_cold_mirrors(&g->map);
 
 		/* Reset work queue */
 		pthread_mutex_lock(&g->threads.work_mutex);
@@ -848,31 +1790,47 @@ static int advance_waymsg_chanwrite(struct way_msg_state *wmsg,
 		pthread_mutex_unlock(&g->threads.work_mutex);
 
 		DTRACE_PROBE(waypipe, channel_write_end);
-		size_t unacked_bytes = 0;
+		size_t unacked_bytes = 0, unwritten_bytes = 0;
 		for (int i = 0; i < wmsg->transfers.end; i++) {
 			unacked_bytes += wmsg->transfers.vecs[i].iov_len;
+			if (i >= wmsg->transfers.start) {
+				unwritten_bytes += wmsg->transfers.vecs[i]
+								   .iov_len;
+			}
 		}
+		unwritten_bytes -= wmsg->transfers.partial_write_amt;
 
-		wp_debug("Sent %d-byte message from %s to channel; %zu-bytes in flight",
-				wmsg->total_written, progdesc, unacked_bytes);
+		wp_debug("Sent %d-byte message from %s to channel; %zu-bytes in flight, %zu-bytes still to write",
+				wmsg->total_written, progdesc, unacked_bytes,
+				unwritten_bytes);
 
 		/* do not delete the used transfers yet; we need a remote
 		 * acknowledgement */
 		wmsg->total_written = 0;
+		wmsg->cycle_end_msgno = wmsg->transfers.last_msgno;
+		wmsg->cycle_end_number = g->pacing.cycles_read;
 		wmsg->state = WM_WAITING_FOR_PROGRAM;
 	}
 	return 0;
 }
 static int advance_waymsg_progread(struct way_msg_state *wmsg,
-		struct globals *g, int progfd, bool display_side,
-		bool progsock_readable)
+		struct cross_state *cxs, struct globals *g, int progfd,
+		bool display_side, bool progsock_readable)
 {
 	const char *progdesc = display_side ? "compositor" : "application";
 	// We have data to read from programs/pipes
 	bool new_proto_data = false;
+	char *proto_out = NULL;
+	size_t proto_out_size = 0;
 	int old_fbuffer_end = wmsg->fds.zone_end;
-	if (progsock_readable) {
-		// Read /once/
+	/* Read until the program has nothing more to send, or the buffer is
+	 * full, so that one update cycle and one WMSG_PROTOCOL message cover
+	 * a burst of messages. Each recvmsg call brings at most one batch of
+	 * file descriptors; reading stops after a few batches. */
+	while (progsock_readable &&
+			wmsg->proto_read.zone_end < wmsg->proto_read.size &&
+			wmsg->fds.zone_end - old_fbuffer_end <
+					PROGREAD_MAX_FDS) {
 		ssize_t rc = iovec_read(progfd,
 				wmsg->proto_read.data +
 						wmsg->proto_read.zone_end,
@@ -880,7 +1838,13 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 						wmsg->proto_read.zone_end),
 				&wmsg->fds);
 		if (rc == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-			// do nothing
+			break;
+		} else if (rc == -1 && errno == EINTR) {
+			continue;
+		} else if (new_proto_data && rc <= 0) {
+			/* Handle what was read first; the next read will
+			 * fail the same way */
+			break;
 		} else if (rc == 0 || (rc == -1 && errno == ECONNRESET)) {
 			wp_debug("%s has closed", progdesc);
 			// state transitions handled in main loop
@@ -897,6 +1861,7 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 	}
 
 	if (new_proto_data) {
+		g->pacing.cycles_read++;
 		wp_debug("Read %d new file descriptors, have %d total now",
 				wmsg->fds.zone_end - old_fbuffer_end,
 				wmsg->fds.zone_end);
@@ -908,42 +1873,74 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 			return ERR_NOMEM;
 		}
 
-		wmsg->proto_write.zone_start = 0;
-		wmsg->proto_write.zone_end = 0;
-		parse_and_prune_messages(g, display_side, !display_side,
-				&wmsg->proto_read, &wmsg->proto_write,
-				&wmsg->fds);
-
-		/* Recycle partial message bytes */
-		if (wmsg->proto_read.zone_start > 0) {
-			if (wmsg->proto_read.zone_end >
-					wmsg->proto_read.zone_start) {
-				memmove(wmsg->proto_read.data,
-						wmsg->proto_read.data +
-								wmsg->proto_read.zone_start,
-						(size_t)(wmsg->proto_read.zone_end -
-								wmsg->proto_read.zone_start));
+		int proto_end = parse_messages_in_place(g, display_side,
+				!display_side, &wmsg->proto_read,
+				&wmsg->proto_write, &wmsg->fds);
+		if (proto_end == -1) {
+			return ERR_NOMEM;
+		}
+		int leftover = wmsg->proto_read.zone_end -
+			       wmsg->proto_read.zone_start;
+		if (proto_end > PROTO_HEADER_SPACE) {
+			/* The parsed messages already sit right after the
+			 * space reserved for the transfer header, so the read
+			 * buffer itself becomes the WMSG_PROTOCOL transfer;
+			 * reading continues in a fresh buffer */
+			char *next_read = malloc((size_t)wmsg->proto_read.size);
+			if (!next_read) {
+				wp_error("Failed to allocate protocol read buffer");
+				return ERR_NOMEM;
 			}
-			wmsg->proto_read.zone_end -=
-					wmsg->proto_read.zone_start;
-			wmsg->proto_read.zone_start = 0;
+			memcpy(next_read + PROTO_HEADER_SPACE,
+					wmsg->proto_read.data +
+							wmsg->proto_read.zone_start,
+					(size_t)leftover);
+			proto_out = wmsg->proto_read.data;
+			proto_out_size = (size_t)proto_end;
+			if (proto_end < wmsg->proto_read.size / 2) {
+				/* Do not hold a mostly empty buffer until
+				 * the message is acknowledged */
+				char *shrunk = realloc(proto_out,
+						(size_t)proto_end);
+				proto_out = shrunk ? shrunk : proto_out;
+			}
+			wmsg->proto_read.data = next_read;
+		} else if (leftover > 0 && wmsg->proto_read.zone_start >
+							  PROTO_HEADER_SPACE) {
+			/* Recycle partial message bytes */
+			memmove(wmsg->proto_read.data + PROTO_HEADER_SPACE,
+					wmsg->proto_read.data +
+							wmsg->proto_read.zone_start,
+					(size_t)leftover);
 		}
+		wmsg->proto_read.zone_start = PROTO_HEADER_SPACE;
+		wmsg->proto_read.zone_end = PROTO_HEADER_SPACE + leftover;
 	}
 
 	read_readable_pipes(&g->map);
 
-	for (struct shadow_fd_link *lcur = g->map.link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &g->map.link;
-			lcur = lnxt, lnxt = lcur->l_next) {
-		/* Note: finish_update() may delete `cur` */
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		collect_update(&g->threads, cur, &wmsg->transfers,
-				g->config->old_video_mode);
-		/* collecting updates can reset `pipe.remote_can_X` state, so
-		 * garbage collect the sfd immediately after */
-		destroy_shadow_if_unreferenced(cur);
+	if (has_unwritten_transfers(wmsg)) {
+		/* Buffers about to be diffed again need not have their older,
+		 * still unsent, diffs sent as well */
+		int nsuperseded = supersede_unsent_diffs(
+				&g->map, &g->threads, &wmsg->transfers);
+		wmsg->cycle_end_msgno -= (uint32_t)nsuperseded;
+	}
+
+	int rret = queue_blob_list(g, wmsg, cxs, display_side);
+	if (rret == 0) {
+		rret = queue_local_probe(wmsg, cxs);
+	}
+	if (rret == 0) {
+		rret = queue_resync_messages(g, wmsg, cxs);
 	}
+	if (rret < 0) {
+		free(proto_out);
+		return rret;
+	}
+
+	collect_dirty_updates(&g->map, &g->threads, &wmsg->transfers,
+			g->config->old_video_mode);
 
 	int num_mt_tasks = start_parallel_work(
 			&g->threads, &wmsg->transfers.async_recv_queue);
@@ -961,6 +1958,7 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 				// TODO: use a ring buffer for allocations,
 				// and figure out how to block until it is clear
 				wp_error("Failed to allocate file desc tx msg");
+				free(proto_out);
 				return ERR_NOMEM;
 			}
 			msg[0] = transfer_header(act_size, WMSG_INJECT_RIDS);
@@ -971,6 +1969,7 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 					    wmsg->fds.zone_start,
 					    wmsg->fds.data, rbuffer) == -1) {
 				free(msg);
+				free(proto_out);
 				return ERR_FATAL;
 			}
 			decref_transferred_rids(
@@ -987,31 +1986,17 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 			wmsg->trailing[wmsg->ntrailing].iov_base = msg;
 			wmsg->ntrailing++;
 		}
-		if (wmsg->proto_write.zone_end > 0) {
+		if (proto_out) {
 			wp_debug("We are transferring a data buffer with %d bytes",
-					wmsg->proto_write.zone_end);
-			size_t act_size = (size_t)wmsg->proto_write.zone_end +
-					  sizeof(uint32_t);
+					(int)proto_out_size - PROTO_HEADER_SPACE);
+			/* Wayland messages are 4-aligned, so no padding is
+			 * needed */
 			uint32_t protoh = transfer_header(
-					act_size, WMSG_PROTOCOL);
+					proto_out_size, WMSG_PROTOCOL);
+			memcpy(proto_out, &protoh, sizeof(uint32_t));
 
-			uint8_t *copy_proto = malloc(alignz(act_size, 4));
-			if (!copy_proto) {
-				wp_error("Failed to allocate protocol tx msg");
-				return ERR_NOMEM;
-			}
-			memcpy(copy_proto, &protoh, sizeof(uint32_t));
-			memcpy(copy_proto + sizeof(uint32_t),
-					wmsg->proto_write.data,
-					(size_t)wmsg->proto_write.zone_end);
-			memset(copy_proto + sizeof(uint32_t) +
-							wmsg->proto_write
-									.zone_end,
-					0, alignz(act_size, 4) - act_size);
-
-			wmsg->trailing[wmsg->ntrailing].iov_len =
-					alignz(act_size, 4);
-			wmsg->trailing[wmsg->ntrailing].iov_base = copy_proto;
+			wmsg->trailing[wmsg->ntrailing].iov_len = proto_out_size;
+			wmsg->trailing[wmsg->ntrailing].iov_base = proto_out;
 			wmsg->ntrailing++;
 		}
 	}
@@ -1031,17 +2016,44 @@ static int advance_waymsg_progread(struct way_msg_state *wmsg,
 	}
 	return 0;
 }
+/* Returns true if the messages from a newer read cycle have all been written
+ * to the channel since this was last called */
+static bool update_cycles_written(
+		struct globals *g, const struct way_msg_state *wmsg)
+{
+	const struct transfer_queue *td = &wmsg->transfers;
+	bool cycle_written = !has_unwritten_transfers(wmsg) ||
+			     msgno_gt(td->meta[td->start].msgno,
+					     wmsg->cycle_end_msgno);
+	if (!cycle_written ||
+			g->pacing.cycles_written == wmsg->cycle_end_number) {
+		return false;
+	}
+	g->pacing.cycles_written = wmsg->cycle_end_number;
+	return true;
+}
 static int advance_waymsg_transfer(struct globals *g,
 		struct way_msg_state *wmsg, struct cross_state *cxs,
 		bool display_side, int chanfd, int progfd,
-		bool progsock_readable)
+		bool progsock_readable, bool ack_due)
 {
 	if (wmsg->state == WM_WAITING_FOR_CHANNEL) {
 		return advance_waymsg_chanwrite(
 				wmsg, cxs, g, chanfd, display_side);
 	} else if (wmsg->state == WM_WAITING_FOR_PROGRAM) {
-		return advance_waymsg_progread(wmsg, g, progfd, display_side,
-				progsock_readable);
+		/* Finish writing the last cycle's messages while reading
+		 * from the program; and if no messages were sent for a
+		 * while, acknowledge received messages on their own, as
+		 * the other side may be waiting for that to free memory */
+		if ((has_unwritten_transfers(wmsg) || ack_due) &&
+				chanfd != -1) {
+			int ret = write_queued_transfers(wmsg, cxs, chanfd);
+			if (ret < 0) {
+				return ret;
+			}
+		}
+		return advance_waymsg_progread(wmsg, cxs, g, progfd,
+				display_side, progsock_readable);
 	}
 	return 0;
 }
@@ -1105,17 +2117,53 @@ static int reconnect_loop(int linkfd, int progfd, struct int_window *recon_fds)
 
 static void reset_connection(struct cross_state *cxs,
 		struct chan_msg_state *cmsg, struct way_msg_state *wmsg,
-		int chanfd)
+		int chanfd, const struct main_config *config)
 {
 	/* Discard partial read transfer, throwing away complete but unread
-	 * messages, and trailing remnants */
-	cmsg->recv_end = 0;
-	cmsg->recv_start = 0;
-	cmsg->recv_unhandled_messages = 0;
+	 * messages, and trailing remnants. A partly parsed protocol message
+	 * held for frame pacing was already counted as received, so keep it */
+	if (cmsg->proto_held) {
+		uint32_t header = *(uint32_t *)ring_head(&cmsg->recv);
+		cmsg->recv.len = alignz(transfer_size(header), 4);
+		cmsg->recv_unhandled_messages = 1;
+	} else {
+		ring_consume(&cmsg->recv, cmsg->recv.len);
+		cmsg->recv_unhandled_messages = 0;
+	}
+	cmsg->direct_fill = false;
+
+	/* Zerocopy completions for the old channel will never be reported;
+	 * as the kernel keeps its own references to the pages of any data
+	 * still being sent, the blocks can be freed anyway */
+	for (int i = 0; i < wmsg->transfers.end; i++) {
+		wmsg->transfers.meta[i].zerocopy_pending = 0;
+	}
 
-	clear_old_transfers(&wmsg->transfers, cxs->last_confirmed_msgno);
+	clear_old_transfers(&wmsg->transfers, &wmsg->spill,
+			cxs->last_confirmed_msgno);
 	wp_debug("Resetting connection: %d blocks unacknowledged",
 			wmsg->transfers.end);
+
+	/* Released updates may not have arrived; once the unacknowledged
+	 * messages have been replayed, check the files they were for */
+	for (int i = 0; i < wmsg->transfers.end; i++) {
+		if (!is_released_update(&wmsg->transfers, i)) {
+			continue;
+		}
+		const struct wmsg_basic *header =
+				wmsg->transfers.vecs[i].iov_base;
+		bool listed = false;
+		for (int j = 0; j < wmsg->nresync_rids; j++) {
+			listed |= wmsg->resync_rids[j] == header->remote_id;
+		}
+		if (listed || buf_ensure_size(wmsg->nresync_rids + 1,
+					      sizeof(int),
+					      &wmsg->resync_rids_size,
+					      (void **)&wmsg->resync_rids) == -1) {
+			continue;
+		}
+		wmsg->resync_rids[wmsg->nresync_rids++] = header->remote_id;
+	}
 	if (wmsg->transfers.end > 0) {
 		/* If there was any data in flight, restart. If there wasn't
 		 * anything in flight, then the remote side shouldn't notice the
@@ -1138,6 +2186,7 @@ static void reset_connection(struct cross_state *cxs,
 		wp_error("Error making new channel connection nonblocking: %s",
 				strerror(errno));
 	}
+	setup_zerocopy(chanfd, &wmsg->zerocopy, config->zerocopy_threshold);
 
 	(void)cxs;
 }
@@ -1164,6 +2213,329 @@ static int set_connections_nonblocking(
 	return 0;
 }
 
+/** State shared between the main thread, which handles the transfer from
+ * the program to the channel, and the thread handling the transfer from
+ * the channel to the program. All fields, and the state machines, globals,
+ * and cross state, are protected by `lock`. */
+struct channel_thread {
+	pthread_mutex_t lock;
+	/** Signaled when `parked` or any of the requests change */
+	pthread_cond_t cond;
+	pthread_t thread;
+	/** Pipe used to interrupt the channel thread's poll */
+	int ctl_r, ctl_w;
+
+	/** The main thread sets this to keep the channel thread from using
+	 * any file descriptors, so that they can be closed or replaced */
+	bool park_request;
+	bool stop;
+	/** Set while the channel thread is waiting, and not touching any
+	 * of the state machines or file descriptors */
+	bool parked;
+	/** Error code returned by the channel->program transfer; the
+	 * channel thread waits until the main thread has handled it */
+	int result;
+
+	int chanfd, progfd;
+	bool display_side;
+	struct globals *g;
+	struct chan_msg_state *cmsg;
+	struct cross_state *cxs;
+};
+
+static void wake_channel_thread(struct channel_thread *ct)
+{
+	uint8_t triv = 0;
+	if (write(ct->ctl_w, &triv, 1) == -1 && errno != EAGAIN) {
+		wp_error("Failed to write to channel thread control pipe");
+	}
+}
+
+/** Wait until the channel thread is idle; must be called with `ct->lock`
+ * held, which will still be held on return */
+static void park_channel_thread(struct channel_thread *ct)
+{
+	ct->park_request = true;
+	wake_channel_thread(ct);
+	while (!ct->parked) {
+		pthread_cond_wait(&ct->cond, &ct->lock);
+	}
+}
+static void resume_channel_thread(struct channel_thread *ct)
+{
+	ct->park_request = false;
+	pthread_cond_broadcast(&ct->cond);
+}
+
+/* Once the frame that protocol messages were held for has been written to
+ * the channel, continue parsing them */
+static void resume_held_protocol(
+		struct chan_msg_state *cmsg, const struct frame_pacing *pacing)
+{
+	if (cmsg->state != CM_WAITING_FOR_FRAME ||
+			(int32_t)(pacing->hold_cycle - pacing->cycles_written) >
+					0) {
+		return;
+	}
+	wp_debug("Resuming held protocol messages");
+	cmsg->state = CM_WAITING_FOR_CHANNEL;
+}
+
+/* Queue the events answering the registry listing from the cache, once the
+ * previously parsed messages have been delivered */
+static void release_registry_replies(
+		struct chan_msg_state *cmsg, struct registry_shortcut *rs)
+{
+	if (cmsg->state != CM_WAITING_FOR_CHANNEL || rs->replies_len == 0) {
+		return;
+	}
+	if (buf_ensure_size(rs->replies_len, 1, &cmsg->proto_write.size,
+			    (void **)&cmsg->proto_write.data) == -1) {
+		wp_error("Failed to allocate space for registry events");
+		return;
+	}
+	memcpy(cmsg->proto_write.data, rs->replies, (size_t)rs->replies_len);
+	cmsg->proto_write.zone_start = 0;
+	cmsg->proto_write.zone_end = rs->replies_len;
+	cmsg->state = CM_WAITING_FOR_PROGRAM;
+	rs->replies_len = 0;
+}
+
+static void *run_channel_thread(void *data)
+{
+	struct channel_thread *ct = (struct channel_thread *)data;
+	struct chan_msg_state *cmsg = ct->cmsg;
+
+	pthread_mutex_lock(&ct->lock);
+	while (true) {
+		while (!ct->stop && (ct->park_request || ct->result != 0 ||
+						    cmsg->state == CM_TERMINAL)) {
+			ct->parked = true;
+			pthread_cond_broadcast(&ct->cond);
+			pthread_cond_wait(&ct->cond, &ct->lock);
+		}
+		ct->parked = false;
+		if (ct->stop) {
+			break;
+		}
+		if (!ct->display_side) {
+			release_registry_replies(cmsg, &ct->g->registry);
+			resume_held_protocol(cmsg, &ct->g->pacing);
+		}
+
+		struct pollfd pfds[3];
+		pfds[0].fd = ct->chanfd;
+		pfds[0].events = cmsg->state == CM_WAITING_FOR_CHANNEL ? POLLIN
+								       : 0;
+		pfds[1].fd = ct->progfd;
+		pfds[1].events = cmsg->state == CM_WAITING_FOR_PROGRAM ? POLLOUT
+								       : 0;
+		pfds[2].fd = ct->ctl_r;
+		pfds[2].events = POLLIN;
+		bool unread_chan_msgs = cmsg->state == CM_WAITING_FOR_CHANNEL &&
+					cmsg->recv_unhandled_messages > 0;
+
+		pthread_mutex_unlock(&ct->lock);
+		int r = poll(pfds, 3, unread_chan_msgs ? 0 : -1);
+		pthread_mutex_lock(&ct->lock);
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			wp_error("Channel thread poll failed, stopping: %s",
+					strerror(errno));
+			ct->result = ERR_FATAL;
+		} else {
+			if (pfds[2].revents & POLLIN) {
+				char tmp[64];
+				(void)read(ct->ctl_r, tmp, sizeof(tmp));
+			}
+			if (ct->park_request || ct->stop) {
+				/* The file descriptors polled may have been
+				 * replaced in the meantime */
+				continue;
+			}
+			bool chanmsg_active =
+					(pfds[0].revents & (POLLIN | POLLHUP)) ||
+					(pfds[1].revents & POLLOUT) ||
+					unread_chan_msgs;
+			if (!chanmsg_active) {
+				continue;
+			}
+			int tr = advance_chanmsg_transfer(ct->g, cmsg, ct->cxs,
+					ct->display_side, ct->chanfd,
+					ct->progfd, true);
+			if (tr < 0) {
+				ct->result = tr;
+			} else if (ct->progfd == -1 &&
+					(cmsg->state != CM_WAITING_FOR_CHANNEL ||
+							cmsg->recv.len == 0)) {
+				/* Nothing more can be written to the program */
+				cmsg->state = CM_TERMINAL;
+			}
+		}
+
+		/* Let the main thread acknowledge new messages, flush pipes,
+		 * and handle state changes */
+		uint8_t triv = 0;
+		if (write(ct->g->threads.selfpipe_w, &triv, 1) == -1 &&
+				errno != EAGAIN) {
+			wp_error("Failed to write to self-pipe");
+		}
+	}
+	ct->parked = true;
+	pthread_cond_broadcast(&ct->cond);
+	pthread_mutex_unlock(&ct->lock);
+	return NULL;
+}
+
+static int start_channel_thread(struct channel_thread *ct)
+{
+	int fds[2];
+	if (pipe(fds) == -1) {
+		wp_error("Failed to create channel thread control pipe: %s",
+				strerror(errno));
+		return -1;
+	}
+	ct->ctl_r = fds[0];
+	ct->ctl_w = fds[1];
+	if (set_nonblocking(ct->ctl_r) == -1 ||
+			set_nonblocking(ct->ctl_w) == -1) {
+		wp_error("Failed to make channel thread control pipe nonblocking: %s",
+				strerror(errno));
+		goto fail_pipe;
+	}
+	int ret = pthread_mutex_init(&ct->lock, NULL);
+	if (ret) {
+		wp_error("Mutex creation failed: %s", strerror(ret));
+		goto fail_pipe;
+	}
+	ret = pthread_cond_init(&ct->cond, NULL);
+	if (ret) {
+		wp_error("Condition variable creation failed: %s",
+				strerror(ret));
+		goto fail_mutex;
+	}
+
+	/* Signals should interrupt the main thread's poll instead */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&ct->thread, NULL, run_channel_thread, ct);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		wp_error("Thread creation failed: %s", strerror(ret));
+		goto fail_cond;
+	}
+	return 0;
+
+fail_cond:
+	pthread_cond_destroy(&ct->cond);
+fail_mutex:
+	pthread_mutex_destroy(&ct->lock);
+fail_pipe:
+	checked_close(ct->ctl_r);
+	checked_close(ct->ctl_w);
+	return -1;
+}
+
+/** Stop and join the channel thread; must be called with `ct->lock`
+ * held, which is released on return */
+static void stop_channel_thread(struct channel_thread *ct)
+{
+	ct->stop = true;
+	pthread_cond_broadcast(&ct->cond);
+	wake_channel_thread(ct);
+	pthread_mutex_unlock(&ct->lock);
+	pthread_join(ct->thread, NULL);
+
+	pthread_cond_destroy(&ct->cond);
+	pthread_mutex_destroy(&ct->lock);
+	checked_close(ct->ctl_r);
+	checked_close(ct->ctl_w);
+}
+
+/** Deadline for acknowledging received messages on their own, when no other
+ * messages are sent to piggyback the acknowledgement on. A timerfd is used
+ * where available, so that the deadline is not pushed back by unrelated
+ * wakeups; otherwise the poll timeout is derived from the deadline. */
+struct ack_timer {
+	int fd;
+	bool armed;
+	struct timespec deadline;
+};
+
+static void setup_ack_timer(struct ack_timer *t)
+{
+	t->armed = false;
+	t->fd = -1;
+#ifdef HAS_TIMERFD
+	t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (t->fd == -1) {
+		wp_error("Failed to create acknowledgement timer, falling back to poll timeouts: %s",
+				strerror(errno));
+	}
+#endif
+}
+static void set_ack_timer(struct ack_timer *t, bool armed, uint32_t delay_ms)
+{
+	if (armed == t->armed) {
+		return;
+	}
+	t->armed = armed;
+	clock_gettime(CLOCK_MONOTONIC, &t->deadline);
+	t->deadline.tv_sec += (time_t)(delay_ms / 1000);
+	t->deadline.tv_nsec += (long)(delay_ms % 1000) * 1000000L;
+	if (t->deadline.tv_nsec >= 1000000000L) {
+		t->deadline.tv_sec++;
+		t->deadline.tv_nsec -= 1000000000L;
+	}
+#ifdef HAS_TIMERFD
+	if (t->fd != -1) {
+		struct itimerspec spec;
+		memset(&spec, 0, sizeof(spec));
+		if (armed) {
+			spec.it_value = t->deadline;
+		}
+		if (timerfd_settime(t->fd, TFD_TIMER_ABSTIME, &spec, NULL) ==
+				-1) {
+			wp_error("Failed to set acknowledgement timer: %s",
+					strerror(errno));
+		}
+	}
+#endif
+}
+/* Returns the poll timeout needed to notice the deadline */
+static int ack_timer_poll_delay(const struct ack_timer *t)
+{
+	if (!t->armed || t->fd != -1) {
+		return -1;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t ms = (int64_t)(t->deadline.tv_sec - now.tv_sec) * 1000 +
+		     (t->deadline.tv_nsec - now.tv_nsec) / 1000000;
+	return ms <= 0 ? 0 : (int)min((int)ms, INT_MAX);
+}
+/* Returns true, and disarms the timer, if the deadline has passed */
+static bool ack_timer_expired(struct ack_timer *t, short revents)
+{
+	if (!t->armed) {
+		return false;
+	}
+	if (t->fd != -1) {
+		if (!(revents & POLLIN)) {
+			return false;
+		}
+		uint64_t expirations;
+		(void)read(t->fd, &expirations, sizeof(expirations));
+	} else if (ack_timer_poll_delay(t) > 0) {
+		return false;
+	}
+	t->armed = false;
+	return true;
+}
+
 int main_interface_loop(int chanfd, int progfd, int linkfd,
 		const struct main_config *config, bool display_side)
 {
@@ -1189,18 +2561,22 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 	memset(&g, 0, sizeof(g));
 
 	way_msg.state = WM_WAITING_FOR_PROGRAM;
+	way_msg.spill.fd = -1;
 	/* AFAIK, there is no documented upper bound for the size of a
 	 * Wayland protocol message, but libwayland (in wl_buffer_put)
 	 * effectively limits message sizes to 4096 bytes. We must
 	 * therefore adopt a limit as least as large. */
 	const int max_read_size = 4096;
-	way_msg.proto_read.size = max_read_size;
+	way_msg.proto_read.size = PROTO_HEADER_SPACE + PROGREAD_BATCH_SIZE;
 	way_msg.proto_read.data = malloc((size_t)way_msg.proto_read.size);
+	way_msg.proto_read.zone_start = PROTO_HEADER_SPACE;
+	way_msg.proto_read.zone_end = PROTO_HEADER_SPACE;
 	way_msg.fds.size = 128;
 	way_msg.fds.data = malloc((size_t)way_msg.fds.size * sizeof(int));
 	way_msg.proto_write.size = 2 * max_read_size;
 	way_msg.proto_write.data = malloc((size_t)way_msg.proto_write.size);
 	way_msg.max_iov = get_iov_max();
+	setup_zerocopy(chanfd, &way_msg.zerocopy, config->zerocopy_threshold);
 	int mut_ret = pthread_mutex_init(
 			&way_msg.transfers.async_recv_queue.lock, NULL);
 	if (mut_ret) {
@@ -1209,21 +2585,39 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 	}
 
 	chan_msg.state = CM_WAITING_FOR_CHANNEL;
-	chan_msg.recv_size = 2 * RECV_GOAL_READ_SIZE;
-	chan_msg.recv_buffer = malloc((size_t)chan_msg.recv_size);
 	chan_msg.proto_write.size = max_read_size * 2;
 	chan_msg.proto_write.data = malloc((size_t)chan_msg.proto_write.size);
-	if (!chan_msg.proto_write.data || !chan_msg.recv_buffer ||
+	if (!chan_msg.proto_write.data ||
 			!way_msg.proto_write.data || !way_msg.fds.data ||
 			!way_msg.proto_read.data) {
 		wp_error("Failed to allocate a message scratch buffer");
 		goto init_failure_cleanup;
 	}
+	if (ring_init(&chan_msg.recv, 2 * RECV_GOAL_READ_SIZE) == -1) {
+		goto init_failure_cleanup;
+	}
 
 	/* The first packet received will be #1 */
 	way_msg.transfers.last_msgno = 1;
+	way_msg.transfers.sent_msgno = 1;
+	way_msg.released_msgno = 1;
+	cross_data.remote_resync = config->remote_resync;
+	cross_data.remote_blobs = config->remote_blobs;
+	chan_msg.recv_fds = is_unix_socket(chanfd);
+	/* Passed fds could not be replayed after a reconnection */
+	cross_data.remote_local = display_side && config->remote_local &&
+				  chan_msg.recv_fds && linkfd == -1;
+	way_msg.cycle_end_msgno = 1;
+	if (config->replay_mem_bytes > 0 && linkfd != -1) {
+		way_msg.spill.fd = create_spill_file();
+		if (way_msg.spill.fd == -1) {
+			wp_error("Failed to create a replay spill file in XDG_RUNTIME_DIR, keeping all unacknowledged messages in memory");
+		}
+	}
 
 	g.config = config;
+	setup_registry_shortcut(&g.registry,
+			display_side ? NULL : config->registry_cache);
 	g.render = (struct render_data){
 			.drm_node_path = config->drm_node,
 			.drm_fd = -1,
@@ -1238,12 +2632,19 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			.av_vadisplay = NULL,
 			.av_copy_config = 0,
 	};
-	if (setup_thread_pool(&g.threads, config->compression,
-			    config->compression_level,
-			    config->n_worker_threads) == -1) {
+	if (config->shared_workers) {
+		if (setup_shared_thread_pool(&g.threads,
+				    config->shared_workers) == -1) {
+			goto init_failure_cleanup;
+		}
+	} else if (setup_thread_pool(&g.threads, config->compression,
+				   config->compression_level,
+				   config->n_worker_threads) == -1) {
 		goto init_failure_cleanup;
 	}
 	setup_translation_map(&g.map, display_side);
+	g.map.blob_cache = config->blob_cache;
+	g.map.mirror_budget = config->mirror_mem_bytes;
 	if (init_message_tracker(&g.tracker) == -1) {
 		goto init_failure_cleanup;
 	}
@@ -1255,6 +2656,24 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			.zone_end = 0,
 	};
 
+	struct channel_thread chan_thread;
+	memset(&chan_thread, 0, sizeof(chan_thread));
+	chan_thread.chanfd = chanfd;
+	chan_thread.progfd = progfd;
+	chan_thread.display_side = display_side;
+	chan_thread.g = &g;
+	chan_thread.cmsg = &chan_msg;
+	chan_thread.cxs = &cross_data;
+	chan_msg.state_lock = &chan_thread.lock;
+	way_msg.state_lock = &chan_thread.lock;
+	if (start_channel_thread(&chan_thread) == -1) {
+		goto init_failure_cleanup;
+	}
+	pthread_mutex_lock(&chan_thread.lock);
+
+	struct ack_timer ack_timer;
+	setup_ack_timer(&ack_timer);
+
 	bool needs_new_channel = false;
 	struct pollfd *pfds = NULL;
 	int pfds_size = 0;
@@ -1262,7 +2681,7 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 	while (!shutdown_flag && exit_code == 0 &&
 			!(way_msg.state == WM_TERMINAL &&
 					chan_msg.state == CM_TERMINAL)) {
-		int psize = 4 + count_npipes(&g.map);
+		int psize = 5 + count_npipes(&g.map);
 		if (buf_ensure_size(psize, sizeof(struct pollfd), &pfds_size,
 				    (void **)&pfds) == -1) {
 			wp_error("Allocation failure, not enough space for pollfds");
@@ -1273,43 +2692,55 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 		pfds[1].fd = progfd;
 		pfds[2].fd = linkfd;
 		pfds[3].fd = g.threads.selfpipe_r;
+		pfds[4].fd = ack_timer.fd;
 		pfds[0].events = 0;
 		pfds[1].events = 0;
 		pfds[2].events = POLLIN;
 		pfds[3].events = POLLIN;
+		pfds[4].events = POLLIN;
+		bool paused = update_read_pause(
+				&way_msg, &cross_data, config->max_queue_bytes);
 		if (way_msg.state == WM_WAITING_FOR_CHANNEL) {
 			pfds[0].events |= POLLOUT;
 		} else if (way_msg.state == WM_WAITING_FOR_PROGRAM) {
-			pfds[1].events |= POLLIN;
+			if (!paused) {
+				pfds[1].events |= POLLIN;
+			}
+			if (has_unwritten_transfers(&way_msg)) {
+				pfds[0].events |= POLLOUT;
+			}
+		}
+		if (pfds[0].events == 0 && way_msg.zerocopy.n_outstanding == 0) {
+			/* The channel thread watches for hangups while reading */
+			pfds[0].fd = -1;
 		}
-		if (chan_msg.state == CM_WAITING_FOR_CHANNEL) {
-			pfds[0].events |= POLLIN;
-		} else if (chan_msg.state == CM_WAITING_FOR_PROGRAM) {
-			pfds[1].events |= POLLOUT;
+		if (paused && pfds[1].events == 0) {
+			/* Otherwise a hangup would be reported immediately */
+			pfds[1].fd = -1;
 		}
-		bool check_read = way_msg.state == WM_WAITING_FOR_PROGRAM;
-		int npoll = 4 + fill_with_pipes(&g.map, pfds + 4, check_read);
+		bool check_read = way_msg.state == WM_WAITING_FOR_PROGRAM &&
+				  !paused;
+		int npoll = 5 + fill_with_pipes(&g.map, pfds + 5, check_read);
 
 		bool own_msg_pending =
 				(cross_data.last_acked_msgno !=
 						cross_data.last_received_msgno) &&
 				way_msg.state == WM_WAITING_FOR_PROGRAM;
-		bool unread_chan_msgs =
-				chan_msg.state == CM_WAITING_FOR_CHANNEL &&
-				chan_msg.recv_unhandled_messages > 0;
-
-		int poll_delay;
-		if (unread_chan_msgs) {
-			/* There is work to do, so continue */
-			poll_delay = 0;
-		} else if (own_msg_pending) {
-			/* To coalesce acknowledgements, we wait for a minimum
-			 * amount */
-			poll_delay = 20;
-		} else {
-			poll_delay = -1;
-		}
+
+		/* To coalesce acknowledgements, they are delayed until either
+		 * enough data has been received to be worth acknowledging, or
+		 * the deadline set when the first unacknowledged message
+		 * arrived has passed. When nothing awaits acknowledgement, the
+		 * timer is disarmed, so an idle connection never wakes up. */
+		bool ack_now = own_msg_pending &&
+			       (config->ack_delay_ms == 0 ||
+					       cross_data.unacked_bytes >=
+							       config->ack_bytes);
+		set_ack_timer(&ack_timer, own_msg_pending, config->ack_delay_ms);
+		int poll_delay = ack_now ? 0 : ack_timer_poll_delay(&ack_timer);
+		pthread_mutex_unlock(&chan_thread.lock);
 		int r = poll(pfds, (nfds_t)npoll, poll_delay);
+		pthread_mutex_lock(&chan_thread.lock);
 		if (r == -1) {
 			if (errno == EINTR) {
 				wp_error("poll interrupted: shutdown=%c",
@@ -1322,6 +2753,17 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 				break;
 			}
 		}
+		if ((pfds[0].revents & POLLERR) &&
+				way_msg.zerocopy.n_outstanding > 0) {
+			/* Completion notifications keep POLLERR set until
+			 * they have been read */
+			if (reap_zerocopy_completions(chanfd,
+					    &way_msg.transfers,
+					    &way_msg.zerocopy) == -1) {
+				exit_code = ERR_FATAL;
+				break;
+			}
+		}
 		if (pfds[3].revents & POLLIN) {
 			/* After the self pipe has been used to wake up the
 			 * connection, drain it */
@@ -1329,28 +2771,64 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			(void)read(g.threads.selfpipe_r, tmp, sizeof(tmp));
 		}
 
-		mark_pipe_object_statuses(&g.map, npoll - 4, pfds + 4);
+		bool ack_expired = ack_timer_expired(&ack_timer, pfds[4].revents);
+
+		mark_pipe_object_statuses(&g.map, npoll - 5, pfds + 5);
 		/* POLLHUP sometimes implies POLLIN, but not on all systems.
 		 * Checking POLLHUP|POLLIN means that we can detect EOF when
 		 * we actually do try to read from the sockets, but also, if
 		 * there was data in the pipe just before the hang up, then we
 		 * can read and handle that data. */
 		bool progsock_readable = pfds[1].revents & (POLLIN | POLLHUP);
-		bool chanmsg_active = (pfds[0].revents & (POLLIN | POLLHUP)) ||
-				      (pfds[1].revents & POLLOUT) ||
-				      unread_chan_msgs;
+
+		if (chan_thread.result != 0) {
+			/* The channel thread stays idle until its error
+			 * has been handled */
+			int tr = chan_thread.result;
+			park_channel_thread(&chan_thread);
+			chan_thread.result = 0;
+			if (tr == ERR_DISCONN) {
+				/* Channel connection has at least
+				 * partially been shut down, so close it
+				 * fully. */
+				checked_close(chanfd);
+				chanfd = -1;
+				if (linkfd == -1) {
+					wp_error("Channel hang up detected, no reconnection link, fatal");
+					exit_code = ERR_FATAL;
+					break;
+				}
+				needs_new_channel = true;
+			} else if (tr == ERR_STOP) {
+				/* Stop returned while writing: Wayland
+				 * connection has at least partially
+				 * shut down, so close it fully. */
+				checked_close(progfd);
+				progfd = -1;
+			} else {
+				/* Fatal error, close and flush */
+				exit_code = tr;
+				break;
+			}
+			chan_thread.chanfd = chanfd;
+			chan_thread.progfd = progfd;
+			resume_channel_thread(&chan_thread);
+		}
 
 		bool maybe_new_channel = (pfds[2].revents & (POLLIN | POLLHUP));
 		if (maybe_new_channel) {
 			int new_fd = read_new_chanfd(linkfd, &recon_fds);
 			if (new_fd >= 0) {
+				park_channel_thread(&chan_thread);
 				if (chanfd != -1) {
 					checked_close(chanfd);
 				}
 				chanfd = new_fd;
 				reset_connection(&cross_data, &chan_msg,
-						&way_msg, chanfd);
+						&way_msg, chanfd, config);
 				needs_new_channel = false;
+				chan_thread.chanfd = chanfd;
+				resume_channel_thread(&chan_thread);
 			} else if (new_fd == -2) {
 				wp_error("Link to root process hang-up detected");
 				checked_close(linkfd);
@@ -1359,6 +2837,7 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 		}
 		if (needs_new_channel && linkfd != -1) {
 			wp_error("Channel hang up detected, waiting for reconnection");
+			park_channel_thread(&chan_thread);
 			int new_fd = reconnect_loop(linkfd, progfd, &recon_fds);
 			if (new_fd < 0) {
 				// -1 is read failure or misc error, -2 is HUP
@@ -1372,8 +2851,10 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 				}
 				chanfd = new_fd;
 				reset_connection(&cross_data, &chan_msg,
-						&way_msg, chanfd);
+						&way_msg, chanfd, config);
 				needs_new_channel = false;
+				chan_thread.chanfd = chanfd;
+				resume_channel_thread(&chan_thread);
 			}
 		} else if (needs_new_channel) {
 			wp_error("Channel hang up detected, no reconnection link, fatal");
@@ -1381,88 +2862,87 @@ int main_interface_loop(int chanfd, int progfd, int linkfd,
 			break;
 		}
 
-		// Q: randomize the order of these?, to highlight
-		// accidental dependencies?
-		for (int m = 0; m < 2; m++) {
-			int tr;
-			if (m == 0) {
-				tr = advance_chanmsg_transfer(&g, &chan_msg,
-						&cross_data, display_side,
-						chanfd, progfd, chanmsg_active);
-			} else {
-				tr = advance_waymsg_transfer(&g, &way_msg,
-						&cross_data, display_side,
-						chanfd, progfd,
-						progsock_readable);
+		bool ack_due = own_msg_pending && (ack_now || ack_expired);
+		int tr = advance_waymsg_transfer(&g, &way_msg, &cross_data,
+				display_side, chanfd, progfd,
+				progsock_readable, ack_due);
+		if (tr >= 0) {
+			if (!display_side && g.registry.replies_len > 0) {
+				wake_channel_thread(&chan_thread);
 			}
-
-			if (tr >= 0) {
-				/* do nothing */
-			} else if (tr == ERR_DISCONN) {
-				/* Channel connection has at least
-				 * partially been shut down, so close it
-				 * fully. */
-				checked_close(chanfd);
-				chanfd = -1;
-				if (linkfd == -1) {
-					wp_error("Channel hang up detected, no reconnection link, fatal");
-					exit_code = ERR_FATAL;
-					break;
-				}
-				needs_new_channel = true;
-			} else if (tr == ERR_STOP) {
-				if (m == 0) {
-					/* Stop returned while writing: Wayland
-					 * connection has at least partially
-					 * shut down, so close it fully. */
-					checked_close(progfd);
-					progfd = -1;
-				} else {
-					/* Stop returned while reading */
-					checked_close(progfd);
-					progfd = -1;
-					if (way_msg.state ==
-							WM_WAITING_FOR_PROGRAM) {
-						way_msg.state = WM_TERMINAL;
-					}
-					if (chan_msg.state == CM_WAITING_FOR_PROGRAM ||
-							chan_msg.recv_start ==
-									chan_msg.recv_end) {
-						chan_msg.state = CM_TERMINAL;
-					}
-				}
-			} else {
-				/* Fatal error, close and flush */
-				exit_code = tr;
+		} else if (tr == ERR_DISCONN) {
+			/* Channel connection has at least partially been shut
+			 * down, so close it fully. */
+			park_channel_thread(&chan_thread);
+			checked_close(chanfd);
+			chanfd = -1;
+			if (linkfd == -1) {
+				wp_error("Channel hang up detected, no reconnection link, fatal");
+				exit_code = ERR_FATAL;
 				break;
 			}
-
-			/* If the program connection has closed, and
-			 * there waypipe is not currently transferring
-			 * any message to the channel, then shutdown the
-			 * program->channel transfers. (The reverse
-			 * situation with the chnanel connection is not
-			 * a cause for permanent closure, thanks to
-			 * reconnection support */
-			if (progfd == -1) {
-				if (way_msg.state == WM_WAITING_FOR_PROGRAM) {
-					way_msg.state = WM_TERMINAL;
-				}
-				if (chan_msg.state == CM_WAITING_FOR_PROGRAM ||
-						chan_msg.recv_start ==
-								chan_msg.recv_end) {
-					chan_msg.state = CM_TERMINAL;
-				}
+			needs_new_channel = true;
+			chan_thread.chanfd = chanfd;
+			resume_channel_thread(&chan_thread);
+		} else if (tr == ERR_STOP) {
+			/* Stop returned while reading; the switch to
+			 * WM_TERMINAL is made below, once all messages are
+			 * written */
+			park_channel_thread(&chan_thread);
+			checked_close(progfd);
+			progfd = -1;
+			if (chan_msg.state != CM_WAITING_FOR_CHANNEL ||
+					chan_msg.recv.len == 0) {
+				chan_msg.state = CM_TERMINAL;
 			}
+			chan_thread.progfd = progfd;
+			resume_channel_thread(&chan_thread);
+		} else {
+			/* Fatal error, close and flush */
+			exit_code = tr;
+			break;
+		}
+
+		/* Without a reconnection link, nothing is ever replayed */
+		if (linkfd == -1 || cross_data.remote_resync) {
+			release_written_updates(&g.map, &way_msg);
+		}
+		if (way_msg.spill.fd != -1) {
+			spill_written_transfers(
+					&way_msg, config->replay_mem_bytes);
+		}
+
+		if (!display_side && update_cycles_written(&g, &way_msg) &&
+				g.pacing.holding) {
+			wake_channel_thread(&chan_thread);
+		}
+
+		/* If the program connection has closed, and there waypipe is
+		 * not currently transferring or writing any message to the
+		 * channel, then shutdown the program->channel transfers. (The
+		 * reverse situation with the chnanel connection is not a cause
+		 * for permanent closure, thanks to reconnection support. The
+		 * channel thread shuts down the channel->program transfers
+		 * once it has nothing left to write.) */
+		if (progfd == -1 && way_msg.state == WM_WAITING_FOR_PROGRAM &&
+				!has_unwritten_transfers(&way_msg)) {
+			way_msg.state = WM_TERMINAL;
 		}
 
 		// Periodic maintenance. It doesn't matter who does this
 		flush_writable_pipes(&g.map);
 	}
+	stop_channel_thread(&chan_thread);
+	if (ack_timer.fd != -1) {
+		checked_close(ack_timer.fd);
+	}
 	free(pfds);
 	free(recon_fds.data);
 	wp_debug("Exiting main loop (%d, %d, %d), attempting close message",
 			exit_code, way_msg.state, chan_msg.state);
+	wp_debug("Transfer queue: %zu bytes queued, at most %zu",
+			way_msg.transfers.queued_bytes,
+			way_msg.transfers.peak_queued_bytes);
 
 init_failure_cleanup:
 	/* It's possible, but very very unlikely, that waypipe gets closed
@@ -1524,6 +3004,7 @@ init_failure_cleanup:
 	}
 
 	cleanup_thread_pool(&g.threads);
+	cleanup_registry_shortcut(&g.registry);
 	cleanup_message_tracker(&g.tracker);
 	cleanup_translation_map(&g.map);
 	cleanup_render_data(&g.render);
@@ -1532,12 +3013,24 @@ init_failure_cleanup:
 	free(way_msg.proto_write.data);
 	free(way_msg.fds.data);
 	cleanup_transfer_queue(&way_msg.transfers);
+	if (way_msg.spill.fd != -1) {
+		checked_close(way_msg.spill.fd);
+	}
+	free(way_msg.resync_rids);
+	for (int i = 0; i < cross_data.nresend_out; i++) {
+		free(cross_data.resend_out[i].data);
+	}
+	for (int i = 0; i < cross_data.nresend_in; i++) {
+		free(cross_data.resend_in[i].data);
+	}
+	free(cross_data.resend_out);
+	free(cross_data.resend_in);
 	for (int i = 0; i < way_msg.ntrailing; i++) {
 		free(way_msg.trailing[i].iov_base);
 	}
 	free(chan_msg.transf_fds.data);
 	free(chan_msg.proto_fds.data);
-	free(chan_msg.recv_buffer);
+	ring_cleanup(&chan_msg.recv);
 	free(chan_msg.proto_write.data);
 
 	if (chanfd != -1) {
@@ -1551,3 +3044,178 @@ init_failure_cleanup:
 	}
 	return EXIT_SUCCESS;
 }
+
+struct connection_thread_args {
+	struct connection_threads *threads;
+	struct main_config config;
+	int chanfd, progfd, linkfd;
+	bool display_side;
+	/* Run run_channel_mux instead of main_interface_loop */
+	bool mux;
+};
+
+/** Block the signals which the main thread of the process relies on
+ * receiving, so that new threads inherit the mask. */
+static void block_main_signals(sigset_t *old_mask)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &mask, old_mask);
+}
+
+int setup_connection_threads(struct connection_threads *threads,
+		const struct main_config *config)
+{
+	threads->count = 0;
+	int fds[2];
+	if (pipe(fds) == -1) {
+		wp_error("Failed to create pipe: %s", strerror(errno));
+		return -1;
+	}
+	threads->wake_r = fds[0];
+	threads->wake_w = fds[1];
+	if (set_nonblocking(threads->wake_r) == -1) {
+		wp_error("Failed to make read end of pipe nonblocking: %s",
+				strerror(errno));
+		goto fail_pipe;
+	}
+	int ret = pthread_mutex_init(&threads->lock, NULL);
+	if (ret) {
+		wp_error("Mutex creation failed: %s", strerror(ret));
+		goto fail_pipe;
+	}
+	sigset_t old_mask;
+	block_main_signals(&old_mask);
+	ret = setup_worker_group(&threads->workers, config->compression,
+			config->compression_level, config->n_worker_threads);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (ret == -1) {
+		pthread_mutex_destroy(&threads->lock);
+		goto fail_pipe;
+	}
+	return 0;
+fail_pipe:
+	checked_close(threads->wake_r);
+	checked_close(threads->wake_w);
+	return -1;
+}
+
+static void *connection_thread_main(void *arg)
+{
+	struct connection_thread_args *args = arg;
+	struct connection_threads *threads = args->threads;
+	int rc;
+	if (args->mux) {
+		rc = run_channel_mux(args->chanfd, args->linkfd,
+				args->display_side);
+	} else {
+		rc = main_interface_loop(args->chanfd, args->progfd,
+				args->linkfd, &args->config,
+				args->display_side);
+	}
+	wp_debug("Connection thread finished with code %d", rc);
+	free(args);
+
+	/* Once count reaches zero, `threads` may be cleaned up at any time */
+	pthread_mutex_lock(&threads->lock);
+	uint8_t triv = 0;
+	if (write(threads->wake_w, &triv, 1) == -1) {
+		wp_error("Failed to write to wake pipe");
+	}
+	threads->count--;
+	pthread_mutex_unlock(&threads->lock);
+	return NULL;
+}
+
+static int start_thread(struct connection_threads *threads,
+		struct connection_thread_args *args)
+{
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_mutex_lock(&threads->lock);
+	threads->count++;
+	pthread_mutex_unlock(&threads->lock);
+
+	sigset_t old_mask;
+	block_main_signals(&old_mask);
+	pthread_t thread;
+	int ret = pthread_create(&thread, &attr, connection_thread_main, args);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		wp_error("Thread creation failed: %s", strerror(ret));
+		pthread_mutex_lock(&threads->lock);
+		threads->count--;
+		pthread_mutex_unlock(&threads->lock);
+		free(args);
+		return -1;
+	}
+	return 0;
+}
+
+int start_connection_thread(struct connection_threads *threads, int chanfd,
+		int progfd, int linkfd, const struct main_config *config,
+		bool display_side)
+{
+	struct connection_thread_args *args =
+			calloc(1, sizeof(struct connection_thread_args));
+	if (!args) {
+		wp_error("Failed to allocate connection thread arguments");
+		return -1;
+	}
+	args->threads = threads;
+	args->config = *config;
+	args->config.shared_workers = &threads->workers;
+	args->chanfd = chanfd;
+	args->progfd = progfd;
+	args->linkfd = linkfd;
+	args->display_side = display_side;
+	return start_thread(threads, args);
+}
+
+int start_mux_thread(struct connection_threads *threads, int chanfd,
+		int linkfd, bool display_side)
+{
+	struct connection_thread_args *args =
+			calloc(1, sizeof(struct connection_thread_args));
+	if (!args) {
+		wp_error("Failed to allocate connection thread arguments");
+		return -1;
+	}
+	args->threads = threads;
+	args->chanfd = chanfd;
+	args->progfd = -1;
+	args->linkfd = linkfd;
+	args->display_side = display_side;
+	args->mux = true;
+	return start_thread(threads, args);
+}
+
+void cleanup_connection_threads(struct connection_threads *threads)
+{
+	while (true) {
+		pthread_mutex_lock(&threads->lock);
+		int count = threads->count;
+		pthread_mutex_unlock(&threads->lock);
+		if (count == 0) {
+			break;
+		}
+		if (shutdown_flag) {
+			/* Connections still starting up may not yet use the
+			 * worker group, so repeat until all have ended */
+			wake_shared_thread_pools(&threads->workers);
+		}
+		struct pollfd pfd = {.fd = threads->wake_r, .events = POLLIN};
+		if (poll(&pfd, 1, shutdown_flag ? 100 : 1000) > 0) {
+			char tmp[64];
+			(void)read(threads->wake_r, tmp, sizeof(tmp));
+		}
+	}
+	cleanup_worker_group(&threads->workers);
+	pthread_mutex_destroy(&threads->lock);
+	checked_close(threads->wake_r);
+	checked_close(threads->wake_w);
+}
@@ -0,0 +1,617 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "main.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Most stream data to send in one WMSG_STREAM_DATA message. Streams take
+ * turns filling the channel, one message each, so this bounds how long a
+ * stream uploading a large buffer can delay the others. */
+#define MUX_CHUNK_SIZE (1u << 16)
+/* Stop reading from streams while this many bytes are waiting to be written
+ * to the channel */
+#define MUX_OUT_LIMIT (1u << 18)
+/* Most bytes of a stream that may be sent before the other side reports
+ * having written them to the stream's connection. As this bounds what the
+ * other side holds for each stream, it never stops reading the channel, so
+ * an application that does not read its connection holds back no others. */
+#define MUX_STREAM_WINDOW (1u << 22)
+#define MUX_MAX_MESSAGE (sizeof(struct wmsg_stream) + MUX_CHUNK_SIZE)
+
+struct mux_stream {
+	int fd;
+	uint32_t id;
+	/* No more data will be read from or written to the stream */
+	bool local_closed;
+	/* The other side closed the stream; once `pending` has been written,
+	 * the stream is closed */
+	bool remote_closed;
+	/* Data received from the channel, not yet written to fd */
+	char *pending;
+	size_t pending_len, pending_size;
+	/* Bytes sent to the channel that the other side has not yet reported
+	 * writing to its connection */
+	size_t unacked;
+	/* Bytes written to fd not yet reported to the other side */
+	size_t unreported;
+};
+
+struct mux_state {
+	int chanfd;
+	int linkfd;
+	bool display_side;
+	struct mux_stream *streams;
+	int nstreams, streams_size;
+	/* Stream ids increase, so an unknown id at most this large belongs to
+	 * a stream that was already closed */
+	uint32_t last_id;
+	/* Index of the stream which reads first in the next round */
+	int next_turn;
+	/* Messages to write to the channel */
+	char *out;
+	size_t out_start, out_end, out_size;
+	/* Messages read from the channel, the last possibly incomplete */
+	struct mirrored_ring in;
+	/* An allocation failed */
+	bool failed;
+};
+
+static int add_stream(struct mux_state *mx, int fd, uint32_t id)
+{
+	if (buf_ensure_size(mx->nstreams + 1, sizeof(struct mux_stream),
+			    &mx->streams_size, (void **)&mx->streams) == -1) {
+		wp_error("Failed to allocate space for stream %u", id);
+		return -1;
+	}
+	if (set_nonblocking(fd) == -1) {
+		wp_error("Failed to make stream %u nonblocking: %s", id,
+				strerror(errno));
+		return -1;
+	}
+	mx->streams[mx->nstreams++] = (struct mux_stream){
+			.fd = fd,
+			.id = id,
+			.local_closed = false,
+			.remote_closed = false,
+			.pending = NULL,
+			.pending_len = 0,
+			.pending_size = 0,
+			.unacked = 0,
+			.unreported = 0,
+	};
+	mx->last_id = id;
+	wp_debug("Opened stream %u, now %d streams", id, mx->nstreams);
+	return 0;
+}
+
+static struct mux_stream *find_stream(struct mux_state *mx, uint32_t id)
+{
+	for (int i = 0; i < mx->nstreams; i++) {
+		if (mx->streams[i].id == id) {
+			return &mx->streams[i];
+		}
+	}
+	return NULL;
+}
+
+/** Make room for `space` more bytes at out_end; returns NULL on failure */
+static char *reserve_output(struct mux_state *mx, size_t space)
+{
+	if (mx->out_start == mx->out_end) {
+		mx->out_start = 0;
+		mx->out_end = 0;
+	} else if (mx->out_end + space > mx->out_size) {
+		memmove(mx->out, mx->out + mx->out_start,
+				mx->out_end - mx->out_start);
+		mx->out_end -= mx->out_start;
+		mx->out_start = 0;
+	}
+	if (mx->out_end + space > mx->out_size) {
+		size_t new_size = 2 * mx->out_size;
+		while (new_size < mx->out_end + space) {
+			new_size *= 2;
+		}
+		char *new_out = realloc(mx->out, new_size);
+		if (!new_out) {
+			wp_error("Failed to allocate %zu bytes for the multiplexed channel",
+					new_size);
+			mx->failed = true;
+			return NULL;
+		}
+		mx->out = new_out;
+		mx->out_size = new_size;
+	}
+	return mx->out + mx->out_end;
+}
+
+static void queue_stream_close(struct mux_state *mx, uint32_t id)
+{
+	char *dest = reserve_output(mx, sizeof(struct wmsg_stream));
+	if (!dest) {
+		return;
+	}
+	struct wmsg_stream msg;
+	msg.size_and_type = transfer_header(sizeof(msg), WMSG_STREAM_CLOSE);
+	msg.stream_id = id;
+	memcpy(dest, &msg, sizeof(msg));
+	mx->out_end += sizeof(msg);
+}
+
+/** Mark the stream closed on this side, telling the other side if needed */
+static void close_stream(struct mux_state *mx, struct mux_stream *stream)
+{
+	if (stream->local_closed) {
+		return;
+	}
+	stream->local_closed = true;
+	if (!stream->remote_closed) {
+		queue_stream_close(mx, stream->id);
+	}
+}
+
+static void remove_closed_streams(struct mux_state *mx)
+{
+	int iw = 0;
+	for (int ir = 0; ir < mx->nstreams; ir++) {
+		struct mux_stream *stream = &mx->streams[ir];
+		if (stream->remote_closed && stream->pending_len == 0) {
+			stream->local_closed = true;
+		}
+		if (!stream->local_closed) {
+			mx->streams[iw++] = *stream;
+			continue;
+		}
+		wp_debug("Closing stream %u", stream->id);
+		checked_close(stream->fd);
+		free(stream->pending);
+	}
+	mx->nstreams = iw;
+}
+
+static void write_pending(struct mux_state *mx, struct mux_stream *stream)
+{
+	while (stream->pending_len > 0 && !stream->local_closed) {
+		ssize_t wc = write(stream->fd, stream->pending,
+				stream->pending_len);
+		if (wc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+						errno == EINTR)) {
+			return;
+		} else if (wc == -1) {
+			wp_debug("Failed to write to stream %u: %s", stream->id,
+					strerror(errno));
+			close_stream(mx, stream);
+			return;
+		}
+		memmove(stream->pending, stream->pending + wc,
+				stream->pending_len - (size_t)wc);
+		stream->pending_len -= (size_t)wc;
+		stream->unreported += (size_t)wc;
+	}
+}
+
+/** Report the data written to streams, once there is a chunk's worth or the
+ * stream has caught up */
+static void queue_stream_acks(struct mux_state *mx)
+{
+	for (int i = 0; i < mx->nstreams; i++) {
+		struct mux_stream *stream = &mx->streams[i];
+		if (stream->unreported == 0 || stream->local_closed ||
+				stream->remote_closed ||
+				(stream->unreported < MUX_CHUNK_SIZE &&
+						stream->pending_len > 0)) {
+			continue;
+		}
+		char *dest = reserve_output(
+				mx, sizeof(struct wmsg_stream_ack));
+		if (!dest) {
+			return;
+		}
+		struct wmsg_stream_ack msg;
+		msg.size_and_type = transfer_header(
+				sizeof(msg), WMSG_STREAM_ACK);
+		msg.stream_id = stream->id;
+		msg.bytes_written = (uint32_t)stream->unreported;
+		memcpy(dest, &msg, sizeof(msg));
+		mx->out_end += sizeof(msg);
+		stream->unreported = 0;
+	}
+}
+
+static int append_pending(
+		struct mux_stream *stream, const char *data, size_t len)
+{
+	if (stream->pending_len + len > stream->pending_size) {
+		size_t new_size = stream->pending_size ? stream->pending_size
+						       : MUX_CHUNK_SIZE;
+		while (new_size < stream->pending_len + len) {
+			new_size *= 2;
+		}
+		char *new_data = realloc(stream->pending, new_size);
+		if (!new_data) {
+			return -1;
+		}
+		stream->pending = new_data;
+		stream->pending_size = new_size;
+	}
+	memcpy(stream->pending + stream->pending_len, data, len);
+	stream->pending_len += len;
+	return 0;
+}
+
+/** On the display side, hand the other end of a new stream to the process
+ * accepting connections; it then arrives like any other connection. */
+static int open_remote_stream(struct mux_state *mx, uint32_t id)
+{
+	if (mx->linkfd == -1) {
+		return -1;
+	}
+	int sockets[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+		wp_error("Socketpair for stream %u failed: %s", id,
+				strerror(errno));
+		return -1;
+	}
+	if (send_one_fd(mx->linkfd, sockets[1]) == -1) {
+		wp_error("Failed to send stream %u to main process: %s", id,
+				strerror(errno));
+		checked_close(sockets[0]);
+		checked_close(sockets[1]);
+		return -1;
+	}
+	checked_close(sockets[1]);
+	if (add_stream(mx, sockets[0], id) == -1) {
+		checked_close(sockets[0]);
+		return -1;
+	}
+	return 0;
+}
+
+static int handle_channel_message(struct mux_state *mx, const char *msg)
+{
+	uint32_t header;
+	memcpy(&header, msg, sizeof(header));
+	size_t size = transfer_size(header);
+	const struct wmsg_stream *smsg = (const struct wmsg_stream *)msg;
+	struct mux_stream *stream = find_stream(mx, smsg->stream_id);
+	if (transfer_type(header) == WMSG_STREAM_CLOSE) {
+		if (stream) {
+			stream->remote_closed = true;
+		}
+		return 0;
+	} else if (transfer_type(header) == WMSG_STREAM_ACK) {
+		const struct wmsg_stream_ack *ack =
+				(const struct wmsg_stream_ack *)msg;
+		if (stream) {
+			stream->unacked -= minu(
+					ack->bytes_written, stream->unacked);
+		}
+		return 0;
+	}
+
+	if (!stream) {
+		if (!mx->display_side || smsg->stream_id <= mx->last_id) {
+			/* Data for a stream that was just closed */
+			return 0;
+		}
+		if (open_remote_stream(mx, smsg->stream_id) == -1) {
+			mx->last_id = smsg->stream_id;
+			queue_stream_close(mx, smsg->stream_id);
+			return 0;
+		}
+		stream = &mx->streams[mx->nstreams - 1];
+	}
+	if (stream->local_closed) {
+		return 0;
+	}
+	const char *data = msg + sizeof(struct wmsg_stream);
+	size_t len = size - sizeof(struct wmsg_stream);
+	if (stream->pending_len == 0) {
+		ssize_t wc = write(stream->fd, data, len);
+		if (wc == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+				errno != EINTR) {
+			wp_debug("Failed to write to stream %u: %s", stream->id,
+					strerror(errno));
+			close_stream(mx, stream);
+			return 0;
+		} else if (wc > 0) {
+			data += wc;
+			len -= (size_t)wc;
+			stream->unreported += (size_t)wc;
+		}
+	}
+	if (stream->pending_len + len > MUX_STREAM_WINDOW + MUX_CHUNK_SIZE) {
+		wp_error("Stream %u was sent more than its window of %u bytes",
+				stream->id, MUX_STREAM_WINDOW);
+		return -1;
+	}
+	if (len > 0 && append_pending(stream, data, len) == -1) {
+		wp_error("Failed to allocate %zu bytes for stream %u", len,
+				stream->id);
+		return -1;
+	}
+	return 0;
+}
+
+/** Returns 1 if the channel was closed, -1 on error */
+static int read_from_channel(struct mux_state *mx)
+{
+	ssize_t rc = read(mx->chanfd, ring_tail(&mx->in),
+			mx->in.size - mx->in.len);
+	if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+					errno == EINTR)) {
+		return 0;
+	} else if (rc == -1) {
+		wp_error("Failed to read from multiplexed channel: %s",
+				strerror(errno));
+		return -1;
+	} else if (rc == 0) {
+		wp_debug("Multiplexed channel closed");
+		return 1;
+	}
+	mx->in.len += (size_t)rc;
+
+	size_t pos = 0;
+	while (mx->in.len - pos >= sizeof(struct wmsg_stream)) {
+		uint32_t header;
+		memcpy(&header, ring_head(&mx->in) + pos, sizeof(header));
+		size_t size = transfer_size(header);
+		enum wmsg_type type = transfer_type(header);
+		size_t min_size = sizeof(struct wmsg_stream);
+		if (type == WMSG_STREAM_ACK) {
+			min_size = sizeof(struct wmsg_stream_ack);
+		}
+		if ((type != WMSG_STREAM_DATA && type != WMSG_STREAM_CLOSE &&
+				    type != WMSG_STREAM_ACK) ||
+				size < min_size || size > MUX_MAX_MESSAGE) {
+			wp_error("Unexpected message on multiplexed channel: type %s, size %zu",
+					wmsg_type_to_str(type), size);
+			return -1;
+		}
+		size_t msg_space = alignz(size, 4);
+		if (mx->in.len - pos < msg_space) {
+			break;
+		}
+		if (handle_channel_message(mx, ring_head(&mx->in) + pos) ==
+				-1) {
+			return -1;
+		}
+		pos += msg_space;
+	}
+	ring_consume(&mx->in, pos);
+	return 0;
+}
+
+static int write_to_channel(struct mux_state *mx)
+{
+	while (mx->out_end > mx->out_start) {
+		ssize_t wc = write(mx->chanfd, mx->out + mx->out_start,
+				mx->out_end - mx->out_start);
+		if (wc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+						errno == EINTR)) {
+			return 0;
+		} else if (wc == -1) {
+			wp_error("Failed to write to multiplexed channel: %s",
+					strerror(errno));
+			return -1;
+		}
+		mx->out_start += (size_t)wc;
+	}
+	return 0;
+}
+
+/** Read at most one message worth of data from the stream */
+static void read_from_stream(struct mux_state *mx, struct mux_stream *stream)
+{
+	char *dest = reserve_output(mx, alignz(MUX_MAX_MESSAGE, 4));
+	if (!dest) {
+		return;
+	}
+	ssize_t rc = read(stream->fd, dest + sizeof(struct wmsg_stream),
+			MUX_CHUNK_SIZE);
+	if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+					errno == EINTR)) {
+		return;
+	} else if (rc <= 0) {
+		if (rc == -1) {
+			wp_debug("Failed to read from stream %u: %s",
+					stream->id, strerror(errno));
+		}
+		close_stream(mx, stream);
+		return;
+	}
+	stream->unacked += (size_t)rc;
+	size_t size = sizeof(struct wmsg_stream) + (size_t)rc;
+	struct wmsg_stream msg;
+	msg.size_and_type = transfer_header(size, WMSG_STREAM_DATA);
+	msg.stream_id = stream->id;
+	memcpy(dest, &msg, sizeof(msg));
+	memset(dest + size, 0, alignz(size, 4) - size);
+	mx->out_end += alignz(size, 4);
+}
+
+int run_channel_mux(int chanfd, int linkfd, bool display_side)
+{
+	size_t out_size = MUX_OUT_LIMIT + alignz(MUX_MAX_MESSAGE, 4);
+	struct mux_state mx = {
+			.chanfd = chanfd,
+			.linkfd = linkfd,
+			.display_side = display_side,
+			.streams = NULL,
+			.nstreams = 0,
+			.streams_size = 0,
+			.last_id = 0,
+			.next_turn = 0,
+			.out = malloc(out_size),
+			.out_start = 0,
+			.out_end = 0,
+			.out_size = out_size,
+			.failed = false,
+	};
+	struct pollfd *pfds = NULL;
+	int pfds_size = 0;
+	int retcode = EXIT_SUCCESS;
+	/* Room for several messages, so each read can fetch many */
+	if (ring_init(&mx.in, 4 * alignz(MUX_MAX_MESSAGE, 4)) == -1 ||
+			!mx.out) {
+		wp_error("Failed to allocate multiplexing buffers");
+		retcode = EXIT_FAILURE;
+		goto cleanup;
+	}
+	if (set_nonblocking(chanfd) == -1) {
+		wp_error("Failed to make channel nonblocking: %s",
+				strerror(errno));
+		retcode = EXIT_FAILURE;
+		goto cleanup;
+	}
+
+	while (!shutdown_flag) {
+		if (mx.linkfd == -1 && mx.nstreams == 0 &&
+				mx.out_end == mx.out_start) {
+			break;
+		}
+		if (buf_ensure_size(2 + mx.nstreams, sizeof(struct pollfd),
+				    &pfds_size, (void **)&pfds) == -1) {
+			wp_error("Failed to allocate poll list");
+			retcode = EXIT_FAILURE;
+			break;
+		}
+		bool out_full = mx.out_end - mx.out_start >= MUX_OUT_LIMIT;
+		int npolled = mx.nstreams;
+		for (int i = 0; i < npolled; i++) {
+			struct mux_stream *stream = &mx.streams[i];
+			bool can_read = !out_full && !stream->remote_closed &&
+					stream->unacked < MUX_STREAM_WINDOW;
+			short events = (stream->pending_len > 0 ? POLLOUT : 0) |
+				       (can_read ? POLLIN : 0);
+			/* Otherwise a hangup would be reported at once */
+			pfds[2 + i].fd = events ? stream->fd : -1;
+			pfds[2 + i].events = events;
+			pfds[2 + i].revents = 0;
+		}
+		pfds[0].fd = chanfd;
+		pfds[0].events = POLLIN |
+				 (mx.out_end > mx.out_start ? POLLOUT : 0);
+		pfds[0].revents = 0;
+		pfds[1].fd = mx.linkfd;
+		pfds[1].events = display_side ? 0 : POLLIN;
+		pfds[1].revents = 0;
+
+		int r = poll(pfds, 2 + (nfds_t)npolled, -1);
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			wp_error("Poll failed: %s", strerror(errno));
+			retcode = EXIT_FAILURE;
+			break;
+		}
+
+		if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			int rc = read_from_channel(&mx);
+			if (rc == 1) {
+				remove_closed_streams(&mx);
+				if (mx.nstreams > 0) {
+					wp_error("Multiplexed channel closed with %d streams still open",
+							mx.nstreams);
+					retcode = EXIT_FAILURE;
+				}
+				break;
+			} else if (rc == -1) {
+				retcode = EXIT_FAILURE;
+				break;
+			}
+		}
+		for (int i = 0; i < npolled; i++) {
+			if (pfds[2 + i].revents & POLLOUT) {
+				write_pending(&mx, &mx.streams[i]);
+			}
+		}
+		/* Streams take turns reading one message each, starting from
+		 * a different stream each round */
+		for (int k = 0; k < npolled; k++) {
+			int i = (mx.next_turn + k) % npolled;
+			struct mux_stream *stream = &mx.streams[i];
+			if (stream->local_closed || stream->remote_closed ||
+					stream->unacked >= MUX_STREAM_WINDOW) {
+				continue;
+			}
+			if (!(pfds[2 + i].revents & (POLLIN | POLLHUP))) {
+				if (pfds[2 + i].revents & POLLERR) {
+					close_stream(&mx, stream);
+				}
+				continue;
+			}
+			if (mx.out_end - mx.out_start >= MUX_OUT_LIMIT) {
+				break;
+			}
+			read_from_stream(&mx, stream);
+		}
+		mx.next_turn = npolled > 0 ? (mx.next_turn + 1) % npolled : 0;
+
+		if (pfds[1].revents & POLLIN) {
+			int fd = recv_one_fd(mx.linkfd);
+			if (fd == -2) {
+				checked_close(mx.linkfd);
+				mx.linkfd = -1;
+			} else if (fd == -1) {
+				wp_error("Failed to receive new stream: %s",
+						strerror(errno));
+			} else if (add_stream(&mx, fd, mx.last_id + 1) == -1) {
+				checked_close(fd);
+			}
+		} else if (pfds[1].revents & (POLLHUP | POLLERR)) {
+			checked_close(mx.linkfd);
+			mx.linkfd = -1;
+		}
+
+		queue_stream_acks(&mx);
+		remove_closed_streams(&mx);
+		if (mx.failed || write_to_channel(&mx) == -1) {
+			retcode = EXIT_FAILURE;
+			break;
+		}
+	}
+
+cleanup:
+	for (int i = 0; i < mx.nstreams; i++) {
+		checked_close(mx.streams[i].fd);
+		free(mx.streams[i].pending);
+	}
+	free(mx.streams);
+	free(pfds);
+	free(mx.out);
+	ring_cleanup(&mx.in);
+	if (mx.linkfd != -1) {
+		checked_close(mx.linkfd);
+	}
+	checked_close(chanfd);
+	return retcode;
+}
@@ -44,139 +44,110 @@ const char *get_nth_packed_string(const char *pack, int n)
 	return pack;
 }
 
-static struct wp_object *tree_rotate_left(struct wp_object *n)
+#define OBJECT_PAGE_BITS 8
+#define OBJECT_PAGE_SIZE (1u << OBJECT_PAGE_BITS)
+#define SERVER_ID_START 0xff000000u
+/* libwayland only accepts new ids adjacent to those in use, so a limit on the
+ * size of each range (here 16M objects) only guards against absurd input */
+#define MAX_OBJECT_PAGES (1u << 16)
+
+struct object_page {
+	uint32_t count;
+	struct wp_object *objs[OBJECT_PAGE_SIZE];
+};
+
+static struct object_table *get_table(
+		struct message_tracker *mt, uint32_t id, uint32_t *offset)
 {
-	struct wp_object *tmp = n->t_right;
-	n->t_right = tmp->t_left;
-	tmp->t_left = n;
-	return tmp;
-}
-static struct wp_object *tree_rotate_right(struct wp_object *n)
-{
-	struct wp_object *tmp = n->t_left;
-	n->t_left = tmp->t_right;
-	tmp->t_right = n;
-	return tmp;
-}
-static void tree_link_right(struct wp_object **cur, struct wp_object **rn)
-{
-	(*rn)->t_left = *cur;
-	*rn = *cur;
-	*cur = (*cur)->t_left;
+	if (id >= SERVER_ID_START) {
+		*offset = id - SERVER_ID_START;
+		return &mt->server_objs;
+	}
+	*offset = id;
+	return &mt->client_objs;
 }
-static void tree_link_left(struct wp_object **cur, struct wp_object **ln)
+static struct wp_object **table_lookup(
+		const struct object_table *table, uint32_t offset)
 {
-	(*ln)->t_right = *cur;
-	*ln = *cur;
-	*cur = (*cur)->t_right;
+	uint32_t p = offset >> OBJECT_PAGE_BITS;
+	if (p >= table->npages || !table->pages[p]) {
+		return NULL;
+	}
+	return &table->pages[p]->objs[offset & (OBJECT_PAGE_SIZE - 1)];
 }
-
-/* Splay operation, following Sleator+Tarjan, 1985 */
-static struct wp_object *tree_branch_splay(struct wp_object *root, uint32_t key)
+static int table_set(struct object_table *table, uint32_t offset,
+		struct wp_object *obj)
 {
-	if (!root) {
-		return NULL;
+	uint32_t p = offset >> OBJECT_PAGE_BITS;
+	if (p >= MAX_OBJECT_PAGES) {
+		return -1;
 	}
-	struct wp_object bg = {.t_left = NULL, .t_right = NULL};
-	struct wp_object *ln = &bg;
-	struct wp_object *rn = &bg;
-	struct wp_object *cur = root;
-
-	while (key != cur->obj_id) {
-		if (key < cur->obj_id) {
-			if (cur->t_left && key < cur->t_left->obj_id) {
-				cur = tree_rotate_right(cur);
-			}
-			if (!cur->t_left) {
-				break;
-			}
-			tree_link_right(&cur, &rn);
-		} else {
-			if (cur->t_right && key > cur->t_right->obj_id) {
-				cur = tree_rotate_left(cur);
-			}
-			if (!cur->t_right) {
-				break;
-			}
-			tree_link_left(&cur, &ln);
+	if (p >= table->npages) {
+		uint32_t npages = table->npages ? table->npages : 4;
+		while (npages <= p) {
+			npages *= 2;
 		}
+		void *new_pages = realloc(table->pages,
+				sizeof(struct object_page *) * npages);
+		if (!new_pages) {
+			return -1;
+		}
+		table->pages = new_pages;
+		memset(table->pages + table->npages, 0,
+				sizeof(struct object_page *) *
+						(npages - table->npages));
+		table->npages = npages;
 	}
-	ln->t_right = cur->t_left;
-	rn->t_left = cur->t_right;
-	cur->t_left = bg.t_right;
-	cur->t_right = bg.t_left;
-	return cur;
-}
-static void tree_insert(struct wp_object **tree, struct wp_object *new_node)
-{
-	/* Reset these, just in case */
-	new_node->t_left = NULL;
-	new_node->t_right = NULL;
-
-	struct wp_object *r = *tree;
-	if (!r) {
-		*tree = new_node;
-		return;
+	if (!table->pages[p]) {
+		table->pages[p] = calloc(1, sizeof(struct object_page));
+		if (!table->pages[p]) {
+			return -1;
+		}
 	}
-	r = tree_branch_splay(r, new_node->obj_id);
-	if (new_node->obj_id < r->obj_id) {
-		new_node->t_left = r->t_left;
-		new_node->t_right = r;
-		r->t_left = NULL;
-		r = new_node;
-	} else if (new_node->obj_id > r->obj_id) {
-		new_node->t_right = r->t_right;
-		new_node->t_left = r;
-		r->t_right = NULL;
-		r = new_node;
-	} else {
-		/* already in tree, no effect? or do silent override */
+	struct object_page *page = table->pages[p];
+	struct wp_object **slot = &page->objs[offset & (OBJECT_PAGE_SIZE - 1)];
+	if (!*slot) {
+		page->count++;
 	}
-	*tree = r;
+	*slot = obj;
+	return 0;
 }
-static void tree_remove(struct wp_object **tree, uint32_t key)
+static void table_remove(struct object_table *table, uint32_t offset)
 {
-	struct wp_object *r = *tree;
-	r = tree_branch_splay(r, key);
-	if (!r || r->obj_id != key) {
-		/* wasn't in tree */
+	struct wp_object **slot = table_lookup(table, offset);
+	if (!slot || !*slot) {
 		return;
 	}
-	struct wp_object *lbranch = r->t_left;
-	struct wp_object *rbranch = r->t_right;
-	if (!lbranch) {
-		*tree = rbranch;
-		return;
-	}
-	r = tree_branch_splay(lbranch, key);
-	r->t_right = rbranch;
-	*tree = r;
-}
-static struct wp_object *tree_lookup(struct wp_object **tree, uint32_t key)
-{
-	*tree = tree_branch_splay(*tree, key);
-	if (*tree && (*tree)->obj_id == key) {
-		return *tree;
+	*slot = NULL;
+	uint32_t p = offset >> OBJECT_PAGE_BITS;
+	if (--table->pages[p]->count == 0) {
+		/* Keep sparse use cheap */
+		free(table->pages[p]);
+		table->pages[p] = NULL;
 	}
-	return NULL;
 }
-static void tree_clear(struct wp_object **tree,
+static void table_clear(struct object_table *table,
 		void (*node_free)(struct wp_object *object))
 {
-	struct wp_object *root = *tree;
-	while (root) {
-		root = tree_branch_splay(root, 0);
-		struct wp_object *right = root->t_right;
-		root->t_right = NULL;
-		node_free(root);
-		root = right;
-	}
-	*tree = NULL;
+	for (uint32_t p = 0; p < table->npages; p++) {
+		if (!table->pages[p]) {
+			continue;
+		}
+		for (uint32_t i = 0; i < OBJECT_PAGE_SIZE; i++) {
+			if (table->pages[p]->objs[i]) {
+				node_free(table->pages[p]->objs[i]);
+			}
+		}
+		free(table->pages[p]);
+	}
+	free(table->pages);
+	table->pages = NULL;
+	table->npages = 0;
 }
 
-void tracker_insert(struct message_tracker *mt, struct wp_object *obj)
+int tracker_insert(struct message_tracker *mt, struct wp_object *obj)
 {
-	struct wp_object *old_obj = tree_lookup(&mt->objtree_root, obj->obj_id);
+	struct wp_object *old_obj = tracker_get(mt, obj->obj_id);
 	if (old_obj) {
 		/* We /always/ replace the object, to ensure that map
 		 * elements are never duplicated and make the deletion
@@ -189,25 +160,41 @@ void tracker_insert(struct message_tracker *mt, struct wp_object *obj)
 		/* Zombie objects (server allocated, client deleted) are
 		 * only acknowledged destroyed by the server when they
 		 * are replaced. */
-		tree_remove(&mt->objtree_root, old_obj->obj_id);
+		tracker_remove(mt, old_obj);
 		destroy_wp_object(old_obj);
 	}
 
-	tree_insert(&mt->objtree_root, obj);
+	uint32_t offset;
+	struct object_table *table = get_table(mt, obj->obj_id, &offset);
+	if (table_set(table, offset, obj) == -1) {
+		wp_error("Failed to track object @%u, its id is too large or allocation failed",
+				obj->obj_id);
+		return -1;
+	}
+	return 0;
 }
 void tracker_replace_existing(
 		struct message_tracker *mt, struct wp_object *new_obj)
 {
-	tree_remove(&mt->objtree_root, new_obj->obj_id);
-	tree_insert(&mt->objtree_root, new_obj);
+	uint32_t offset;
+	struct object_table *table = get_table(mt, new_obj->obj_id, &offset);
+	struct wp_object **slot = table_lookup(table, offset);
+	if (slot && *slot) {
+		*slot = new_obj;
+	}
 }
 void tracker_remove(struct message_tracker *mt, struct wp_object *obj)
 {
-	tree_remove(&mt->objtree_root, obj->obj_id);
+	uint32_t offset;
+	struct object_table *table = get_table(mt, obj->obj_id, &offset);
+	table_remove(table, offset);
 }
 struct wp_object *tracker_get(struct message_tracker *mt, uint32_t id)
 {
-	return tree_lookup(&mt->objtree_root, id);
+	uint32_t offset;
+	const struct object_table *table = get_table(mt, id, &offset);
+	struct wp_object **slot = table_lookup(table, offset);
+	return slot ? *slot : NULL;
 }
 struct wp_object *get_object(struct message_tracker *mt, uint32_t id,
 		const struct wp_interface *intf)
@@ -226,18 +213,16 @@ int init_message_tracker(struct message_tracker *mt)
 	if (!disp) {
 		return -1;
 	}
-	tracker_insert(mt, disp);
+	if (tracker_insert(mt, disp) == -1) {
+		destroy_wp_object(disp);
+		return -1;
+	}
 	return 0;
 }
 void cleanup_message_tracker(struct message_tracker *mt)
 {
-	tree_clear(&mt->objtree_root, destroy_wp_object);
-}
-
-static bool word_has_empty_bytes(uint32_t v)
-{
-	return ((v & 0xFF) == 0) || ((v & 0xFF00) == 0) ||
-	       ((v & 0xFF0000) == 0) || ((v & 0xFF000000) == 0);
+	table_clear(&mt->client_objs, destroy_wp_object);
+	table_clear(&mt->server_objs, destroy_wp_object);
 }
 
 bool size_check(const struct msg_data *data, const uint32_t *payload,
@@ -248,43 +233,19 @@ bool size_check(const struct msg_data *data, const uint32_t *payload,
 				fd_length);
 		return false;
 	}
-
-	const uint16_t *gaps = data->gaps;
-	uint32_t pos = 0;
-	for (;; gaps++) {
-		uint16_t g = (*gaps >> 2);
-		uint16_t e = (*gaps & 0x3);
-		pos += g;
-		if (pos > true_length) {
-			wp_error("Msg overflow, not enough words %d > %d", pos,
-					true_length);
-			return false;
-		}
-		switch (e) {
-		case GAP_CODE_STR: {
-			uint32_t x_words = (payload[pos - 1] + 3) / 4;
-			uint32_t end_idx = pos + x_words - 1;
-			if (end_idx < true_length &&
-					!word_has_empty_bytes(
-							payload[end_idx])) {
-				wp_error("Msg overflow, string termination %d < %d, %d, %x %d",
-						pos, true_length, x_words,
-						payload[end_idx],
-						word_has_empty_bytes(
-								payload[end_idx]));
-				return false;
-			}
-			pos += x_words;
-		} break;
-		case GAP_CODE_ARR:
-			pos += (payload[pos - 1] + 3) / 4;
-			break;
-		case GAP_CODE_OBJ:
-			break;
-		case GAP_CODE_END:
-			return true;
-		}
+	if (data->base_words > true_length) {
+		wp_error("Msg overflow, not enough words %d > %d",
+				data->base_words, true_length);
+		return false;
+	}
+	/* The generated validator walks the message's strings and arrays;
+	 * messages without any have a fixed size and are fully checked */
+	if (data->check && !(*data->check)(payload, true_length)) {
+		wp_error("Msg overflow, strings or arrays do not fit in %d words",
+				true_length);
+		return false;
 	}
+	return true;
 }
 
 /* Given a size-checked request, try to construct all the new objects
@@ -326,7 +287,10 @@ static bool build_new_objects(const struct msg_data *data,
 			if (!new_obj) {
 				return false;
 			}
-			tracker_insert(mt, new_obj);
+			if (tracker_insert(mt, new_obj) == -1) {
+				destroy_wp_object(new_obj);
+				return false;
+			}
 			objno++;
 		} break;
 		case GAP_CODE_END:
@@ -340,10 +304,13 @@ int peek_message_size(const void *data)
 	return (int)(((const uint32_t *)data)[1] >> 16);
 }
 
-enum parse_state handle_message(struct globals *g, bool display_side,
-		bool from_client, struct char_window *chars,
-		struct int_window *fds)
+/** If `scratch` is not NULL, and the message has a handler, the message is
+ * first copied to `scratch`, and `chars` is redirected to point to it */
+static enum parse_state process_message(struct globals *g, bool display_side,
+		bool from_client, struct char_window **chars_ptr,
+		struct char_window *scratch, struct int_window *fds)
 {
+	struct char_window *chars = *chars_ptr;
 	bool to_wire = from_client == !display_side;
 
 	const uint32_t *const header =
@@ -392,9 +359,31 @@ enum parse_state handle_message(struct globals *g, bool display_side,
 	int meth_offset = from_client ? meth : meth + intf->nreq;
 	const struct msg_data *msg = &intf->msgs[meth_offset];
 
-	const uint32_t *payload = header + 2;
-	if (!size_check(msg, payload, (unsigned int)len / 4 - 2,
-			    fds->zone_end - fds->zone_start)) {
+	if (scratch && msg->call) {
+		/* The handler may edit or grow the message, so let it
+		 * work on a copy with room to spare */
+		memcpy(scratch->data, header, (size_t)len);
+		scratch->zone_start = 0;
+		scratch->zone_end = len;
+		chars = scratch;
+		*chars_ptr = scratch;
+	}
+
+	const uint32_t *payload =
+			(const uint32_t *)&chars->data[chars->zone_start] + 2;
+	unsigned int payload_words = (unsigned int)len / 4 - 2;
+	int fds_left = fds->zone_end - fds->zone_start;
+	bool valid;
+	if (msg->call || msg->new_objs) {
+		valid = size_check(msg, payload, payload_words, fds_left);
+	} else {
+		/* The contents of messages which are neither decoded nor
+		 * create objects are only forwarded, so checking the length
+		 * suffices */
+		valid = msg->base_words <= payload_words &&
+			msg->n_fds <= fds_left;
+	}
+	if (!valid) {
 		wp_error("Message %x %s@%u.%s parse length overflow", payload,
 				intf->name, objh->obj_id,
 				get_nth_packed_string(
@@ -402,10 +391,16 @@ enum parse_state handle_message(struct globals *g, bool display_side,
 		return PARSE_UNKNOWN;
 	}
 
-	if (!build_new_objects(msg, payload, &g->tracker, objh, meth_offset)) {
+	if (msg->new_objs && !build_new_objects(msg, payload, &g->tracker,
+					    objh, meth_offset)) {
 		return PARSE_UNKNOWN;
 	}
 
+	if (from_client && !display_side && intf != the_display_interface) {
+		/* The reply to a later wl_display.sync depends on this */
+		g->registry.sync_allowed = false;
+	}
+
 	int fds_used = 0;
 	struct context ctx = {
 			.g = g,
@@ -413,6 +408,7 @@ enum parse_state handle_message(struct globals *g, bool display_side,
 			.obj = objh,
 			.on_display_side = display_side,
 			.drop_this_msg = false,
+			.defer_this_msg = false,
 			.message = (uint32_t *)&chars->data[chars->zone_start],
 			.message_length = len,
 			.message_available_space =
@@ -424,6 +420,10 @@ enum parse_state handle_message(struct globals *g, bool display_side,
 		(*msg->call)(&ctx, payload, &fds->data[fds->zone_start],
 				&g->tracker);
 	}
+	if (ctx.defer_this_msg) {
+		chars->zone_end = chars->zone_start;
+		return PARSE_DEFERRED;
+	}
 	if (num_fds_with_message >= 0 && msg->n_fds != num_fds_with_message) {
 		wp_error("Message used %d file descriptors, but was tagged as using %d",
 				msg->n_fds, num_fds_with_message);
@@ -505,6 +505,67 @@ enum parse_state handle_message(struct globals *g, bool display_side,
 	return PARSE_KNOWN;
 }
 
+enum parse_state handle_message(struct globals *g, bool display_side,
+		bool from_client, struct char_window *chars,
+		struct int_window *fds)
+{
+	return process_message(g, display_side, from_client, &chars, NULL, fds);
+}
+
+/** Return the size of the complete message at the start of the window,
+ * or 0 if the message is not yet complete or is malformed */
+static int complete_message_size(const struct char_window *bytes)
+{
+	if (bytes->zone_end - bytes->zone_start < 8) {
+		// Not enough remaining bytes to parse the
+		// header
+		wp_debug("Insufficient bytes for header: %d %d",
+				bytes->zone_start, bytes->zone_end);
+		return 0;
+	}
+	int msgsz = peek_message_size(&bytes->data[bytes->zone_start]);
+	if (msgsz % 4 != 0) {
+		wp_debug("Wayland messages lengths must be divisible by 4");
+		return 0;
+	}
+	if (bytes->zone_start + msgsz > bytes->zone_end) {
+		wp_debug("Insufficient bytes");
+		// Not enough remaining bytes to contain the
+		// message
+		return 0;
+	}
+	if (msgsz < 8) {
+		wp_debug("Degenerate message, claimed len=%d", msgsz);
+		// Not enough remaining bytes to contain the
+		// message
+		return 0;
+	}
+	return msgsz;
+}
+
+static void mark_unowned_dirty(struct globals *g)
+{
+	// All-un-owned buffers are assumed to have changed.
+	// (Note that in some cases, a new protocol could imply
+	// a change for an existing buffer; it may make sense to
+	// mark everything dirty, then.)
+	//
+	// Without more specific evidence, the buffers are only marked as
+	// possibly changed, so that DMABUFs are checked block by block
+	// instead of being diffed in full. Files only send recorded damage,
+	// and unowned files have none; guessing damage for every shm pool
+	// here would make each unknown message hash all of them.
+	for (struct shadow_fd_link *lcur = g->map.link.l_next,
+				   *lnxt = lcur->l_next;
+			lcur != &g->map.link;
+			lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *cur = (struct shadow_fd *)lcur;
+		if (!cur->has_owner && cur->type != FDC_FILE) {
+			mark_shadow_maybe_dirty(&g->map, cur);
+		}
+	}
+}
+
 void parse_and_prune_messages(struct globals *g, bool on_display_side,
 		bool from_client, struct char_window *source_bytes,
 		struct char_window *dest_bytes, struct int_window *fds)
@@ -520,30 +581,8 @@ void parse_and_prune_messages(struct globals *g, bool on_display_side,
 			source_bytes->zone_end - source_bytes->zone_start);
 
 	for (; source_bytes->zone_start < source_bytes->zone_end;) {
-		if (source_bytes->zone_end - source_bytes->zone_start < 8) {
-			// Not enough remaining bytes to parse the
-			// header
-			wp_debug("Insufficient bytes for header: %d %d",
-					source_bytes->zone_start,
-					source_bytes->zone_end);
-			break;
-		}
-		int msgsz = peek_message_size(
-				&source_bytes->data[source_bytes->zone_start]);
-		if (msgsz % 4 != 0) {
-			wp_debug("Wayland messages lengths must be divisible by 4");
-			break;
-		}
-		if (source_bytes->zone_start + msgsz > source_bytes->zone_end) {
-			wp_debug("Insufficient bytes");
-			// Not enough remaining bytes to contain the
-			// message
-			break;
-		}
-		if (msgsz < 8) {
-			wp_debug("Degenerate message, claimed len=%d", msgsz);
-			// Not enough remaining bytes to contain the
-			// message
+		int msgsz = complete_message_size(source_bytes);
+		if (msgsz == 0) {
 			break;
 		}
 
@@ -558,6 +597,10 @@ void parse_and_prune_messages(struct globals *g, bool on_display_side,
 
 		enum parse_state pstate = handle_message(g, on_display_side,
 				from_client, &scan_bytes, fds);
+		if (pstate == PARSE_DEFERRED) {
+			source_bytes->zone_start -= msgsz;
+			break;
+		}
 		if (pstate == PARSE_UNKNOWN || pstate == PARSE_ERROR) {
 			anything_unknown = true;
 		}
@@ -566,21 +609,90 @@ void parse_and_prune_messages(struct globals *g, bool on_display_side,
 	dest_bytes->zone_end = scan_bytes.zone_end;
 
 	if (anything_unknown) {
-		// All-un-owned buffers are assumed to have changed.
-		// (Note that in some cases, a new protocol could imply
-		// a change for an existing buffer; it may make sense to
-		// mark everything dirty, then.)
-
-		for (struct shadow_fd_link *lcur = g->map.link.l_next,
-					   *lnxt = lcur->l_next;
-				lcur != &g->map.link;
-				lcur = lnxt, lnxt = lcur->l_next) {
-			struct shadow_fd *cur = (struct shadow_fd *)lcur;
-			if (!cur->has_owner) {
-				cur->is_dirty = true;
+		mark_unowned_dirty(g);
+	}
+	DTRACE_PROBE(waypipe, parse_exit);
+	return;
+}
+
+int parse_messages_in_place(struct globals *g, bool on_display_side,
+		bool from_client, struct char_window *bytes,
+		struct char_window *scratch, struct int_window *fds)
+{
+	bool anything_unknown = false;
+	/* Messages before `write_pos` are output; messages after
+	 * bytes->zone_start are not yet parsed; the gap between the two
+	 * is left by dropped or shrunk messages. */
+	int write_pos = bytes->zone_start;
+
+	DTRACE_PROBE1(waypipe, parse_enter,
+			bytes->zone_end - bytes->zone_start);
+
+	for (; bytes->zone_start < bytes->zone_end;) {
+		int msgsz = complete_message_size(bytes);
+		if (msgsz == 0) {
+			break;
+		}
+		if (msgsz + 1024 > scratch->size &&
+				buf_ensure_size(msgsz + 1024, 1, &scratch->size,
+						(void **)&scratch->data) == -1) {
+			wp_error("Allocation failure for message workspace");
+			return -1;
+		}
+		if (write_pos != bytes->zone_start) {
+			memmove(&bytes->data[write_pos],
+					&bytes->data[bytes->zone_start],
+					(size_t)msgsz);
+		}
+		struct char_window in_place = {
+				.data = bytes->data,
+				.size = write_pos + msgsz,
+				.zone_start = write_pos,
+				.zone_end = write_pos + msgsz,
+		};
+		struct char_window *msg_window = &in_place;
+		/* Messages that a handler may change are redirected to
+		 * `scratch`; otherwise, only object tracking and fd tagging
+		 * happen, and neither changes the message length */
+		enum parse_state pstate = process_message(g, on_display_side,
+				from_client, &msg_window, scratch, fds);
+		bytes->zone_start += msgsz;
+		if (msg_window == &in_place) {
+			write_pos = in_place.zone_end;
+		} else {
+			int new_len = scratch->zone_end - scratch->zone_start;
+			int overflow = write_pos + new_len - bytes->zone_start;
+			if (overflow > 0) {
+				/* Rare: the message grew past the gap, so shift
+				 * the unparsed bytes to make room */
+				if (buf_ensure_size(bytes->zone_end + overflow,
+						    1, &bytes->size,
+						    (void **)&bytes->data) ==
+						-1) {
+					wp_error("Allocation failure for message workspace");
+					return -1;
+				}
+				memmove(&bytes->data[bytes->zone_start +
+							 overflow],
+						&bytes->data[bytes->zone_start],
+						(size_t)(bytes->zone_end -
+								bytes->zone_start));
+				bytes->zone_start += overflow;
+				bytes->zone_end += overflow;
 			}
+			memcpy(&bytes->data[write_pos],
+					&scratch->data[scratch->zone_start],
+					(size_t)new_len);
+			write_pos += new_len;
+		}
+		if (pstate == PARSE_UNKNOWN || pstate == PARSE_ERROR) {
+			anything_unknown = true;
 		}
 	}
+
+	if (anything_unknown) {
+		mark_unowned_dirty(g);
+	}
 	DTRACE_PROBE(waypipe, parse_exit);
-	return;
+	return write_pos;
 }
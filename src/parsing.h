@@ -37,14 +37,21 @@ struct wp_interface;
 /** An object used by the wayland protocol. Specific types may extend
  * this struct, using the following data as a header */
 struct wp_object {
-	struct wp_object *t_left, *t_right; // inline tree implementation
-	const struct wp_interface *type;    // Use to lookup the message handler
+	const struct wp_interface *type; // Use to lookup the message handler
 	uint32_t obj_id;
 	bool is_zombie; // object deleted but not yet acknowledged remotely
 };
+/** Object ids are allocated densely, by clients starting from 1 and by servers
+ * from 0xff000000; each range is a table directly indexed by the offset of
+ * the id from the range start, split into pages allocated on first use. */
+struct object_table {
+	struct object_page **pages;
+	uint32_t npages;
+};
 struct message_tracker {
-	/* Tree containing all objects that are currently alive or zombie */
-	struct wp_object *objtree_root;
+	/* Tables of all objects that are currently alive or zombie */
+	struct object_table client_objs;
+	struct object_table server_objs;
 	/* sequence number to discriminate between wl_buffer objects; object ids
 	 * and pointers are not guaranteed to be unique */
 	uint64_t buffer_seqno;
@@ -55,6 +62,9 @@ struct context {
 	struct message_tracker *const tracker;
 	struct wp_object *obj;
 	bool drop_this_msg;
+	/* If set, the message and all later ones are left unparsed, to be
+	 * handled again later; only parse_and_prune_messages supports this */
+	bool defer_this_msg;
 	/* If true, running as waypipe client, and interfacing with compositor's
 	 * buffers */
 	const bool on_display_side;
@@ -70,8 +80,9 @@ struct context {
 };
 
 /** Add a protocol object to the list, replacing any preceding object with
- * the same id. */
-void tracker_insert(struct message_tracker *mt, struct wp_object *obj);
+ * the same id. Returns -1 if the id is too far from the ones already used, and
+ * 0 on success. */
+int tracker_insert(struct message_tracker *mt, struct wp_object *obj);
 void tracker_remove(struct message_tracker *mt, struct wp_object *obj);
 /** Replace an object that is already in the protocol list with a new object
  * that has the same id; will silently fail if id not present */
@@ -91,7 +102,7 @@ static inline uint32_t message_header_2(uint32_t size_bytes, uint32_t msgno)
 	return (size_bytes << 16) | msgno;
 }
 const char *get_nth_packed_string(const char *pack, int n);
-enum parse_state { PARSE_KNOWN, PARSE_UNKNOWN, PARSE_ERROR };
+enum parse_state { PARSE_KNOWN, PARSE_UNKNOWN, PARSE_ERROR, PARSE_DEFERRED };
 /**
  * The return value is false iff the given message should be dropped.
  * The flag `unidentified_changes` is set to true if the message does
@@ -123,10 +134,29 @@ enum parse_state handle_message(struct globals *g, bool on_display_side,
  * The file descriptor queue `fds` will have its start advanced, leaving only
  * file descriptors that have not yet been read. Further edits may be made
  * to inject new file descriptors.
+ *
+ * If a handler defers its message, parsing stops before it, and the start of
+ * `source_bytes` is left at that message.
  */
 void parse_and_prune_messages(struct globals *g, bool on_display_side,
 		bool from_client, struct char_window *source_bytes,
 		struct char_window *dest_bytes, struct int_window *fds);
+/**
+ * Like parse_and_prune_messages, but compacts the messages within `bytes`
+ * itself, so that messages which no handler can touch are not copied at
+ * all, and are only moved down when an earlier message was dropped or
+ * shrunk. Messages with handlers are edited in the `scratch` buffer, which
+ * may be reallocated, and then copied back.
+ *
+ * The output is written starting from the initial zone start of `bytes`;
+ * the return value is the end of the output, or -1 on allocation failure.
+ * On return, the zone of `bytes` holds the unparsed remainder. The
+ * data of `bytes` must be heap allocated, as it may be reallocated if a
+ * handler grows a message by more than the space freed so far.
+ */
+int parse_messages_in_place(struct globals *g, bool on_display_side,
+		bool from_client, struct char_window *bytes,
+		struct char_window *scratch, struct int_window *fds);
 
 // handlers.c
 /** Create a new Wayland protocol object of the given type; some types
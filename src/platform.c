@@ -29,7 +29,9 @@
 
 #include "config-waypipe.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -56,6 +58,7 @@
 
 #if defined(__linux__)
 #define HAS_O_PATH 1
+#define HAS_MREMAP 1
 #endif
 
 int create_anon_file(void)
@@ -81,6 +84,37 @@ int create_anon_file(void)
 	return new_fileno;
 }
 
+int create_spill_file(void)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	if (!dir) {
+		return -1;
+	}
+	int fd;
+#ifdef O_TMPFILE
+	fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd != -1) {
+		return fd;
+	}
+#endif
+	/* Fallback, if the file system does not support O_TMPFILE */
+	char path[256];
+	if (snprintf(path, sizeof(path), "%s/waypipe-spill-XXXXXX", dir) >=
+			(int)sizeof(path)) {
+		return -1;
+	}
+	fd = mkstemp(path);
+	if (fd == -1) {
+		return -1;
+	}
+	(void)unlink(path);
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
 int get_hardware_thread_count(void)
 {
 	return (int)sysconf(_SC_NPROCESSORS_ONLN);
@@ -88,6 +122,35 @@ int get_hardware_thread_count(void)
 
 int get_iov_max(void) { return (int)sysconf(_SC_IOV_MAX); }
 
+void *create_shared_memory(size_t size)
+{
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	return mem == MAP_FAILED ? NULL : mem;
+}
+void destroy_shared_memory(void *mem, size_t size) { munmap(mem, size); }
+
+int init_shared_mutex(pthread_mutex_t *mutex)
+{
+	pthread_mutexattr_t attr;
+	if (pthread_mutexattr_init(&attr)) {
+		return -1;
+	}
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	int ret = pthread_mutex_init(mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	return ret ? -1 : 0;
+}
+bool lock_shared_mutex(pthread_mutex_t *mutex)
+{
+	if (pthread_mutex_lock(mutex) == EOWNERDEAD) {
+		pthread_mutex_consistent(mutex);
+		return true;
+	}
+	return false;
+}
+
 #ifdef HAVE_NEON
 bool neon_available(void)
 {
@@ -103,9 +166,13 @@ bool neon_available(void)
 }
 #endif
 
-static void *align_ptr(void *ptr, size_t alignment)
+/* These allocations are anonymous mappings, so that their pages are only
+ * populated once written to, and are returned to the system when freed or
+ * shrunk. The mapping starts with its length; the data follows at the first
+ * aligned offset after that. */
+static size_t mapping_data_offset(size_t alignment)
 {
-	return (uint8_t *)ptr + ((alignment - (uintptr_t)ptr) % alignment);
+	return alignment * ((sizeof(size_t) + alignment - 1) / alignment);
 }
 void *zeroed_aligned_alloc(size_t bytes, size_t alignment, void **handle)
 {
@@ -113,58 +180,64 @@ void *zeroed_aligned_alloc(size_t bytes, size_t alignment, void **handle)
 		/* require a clean handle */
 		return NULL;
 	}
-	*handle = calloc(bytes + alignment - 1, 1);
-	return align_ptr(*handle, alignment);
+	size_t offset = mapping_data_offset(alignment);
+	size_t len = offset + bytes;
+	void *base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+	memcpy(base, &len, sizeof(size_t));
+	*handle = base;
+	return (uint8_t *)base + offset;
 }
 void *zeroed_aligned_realloc(size_t old_size_bytes, size_t new_size_bytes,
 		size_t alignment, void *data, void **handle)
 {
-	/* warning: this might copy a lot of data */
-	if (new_size_bytes <= 2 * old_size_bytes) {
-		void *old_handle = *handle;
-		ptrdiff_t old_offset = (uint8_t *)data - (uint8_t *)old_handle;
-
-		void *new_handle = realloc(
-				old_handle, new_size_bytes + alignment - 1);
-		if (!new_handle) {
-			return NULL;
-		}
-		void *new_data = align_ptr(new_handle, alignment);
-		ptrdiff_t new_offset =
-				(uint8_t *)new_data - (uint8_t *)new_handle;
-		if (old_offset != new_offset) {
-			/* realloc broke alignment offset */
-			memmove((uint8_t *)new_data + new_offset,
-					(uint8_t *)new_data + old_offset,
-					new_size_bytes > old_size_bytes
-							? old_size_bytes
-							: new_size_bytes);
-		}
-		if (new_size_bytes > old_size_bytes) {
-			memset((uint8_t *)new_data + old_size_bytes, 0,
-					new_size_bytes - old_size_bytes);
-		}
-		*handle = new_handle;
-		return new_data;
-	} else {
-		void *new_handle = calloc(new_size_bytes + alignment - 1, 1);
-		if (!new_handle) {
-			return NULL;
+	(void)data;
+	size_t offset = mapping_data_offset(alignment);
+	size_t old_len, new_len = offset + new_size_bytes;
+	memcpy(&old_len, *handle, sizeof(size_t));
+	if (new_size_bytes < old_size_bytes) {
+		/* The rest of the last page is kept, and must read as zero if
+		 * the allocation grows again */
+		size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		size_t end = page * ((new_len + page - 1) / page);
+		if (end > old_len) {
+			end = old_len;
 		}
-		void *new_data = align_ptr(new_handle, alignment);
-		memcpy(new_data, data,
-				new_size_bytes > old_size_bytes
-						? old_size_bytes
-						: new_size_bytes);
-		free(*handle);
-		*handle = new_handle;
-		return new_data;
+		memset((uint8_t *)*handle + new_len, 0, end - new_len);
+	}
+#ifdef HAS_MREMAP
+	/* Moves the pages instead of copying them; new pages are zero */
+	void *base = mremap(*handle, old_len, new_len, MREMAP_MAYMOVE);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+#else
+	void *base = mmap(NULL, new_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		return NULL;
 	}
+	memcpy((uint8_t *)base + offset, (uint8_t *)*handle + offset,
+			new_size_bytes > old_size_bytes ? old_size_bytes
+							: new_size_bytes);
+	munmap(*handle, old_len);
+#endif
+	memcpy(base, &new_len, sizeof(size_t));
+	*handle = base;
+	return (uint8_t *)base + offset;
 }
 void zeroed_aligned_free(void *data, void **handle)
 {
 	(void)data;
-	free(*handle);
+	if (!*handle) {
+		return;
+	}
+	size_t len;
+	memcpy(&len, *handle, sizeof(size_t));
+	munmap(*handle, len);
 	*handle = NULL;
 }
 
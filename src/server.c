@@ -46,6 +46,9 @@ static inline uint32_t conntoken_header(const struct main_config *config,
 	uint32_t header = (WAYPIPE_PROTOCOL_VERSION << 16) | CONN_FIXED_BIT;
 	header |= (update ? CONN_UPDATE_BIT : 0);
 	header |= (reconnectable ? CONN_RECONNECTABLE_BIT : 0);
+	header |= CONN_RESYNC_BIT;
+	header |= CONN_BLOBS_BIT;
+	header |= CONN_LOCAL_BIT;
 	// TODO: stop compile gating the 'COMP' enum entries
 #ifdef HAS_LZ4
 	header |= (config->compression == COMP_LZ4 ? CONN_LZ4_COMPRESSION : 0);
@@ -263,13 +266,28 @@ fail_srv:
 	return EXIT_FAILURE;
 }
 
+static int connect_to_channel(int cwd_fd, struct socket_path sockaddr,
+		const struct main_config *config, int *chanfd)
+{
+	if (!config->vsock) {
+		return connect_to_socket(cwd_fd, sockaddr, NULL, chanfd);
+	}
+#ifdef HAS_VSOCK
+	return connect_to_vsock(config->vsock_port, config->vsock_cid,
+			config->vsock_to_host, chanfd);
+#else
+	return -1;
+#endif
+}
+
 static int handle_new_server_connection(int cwd_fd,
 		struct socket_path current_sockaddr, int control_pipe,
-		int wdisplay_socket, int appfd, struct conn_map *connmap,
-		const struct main_config *config,
-		const struct connection_token *new_token)
+		int wdisplay_socket, int mux_link, int appfd,
+		struct conn_map *connmap, const struct main_config *config,
+		const struct connection_token *new_token,
+		struct connection_threads *conn_threads)
 {
-	bool reconnectable = control_pipe != -1;
+	bool reconnectable = control_pipe != -1 && mux_link == -1;
 	if (reconnectable && buf_ensure_size(connmap->count + 1,
 					     sizeof(struct conn_addr),
 					     &connmap->size,
@@ -279,18 +297,26 @@ static int handle_new_server_connection(int cwd_fd,
 	}
 
 	int chanfd = -1;
-	if (!config->vsock) {
-		if (connect_to_socket(cwd_fd, current_sockaddr, NULL,
-				    &chanfd) == -1) {
+	if (mux_link != -1) {
+		/* The connection is relayed over the multiplexed channel */
+		int streamsocks[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, streamsocks) == -1) {
+			wp_error("Socketpair for multiplexed stream failed: %s",
+					strerror(errno));
 			goto fail_appfd;
 		}
-	} else {
-#ifdef HAS_VSOCK
-		if (connect_to_vsock(config->vsock_port, config->vsock_cid,
-				    config->vsock_to_host, &chanfd) == -1) {
+		if (send_one_fd(mux_link, streamsocks[1]) == -1) {
+			wp_error("Failed to send stream to multiplexing process: %s",
+					strerror(errno));
+			checked_close(streamsocks[0]);
+			checked_close(streamsocks[1]);
 			goto fail_appfd;
 		}
-#endif
+		checked_close(streamsocks[1]);
+		chanfd = streamsocks[0];
+	} else if (connect_to_channel(cwd_fd, current_sockaddr, config,
+				   &chanfd) == -1) {
+		goto fail_appfd;
 	}
 	if (write(chanfd, new_token, sizeof(*new_token)) !=
 			sizeof(*new_token)) {
@@ -308,11 +334,34 @@ static int handle_new_server_connection(int cwd_fd,
 		}
 	}
 
+	if (conn_threads) {
+		if (start_connection_thread(conn_threads, chanfd, appfd,
+				    linksocks[1], config, false) == -1) {
+			if (reconnectable) {
+				checked_close(linksocks[0]);
+				checked_close(linksocks[1]);
+			}
+			goto fail_chanfd;
+		}
+		if (reconnectable) {
+			/* The thread has ended once its link hangs up */
+			connmap->data[connmap->count++] = (struct conn_addr){
+					.token = *new_token,
+					.pid = 0,
+					.linkfd = linksocks[0],
+			};
+		}
+		return 0;
+	}
+
 	pid_t npid = fork();
 	if (npid == 0) {
 		// Run forked process, with the only shared state being the
 		// new channel socket
 		checked_close(wdisplay_socket);
+		if (mux_link != -1) {
+			checked_close(mux_link);
+		}
 		if (reconnectable) {
 			checked_close(control_pipe);
 			checked_close(linksocks[0]);
@@ -356,6 +405,58 @@ fail_appfd:
 	return -1;
 }
 
+/** Connect the one channel connection which will carry all application
+ * connections, and fork a process to relay between it and the per-application
+ * sockets. Returns the socket to send new application sockets over, or -1 on
+ * failure. */
+static int start_channel_mux(int cwd_fd, struct socket_path sockaddr,
+		int control_pipe, int wdisplay_socket,
+		const struct main_config *config)
+{
+	int chanfd = -1;
+	if (connect_to_channel(cwd_fd, sockaddr, config, &chanfd) == -1) {
+		return -1;
+	}
+	struct connection_token token;
+	memset(&token, 0, sizeof(token));
+	token.header = conntoken_header(config, false, false) | CONN_MUX_BIT;
+	fill_random_key(&token);
+	if (write(chanfd, &token, sizeof(token)) != sizeof(token)) {
+		wp_error("Failed to write connection token: %s",
+				strerror(errno));
+		checked_close(chanfd);
+		return -1;
+	}
+
+	int linksocks[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, linksocks) == -1) {
+		wp_error("Socketpair for multiplexing process link failed: %s",
+				strerror(errno));
+		checked_close(chanfd);
+		return -1;
+	}
+	pid_t npid = fork();
+	if (npid == 0) {
+		checked_close(wdisplay_socket);
+		if (control_pipe != -1) {
+			checked_close(control_pipe);
+		}
+		checked_close(linksocks[0]);
+		int rc = run_channel_mux(chanfd, linksocks[1], false);
+		check_unclosed_fds();
+		exit(rc);
+	} else if (npid == -1) {
+		wp_error("Fork failure: %s", strerror(errno));
+		checked_close(linksocks[0]);
+		checked_close(linksocks[1]);
+		checked_close(chanfd);
+		return -1;
+	}
+	checked_close(chanfd);
+	checked_close(linksocks[1]);
+	return linksocks[0];
+}
+
 static int update_connections(int cwd_fd, struct socket_path new_sock,
 		int new_sock_folder, struct conn_map *connmap)
 {
@@ -405,16 +506,55 @@ static int run_multi_server(int cwd_fd, int control_pipe,
 	// TODO: grab the folder, on startup; then connectat within the folder
 	// we do not need to remember the folder name, thankfully
 
-	struct pollfd pfs[2];
+	/* The cache is created before any connection process is forked, so
+	 * that all of them share it */
+	struct main_config conn_config = *config;
+	if (config->cache_registry) {
+		conn_config.registry_cache = create_registry_cache();
+	}
+	conn_config.blob_cache = create_blob_cache();
+	config = &conn_config;
+
+	/* Application connections relayed over a multiplexed channel can not
+	 * be moved to a new channel individually */
+	int mux_link = -1;
+	if (config->multiplex) {
+		mux_link = start_channel_mux(cwd_fd, current_sockaddr,
+				control_pipe, wdisplay_socket, config);
+		if (mux_link == -1) {
+			retcode = EXIT_FAILURE;
+			shutdown_flag = true;
+		}
+	}
+
+	struct connection_threads conn_threads;
+	bool threaded = false;
+	if (config->single_process && !shutdown_flag) {
+		if (setup_connection_threads(&conn_threads, config) == -1) {
+			retcode = EXIT_FAILURE;
+			shutdown_flag = true;
+		} else {
+			threaded = true;
+		}
+	}
+
+	struct pollfd pfs[4];
 	pfs[0].fd = wdisplay_socket;
 	pfs[0].events = POLLIN;
 	pfs[0].revents = 0;
 	pfs[1].fd = control_pipe;
 	pfs[1].events = POLLIN;
 	pfs[1].revents = 0;
+	pfs[2].fd = mux_link;
+	pfs[2].events = 0;
+	pfs[2].revents = 0;
+	pfs[3].fd = threaded ? conn_threads.wake_r : -1;
+	pfs[3].events = POLLIN;
+	pfs[3].revents = 0;
 	struct connection_token token;
 	memset(&token, 0, sizeof(token));
-	token.header = conntoken_header(config, control_pipe != -1, false);
+	token.header = conntoken_header(config,
+			control_pipe != -1 && mux_link == -1, false);
 	wp_debug("Connection token header: %08" PRIx32, token.header);
 
 	int current_folder_fd = open_folder(current_sockaddr.folder);
@@ -434,7 +574,8 @@ static int run_multi_server(int cwd_fd, int control_pipe,
 			break;
 		}
 
-		int r = poll(pfs, 1 + (control_pipe != -1), -1);
+		/* poll ignores the entries whose fd is -1 */
+		int r = poll(pfs, 4, -1);
 		if (r == -1) {
 			if (errno == EINTR) {
 				// If SIGCHLD, we will check the child.
@@ -447,6 +588,16 @@ static int run_multi_server(int cwd_fd, int control_pipe,
 		} else if (r == 0) {
 			continue;
 		}
+		if (pfs[2].revents & (POLLHUP | POLLERR)) {
+			wp_error("Multiplexed channel has closed, exiting");
+			retcode = EXIT_FAILURE;
+			break;
+		}
+		if (pfs[3].revents & POLLIN) {
+			char tmp[64];
+			(void)read(conn_threads.wake_r, tmp, sizeof(tmp));
+			clean_ended_threads(&connmap);
+		}
 		if (pfs[1].revents & POLLIN) {
 			struct sockaddr_un new_sockaddr_filename = {0};
 			char new_sockaddr_folder[sizeof(
@@ -529,9 +680,11 @@ static int run_multi_server(int cwd_fd, int control_pipe,
 				if (handle_new_server_connection(cwd_fd,
 						    current_sockaddr,
 						    control_pipe,
-						    wdisplay_socket, appfd,
-						    &connmap, config,
-						    &token) == -1) {
+						    wdisplay_socket, mux_link,
+						    appfd, &connmap, config,
+						    &token,
+						    threaded ? &conn_threads
+							     : NULL) == -1) {
 					retcode = EXIT_FAILURE;
 					break;
 				}
@@ -548,10 +701,23 @@ static int run_multi_server(int cwd_fd, int control_pipe,
 		checked_close(control_pipe);
 	}
 	checked_close(current_folder_fd);
+	if (mux_link != -1) {
+		checked_close(mux_link);
+	}
 	for (int i = 0; i < connmap.count; i++) {
 		checked_close(connmap.data[i].linkfd);
 	}
 	free(connmap.data);
+	if (threaded) {
+		/* Unlike forked processes, the threads end with this one */
+		cleanup_connection_threads(&conn_threads);
+	}
+	if (conn_config.registry_cache) {
+		destroy_registry_cache(conn_config.registry_cache);
+	}
+	if (conn_config.blob_cache) {
+		destroy_blob_cache(conn_config.blob_cache);
+	}
 	return retcode;
 }
 
@@ -29,12 +29,14 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <poll.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef HAS_LZ4
@@ -45,13 +47,169 @@
 #include <zstd.h>
 #endif
 
+/* Get the shadow_fd containing a link of one of the secondary lists */
+#define SFD_FROM_LINK(lnk, field)                                              \
+	((struct shadow_fd *)((char *)(lnk)-offsetof(struct shadow_fd, field)))
+
+static void list_insert(struct shadow_fd_link *head, struct shadow_fd_link *lnk)
+{
+	lnk->l_prev = head;
+	lnk->l_next = head->l_next;
+	lnk->l_prev->l_next = lnk;
+	lnk->l_next->l_prev = lnk;
+}
+static void list_remove(struct shadow_fd_link *lnk)
+{
+	if (!lnk->l_next) {
+		return;
+	}
+	lnk->l_prev->l_next = lnk->l_next;
+	lnk->l_next->l_prev = lnk->l_prev;
+	lnk->l_next = NULL;
+	lnk->l_prev = NULL;
+}
+
+/* Chains longer than this trigger a doubling of the hash tables */
+#define MAX_HASH_CHAIN 4
+#define MAX_HASH_TABLE_SIZE (1 << 20)
+
+static struct shadow_fd_hlink *get_hlink(struct shadow_fd *sfd, bool by_fd)
+{
+	return by_fd ? &sfd->lfd_hlink : &sfd->rid_hlink;
+}
+static uint32_t hash_key(int key, int table_size)
+{
+	uint32_t x = (uint32_t)key;
+	x ^= x >> 16;
+	x *= 0x45d9f3bu;
+	x ^= x >> 16;
+	return x & (uint32_t)(table_size - 1);
+}
+/* Returns the length of the chain that the entry was added to */
+static int hash_insert(struct shadow_fd **table, int table_size, int key,
+		struct shadow_fd *sfd, bool by_fd)
+{
+	struct shadow_fd **bucket = &table[hash_key(key, table_size)];
+	struct shadow_fd_hlink *h = get_hlink(sfd, by_fd);
+	h->h_next = *bucket;
+	h->h_pprev = bucket;
+	if (*bucket) {
+		get_hlink(*bucket, by_fd)->h_pprev = &h->h_next;
+	}
+	*bucket = sfd;
+
+	int len = 1;
+	for (struct shadow_fd *cur = h->h_next; cur;
+			cur = get_hlink(cur, by_fd)->h_next) {
+		len++;
+	}
+	return len;
+}
+static void hash_remove(struct shadow_fd *sfd, bool by_fd)
+{
+	struct shadow_fd_hlink *h = get_hlink(sfd, by_fd);
+	if (!h->h_pprev) {
+		return;
+	}
+	*h->h_pprev = h->h_next;
+	if (h->h_next) {
+		get_hlink(h->h_next, by_fd)->h_pprev = h->h_pprev;
+	}
+	h->h_next = NULL;
+	h->h_pprev = NULL;
+}
+static void resize_shadow_tables(struct fd_translation_map *map, int new_size)
+{
+	struct shadow_fd **rid_table =
+			calloc((size_t)new_size, sizeof(struct shadow_fd *));
+	struct shadow_fd **lfd_table =
+			calloc((size_t)new_size, sizeof(struct shadow_fd *));
+	if (!rid_table || !lfd_table) {
+		/* Lookups still work with the old tables, only slower */
+		wp_error("Failed to resize shadow structure hash tables");
+		free(rid_table);
+		free(lfd_table);
+		return;
+	}
+	free(map->rid_table);
+	free(map->lfd_table);
+	map->rid_table = rid_table;
+	map->lfd_table = lfd_table;
+	map->table_size = new_size;
+	for (struct shadow_fd_link *lcur = map->link.l_next;
+			lcur != &map->link; lcur = lcur->l_next) {
+		struct shadow_fd *cur = (struct shadow_fd *)lcur;
+		(void)hash_insert(rid_table, new_size, cur->remote_id, cur,
+				false);
+		if (cur->fd_local != -1) {
+			(void)hash_insert(lfd_table, new_size, cur->fd_local,
+					cur, true);
+		} else {
+			cur->lfd_hlink.h_next = NULL;
+			cur->lfd_hlink.h_pprev = NULL;
+		}
+	}
+}
+/* Update the local fd index after sfd->fd_local has been changed */
+static void index_local_fd(struct fd_translation_map *map, struct shadow_fd *sfd)
+{
+	hash_remove(sfd, true);
+	if (sfd->fd_local == -1 || map->table_size == 0) {
+		return;
+	}
+	int len = hash_insert(map->lfd_table, map->table_size, sfd->fd_local,
+			sfd, true);
+	if (len > MAX_HASH_CHAIN && map->table_size < MAX_HASH_TABLE_SIZE) {
+		resize_shadow_tables(map, 2 * map->table_size);
+	}
+}
+/* Add a new shadow structure to the map, and index it */
+static void link_shadow(struct fd_translation_map *map, struct shadow_fd *sfd)
+{
+	list_insert(&map->link, &sfd->link);
+	if (map->table_size == 0) {
+		resize_shadow_tables(map, 64);
+	} else {
+		int len = hash_insert(map->rid_table, map->table_size,
+				sfd->remote_id, sfd, false);
+		if (len > MAX_HASH_CHAIN &&
+				map->table_size < MAX_HASH_TABLE_SIZE) {
+			resize_shadow_tables(map, 2 * map->table_size);
+		}
+	}
+	index_local_fd(map, sfd);
+	if (sfd->type == FDC_PIPE) {
+		list_insert(&map->pipes, &sfd->pipe_link);
+	}
+}
+/* Remove a shadow structure from all lists and indices of its map */
+static void unlink_shadow(struct shadow_fd *sfd)
+{
+	list_remove(&sfd->link);
+	list_remove(&sfd->dirty_link);
+	list_remove(&sfd->pipe_link);
+	list_remove(&sfd->pending_link);
+	hash_remove(sfd, false);
+	hash_remove(sfd, true);
+}
+
 struct shadow_fd *get_shadow_for_local_fd(
 		struct fd_translation_map *map, int lfd)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
+	if (map->table_size == 0) {
+		/* Hash table allocation failed */
+		for (struct shadow_fd_link *lcur = map->link.l_next;
+				lcur != &map->link; lcur = lcur->l_next) {
+			struct shadow_fd *cur = (struct shadow_fd *)lcur;
+			if (cur->fd_local == lfd) {
+				return cur;
+			}
+		}
+		return NULL;
+	}
+	for (struct shadow_fd *cur =
+				map->lfd_table[hash_key(lfd, map->table_size)];
+			cur; cur = cur->lfd_hlink.h_next) {
 		if (cur->fd_local == lfd) {
 			return cur;
 		}
@@ -60,16 +218,108 @@ struct shadow_fd *get_shadow_for_local_fd(
 }
 struct shadow_fd *get_shadow_for_rid(struct fd_translation_map *map, int rid)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
+	if (map->table_size == 0) {
+		/* Hash table allocation failed */
+		for (struct shadow_fd_link *lcur = map->link.l_next;
+				lcur != &map->link; lcur = lcur->l_next) {
+			struct shadow_fd *cur = (struct shadow_fd *)lcur;
+			if (cur->remote_id == rid) {
+				return cur;
+			}
+		}
+		return NULL;
+	}
+	for (struct shadow_fd *cur =
+				map->rid_table[hash_key(rid, map->table_size)];
+			cur; cur = cur->rid_hlink.h_next) {
 		if (cur->remote_id == rid) {
 			return cur;
 		}
 	}
 	return NULL;
 }
+void mark_shadow_dirty(struct fd_translation_map *map, struct shadow_fd *sfd)
+{
+	sfd->is_dirty = true;
+	sfd->dirty_unverified = false;
+	/* Pipes are always checked for updates */
+	if (sfd->type != FDC_PIPE && !sfd->dirty_link.l_next) {
+		list_insert(&map->dirty, &sfd->dirty_link);
+	}
+}
+void mark_shadow_maybe_dirty(
+		struct fd_translation_map *map, struct shadow_fd *sfd)
+{
+	if (sfd->is_dirty) {
+		return;
+	}
+	mark_shadow_dirty(map, sfd);
+	damage_everything(&sfd->damage);
+	sfd->dirty_unverified = true;
+}
+/* Bytes allocated for the mirrors of all connections in this process */
+static pthread_mutex_t mirror_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t mirror_mem_bytes = 0;
+
+static size_t update_mirror_mem(size_t added, size_t removed)
+{
+	pthread_mutex_lock(&mirror_mem_lock);
+	mirror_mem_bytes = mirror_mem_bytes + added - removed;
+	size_t total = mirror_mem_bytes;
+	pthread_mutex_unlock(&mirror_mem_lock);
+	return total;
+}
+static uint64_t monotonic_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+static void touch_mirror(struct shadow_fd *sfd)
+{
+	sfd->mirror_used_ms = monotonic_ms();
+}
+static void free_mirror(struct shadow_fd *sfd)
+{
+	if (sfd->mem_mirror_handle) {
+		zeroed_aligned_free(sfd->mem_mirror, &sfd->mem_mirror_handle);
+	}
+	if (sfd->dmabuf_warped_handle) {
+		zeroed_aligned_free(
+				sfd->dmabuf_warped, &sfd->dmabuf_warped_handle);
+	}
+	sfd->mem_mirror = NULL;
+	sfd->dmabuf_warped = NULL;
+	(void)update_mirror_mem(0, sfd->mirror_size);
+	sfd->mirror_size = 0;
+}
+/* Allocate a zeroed mirror for a file or DMABUF, and for a DMABUF also the
+ * buffer used to fix its stride. Returns -1 on failure. */
+static int alloc_mirror(struct shadow_fd *sfd, int alignment_bits)
+{
+	size_t alignment = 1u << alignment_bits;
+	size_t size = alignz(sfd->buffer_size, alignment);
+	sfd->mem_mirror = zeroed_aligned_alloc(
+			size, alignment, &sfd->mem_mirror_handle);
+	sfd->mirror_size = size;
+	if (sfd->type == FDC_DMABUF) {
+		sfd->dmabuf_warped = zeroed_aligned_alloc(
+				size, alignment, &sfd->dmabuf_warped_handle);
+		sfd->mirror_size += size;
+	}
+	if (!sfd->mem_mirror ||
+			(sfd->type == FDC_DMABUF && !sfd->dmabuf_warped)) {
+		sfd->mirror_size = 0;
+		free_mirror(sfd);
+		wp_error("Failed to allocate mirror for RID=%d",
+				sfd->remote_id);
+		return -1;
+	}
+	(void)update_mirror_mem(sfd->mirror_size, 0);
+	touch_mirror(sfd);
+	return 0;
+}
+
 static void destroy_unlinked_sfd(struct shadow_fd *sfd)
 {
 	wp_debug("Destroying %s RID=%d", fdcat_to_str(sfd->type),
@@ -79,22 +329,22 @@ static void destroy_unlinked_sfd(struct shadow_fd *sfd)
 
 	/* free all accumulated damage records */
 	reset_damage(&sfd->damage);
+	reset_damage(&sfd->diffed_damage);
+	reset_damage(&sfd->resend_damage);
 	free(sfd->damage_task_interval_store);
+	free(sfd->tile_hashes);
+	free(sfd->evicted_hashes);
 
 	if (sfd->type == FDC_FILE) {
 		munmap(sfd->mem_local, sfd->buffer_size);
-		zeroed_aligned_free(sfd->mem_mirror, &sfd->mem_mirror_handle);
+		free_mirror(sfd);
 	} else if (sfd->type == FDC_DMABUF || sfd->type == FDC_DMAVID_IR ||
 			sfd->type == FDC_DMAVID_IW) {
 		if (sfd->dmabuf_map_handle) {
 			unmap_dmabuf(sfd->dmabuf_bo, sfd->dmabuf_map_handle);
 		}
 		destroy_dmabuf(sfd->dmabuf_bo);
-		zeroed_aligned_free(sfd->mem_mirror, &sfd->mem_mirror_handle);
-		if (sfd->dmabuf_warped_handle) {
-			zeroed_aligned_free(sfd->dmabuf_warped,
-					&sfd->dmabuf_warped_handle);
-		}
+		free_mirror(sfd);
 	} else if (sfd->type == FDC_PIPE) {
 		if (sfd->pipe.fd != sfd->fd_local && sfd->pipe.fd != -1) {
 			checked_close(sfd->pipe.fd);
@@ -160,6 +410,40 @@ void cleanup_translation_map(struct fd_translation_map *map)
 	}
 	map->link.l_next = &map->link;
 	map->link.l_prev = &map->link;
+	map->dirty.l_next = &map->dirty;
+	map->dirty.l_prev = &map->dirty;
+	map->pipes.l_next = &map->pipes;
+	map->pipes.l_prev = &map->pipes;
+	map->pending.l_next = &map->pending;
+	map->pending.l_prev = &map->pending;
+	free(map->rid_table);
+	free(map->lfd_table);
+	map->rid_table = NULL;
+	map->lfd_table = NULL;
+	map->table_size = 0;
+	free(map->remote_blobs);
+	map->remote_blobs = NULL;
+	map->nremote_blobs = 0;
+	map->remote_blobs_size = 0;
+	for (int i = map->passed_fds.zone_start; i < map->passed_fds.zone_end;
+			i++) {
+		checked_close(map->passed_fds.data[i]);
+	}
+	free(map->passed_fds.data);
+	memset(&map->passed_fds, 0, sizeof(map->passed_fds));
+}
+int take_passed_fd(struct fd_translation_map *map)
+{
+	struct int_window *fds = &map->passed_fds;
+	if (fds->zone_start == fds->zone_end) {
+		return -1;
+	}
+	int fd = fds->data[fds->zone_start++];
+	if (fds->zone_start == fds->zone_end) {
+		fds->zone_start = 0;
+		fds->zone_end = 0;
+	}
+	return fd;
 }
 bool destroy_shadow_if_unreferenced(struct shadow_fd *sfd)
 {
@@ -172,10 +456,7 @@ bool destroy_shadow_if_unreferenced(struct shadow_fd *sfd)
 	if (sfd->refcount.protocol == 0 && sfd->refcount.transfer == 0 &&
 			sfd->refcount.compute == false && autodelete) {
 		/* remove shadowfd from list */
-		sfd->link.l_prev->l_next = sfd->link.l_next;
-		sfd->link.l_next->l_prev = sfd->link.l_prev;
-		sfd->link.l_next = NULL;
-		sfd->link.l_prev = NULL;
+		unlink_shadow(sfd);
 
 		destroy_unlinked_sfd(sfd);
 		return true;
@@ -188,12 +469,28 @@ bool destroy_shadow_if_unreferenced(struct shadow_fd *sfd)
 }
 
 static void *worker_thread_main(void *arg);
+static void *group_worker_main(void *arg);
 void setup_translation_map(struct fd_translation_map *map, bool display_side)
 {
 	map->local_sign = display_side ? -1 : 1;
 	map->link.l_next = &map->link;
 	map->link.l_prev = &map->link;
+	map->dirty.l_next = &map->dirty;
+	map->dirty.l_prev = &map->dirty;
+	map->pipes.l_next = &map->pipes;
+	map->pipes.l_prev = &map->pipes;
+	map->pending.l_next = &map->pending;
+	map->pending.l_prev = &map->pending;
+	map->rid_table = NULL;
+	map->lfd_table = NULL;
+	map->table_size = 0;
 	map->max_local_id = 1;
+	map->blob_cache = NULL;
+	map->remote_blobs = NULL;
+	map->nremote_blobs = 0;
+	map->remote_blobs_size = 0;
+	map->local_fds = false;
+	memset(&map->passed_fds, 0, sizeof(map->passed_fds));
 }
 
 static void shutdown_threads(struct thread_pool *pool)
@@ -284,6 +581,7 @@ int setup_thread_pool(struct thread_pool *pool,
 	for (int i = 0; i < pool->nthreads; i++) {
 		setup_thread_local(&pool->threads[i], compression, comp_level);
 	}
+	setup_thread_local(&pool->recv_thread, compression, comp_level);
 
 	int fds[2];
 	if (pipe(fds) == -1) {
@@ -297,14 +595,90 @@ int setup_thread_pool(struct thread_pool *pool,
 	}
 	return 0;
 }
+int setup_shared_thread_pool(
+		struct thread_pool *pool, struct worker_group *group)
+{
+	pthread_mutex_lock(&group->lock);
+	int ret = buf_ensure_size(group->nattached + 1,
+			sizeof(struct thread_pool *), &group->attached_size,
+			(void **)&group->attached);
+	pthread_mutex_unlock(&group->lock);
+	if (ret == -1) {
+		wp_error("Failed to allocate space to track thread pool");
+		return -1;
+	}
+	if (setup_thread_pool(pool, group->compression,
+			    group->compression_level, 1) == -1) {
+		return -1;
+	}
+	pool->group = group;
+
+	pthread_mutex_lock(&group->lock);
+	group->attached[group->nattached++] = pool;
+	pthread_mutex_unlock(&group->lock);
+	return 0;
+}
+
+void wake_shared_thread_pools(struct worker_group *group)
+{
+	pthread_mutex_lock(&group->lock);
+	for (int i = 0; i < group->nattached; i++) {
+		uint8_t triv = 0;
+		if (write(group->attached[i]->selfpipe_w, &triv, 1) == -1) {
+			wp_error("Failed to write to self-pipe");
+		}
+	}
+	pthread_mutex_unlock(&group->lock);
+}
+
+static void remove_group_pool(struct worker_group *group, int index)
+{
+	group->pools[index] = group->pools[group->npools - 1];
+	group->npools--;
+}
+
+/** Stop handing out tasks from the pool, and wait until the tasks that
+ * workers of the group have already taken are complete */
+static void detach_from_group(struct thread_pool *pool)
+{
+	struct worker_group *group = pool->group;
+	pthread_mutex_lock(&group->lock);
+	for (int i = 0; i < group->npools; i++) {
+		if (group->pools[i] == pool) {
+			remove_group_pool(group, i);
+			break;
+		}
+	}
+	for (int i = 0; i < group->nattached; i++) {
+		if (group->attached[i] == pool) {
+			group->attached[i] =
+					group->attached[group->nattached - 1];
+			group->nattached--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&group->lock);
+
+	pthread_mutex_lock(&pool->work_mutex);
+	while (pool->tasks_in_progress > 0) {
+		pthread_cond_wait(&pool->work_cond, &pool->work_mutex);
+	}
+	pthread_mutex_unlock(&pool->work_mutex);
+}
+
 void cleanup_thread_pool(struct thread_pool *pool)
 {
-	shutdown_threads(pool);
+	if (pool->group) {
+		detach_from_group(pool);
+	} else {
+		shutdown_threads(pool);
+	}
 	if (pool->threads) {
 		for (int i = 0; i < pool->nthreads; i++) {
 			cleanup_thread_local(&pool->threads[i]);
 		}
 	}
+	cleanup_thread_local(&pool->recv_thread);
 
 	pthread_mutex_destroy(&pool->work_mutex);
 	pthread_cond_destroy(&pool->work_cond);
@@ -315,6 +689,70 @@ void cleanup_thread_pool(struct thread_pool *pool)
 	checked_close(pool->selfpipe_w);
 }
 
+int setup_worker_group(struct worker_group *group,
+		enum compression_mode compression, int comp_level,
+		int n_threads)
+{
+	memset(group, 0, sizeof(struct worker_group));
+	group->compression = compression;
+	group->compression_level = comp_level;
+	if (n_threads <= 0) {
+		n_threads = max(get_hardware_thread_count() / 2, 1);
+	}
+
+	int ret = pthread_mutex_init(&group->lock, NULL);
+	if (ret) {
+		wp_error("Mutex creation failed: %s", strerror(ret));
+		return -1;
+	}
+	ret = pthread_cond_init(&group->cond, NULL);
+	if (ret) {
+		wp_error("Condition variable creation failed: %s",
+				strerror(ret));
+		pthread_mutex_destroy(&group->lock);
+		return -1;
+	}
+	group->workers = calloc((size_t)max(n_threads - 1, 1),
+			sizeof(struct thread_data));
+	if (!group->workers) {
+		wp_error("Failed to allocate list of thread data");
+		pthread_cond_destroy(&group->cond);
+		pthread_mutex_destroy(&group->lock);
+		return -1;
+	}
+	for (int i = 0; i < n_threads - 1; i++) {
+		struct thread_data *data = &group->workers[i];
+		setup_thread_local(data, compression, comp_level);
+		data->group = group;
+		ret = pthread_create(&data->thread, NULL, group_worker_main,
+				data);
+		if (ret) {
+			wp_error("Thread creation failed: %s", strerror(ret));
+			cleanup_thread_local(data);
+			break;
+		}
+		group->nworkers++;
+	}
+	return 0;
+}
+
+void cleanup_worker_group(struct worker_group *group)
+{
+	pthread_mutex_lock(&group->lock);
+	group->stop = true;
+	pthread_cond_broadcast(&group->cond);
+	pthread_mutex_unlock(&group->lock);
+	for (int i = 0; i < group->nworkers; i++) {
+		pthread_join(group->workers[i].thread, NULL);
+		cleanup_thread_local(&group->workers[i]);
+	}
+	free(group->workers);
+	free(group->pools);
+	free(group->attached);
+	pthread_cond_destroy(&group->cond);
+	pthread_mutex_destroy(&group->lock);
+}
+
 const char *fdcat_to_str(enum fdcat cat)
 {
 	switch (cat) {
@@ -532,6 +970,35 @@ static void uncompress_buffer(struct thread_pool *pool, struct comp_ctx *ctx,
 	DTRACE_PROBE1(waypipe, uncompress_buffer_exit, *wsize);
 }
 
+/* Map the file `sfd->fd_local` of size `sfd->buffer_size` to `mem_local` */
+static int map_local_file(struct shadow_fd *sfd)
+{
+	sfd->file_readonly = false;
+	// both r/w permissions, because the side which allocates the
+	// memory does not always have to be the side that modifies it
+	sfd->mem_local = mmap(NULL, sfd->buffer_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, sfd->fd_local, 0);
+	if (sfd->mem_local == MAP_FAILED &&
+			(errno == EPERM || errno == EACCES)) {
+		wp_debug("Initial mmap for RID=%d failed, trying private+readonly",
+				sfd->remote_id);
+		// Some files are memfds that are sealed
+		// to be read-only
+		sfd->mem_local = mmap(NULL, sfd->buffer_size, PROT_READ,
+				MAP_PRIVATE, sfd->fd_local, 0);
+		if (sfd->mem_local != MAP_FAILED) {
+			sfd->file_readonly = true;
+		}
+	}
+
+	if (sfd->mem_local == MAP_FAILED) {
+		wp_error("Mmap failed when creating shadow RID=%d: %s",
+				sfd->remote_id, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
 struct shadow_fd *translate_fd(struct fd_translation_map *map,
 		struct render_data *render, struct thread_pool *threads, int fd,
 		enum fdcat type, size_t file_sz,
@@ -554,10 +1021,6 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
 		wp_error("Failed to allocate shadow_fd structure");
 		return NULL;
 	}
-	sfd->link.l_prev = &map->link;
-	sfd->link.l_next = map->link.l_next;
-	sfd->link.l_prev->l_next = &sfd->link;
-	sfd->link.l_next->l_prev = &sfd->link;
 
 	sfd->fd_local = fd;
 	sfd->mem_local = NULL;
@@ -566,8 +1029,9 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
 	sfd->buffer_size = 0;
 	sfd->remote_id = (map->max_local_id++) * map->local_sign;
 	sfd->type = type;
+	link_shadow(map, sfd);
 	// File changes must be propagated
-	sfd->is_dirty = true;
+	mark_shadow_dirty(map, sfd);
 	/* files/dmabufs are damaged by default; shm_pools are explicitly
 	 * undamaged in handlers.c */
 	damage_everything(&sfd->damage);
@@ -580,9 +1044,12 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
 	sfd->refcount.compute = false;
 
 	sfd->only_here = true;
+	sfd->passthrough = map->local_fds &&
+			   (type == FDC_FILE || type == FDC_DMABUF);
 
-	wp_debug("Creating new %s shadow RID=%d for local fd %d",
-			fdcat_to_str(sfd->type), sfd->remote_id, fd);
+	wp_debug("Creating new %s shadow RID=%d for local fd %d%s",
+			fdcat_to_str(sfd->type), sfd->remote_id, fd,
+			sfd->passthrough ? ", to pass on directly" : "");
 	switch (sfd->type) {
 	case FDC_FILE: {
 		if (file_sz >= UINT32_MAX / 2) {
@@ -591,27 +1058,7 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
 			return sfd;
 		}
 		sfd->buffer_size = file_sz;
-		sfd->file_readonly = false;
-		// both r/w permissions, because the side which allocates the
-		// memory does not always have to be the side that modifies it
-		sfd->mem_local = mmap(NULL, sfd->buffer_size,
-				PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-		if (sfd->mem_local == MAP_FAILED &&
-				(errno == EPERM || errno == EACCES)) {
-			wp_debug("Initial mmap for RID=%d failed, trying private+readonly",
-					sfd->remote_id);
-			// Some files are memfds that are sealed
-			// to be read-only
-			sfd->mem_local = mmap(NULL, sfd->buffer_size, PROT_READ,
-					MAP_PRIVATE, fd, 0);
-			if (sfd->mem_local != MAP_FAILED) {
-				sfd->file_readonly = true;
-			}
-		}
-
-		if (sfd->mem_local == MAP_FAILED) {
-			wp_error("Mmap failed when creating shadow RID=%d: %s",
-					sfd->remote_id, strerror(errno));
+		if (map_local_file(sfd) == -1) {
 			return sfd;
 		}
 		// This will be created at the first transfer.
@@ -681,6 +1128,12 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
 	} break;
 	case FDC_DMABUF: {
 		sfd->buffer_size = 0;
+		if (sfd->passthrough) {
+			/* The DMABUF is not accessed here */
+			off_t end = lseek(fd, 0, SEEK_END);
+			sfd->buffer_size = end == -1 ? 0 : (size_t)end;
+			break;
+		}
 
 		init_render_data(render);
 		memcpy(&sfd->dmabuf_info, info,
@@ -711,6 +1164,124 @@ static void *shrink_buffer(void *buf, size_t sz)
 	}
 }
 
+/* Blocks this large are hashed to check buffers that may have changed */
+#define TILE_HASH_SIZE 65536
+
+/* A fast non-cryptographic hash, used to detect changes. The four
+ * quarters of the data are read in parallel, since a single sequential
+ * stream can not use all of the memory bandwidth. */
+static uint64_t hash_bytes(const char *data, size_t len, uint64_t seed)
+{
+	const uint64_t k = 0x9e3779b97f4a7c15uLL;
+	uint64_t a = seed ^ k, b = seed + k, c = seed - k, d = ~seed;
+	size_t part = (len / 4) & ~(size_t)7;
+	const char *q0 = data, *q1 = data + part, *q2 = data + 2 * part,
+		   *q3 = data + 3 * part;
+	for (size_t i = 0; i < part; i += 8) {
+		uint64_t w0, w1, w2, w3;
+		memcpy(&w0, q0 + i, sizeof(w0));
+		memcpy(&w1, q1 + i, sizeof(w1));
+		memcpy(&w2, q2 + i, sizeof(w2));
+		memcpy(&w3, q3 + i, sizeof(w3));
+		a = (a ^ w0) * k;
+		b = (b ^ w1) * k;
+		c = (c ^ w2) * k;
+		d = (d ^ w3) * k;
+	}
+	for (size_t i = 4 * part; i < len; i += 8) {
+		uint64_t w = 0;
+		memcpy(&w, data + i, (size_t)minu(8, len - i));
+		a = (a ^ w) * k;
+	}
+	uint64_t h = a ^ (b << 17 | b >> 47) ^ (c << 31 | c >> 33) ^
+		     (d << 47 | d >> 17) ^ (uint64_t)len;
+	h = (h ^ (h >> 32)) * k;
+	return h ^ (h >> 29);
+}
+
+/* Hash the bytes [start, end) of a mapped file or DMABUF, in the layout
+ * that is sent over the wire, skipping any stride padding of the mapping */
+static uint64_t hash_tile(
+		const struct shadow_fd *sfd, size_t start, size_t end)
+{
+	size_t tx_stride = (size_t)sfd->dmabuf_info.strides[0];
+	size_t map_stride = (size_t)sfd->dmabuf_map_stride;
+	if (tx_stride == map_stride || tx_stride == 0) {
+		return hash_bytes(sfd->mem_local + start, end - start, 0);
+	}
+	size_t common = (size_t)minu(map_stride, tx_stride);
+	uint64_t h = 0;
+	for (size_t pos = start; pos < end;) {
+		size_t row = pos / tx_stride;
+		size_t col = pos % tx_stride;
+		size_t row_end = (size_t)minu((row + 1) * tx_stride, end);
+		size_t col_end = (size_t)minu(col + (row_end - pos), common);
+		if (col < col_end) {
+			h = hash_bytes(sfd->mem_local + row * map_stride + col,
+					col_end - col, h);
+		}
+		pos = row_end;
+	}
+	return h;
+}
+
+/* Drop all block hashes, after the mirror or the buffer size changed */
+static void drop_tile_hashes(struct shadow_fd *sfd)
+{
+	free(sfd->tile_hashes);
+	sfd->tile_hashes = NULL;
+}
+
+/* Mark the hashes of the blocks overlapping [start, end) as unknown, since
+ * the mirror for that region will be updated without checking them */
+static void forget_tile_hashes(struct shadow_fd *sfd, int start, int end)
+{
+	if (!sfd->tile_hashes || start >= end) {
+		return;
+	}
+	int ntiles = ceildiv((int)sfd->buffer_size, TILE_HASH_SIZE);
+	int stop = min(ceildiv(end, TILE_HASH_SIZE), ntiles);
+	for (int t = start / TILE_HASH_SIZE; t < stop; t++) {
+		sfd->tile_hashes[t] = 0;
+	}
+}
+
+/* Replace the task's damage with the tiles in [band_start, band_end) whose
+ * hashes changed, and update the stored hashes. Each task owns its tiles,
+ * so no locking is needed. Returns false if nothing changed. */
+static bool filter_changed_tiles(struct task_data *task, int alignment_bits)
+{
+	struct shadow_fd *sfd = task->sfd;
+	int bs = 1 << alignment_bits;
+	int align_end = bs * ((int)sfd->buffer_size / bs);
+	int n = 0;
+	for (int t = task->band_start; t < task->band_end; t++) {
+		size_t start = (size_t)t * TILE_HASH_SIZE;
+		size_t end = (size_t)minu(
+				start + TILE_HASH_SIZE, sfd->buffer_size);
+		uint64_t h = hash_tile(sfd, start, end);
+		if (h != 0 && h == sfd->tile_hashes[t]) {
+			continue;
+		}
+		sfd->tile_hashes[t] = h;
+		if ((int)end > align_end) {
+			task->damaged_end = true;
+		}
+		struct interval e = {.start = (int)start,
+				.end = min((int)end, align_end)};
+		if (e.start >= e.end) {
+			continue;
+		}
+		if (n > 0 && task->damage_intervals[n - 1].end == e.start) {
+			task->damage_intervals[n - 1].end = e.end;
+		} else {
+			task->damage_intervals[n++] = e;
+		}
+	}
+	task->damage_len = n;
+	return n > 0 || task->damaged_end;
+}
+
 /* Construct and optionally compress a diff between sfd->mem_mirror and
  * the actual memmap'd data, and synchronize sfd->mem_mirror */
 static void worker_run_compress_diff(
@@ -720,6 +1291,12 @@ static void worker_run_compress_diff(
 	struct thread_pool *pool = local->pool;
 	size_t diffsize = (size_t)-1;
 
+	if (task->band_end > task->band_start) {
+		if (!filter_changed_tiles(task, pool->diff_alignment_bits)) {
+			goto end;
+		}
+	}
+
 	size_t damage_space = 0;
 	for (int i = 0; i < task->damage_len; i++) {
 		int range = task->damage_intervals[i].end -
@@ -987,23 +1564,204 @@ static void queue_fill_transfers(struct thread_pool *threads,
 	pthread_mutex_unlock(&threads->work_mutex);
 }
 
-static void queue_diff_transfers(struct thread_pool *threads,
-		struct shadow_fd *sfd, struct transfer_queue *transfers)
+/* Remove the sorted, disjoint intervals in `cut` from the damage */
+static void subtract_damage(struct damage *base, int size,
+		const struct interval *cut, int ncut)
 {
-	const int chunksize = 262144;
-	if (!sfd->damage.damage) {
+	if (!base->damage || ncut == 0) {
+		return;
+	}
+	struct interval all = {.start = 0, .end = size};
+	const struct interval *src = &all;
+	int nsrc = 1;
+	if (base->damage != DAMAGE_EVERYTHING) {
+		src = base->damage;
+		nsrc = base->ndamage_intvs;
+	}
+	/* Each cut splits at most one interval in two */
+	struct interval *out = malloc(
+			sizeof(struct interval) * (size_t)(nsrc + ncut + 1));
+	if (!out) {
+		wp_error("Failed to allocate damage list, diffing resent regions too");
+		return;
+	}
+	int n = 0;
+	for (int i = 0, j = 0; i < nsrc; i++) {
+		int cur = src[i].start;
+		while (j < ncut && cut[j].end <= cur) {
+			j++;
+		}
+		for (int k = j; k < ncut && cut[k].start < src[i].end; k++) {
+			if (cut[k].start > cur) {
+				out[n++] = (struct interval){.start = cur,
+						.end = cut[k].start};
+			}
+			cur = max(cur, cut[k].end);
+		}
+		if (cur < src[i].end) {
+			out[n++] = (struct interval){
+					.start = cur, .end = src[i].end};
+		}
+	}
+	out[n] = (struct interval){.start = INT32_MAX, .end = INT32_MAX};
+	reset_damage(base);
+	if (n == 0) {
+		free(out);
 		return;
 	}
+	base->damage = out;
+	base->ndamage_intvs = n;
+}
 
-	/* Keep sfd alive at least until write to channel is done */
-	sfd->refcount.compute = true;
+/* Queue fills for the regions recorded by resend_regions, and remove them
+ * from the damage, so that the diff tasks do not touch the same part of the
+ * mirror. The fills do not compare against the mirror, which may not match
+ * the remote copy in these regions. If `whole_tiles`, the regions are
+ * widened to the blocks checked by queue_verified_diff_transfers. */
+static void queue_resend_transfers(struct thread_pool *threads,
+		struct shadow_fd *sfd, struct transfer_queue *transfers,
+		bool whole_tiles)
+{
+	const int chunksize = 262144;
+	struct damage *resend = &sfd->resend_damage;
+	if (!resend->damage) {
+		return;
+	}
+	int size = (int)sfd->buffer_size;
+	int bs = whole_tiles ? TILE_HASH_SIZE
+			     : 1 << threads->diff_alignment_bits;
+	struct interval all = {.start = 0, .end = size};
+	const struct interval *src = &all;
+	int nsrc = 1;
+	if (resend->damage != DAMAGE_EVERYTHING) {
+		src = resend->damage;
+		nsrc = resend->ndamage_intvs;
+	}
+	struct interval *regions =
+			malloc(sizeof(struct interval) * (size_t)nsrc);
+	if (!regions) {
+		wp_error("Failed to allocate resend regions, resending everything");
+		regions = &all;
+		src = &all;
+		nsrc = 1;
+	}
+	int nregions = 0, nshards = 0;
+	for (int i = 0; i < nsrc; i++) {
+		int start = bs * (src[i].start / bs);
+		int end = min(bs * ceildiv(src[i].end, bs), size);
+		if (nregions > 0 && regions[nregions - 1].end >= start) {
+			start = regions[--nregions].start;
+			end = max(end, regions[nregions].end);
+		}
+		if (start < end) {
+			regions[nregions++] = (struct interval){
+					.start = start, .end = end};
+		}
+	}
+	for (int i = 0; i < nregions; i++) {
+		nshards += ceildiv(
+				regions[i].end - regions[i].start, chunksize);
+	}
+	subtract_damage(&sfd->damage, size, regions, nregions);
+	if (nshards > 0) {
+		/* Keep sfd alive at least until write to channel is done */
+		sfd->refcount.compute = true;
+	}
 
-	int bs = 1 << threads->diff_alignment_bits;
-	int align_end = bs * ((int)sfd->buffer_size / bs);
-	bool check_tail = false;
+	pthread_mutex_lock(&threads->work_mutex);
+	if (buf_ensure_size(threads->stack_count + nshards,
+			    sizeof(struct task_data), &threads->stack_size,
+			    (void **)&threads->stack) == -1) {
+		wp_error("Allocation failed, will resend regions of RID=%d later",
+				sfd->remote_id);
+		pthread_mutex_unlock(&threads->work_mutex);
+		if (regions != &all) {
+			free(regions);
+		}
+		return;
+	}
+	for (int i = 0; i < nregions; i++) {
+		int n = ceildiv(regions[i].end - regions[i].start, chunksize);
+		for (int k = 0; k < n; k++) {
+			struct task_data task;
+			memset(&task, 0, sizeof(task));
+			task.type = TASK_COMPRESS_BLOCK;
+			task.sfd = sfd;
+			task.msg_queue = &transfers->async_recv_queue;
+			task.zone_start = split_interval(regions[i].start,
+					regions[i].end, n, k);
+			task.zone_end = split_interval(regions[i].start,
+					regions[i].end, n, k + 1);
+			threads->stack[threads->stack_count++] = task;
+		}
+	}
+	pthread_mutex_unlock(&threads->work_mutex);
+	if (regions != &all) {
+		free(regions);
+	}
+	reset_damage(resend);
+}
+
+/* Is block `i` of the queue a diff for the given buffer that has never
+ * been written to the channel? */
+static bool is_unsent_diff(const struct transfer_queue *transfers, int i,
+		int32_t remote_id)
+{
+	if (transfers->meta[i].static_alloc ||
+			!msgno_gt(transfers->meta[i].msgno,
+					transfers->sent_msgno) ||
+			transfers->vecs[i].iov_len <
+					sizeof(struct wmsg_buffer_diff)) {
+		return false;
+	}
+	const struct wmsg_buffer_diff *header =
+			(const struct wmsg_buffer_diff *)transfers->vecs[i]
+					.iov_base;
+	return transfer_type(header->size_and_type) == WMSG_BUFFER_DIFF &&
+	       header->remote_id == remote_id;
+}
+
+/* Record the regions (a malloc'd list, owned afterwards by the shadow) that
+ * the diff now being queued will cover. If older diffs of the buffer are
+ * still unsent, the record must cover them too, so give up on precision */
+static void set_diffed_damage(struct shadow_fd *sfd,
+		const struct transfer_queue *transfers, struct interval *list,
+		int n)
+{
+	reset_damage(&sfd->diffed_damage);
+	for (int i = transfers->start; i < transfers->end; i++) {
+		if (is_unsent_diff(transfers, i, sfd->remote_id)) {
+			free(list);
+			damage_everything(&sfd->diffed_damage);
+			return;
+		}
+	}
+	if (!list || n == 0) {
+		free(list);
+		return;
+	}
+	sfd->diffed_damage.damage = list;
+	sfd->diffed_damage.ndamage_intvs = n;
+}
+
+static void queue_diff_transfers(struct thread_pool *threads,
+		struct shadow_fd *sfd, struct transfer_queue *transfers)
+{
+	const int chunksize = 262144;
+	if (!sfd->damage.damage) {
+		return;
+	}
+
+	/* Keep sfd alive at least until write to channel is done */
+	sfd->refcount.compute = true;
+
+	int bs = 1 << threads->diff_alignment_bits;
+	int align_end = bs * ((int)sfd->buffer_size / bs);
+	bool check_tail = false;
 
 	int net_damage = 0;
 	if (sfd->damage.damage == DAMAGE_EVERYTHING) {
+		drop_tile_hashes(sfd);
 		reset_damage(&sfd->damage);
 		struct ext_interval all = {.start = 0,
 				.width = align_end,
@@ -1017,6 +1775,7 @@ static void queue_diff_transfers(struct thread_pool *threads,
 		for (int ir = 0, iw = 0; ir < sfd->damage.ndamage_intvs; ir++) {
 			/* Extend all damage to the nearest alignment block */
 			struct interval e = sfd->damage.damage[ir];
+			forget_tile_hashes(sfd, e.start, e.end);
 			check_tail |= e.end > align_end;
 			e.end = min(e.end, align_end);
 			if (e.start < e.end) {
@@ -1082,6 +1841,17 @@ static void queue_diff_transfers(struct thread_pool *threads,
 	/* Reset damage, once it has been applied */
 	reset_damage(&sfd->damage);
 
+	struct interval *diffed = malloc(sizeof(struct interval) *
+					 (size_t)(iw + (check_tail ? 1 : 0)));
+	if (diffed) {
+		memcpy(diffed, intvs, sizeof(struct interval) * (size_t)iw);
+		if (check_tail) {
+			diffed[iw++] = (struct interval){.start = align_end,
+					.end = (int)sfd->buffer_size};
+		}
+	}
+	set_diffed_damage(sfd, transfers, diffed, iw);
+
 	pthread_mutex_lock(&threads->work_mutex);
 	if (buf_ensure_size(threads->stack_count + nshards,
 			    sizeof(struct task_data), &threads->stack_size,
@@ -1110,6 +1880,105 @@ static void queue_diff_transfers(struct thread_pool *threads,
 	free(offsets);
 }
 
+/* Like queue_diff_transfers, but instead of trusting the recorded damage,
+ * have the worker threads only diff those damaged blocks whose hashes
+ * changed since the last call. */
+static void queue_verified_diff_transfers(struct thread_pool *threads,
+		struct shadow_fd *sfd, struct transfer_queue *transfers)
+{
+	const int tiles_per_task = 4;
+	if (!sfd->damage.damage) {
+		return;
+	}
+	int ntiles = ceildiv((int)sfd->buffer_size, TILE_HASH_SIZE);
+	if (!sfd->tile_hashes) {
+		sfd->tile_hashes = calloc((size_t)ntiles, sizeof(uint64_t));
+	}
+	struct interval *intvs =
+			malloc(sizeof(struct interval) * (size_t)ntiles);
+	/* The damaged tiles, as a list of disjoint increasing ranges */
+	int nbands = 0;
+	struct interval *bands = NULL;
+	if (sfd->damage.damage == DAMAGE_EVERYTHING) {
+		bands = malloc(sizeof(struct interval));
+		if (bands) {
+			bands[0] = (struct interval){.start = 0, .end = ntiles};
+			nbands = 1;
+		}
+	} else {
+		bands = malloc(sizeof(struct interval) *
+				(size_t)max(sfd->damage.ndamage_intvs, 1));
+		for (int i = 0; bands && i < sfd->damage.ndamage_intvs; i++) {
+			struct interval e = sfd->damage.damage[i];
+			int lo = e.start / TILE_HASH_SIZE;
+			int hi = min(ceildiv(e.end, TILE_HASH_SIZE), ntiles);
+			if (nbands > 0 && bands[nbands - 1].end >= lo) {
+				bands[nbands - 1].end =
+						max(bands[nbands - 1].end, hi);
+			} else if (lo < hi) {
+				bands[nbands++] = (struct interval){
+						.start = lo, .end = hi};
+			}
+		}
+	}
+	if (!sfd->tile_hashes || !intvs || !bands) {
+		wp_error("Failed to allocate tile hash buffers, diffing entire buffer");
+		free(intvs);
+		free(bands);
+		damage_everything(&sfd->damage);
+		queue_diff_transfers(threads, sfd, transfers);
+		return;
+	}
+	reset_damage(&sfd->damage);
+
+	struct interval *diffed =
+			malloc(sizeof(struct interval) * (size_t)nbands);
+	for (int i = 0; diffed && i < nbands; i++) {
+		diffed[i] = (struct interval){
+				.start = bands[i].start * TILE_HASH_SIZE,
+				.end = min(bands[i].end * TILE_HASH_SIZE,
+						(int)sfd->buffer_size)};
+	}
+	set_diffed_damage(sfd, transfers, diffed, nbands);
+
+	/* Keep sfd alive at least until write to channel is done */
+	sfd->refcount.compute = true;
+	sfd->damage_task_interval_store = intvs;
+
+	int ntasks = 0;
+	for (int i = 0; i < nbands; i++) {
+		ntasks += ceildiv(bands[i].end - bands[i].start,
+				tiles_per_task);
+	}
+	pthread_mutex_lock(&threads->work_mutex);
+	if (buf_ensure_size(threads->stack_count + ntasks,
+			    sizeof(struct task_data), &threads->stack_size,
+			    (void **)&threads->stack) == -1) {
+		wp_error("Allocation failed, dropping some diff tasks");
+		pthread_mutex_unlock(&threads->work_mutex);
+		free(bands);
+		return;
+	}
+	for (int i = 0; i < nbands; i++) {
+		for (int t = bands[i].start; t < bands[i].end;
+				t += tiles_per_task) {
+			struct task_data task;
+			memset(&task, 0, sizeof(task));
+			task.type = TASK_COMPRESS_DIFF;
+			task.sfd = sfd;
+			task.msg_queue = &transfers->async_recv_queue;
+			task.band_start = t;
+			task.band_end = min(bands[i].end, t + tiles_per_task);
+			task.damage_intervals = &intvs[task.band_start];
+			task.damage_len = 0;
+
+			threads->stack[threads->stack_count++] = task;
+		}
+	}
+	pthread_mutex_unlock(&threads->work_mutex);
+	free(bands);
+}
+
 static void add_dmabuf_create_request(struct transfer_queue *transfers,
 		struct shadow_fd *sfd, enum wmsg_type variant)
 {
@@ -1162,30 +2031,727 @@ static void add_file_create_request(
 	header->size_and_type = transfer_header(
 			sizeof(struct wmsg_open_file), WMSG_OPEN_FILE);
 
-	transfer_add(transfers, sizeof(struct wmsg_open_file), header);
+	transfer_add(transfers, sizeof(struct wmsg_open_file), header);
+}
+static void add_blob_create_request(
+		struct transfer_queue *transfers, struct shadow_fd *sfd)
+{
+	struct wmsg_open_blob *header =
+			calloc(1, sizeof(struct wmsg_open_blob));
+	header->remote_id = sfd->remote_id;
+	header->key = sfd->blob_key;
+	header->size_and_type = transfer_header(
+			sizeof(struct wmsg_open_blob), WMSG_OPEN_BLOB);
+
+	transfer_add(transfers, sizeof(struct wmsg_open_blob), header);
+	wp_debug("Sending only the key of RID=%d, %zu bytes, which the other side has cached",
+			sfd->remote_id, sfd->buffer_size);
+}
+
+static void add_local_create_request(
+		struct transfer_queue *transfers, struct shadow_fd *sfd)
+{
+	int fd = dup(sfd->fd_local);
+	if (fd == -1) {
+		wp_error("Failed to duplicate fd for RID=%d: %s",
+				sfd->remote_id, strerror(errno));
+		return;
+	}
+	struct wmsg_open_local *header =
+			calloc(1, sizeof(struct wmsg_open_local));
+	header->remote_id = sfd->remote_id;
+	header->fd_type = (uint32_t)sfd->type;
+	header->file_size = (uint32_t)sfd->buffer_size;
+	header->size_and_type = transfer_header(
+			sizeof(struct wmsg_open_local), WMSG_OPEN_LOCAL);
+
+	transfer_add_fd(transfers, sizeof(struct wmsg_open_local), header, fd);
+}
+
+void finish_update(struct shadow_fd *sfd)
+{
+	if (!sfd->refcount.compute) {
+		return;
+	}
+	if (sfd->type == FDC_DMABUF && sfd->dmabuf_map_handle) {
+		// if this fails, unmap_dmabuf will print error
+		(void)unmap_dmabuf(sfd->dmabuf_bo, sfd->dmabuf_map_handle);
+		sfd->dmabuf_map_handle = NULL;
+		sfd->mem_local = NULL;
+	}
+	if (sfd->damage_task_interval_store) {
+		free(sfd->damage_task_interval_store);
+		sfd->damage_task_interval_store = NULL;
+	}
+	sfd->refcount.compute = false;
+}
+
+void finish_pending_updates(struct fd_translation_map *map)
+{
+	for (struct shadow_fd_link *lcur = map->pending.l_next,
+				   *lnxt = lcur->l_next;
+			lcur != &map->pending; lcur = lnxt, lnxt = lcur->l_next) {
+		/* Note: finish_update() may delete `cur` */
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, pending_link);
+		list_remove(&cur->pending_link);
+		finish_update(cur);
+		destroy_shadow_if_unreferenced(cur);
+	}
+}
+
+static void collect_listed_update(struct fd_translation_map *map,
+		struct thread_pool *threads, struct shadow_fd *sfd,
+		struct transfer_queue *transfers, bool use_old_dmavid_req)
+{
+	collect_update(threads, sfd, transfers, use_old_dmavid_req);
+	if (sfd->refcount.compute && !sfd->pending_link.l_next) {
+		list_insert(&map->pending, &sfd->pending_link);
+	}
+	/* collecting updates can reset `pipe.remote_can_X` state, so
+	 * garbage collect the sfd immediately after */
+	destroy_shadow_if_unreferenced(sfd);
+}
+/* Make the next update of the buffer send the given regions in full, even
+ * where the mirror claims the remote copy is already up to date */
+static void resend_regions(struct thread_pool *threads, struct shadow_fd *sfd,
+		const struct interval *regions, int nregions)
+{
+	struct ext_interval *ext = malloc(
+			sizeof(struct ext_interval) * (size_t)max(nregions, 1));
+	int next = 0;
+	for (int i = 0; i < nregions; i++) {
+		struct interval e = regions[i];
+		e.end = min(e.end, (int)sfd->buffer_size);
+		if (e.start >= e.end) {
+			continue;
+		}
+		forget_tile_hashes(sfd, e.start, e.end);
+		if (ext) {
+			ext[next++] = (struct ext_interval){.start = e.start,
+					.width = e.end - e.start,
+					.rep = 1,
+					.stride = 0};
+		}
+	}
+	if (ext) {
+		merge_damage_records(&sfd->resend_damage, next, ext,
+				threads->diff_alignment_bits);
+	} else {
+		damage_everything(&sfd->resend_damage);
+	}
+	free(ext);
+}
+/* Mirrors used less than this long ago are never dropped */
+#define MIRROR_MIN_IDLE_MS 2000
+/* How often to check whether mirrors must be dropped */
+#define MIRROR_SCAN_INTERVAL_MS 500
+
+/* Rebuild a mirror dropped by evict_cold_mirrors from the local copy. The
+ * blocks whose hashes differ from those recorded when it was dropped may no
+ * longer match the remote copy, so they will be sent again in full. Returns
+ * -1 on failure. */
+static int restore_mirror(struct thread_pool *threads, struct shadow_fd *sfd)
+{
+	if (sfd->mem_mirror || !sfd->evicted_hashes) {
+		return 0;
+	}
+	char *mem_local = sfd->mem_local;
+	uint32_t map_stride = sfd->dmabuf_map_stride;
+	void *handle = NULL;
+	if (sfd->type == FDC_DMABUF && !mem_local && sfd->dmabuf_bo) {
+		mem_local = map_dmabuf(
+				sfd->dmabuf_bo, false, &handle, &map_stride);
+	}
+	if (!mem_local) {
+		wp_error("Failed to restore mirror of RID=%d, not mapped",
+				sfd->remote_id);
+		return -1;
+	}
+	if (alloc_mirror(sfd, threads->diff_alignment_bits) == -1) {
+		if (handle) {
+			(void)unmap_dmabuf(sfd->dmabuf_bo, handle);
+		}
+		return -1;
+	}
+	/* Past the old size, the remote copy was extended with zeros */
+	size_t size = sfd->evicted_size;
+	uint32_t tx_stride = sfd->dmabuf_info.strides[0];
+	bool shift = sfd->type == FDC_DMABUF && map_stride != tx_stride;
+	size_t common = (size_t)minu(map_stride, tx_stride);
+
+	/* The new mirror is zero, and the blocks which were zero need not be
+	 * read from the buffer, so that unused parts of it stay unpopulated */
+	size_t first_len = (size_t)minu(TILE_HASH_SIZE, size);
+	uint64_t zero_hash = hash_bytes(sfd->mem_mirror, first_len, 0);
+	int ntiles = ceildiv((int)size, TILE_HASH_SIZE);
+	struct interval *stale = malloc(
+			sizeof(struct interval) * (size_t)max(ntiles, 1));
+	int nstale = 0;
+	size_t stale_bytes = 0;
+	for (int t = 0; t < ntiles; t++) {
+		size_t start = (size_t)t * TILE_HASH_SIZE;
+		size_t end = (size_t)minu(start + TILE_HASH_SIZE, size);
+		char *tile = sfd->mem_mirror + start;
+		uint64_t zh = (end - start == first_len)
+					      ? zero_hash
+					      : hash_bytes(tile, end - start, 0);
+		if (sfd->evicted_hashes[t] == zh) {
+			continue;
+		}
+		if (shift) {
+			size_t loc_start = (start % tx_stride) +
+					   (start / tx_stride) * map_stride;
+			size_t loc_end = (end % tx_stride) +
+					 (end / tx_stride) * map_stride;
+			stride_shifted_copy(sfd->mem_mirror, mem_local,
+					loc_start, loc_end - loc_start, common,
+					map_stride, tx_stride);
+		} else {
+			memcpy(tile, mem_local + start, end - start);
+		}
+		if (stale && hash_bytes(tile, end - start, 0) ==
+					     sfd->evicted_hashes[t]) {
+			continue;
+		}
+		stale_bytes += end - start;
+		if (!stale) {
+			continue;
+		}
+		if (nstale > 0 && stale[nstale - 1].end == (int)start) {
+			stale[nstale - 1].end = (int)end;
+		} else {
+			stale[nstale++] = (struct interval){
+					.start = (int)start, .end = (int)end};
+		}
+	}
+	if (handle) {
+		(void)unmap_dmabuf(sfd->dmabuf_bo, handle);
+	}
+	if (!stale) {
+		struct interval all = {.start = 0, .end = (int)size};
+		resend_regions(threads, sfd, &all, 1);
+	} else if (nstale > 0) {
+		resend_regions(threads, sfd, stale, nstale);
+	}
+	free(stale);
+	free(sfd->evicted_hashes);
+	sfd->evicted_hashes = NULL;
+	wp_debug("Restored mirror of RID=%d, %zu of %zu bytes must be resent",
+			sfd->remote_id, stale_bytes, size);
+	return 0;
+}
+
+static bool can_evict_mirror(const struct shadow_fd *sfd, uint64_t now)
+{
+	if ((sfd->type != FDC_FILE && sfd->type != FDC_DMABUF) ||
+			!sfd->mem_mirror || sfd->only_here ||
+			sfd->passthrough || sfd->is_dirty ||
+			sfd->fill_in_place || sfd->refcount.compute ||
+			now - sfd->mirror_used_ms < MIRROR_MIN_IDLE_MS) {
+		return false;
+	}
+	/* The mirror must be rebuilt from a mapping of the buffer */
+	if (sfd->type == FDC_FILE) {
+		return sfd->mem_local != NULL;
+	}
+	return sfd->dmabuf_bo != NULL;
+}
+static int cmp_mirror_use(const void *a, const void *b)
+{
+	const struct shadow_fd *sa = *(struct shadow_fd *const *)a;
+	const struct shadow_fd *sb = *(struct shadow_fd *const *)b;
+	return (sa->mirror_used_ms > sb->mirror_used_ms) -
+	       (sa->mirror_used_ms < sb->mirror_used_ms);
+}
+/* Replace the mirror of the buffer with hashes of its blocks */
+static void evict_mirror(struct shadow_fd *sfd)
+{
+	int ntiles = ceildiv((int)sfd->buffer_size, TILE_HASH_SIZE);
+	uint64_t *hashes = malloc(sizeof(uint64_t) * (size_t)max(ntiles, 1));
+	if (!hashes) {
+		return;
+	}
+	for (int t = 0; t < ntiles; t++) {
+		size_t start = (size_t)t * TILE_HASH_SIZE;
+		size_t end = (size_t)minu(
+				start + TILE_HASH_SIZE, sfd->buffer_size);
+		hashes[t] = hash_bytes(sfd->mem_mirror + start, end - start, 0);
+	}
+	free_mirror(sfd);
+	/* Any unsent diffs can no longer be superseded */
+	reset_damage(&sfd->diffed_damage);
+	sfd->evicted_hashes = hashes;
+	sfd->evicted_size = sfd->buffer_size;
+}
+void evict_cold_mirrors(struct fd_translation_map *map)
+{
+	if (map->mirror_budget == 0) {
+		return;
+	}
+	uint64_t now = monotonic_ms();
+	if (now - map->mirror_scan_ms < MIRROR_SCAN_INTERVAL_MS) {
+		return;
+	}
+	map->mirror_scan_ms = now;
+	size_t total = update_mirror_mem(0, 0);
+	if (total <= map->mirror_budget) {
+		return;
+	}
+
+	int ncold = 0;
+	for (struct shadow_fd_link *lcur = map->link.l_next;
+			lcur != &map->link; lcur = lcur->l_next) {
+		ncold += can_evict_mirror(SFD_FROM_LINK(lcur, link), now);
+	}
+	if (ncold == 0) {
+		return;
+	}
+	struct shadow_fd **cold =
+			malloc(sizeof(struct shadow_fd *) * (size_t)ncold);
+	if (!cold) {
+		return;
+	}
+	ncold = 0;
+	for (struct shadow_fd_link *lcur = map->link.l_next;
+			lcur != &map->link; lcur = lcur->l_next) {
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, link);
+		if (can_evict_mirror(cur, now)) {
+			cold[ncold++] = cur;
+		}
+	}
+	qsort(cold, (size_t)ncold, sizeof(struct shadow_fd *),
+			cmp_mirror_use);
+	int nevicted = 0;
+	size_t evicted_bytes = 0;
+	for (int i = 0; i < ncold && total > map->mirror_budget; i++) {
+		size_t size = cold[i]->mirror_size;
+		evict_mirror(cold[i]);
+		if (!cold[i]->mem_mirror) {
+			evicted_bytes += size;
+			nevicted++;
+			total = update_mirror_mem(0, 0);
+		}
+	}
+	free(cold);
+	if (nevicted > 0) {
+		wp_debug("Dropped %d idle mirrors (%zu bytes), mirrors now use %zu bytes",
+				nevicted, evicted_bytes, total);
+	}
+}
+
+/* Drop the unsent diffs of a dirty buffer, see supersede_unsent_diffs */
+static int supersede_diffs(struct thread_pool *threads, struct shadow_fd *sfd,
+		struct transfer_queue *transfers)
+{
+	const struct damage *old = &sfd->diffed_damage;
+	size_t old_bytes = 0;
+	if (old->damage == DAMAGE_EVERYTHING) {
+		old_bytes = sfd->buffer_size;
+	} else {
+		for (int i = 0; i < old->ndamage_intvs; i++) {
+			old_bytes += (size_t)(old->damage[i].end -
+					      old->damage[i].start);
+		}
+	}
+	size_t diff_bytes = 0;
+	int ndiffs = 0;
+	for (int i = transfers->start; i < transfers->end; i++) {
+		if (is_unsent_diff(transfers, i, sfd->remote_id)) {
+			const struct wmsg_buffer_diff *header =
+					(const struct wmsg_buffer_diff *)
+							transfers->vecs[i]
+									.iov_base;
+			diff_bytes += header->diff_size + header->ntrailing;
+			ndiffs++;
+		}
+	}
+	/* The replacement sends the old regions whole; when the old diffs
+	 * were much smaller than that, they are cheaper to keep */
+	if (ndiffs == 0 || 2 * diff_bytes < old_bytes) {
+		return 0;
+	}
+
+	int nremoved = 0, k = transfers->start;
+	for (int i = transfers->start; i < transfers->end; i++) {
+		if (is_unsent_diff(transfers, i, sfd->remote_id)) {
+			free(transfers->vecs[i].iov_base);
+			transfers->queued_bytes -= transfers->vecs[i].iov_len;
+			nremoved++;
+			continue;
+		}
+		/* No later message has been seen by the other side, so
+		 * they can all be renumbered */
+		transfers->vecs[k] = transfers->vecs[i];
+		transfers->meta[k] = transfers->meta[i];
+		transfers->meta[k].msgno -= (uint32_t)nremoved;
+		k++;
+	}
+	transfers->end = k;
+	transfers->last_msgno -= (uint32_t)nremoved;
+
+	/* The mirror holds what the dropped diffs would have produced, not
+	 * what the remote copy contains, so the regions they covered must be
+	 * sent in full */
+	if (old->damage == DAMAGE_EVERYTHING) {
+		struct interval all = {.start = 0, .end = (int)sfd->buffer_size};
+		resend_regions(threads, sfd, &all, 1);
+	} else {
+		resend_regions(threads, sfd, old->damage, old->ndamage_intvs);
+	}
+	reset_damage(&sfd->diffed_damage);
+
+	wp_debug("Superseded %d unsent diffs (%zu bytes) for RID=%d", nremoved,
+			diff_bytes, sfd->remote_id);
+	return nremoved;
+}
+int supersede_unsent_diffs(struct fd_translation_map *map,
+		struct thread_pool *threads, struct transfer_queue *transfers)
+{
+	int nremoved = 0;
+	for (struct shadow_fd_link *lcur = map->dirty.l_next;
+			lcur != &map->dirty; lcur = lcur->l_next) {
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, dirty_link);
+		if ((cur->type != FDC_FILE && cur->type != FDC_DMABUF) ||
+				!cur->is_dirty || cur->only_here ||
+				!cur->mem_mirror ||
+				!cur->diffed_damage.damage) {
+			continue;
+		}
+		nremoved += supersede_diffs(threads, cur, transfers);
+	}
+	return nremoved;
+}
+void *make_buffer_hashes(const struct shadow_fd *sfd, size_t *size)
+{
+	size_t ntiles = (size_t)ceildiv(
+			(int)sfd->buffer_size, TILE_HASH_SIZE);
+	*size = sizeof(struct wmsg_buffer_hashes) + ntiles * sizeof(uint64_t);
+	struct wmsg_buffer_hashes *header = calloc(1, *size);
+	if (!header) {
+		wp_error("Failed to allocate hashes for RID=%d",
+				sfd->remote_id);
+		return NULL;
+	}
+	header->size_and_type = transfer_header(*size, WMSG_BUFFER_HASHES);
+	header->remote_id = sfd->remote_id;
+	header->tile_size = TILE_HASH_SIZE;
+	header->buffer_size = (uint32_t)sfd->buffer_size;
+	char *hashes = (char *)(header + 1);
+	for (size_t t = 0; t < ntiles; t++) {
+		size_t start = t * TILE_HASH_SIZE;
+		size_t end = (size_t)minu(
+				start + TILE_HASH_SIZE, sfd->buffer_size);
+		uint64_t h;
+		if (sfd->mem_mirror) {
+			h = hash_bytes(sfd->mem_mirror + start, end - start, 0);
+		} else if (end <= sfd->evicted_size) {
+			/* The mirror was dropped, but its hashes are known */
+			h = sfd->evicted_hashes[t];
+		} else {
+			/* Will not match, so the block will be resent */
+			h = 0;
+		}
+		memcpy(hashes + t * sizeof(uint64_t), &h, sizeof(uint64_t));
+	}
+	return header;
+}
+int check_buffer_hashes(struct fd_translation_map *map,
+		const struct bytebuf *msg, struct bytebuf *reply)
+{
+	reply->data = NULL;
+	reply->size = 0;
+	if (msg->size < sizeof(struct wmsg_buffer_hashes)) {
+		wp_error("%s is too small: %zu bytes",
+				wmsg_type_to_str(WMSG_BUFFER_HASHES),
+				msg->size);
+		return ERR_FATAL;
+	}
+	const struct wmsg_buffer_hashes *header =
+			(const struct wmsg_buffer_hashes *)msg->data;
+	if (header->buffer_size == 0) {
+		return 0;
+	}
+	size_t tile_size = header->tile_size;
+	size_t ntiles = tile_size ? (header->buffer_size + tile_size - 1) /
+						    tile_size
+				  : 0;
+	if (tile_size == 0 || msg->size < sizeof(*header) +
+							  ntiles * sizeof(uint64_t)) {
+		wp_error("%s for RID=%d has %zu bytes, not enough for %zu blocks",
+				wmsg_type_to_str(WMSG_BUFFER_HASHES),
+				header->remote_id, msg->size, ntiles);
+		return ERR_FATAL;
+	}
+	struct shadow_fd *sfd = get_shadow_for_rid(map, header->remote_id);
+	if (!sfd || sfd->type != FDC_FILE || !sfd->mem_local ||
+			sfd->file_readonly) {
+		wp_debug("Not checking hashes for RID=%d, not a writable file",
+				header->remote_id);
+		return 0;
+	}
+
+	size_t size = sizeof(struct wmsg_basic);
+	uint32_t *request = malloc(size + ntiles * 2 * sizeof(uint32_t));
+	if (!request) {
+		wp_error("Failed to allocate resend request");
+		return ERR_NOMEM;
+	}
+	uint32_t *last = NULL;
+	const char *hashes = msg->data + sizeof(*header);
+	for (size_t t = 0; t < ntiles; t++) {
+		size_t start = t * tile_size;
+		size_t end = (size_t)minu(start + tile_size, header->buffer_size);
+		uint64_t h;
+		memcpy(&h, hashes + t * sizeof(uint64_t), sizeof(uint64_t));
+		if (end <= sfd->buffer_size &&
+				hash_bytes(sfd->mem_local + start, end - start,
+						0) == h) {
+			continue;
+		}
+		if (last && last[1] == start) {
+			last[1] = (uint32_t)end;
+		} else {
+			last = (uint32_t *)((char *)request + size);
+			last[0] = (uint32_t)start;
+			last[1] = (uint32_t)end;
+			size += 2 * sizeof(uint32_t);
+		}
+	}
+	if (!last) {
+		free(request);
+		wp_debug("Copy of RID=%d matches its hashes", header->remote_id);
+		return 0;
+	}
+	request[0] = transfer_header(size, WMSG_BUFFER_RESEND);
+	request[1] = (uint32_t)header->remote_id;
+	wp_debug("Requesting %zu regions of RID=%d again",
+			(size - sizeof(struct wmsg_basic)) / 8,
+			header->remote_id);
+	reply->data = (char *)request;
+	reply->size = size;
+	return 0;
+}
+int resend_buffer_regions(struct fd_translation_map *map,
+		struct thread_pool *threads, const struct bytebuf *msg)
+{
+	if (msg->size < sizeof(struct wmsg_basic)) {
+		wp_error("%s is too small: %zu bytes",
+				wmsg_type_to_str(WMSG_BUFFER_RESEND),
+				msg->size);
+		return ERR_FATAL;
+	}
+	const struct wmsg_basic *header = (const struct wmsg_basic *)msg->data;
+	struct shadow_fd *sfd = get_shadow_for_rid(map, header->remote_id);
+	if (!sfd || sfd->type != FDC_FILE || sfd->only_here ||
+			(!sfd->mem_mirror && !sfd->evicted_hashes)) {
+		wp_debug("Not resending RID=%d, no longer a shared file",
+				header->remote_id);
+		return 0;
+	}
+	if (restore_mirror(threads, sfd) == -1) {
+		return ERR_NOMEM;
+	}
+	touch_mirror(sfd);
+	int nregions = (int)((msg->size - sizeof(struct wmsg_basic)) /
+			     (2 * sizeof(uint32_t)));
+	struct interval *regions = malloc(
+			sizeof(struct interval) * (size_t)max(nregions, 1));
+	if (!regions) {
+		wp_error("Failed to allocate resend regions");
+		return ERR_NOMEM;
+	}
+	const char *pairs = msg->data + sizeof(struct wmsg_basic);
+	for (int i = 0; i < nregions; i++) {
+		uint32_t e[2];
+		memcpy(e, pairs + (size_t)i * sizeof(e), sizeof(e));
+		regions[i].start = (int)minu(e[0], sfd->buffer_size);
+		regions[i].end = (int)minu(e[1], sfd->buffer_size);
+	}
+	resend_regions(threads, sfd, regions, nregions);
+	free(regions);
+	mark_shadow_dirty(map, sfd);
+	wp_debug("Resending %d regions of RID=%d", nregions, sfd->remote_id);
+	return 0;
+}
+
+struct blob_cache *create_blob_cache(void)
+{
+	struct blob_cache *cache = create_shared_memory(sizeof(*cache));
+	if (!cache) {
+		wp_error("Failed to map blob cache: %s", strerror(errno));
+		return NULL;
+	}
+	if (init_shared_mutex(&cache->lock) == -1) {
+		wp_error("Failed to create blob cache lock");
+		destroy_shared_memory(cache, sizeof(*cache));
+		return NULL;
+	}
+	return cache;
+}
+void destroy_blob_cache(struct blob_cache *cache)
+{
+	pthread_mutex_destroy(&cache->lock);
+	destroy_shared_memory(cache, sizeof(*cache));
+}
+
+static struct blob_key make_blob_key(const char *data, size_t size)
+{
+	struct blob_key key;
+	key.size = (uint32_t)size;
+	sha256(data, size, key.hash);
+	return key;
+}
+static int cmp_blob_key(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct blob_key));
+}
+/* Returns the index of the entry with the key, or -1 */
+static int find_cached_blob(struct blob_cache *cache, struct blob_key key)
+{
+	(void)lock_shared_mutex(&cache->lock);
+	int n = cache->nentries;
+	pthread_mutex_unlock(&cache->lock);
+	/* Entries before `n` never change, so need no lock */
+	for (int i = 0; i < n; i++) {
+		if (!cmp_blob_key(&cache->entries[i].key, &key)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void *make_blob_list(struct blob_cache *cache, size_t *size)
+{
+	int n = 0;
+	if (cache) {
+		(void)lock_shared_mutex(&cache->lock);
+		n = cache->nentries;
+		pthread_mutex_unlock(&cache->lock);
+	}
+	*size = sizeof(uint32_t) + (size_t)n * sizeof(struct blob_key);
+	uint32_t *msg = malloc(*size);
+	if (!msg) {
+		wp_error("Failed to allocate list of cached files");
+		return NULL;
+	}
+	msg[0] = transfer_header(*size, WMSG_BLOB_HASHES);
+	for (int i = 0; i < n; i++) {
+		memcpy((char *)(msg + 1) + (size_t)i * sizeof(struct blob_key),
+				&cache->entries[i].key,
+				sizeof(struct blob_key));
+	}
+	return msg;
+}
+int add_remote_blobs(struct fd_translation_map *map, const struct bytebuf *msg)
+{
+	int n = (int)((msg->size - sizeof(uint32_t)) /
+		      sizeof(struct blob_key));
+	if (buf_ensure_size(map->nremote_blobs + n, sizeof(struct blob_key),
+			    &map->remote_blobs_size,
+			    (void **)&map->remote_blobs) == -1) {
+		wp_error("Failed to allocate list of files cached remotely");
+		return ERR_NOMEM;
+	}
+	memcpy(map->remote_blobs + map->nremote_blobs,
+			msg->data + sizeof(uint32_t),
+			(size_t)n * sizeof(struct blob_key));
+	map->nremote_blobs += n;
+	qsort(map->remote_blobs, (size_t)map->nremote_blobs,
+			sizeof(struct blob_key), cmp_blob_key);
+	wp_debug("Other side has cached %d files", n);
+	return 0;
+}
+
+static void add_cached_blob(struct blob_cache *cache, struct blob_key key,
+		const char *data)
+{
+	if (find_cached_blob(cache, key) != -1) {
+		return;
+	}
+	if (lock_shared_mutex(&cache->lock)) {
+		/* An incomplete entry was not counted in `nentries`, and its
+		 * space will simply be reused */
+		wp_debug("Blob cache owner died, reusing its space");
+	}
+	size_t offset = cache->data_used;
+	if (cache->nentries < BLOB_CACHE_MAX_ENTRIES &&
+			key.size <= BLOB_CACHE_DATA_SIZE - offset) {
+		memcpy(cache->data + offset, data, key.size);
+		cache->entries[cache->nentries].key = key;
+		cache->entries[cache->nentries].offset = offset;
+		cache->data_used += key.size;
+		cache->nentries++;
+		wp_debug("Cached a file of %u bytes, now %d cached",
+				key.size, cache->nentries);
+	}
+	pthread_mutex_unlock(&cache->lock);
 }
 
-void finish_update(struct shadow_fd *sfd)
+void share_immutable_file(
+		struct fd_translation_map *map, struct shadow_fd *sfd)
 {
-	if (!sfd->refcount.compute) {
+	if (sfd->type != FDC_FILE || sfd->passthrough || !sfd->mem_local ||
+			sfd->buffer_size == 0 ||
+			sfd->buffer_size > BLOB_CACHE_MAX_FILE_SIZE) {
 		return;
 	}
-	if (sfd->type == FDC_DMABUF && sfd->dmabuf_map_handle) {
-		// if this fails, unmap_dmabuf will print error
-		(void)unmap_dmabuf(sfd->dmabuf_bo, sfd->dmabuf_map_handle);
-		sfd->dmabuf_map_handle = NULL;
-		sfd->mem_local = NULL;
+	if (sfd->only_here) {
+		if (map->nremote_blobs == 0) {
+			return;
+		}
+		struct blob_key key =
+				make_blob_key(sfd->mem_local, sfd->buffer_size);
+		if (bsearch(&key, map->remote_blobs,
+				    (size_t)map->nremote_blobs,
+				    sizeof(struct blob_key), cmp_blob_key)) {
+			sfd->send_as_blob = true;
+			sfd->blob_key = key;
+		}
+	} else if (map->blob_cache && sfd->mem_mirror &&
+			sfd->remote_id * map->local_sign < 0) {
+		/* Received from the other side, which will only send its key
+		 * to later connections */
+		struct blob_key key = make_blob_key(
+				sfd->mem_mirror, sfd->buffer_size);
+		add_cached_blob(map->blob_cache, key, sfd->mem_mirror);
 	}
-	if (sfd->damage_task_interval_store) {
-		free(sfd->damage_task_interval_store);
-		sfd->damage_task_interval_store = NULL;
+}
+
+void collect_dirty_updates(struct fd_translation_map *map,
+		struct thread_pool *threads, struct transfer_queue *transfers,
+		bool use_old_dmavid_req)
+{
+	for (struct shadow_fd_link *lcur = map->dirty.l_next,
+				   *lnxt = lcur->l_next;
+			lcur != &map->dirty; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, dirty_link);
+		list_remove(&cur->dirty_link);
+		collect_listed_update(map, threads, cur, transfers,
+				use_old_dmavid_req);
+	}
+	for (struct shadow_fd_link *lcur = map->pipes.l_next,
+				   *lnxt = lcur->l_next;
+			lcur != &map->pipes; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, pipe_link);
+		collect_listed_update(map, threads, cur, transfers,
+				use_old_dmavid_req);
 	}
-	sfd->refcount.compute = false;
 }
 
 void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 		struct transfer_queue *transfers, bool use_old_dmavid_req)
 {
+	if (sfd->passthrough) {
+		/* Both sides share the contents, so only the fd is sent */
+		if (sfd->only_here) {
+			sfd->only_here = false;
+			add_local_create_request(transfers, sfd);
+		}
+		sfd->is_dirty = false;
+		sfd->dirty_unverified = false;
+		reset_damage(&sfd->damage);
+		return;
+	}
 	switch (sfd->type) {
 	case FDC_FILE: {
 		if (!sfd->is_dirty) {
@@ -1198,22 +2764,28 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 		if (sfd->only_here) {
 			// increase space, to avoid overflow when
 			// writing this buffer along with padding
-			size_t alignment = 1u << threads->diff_alignment_bits;
-			sfd->mem_mirror = zeroed_aligned_alloc(
-					alignz(sfd->buffer_size, alignment),
-					alignment, &sfd->mem_mirror_handle);
-			if (!sfd->mem_mirror) {
-				wp_error("Failed to allocate mirror");
+			if (alloc_mirror(sfd, threads->diff_alignment_bits) ==
+					-1) {
 				return;
 			}
 
 			sfd->only_here = false;
 
+			if (sfd->send_as_blob) {
+				add_blob_create_request(transfers, sfd);
+				memcpy(sfd->mem_mirror, sfd->mem_local,
+						sfd->buffer_size);
+				sfd->remote_bufsize = sfd->buffer_size;
+				sfd->dirty_unverified = false;
+				return;
+			}
+
 			sfd->remote_bufsize = 0;
 
 			add_file_create_request(transfers, sfd);
 			sfd->remote_bufsize = sfd->buffer_size;
 			queue_diff_transfers(threads, sfd, transfers);
+			sfd->dirty_unverified = false;
 			return;
 		}
 
@@ -1231,8 +2803,21 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 
 			sfd->remote_bufsize = sfd->buffer_size;
 		}
+		if (restore_mirror(threads, sfd) == -1) {
+			return;
+		}
+		touch_mirror(sfd);
 
-		queue_diff_transfers(threads, sfd, transfers);
+		queue_resend_transfers(threads, sfd, transfers,
+				sfd->dirty_unverified);
+		if (sfd->dirty_unverified) {
+			/* The damage is only a guess, so skip the blocks
+			 * that have not changed since they were last checked */
+			queue_verified_diff_transfers(threads, sfd, transfers);
+		} else {
+			queue_diff_transfers(threads, sfd, transfers);
+		}
+		sfd->dirty_unverified = false;
 	} break;
 	case FDC_DMABUF: {
 		// If buffer is clean, do not check for changes
@@ -1262,26 +2847,27 @@ void collect_update(struct thread_pool *threads, struct shadow_fd *sfd,
 			}
 		}
 		if (first) {
-			size_t alignment = 1u << threads->diff_alignment_bits;
-			sfd->mem_mirror = zeroed_aligned_alloc(
-					alignz(sfd->buffer_size, alignment),
-					alignment, &sfd->mem_mirror_handle);
-			sfd->dmabuf_warped = zeroed_aligned_alloc(
-					alignz(sfd->buffer_size, alignment),
-					alignment, &sfd->dmabuf_warped_handle);
-			if (!sfd->mem_mirror || !sfd->dmabuf_warped) {
-				wp_error("Failed to allocate mirror");
+			if (alloc_mirror(sfd, threads->diff_alignment_bits) ==
+					-1) {
 				return;
 			}
 
 			sfd->remote_bufsize = 0;
 			queue_fill_transfers(threads, sfd, transfers);
 			sfd->remote_bufsize = sfd->buffer_size;
+		} else if (restore_mirror(threads, sfd) == -1) {
+			return;
+		} else if (sfd->dirty_unverified) {
+			/* Only diff the blocks that have actually changed */
+			queue_resend_transfers(threads, sfd, transfers, true);
+			queue_verified_diff_transfers(threads, sfd, transfers);
 		} else {
 			// TODO: detailed damage tracking
 			damage_everything(&sfd->damage);
+			queue_resend_transfers(threads, sfd, transfers, false);
 			queue_diff_transfers(threads, sfd, transfers);
 		}
+		sfd->dirty_unverified = false;
 		/* Unmapping will be handled by finish_update() */
 	} break;
 	case FDC_DMAVID_IR: {
@@ -1399,6 +2985,7 @@ static void increase_buffer_sizes(struct shadow_fd *sfd,
 {
 	size_t old_size = sfd->buffer_size;
 	munmap(sfd->mem_local, old_size);
+	drop_tile_hashes(sfd);
 	sfd->buffer_size = new_size;
 	sfd->mem_local = mmap(NULL, sfd->buffer_size, PROT_READ | PROT_WRITE,
 			MAP_SHARED, sfd->fd_local, 0);
@@ -1420,6 +3007,9 @@ static void increase_buffer_sizes(struct shadow_fd *sfd,
 			return;
 		}
 		sfd->mem_mirror = new_mirror;
+		size_t new_alloc = alignz(sfd->buffer_size, alignment);
+		(void)update_mirror_mem(new_alloc, sfd->mirror_size);
+		sfd->mirror_size = new_alloc;
 	}
 }
 
@@ -1433,6 +3023,7 @@ static void pipe_close_write(struct shadow_fd *sfd)
 	} else {
 		checked_close(sfd->pipe.fd);
 		if (sfd->fd_local == sfd->pipe.fd) {
+			hash_remove(sfd, true);
 			sfd->fd_local = -1;
 		}
 		sfd->pipe.fd = -1;
@@ -1453,6 +3044,7 @@ static void pipe_close_read(struct shadow_fd *sfd)
 	} else {
 		checked_close(sfd->pipe.fd);
 		if (sfd->fd_local == sfd->pipe.fd) {
+			hash_remove(sfd, true);
 			sfd->fd_local = -1;
 		}
 		sfd->pipe.fd = -1;
@@ -1476,13 +3068,11 @@ static int open_sfd(struct fd_translation_map *map, struct shadow_fd **sfd_ptr,
 				remote_id);
 		return ERR_FATAL;
 	}
-	sfd->link.l_prev = &map->link;
-	sfd->link.l_next = map->link.l_next;
-	sfd->link.l_prev->l_next = &sfd->link;
-	sfd->link.l_next->l_prev = &sfd->link;
-
 	sfd->remote_id = remote_id;
 	sfd->fd_local = -1;
+	/* The type and local fd are set, and the shadow indexed accordingly,
+	 * by apply_decompressed_update */
+	link_shadow(map, sfd);
 	sfd->is_dirty = false;
 	/* a received file descriptor is up to date by default */
 	reset_damage(&sfd->damage);
@@ -1530,9 +3120,201 @@ static int check_sfd_type(struct shadow_fd *sfd, int remote_id,
 	return check_sfd_type_2(sfd, remote_id, mtype, ftype, ftype);
 }
 
+void decompress_update(struct thread_pool *threads, struct thread_data *local,
+		enum wmsg_type type, const struct bytebuf *msg,
+		struct bytebuf *payload)
+{
+	payload->data = NULL;
+	payload->size = 0;
+
+	size_t header_size, uncomp_size;
+	if (type == WMSG_BUFFER_FILL &&
+			msg->size >= sizeof(struct wmsg_buffer_fill)) {
+		const struct wmsg_buffer_fill *header =
+				(const struct wmsg_buffer_fill *)msg->data;
+		header_size = sizeof(struct wmsg_buffer_fill);
+		uncomp_size = header->end - header->start;
+	} else if (type == WMSG_BUFFER_DIFF &&
+			msg->size >= sizeof(struct wmsg_buffer_diff)) {
+		const struct wmsg_buffer_diff *header =
+				(const struct wmsg_buffer_diff *)msg->data;
+		header_size = sizeof(struct wmsg_buffer_diff);
+		uncomp_size = (size_t)header->diff_size + header->ntrailing;
+	} else {
+		return;
+	}
+
+	if (buf_ensure_size((int)uncomp_size, 1, &local->tmp_size,
+			    &local->tmp_buf) == -1) {
+		wp_error("Failed to expand temporary decompression buffer, dropping update");
+		return;
+	}
+
+	const char *act_buffer = NULL;
+	size_t act_size = 0;
+	uncompress_buffer(threads, &local->comp_ctx, msg->size - header_size,
+			msg->data + header_size, uncomp_size, local->tmp_buf,
+			&act_size, &act_buffer);
+	payload->data = (char *)act_buffer;
+	payload->size = act_size;
+}
+
+/* Copy the range [start, end) of the mirror, which was just filled, to the
+ * local file or DMABUF */
+static void copy_fill_to_local(
+		struct shadow_fd *sfd, uint32_t start, uint32_t end)
+{
+	if (sfd->type == FDC_FILE) {
+		memcpy(sfd->mem_local + start, sfd->mem_mirror + start,
+				end - start);
+		return;
+	}
+
+	int bpp = get_shm_bytes_per_pixel(sfd->dmabuf_info.format);
+	void *handle = NULL;
+	uint32_t map_stride = 0;
+	char *mem_local = map_dmabuf(
+			sfd->dmabuf_bo, true, &handle, &map_stride);
+	if (!mem_local) {
+		wp_error("Failed to apply fill to RID=%d, fd not mapped",
+				sfd->remote_id);
+		return;
+	}
+	uint32_t in_stride = sfd->dmabuf_info.strides[0];
+	if (map_stride == in_stride) {
+		memcpy(mem_local + start, sfd->mem_mirror + start, end - start);
+	} else {
+		/* stride changing transfer */
+		uint32_t row_length = (uint32_t)bpp * sfd->dmabuf_info.width;
+
+		uint32_t copy_size = (uint32_t)minu(
+				row_length, minu(map_stride, in_stride));
+
+		stride_shifted_copy(mem_local, sfd->mem_mirror, start,
+				end - start, copy_size, in_stride, map_stride);
+	}
+	(void)unmap_dmabuf(sfd->dmabuf_bo, handle);
+}
+
+/* Get the shadow structure whose mirror a fill may be written into directly,
+ * or NULL if the message must be checked and applied by apply_update */
+static struct shadow_fd *get_fill_target(struct fd_translation_map *map,
+		const struct wmsg_buffer_fill *header)
+{
+	struct shadow_fd *sfd = get_shadow_for_rid(map, header->remote_id);
+	if (!sfd || !sfd->mem_mirror || header->start > header->end ||
+			header->end > sfd->buffer_size) {
+		return NULL;
+	}
+	if (sfd->type == FDC_FILE) {
+		return sfd->file_readonly ? NULL : sfd;
+	} else if (sfd->type == FDC_DMABUF) {
+		return get_shm_bytes_per_pixel(sfd->dmabuf_info.format) == -1
+					       ? NULL
+					       : sfd;
+	}
+	return NULL;
+}
+
+char *begin_fill_in_place(struct fd_translation_map *map,
+		const struct wmsg_buffer_fill *header)
+{
+	struct shadow_fd *sfd = get_fill_target(map, header);
+	if (!sfd) {
+		return NULL;
+	}
+	/* The mirror changes without the block hashes being updated */
+	drop_tile_hashes(sfd);
+	touch_mirror(sfd);
+	sfd->fill_in_place = true;
+	return sfd->mem_mirror + header->start;
+}
+
+void finish_fill_in_place(struct fd_translation_map *map,
+		const struct wmsg_buffer_fill *header)
+{
+	struct shadow_fd *sfd = get_fill_target(map, header);
+	if (!sfd) {
+		wp_debug("RID=%d was closed while receiving a fill for it",
+				header->remote_id);
+		return;
+	}
+	sfd->fill_in_place = false;
+	copy_fill_to_local(sfd, header->start, header->end);
+}
+
+int decompress_fill_in_place(struct fd_translation_map *map,
+		struct thread_pool *threads, struct thread_data *local,
+		const struct bytebuf *msg)
+{
+	/* Other modes decompress too slowly to hold up the main thread */
+	if (threads->compression != COMP_LZ4 ||
+			msg->size < sizeof(struct wmsg_buffer_fill)) {
+		return 0;
+	}
+	const struct wmsg_buffer_fill *header =
+			(const struct wmsg_buffer_fill *)msg->data;
+	char *target = begin_fill_in_place(map, header);
+	if (!target) {
+		return 0;
+	}
+	size_t fill_size = header->end - header->start;
+	const char *act_buffer = NULL;
+	size_t act_size = 0;
+	uncompress_buffer(threads, &local->comp_ctx,
+			msg->size - sizeof(struct wmsg_buffer_fill),
+			msg->data + sizeof(struct wmsg_buffer_fill), fill_size,
+			target, &act_size, &act_buffer);
+	if (act_size != fill_size) {
+		wp_error("Transfer size mismatch %zu %zu", act_size, fill_size);
+		return ERR_FATAL;
+	}
+	finish_fill_in_place(map, header);
+	return 1;
+}
+
 int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		struct render_data *render, enum wmsg_type type, int remote_id,
 		const struct bytebuf *msg)
+{
+	struct bytebuf payload = {.data = NULL, .size = 0};
+	if (type == WMSG_BUFFER_FILL || type == WMSG_BUFFER_DIFF) {
+		decompress_update(threads, &threads->threads[0], type, msg,
+				&payload);
+	}
+	return apply_decompressed_update(
+			map, threads, render, type, remote_id, msg, &payload);
+}
+
+static int apply_update_to_shadow(struct fd_translation_map *map,
+		struct thread_pool *threads, struct render_data *render,
+		enum wmsg_type type, int remote_id, const struct bytebuf *msg,
+		const struct bytebuf *payload);
+int apply_decompressed_update(struct fd_translation_map *map,
+		struct thread_pool *threads, struct render_data *render,
+		enum wmsg_type type, int remote_id, const struct bytebuf *msg,
+		const struct bytebuf *payload)
+{
+	bool existed = get_shadow_for_rid(map, remote_id) != NULL;
+	int ret = apply_update_to_shadow(map, threads, render, type, remote_id,
+			msg, payload);
+	if (!existed) {
+		/* A new shadow structure only learns its local fd and type
+		 * after it has been linked into the map */
+		struct shadow_fd *sfd = get_shadow_for_rid(map, remote_id);
+		if (sfd) {
+			index_local_fd(map, sfd);
+			if (sfd->type == FDC_PIPE && !sfd->pipe_link.l_next) {
+				list_insert(&map->pipes, &sfd->pipe_link);
+			}
+		}
+	}
+	return ret;
+}
+static int apply_update_to_shadow(struct fd_translation_map *map,
+		struct thread_pool *threads, struct render_data *render,
+		enum wmsg_type type, int remote_id, const struct bytebuf *msg,
+		const struct bytebuf *payload)
 {
 	struct shadow_fd *sfd = get_shadow_for_rid(map, remote_id);
 	int ret = 0;
@@ -1542,6 +3324,9 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 	case WMSG_CLOSE:
 	case WMSG_ACK_NBLOCKS:
 	case WMSG_INJECT_RIDS:
+	case WMSG_BUFFER_HASHES:
+	case WMSG_BUFFER_RESEND:
+	case WMSG_BLOB_HASHES:
 	case WMSG_PROTOCOL: {
 		if (wmsg_type_is_known(type)) {
 			wp_error("Unexpected update type: %s",
@@ -1556,29 +3341,49 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		return ERR_FATAL;
 	}
 	/* SFD creation messages */
-	case WMSG_OPEN_FILE: {
-		if ((ret = check_message_min_size(type, msg,
-				     sizeof(struct wmsg_open_file))) < 0) {
+	case WMSG_OPEN_FILE:
+	case WMSG_OPEN_BLOB: {
+		size_t min_size = sizeof(struct wmsg_open_file);
+		if (type == WMSG_OPEN_BLOB) {
+			min_size = sizeof(struct wmsg_open_blob);
+		}
+		if ((ret = check_message_min_size(type, msg, min_size)) < 0) {
 			return ret;
 		}
 
+		/* A blob is copied from the cache, which only grows */
+		const char *contents = NULL;
+		size_t file_size;
+		if (type == WMSG_OPEN_BLOB) {
+			const struct wmsg_open_blob *header =
+					(const struct wmsg_open_blob *)msg->data;
+			int i = -1;
+			if (map->blob_cache) {
+				i = find_cached_blob(
+						map->blob_cache, header->key);
+			}
+			if (i == -1) {
+				wp_error("No cached file for RID=%d, of %u bytes",
+						remote_id, header->key.size);
+				return ERR_FATAL;
+			}
+			contents = map->blob_cache->data +
+				   map->blob_cache->entries[i].offset;
+			file_size = header->key.size;
+		} else {
+			file_size = ((const struct wmsg_open_file *)msg->data)
+						    ->file_size;
+		}
+
 		if ((ret = open_sfd(map, &sfd, remote_id)) < 0) {
 			return ret;
 		}
 
-		const struct wmsg_open_file header =
-				*(const struct wmsg_open_file *)msg->data;
-
 		sfd->type = FDC_FILE;
 		sfd->mem_local = NULL;
-		sfd->buffer_size = header.file_size;
+		sfd->buffer_size = file_size;
 		sfd->remote_bufsize = sfd->buffer_size;
-		size_t alignment = 1u << threads->diff_alignment_bits;
-		sfd->mem_mirror = zeroed_aligned_alloc(
-				alignz(sfd->buffer_size, alignment), alignment,
-				&sfd->mem_mirror_handle);
-		if (!sfd->mem_mirror) {
-			wp_error("Failed to allocate mirror");
+		if (alloc_mirror(sfd, threads->diff_alignment_bits) == -1) {
 			return 0;
 		}
 
@@ -1604,9 +3409,50 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 			sfd->mem_local = NULL;
 			return 0;
 		}
+		if (contents) {
+			memcpy(sfd->mem_mirror, contents, sfd->buffer_size);
+			memcpy(sfd->mem_local, contents, sfd->buffer_size);
+		}
 
 		return 0;
 	}
+	case WMSG_OPEN_LOCAL: {
+		if ((ret = check_message_min_size(type, msg,
+				     sizeof(struct wmsg_open_local))) < 0) {
+			return ret;
+		}
+		const struct wmsg_open_local *header =
+				(const struct wmsg_open_local *)msg->data;
+		int fd = take_passed_fd(map);
+		if (fd == -1) {
+			wp_error("No file descriptor was passed for RID=%d",
+					remote_id);
+			return ERR_FATAL;
+		}
+		if (header->fd_type != FDC_FILE &&
+				header->fd_type != FDC_DMABUF) {
+			wp_error("Unexpected type %u of passed fd for RID=%d",
+					header->fd_type, remote_id);
+			checked_close(fd);
+			return ERR_FATAL;
+		}
+		if ((ret = open_sfd(map, &sfd, remote_id)) < 0) {
+			checked_close(fd);
+			return ret;
+		}
+		sfd->type = (enum fdcat)header->fd_type;
+		sfd->fd_local = fd;
+		sfd->passthrough = true;
+		sfd->buffer_size = header->file_size;
+		sfd->remote_bufsize = sfd->buffer_size;
+		if (sfd->type == FDC_FILE) {
+			/* Handlers may read the file, as with format tables */
+			if (map_local_file(sfd) == -1) {
+				sfd->mem_local = NULL;
+			}
+		}
+		return 0;
+	}
 	case WMSG_OPEN_DMABUF: {
 		if ((ret = check_message_min_size(type, msg,
 				     sizeof(struct wmsg_open_dmabuf) +
@@ -1629,15 +3475,7 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		 * of the buffer */
 		sfd->buffer_size = sfd->dmabuf_info.height *
 				   sfd->dmabuf_info.strides[0];
-		size_t alignment = 1u << threads->diff_alignment_bits;
-		sfd->mem_mirror = zeroed_aligned_alloc(
-				alignz(sfd->buffer_size, alignment), alignment,
-				&sfd->mem_mirror_handle);
-		sfd->dmabuf_warped = zeroed_aligned_alloc(
-				alignz(sfd->buffer_size, alignment), alignment,
-				&sfd->dmabuf_warped_handle);
-		if (!sfd->mem_mirror || !sfd->dmabuf_warped) {
-			wp_error("Failed to allocate mirror");
+		if (alloc_mirror(sfd, threads->diff_alignment_bits) == -1) {
 			return 0;
 		}
 
@@ -1898,25 +3736,21 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 					remote_id);
 			return 0;
 		}
+		if (restore_mirror(threads, sfd) == -1) {
+			return 0;
+		}
+		touch_mirror(sfd);
+		/* The mirror changes without the block hashes being updated */
+		drop_tile_hashes(sfd);
 
 		const struct wmsg_buffer_fill *header =
 				(const struct wmsg_buffer_fill *)msg->data;
-
-		size_t uncomp_size = header->end - header->start;
-		struct thread_data *local = &threads->threads[0];
-		if (buf_ensure_size((int)uncomp_size, 1, &local->tmp_size,
-				    &local->tmp_buf) == -1) {
-			wp_error("Failed to expand temporary decompression buffer, dropping update");
+		if (!payload->data) {
+			/* decompression was not possible */
 			return 0;
 		}
-
-		const char *act_buffer = NULL;
-		size_t act_size = 0;
-		uncompress_buffer(threads, &threads->threads[0].comp_ctx,
-				msg->size - sizeof(struct wmsg_buffer_fill),
-				msg->data + sizeof(struct wmsg_buffer_fill),
-				uncomp_size, local->tmp_buf, &act_size,
-				&act_buffer);
+		const char *act_buffer = payload->data;
+		size_t act_size = payload->size;
 
 		// `memsize+8*remote_nthreads` is the worst-case diff
 		// expansion
@@ -1940,49 +3774,10 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 						sfd->dmabuf_info.format);
 				return 0;
 			}
-
-			memcpy(sfd->mem_mirror + header->start, act_buffer,
-					header->end - header->start);
-
-			void *handle = NULL;
-			uint32_t map_stride = 0;
-			char *mem_local = map_dmabuf(sfd->dmabuf_bo, true,
-					&handle, &map_stride);
-			if (!mem_local) {
-				wp_error("Failed to apply fill to RID=%d, fd not mapped",
-						sfd->remote_id);
-				return 0;
-			}
-			uint32_t in_stride = sfd->dmabuf_info.strides[0];
-			if (map_stride == in_stride) {
-				memcpy(mem_local + header->start,
-						sfd->mem_mirror + header->start,
-						header->end - header->start);
-			} else {
-				/* stride changing transfer */
-				uint32_t row_length = (uint32_t)bpp *
-						      sfd->dmabuf_info.width;
-
-				uint32_t copy_size = (uint32_t)minu(row_length,
-						minu(map_stride, in_stride));
-
-				stride_shifted_copy(mem_local,
-						act_buffer - header->start,
-						header->start,
-						header->end - header->start,
-						copy_size, in_stride,
-						map_stride);
-			}
-
-			if (unmap_dmabuf(sfd->dmabuf_bo, handle) == -1) {
-				return 0;
-			}
-		} else {
-			memcpy(sfd->mem_mirror + header->start, act_buffer,
-					header->end - header->start);
-			memcpy(sfd->mem_local + header->start, act_buffer,
-					header->end - header->start);
 		}
+		memcpy(sfd->mem_mirror + header->start, act_buffer,
+				header->end - header->start);
+		copy_fill_to_local(sfd, header->start, header->end);
 		return 0;
 	}
 	case WMSG_BUFFER_DIFF: {
@@ -1999,25 +3794,20 @@ int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 					remote_id);
 			return 0;
 		}
+		if (restore_mirror(threads, sfd) == -1) {
+			return 0;
+		}
+		touch_mirror(sfd);
+		/* The mirror changes without the block hashes being updated */
+		drop_tile_hashes(sfd);
 		const struct wmsg_buffer_diff *header =
 				(const struct wmsg_buffer_diff *)msg->data;
-
-		struct thread_data *local = &threads->threads[0];
-		if (buf_ensure_size((int)(header->diff_size +
-						    header->ntrailing),
-				    1, &local->tmp_size,
-				    &local->tmp_buf) == -1) {
-			wp_error("Failed to expand temporary decompression buffer, dropping update");
+		if (!payload->data) {
+			/* decompression was not possible */
 			return 0;
 		}
-
-		const char *act_buffer = NULL;
-		size_t act_size = 0;
-		uncompress_buffer(threads, &threads->threads[0].comp_ctx,
-				msg->size - sizeof(struct wmsg_buffer_diff),
-				msg->data + sizeof(struct wmsg_buffer_diff),
-				header->diff_size + header->ntrailing,
-				local->tmp_buf, &act_size, &act_buffer);
+		const char *act_buffer = payload->data;
+		size_t act_size = payload->size;
 
 		// `memsize+8*remote_nthreads` is the worst-case diff
 		// expansion
@@ -2209,6 +3999,8 @@ bool shadow_decref_transfer(struct shadow_fd *sfd)
 		 * it and make it match pipe.fd, just as on the side where
 		 * the original pipe was introduced */
 		if (sfd->pipe.fd != sfd->fd_local) {
+			/* Only the callers know the map to reindex this in */
+			hash_remove(sfd, true);
 			checked_close(sfd->fd_local);
 			sfd->fd_local = sfd->pipe.fd;
 		}
@@ -2234,7 +4026,9 @@ void decref_transferred_fds(struct fd_translation_map *map, int nfds, int fds[])
 {
 	for (int i = 0; i < nfds; i++) {
 		struct shadow_fd *sfd = get_shadow_for_local_fd(map, fds[i]);
-		shadow_decref_transfer(sfd);
+		if (!shadow_decref_transfer(sfd)) {
+			index_local_fd(map, sfd);
+		}
 	}
 }
 void decref_transferred_rids(
@@ -2242,20 +4036,18 @@ void decref_transferred_rids(
 {
 	for (int i = 0; i < nids; i++) {
 		struct shadow_fd *sfd = get_shadow_for_rid(map, ids[i]);
-		shadow_decref_transfer(sfd);
+		if (!shadow_decref_transfer(sfd)) {
+			index_local_fd(map, sfd);
+		}
 	}
 }
 
 int count_npipes(const struct fd_translation_map *map)
 {
 	int np = 0;
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		if (cur->type == FDC_PIPE) {
-			np++;
-		}
+	for (struct shadow_fd_link *lcur = map->pipes.l_next;
+			lcur != &map->pipes; lcur = lcur->l_next) {
+		np++;
 	}
 	return np;
 }
@@ -2263,11 +4055,10 @@ int fill_with_pipes(const struct fd_translation_map *map, struct pollfd *pfds,
 		bool check_read)
 {
 	int np = 0;
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		if (cur->type == FDC_PIPE && cur->pipe.fd != -1) {
+	for (struct shadow_fd_link *lcur = map->pipes.l_next;
+			lcur != &map->pipes; lcur = lcur->l_next) {
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, pipe_link);
+		if (cur->pipe.fd != -1) {
 			pfds[np].fd = cur->pipe.fd;
 			pfds[np].events = 0;
 			if (check_read && cur->pipe.readable) {
@@ -2285,11 +4076,10 @@ int fill_with_pipes(const struct fd_translation_map *map, struct pollfd *pfds,
 static struct shadow_fd *get_shadow_for_pipe_fd(
 		struct fd_translation_map *map, int pipefd)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
-		if (cur->type == FDC_PIPE && cur->pipe.fd == pipefd) {
+	for (struct shadow_fd_link *lcur = map->pipes.l_next;
+			lcur != &map->pipes; lcur = lcur->l_next) {
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, pipe_link);
+		if (cur->pipe.fd == pipefd) {
 			return cur;
 		}
 	}
@@ -2329,11 +4119,10 @@ void mark_pipe_object_statuses(
 
 void flush_writable_pipes(struct fd_translation_map *map)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *sfd = (struct shadow_fd *)lcur;
-		if (sfd->type != FDC_PIPE || !sfd->pipe.writable ||
+	for (struct shadow_fd_link *lcur = map->pipes.l_next;
+			lcur != &map->pipes; lcur = lcur->l_next) {
+		struct shadow_fd *sfd = SFD_FROM_LINK(lcur, pipe_link);
+		if (!sfd->pipe.writable ||
 				sfd->pipe.send.used <= 0) {
 			continue;
 		}
@@ -2378,20 +4167,19 @@ void flush_writable_pipes(struct fd_translation_map *map)
 		}
 	}
 	/* Destroy any new unreferenced objects */
-	for (struct shadow_fd_link *lcur = map->link.l_next,
+	for (struct shadow_fd_link *lcur = map->pipes.l_next,
 				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
+			lcur != &map->pipes; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, pipe_link);
 		destroy_shadow_if_unreferenced(cur);
 	}
 }
 void read_readable_pipes(struct fd_translation_map *map)
 {
-	for (struct shadow_fd_link *lcur = map->link.l_next,
-				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *sfd = (struct shadow_fd *)lcur;
-		if (sfd->type != FDC_PIPE || !sfd->pipe.readable) {
+	for (struct shadow_fd_link *lcur = map->pipes.l_next;
+			lcur != &map->pipes; lcur = lcur->l_next) {
+		struct shadow_fd *sfd = SFD_FROM_LINK(lcur, pipe_link);
+		if (!sfd->pipe.readable) {
 			continue;
 		}
 
@@ -2430,15 +4218,16 @@ void read_readable_pipes(struct fd_translation_map *map)
 	}
 
 	/* Destroy any new unreferenced objects */
-	for (struct shadow_fd_link *lcur = map->link.l_next,
+	for (struct shadow_fd_link *lcur = map->pipes.l_next,
 				   *lnxt = lcur->l_next;
-			lcur != &map->link; lcur = lnxt, lnxt = lcur->l_next) {
-		struct shadow_fd *cur = (struct shadow_fd *)lcur;
+			lcur != &map->pipes; lcur = lnxt, lnxt = lcur->l_next) {
+		struct shadow_fd *cur = SFD_FROM_LINK(lcur, pipe_link);
 		destroy_shadow_if_unreferenced(cur);
 	}
 }
 
-void extend_shm_shadow(struct thread_pool *threads, struct shadow_fd *sfd,
+void extend_shm_shadow(struct fd_translation_map *map,
+		struct thread_pool *threads, struct shadow_fd *sfd,
 		size_t new_size)
 {
 	if (sfd->buffer_size >= new_size) {
@@ -2461,7 +4250,7 @@ void extend_shm_shadow(struct thread_pool *threads, struct shadow_fd *sfd,
 	increase_buffer_sizes(sfd, threads, new_size);
 
 	// leave `sfd->remote_bufsize` unchanged, and mark dirty
-	sfd->is_dirty = true;
+	mark_shadow_dirty(map, sfd);
 }
 
 void run_task(struct task_data *task, struct thread_data *local)
@@ -2494,11 +4283,30 @@ int start_parallel_work(struct thread_pool *pool,
 	pool->do_work = num_mt_tasks > 0;
 
 	/* Start the work tasks here */
-	if (num_mt_tasks > 0) {
+	if (num_mt_tasks > 0 && !pool->group) {
 		pthread_cond_broadcast(&pool->work_cond);
 	}
 	pthread_mutex_unlock(&pool->work_mutex);
 
+	if (num_mt_tasks > 0 && pool->group) {
+		struct worker_group *group = pool->group;
+		pthread_mutex_lock(&group->lock);
+		bool listed = false;
+		for (int i = 0; i < group->npools; i++) {
+			listed |= group->pools[i] == pool;
+		}
+		if (!listed && buf_ensure_size(group->npools + 1,
+					       sizeof(struct thread_pool *),
+					       &group->pools_size,
+					       (void **)&group->pools) != -1) {
+			group->pools[group->npools++] = pool;
+		}
+		/* If the pool could not be listed, the main thread still
+		 * runs all its tasks */
+		pthread_cond_broadcast(&group->cond);
+		pthread_mutex_unlock(&group->lock);
+	}
+
 	return num_mt_tasks;
 }
 
@@ -2524,6 +4332,77 @@ bool request_work_task(
 	return has_task;
 }
 
+/** Take a task from the next pool with work available, removing pools
+ * that have no more tasks from the list. Requires group->lock. */
+static bool take_group_task(struct worker_group *group,
+		struct task_data *task, struct thread_pool **source)
+{
+	while (group->npools > 0) {
+		int i = group->next_pool % group->npools;
+		struct thread_pool *pool = group->pools[i];
+		bool found = false;
+		pthread_mutex_lock(&pool->work_mutex);
+		if (pool->do_work && pool->stack_count > 0 &&
+				pool->stack[pool->stack_count - 1].type !=
+						TASK_STOP) {
+			*task = pool->stack[pool->stack_count - 1];
+			pool->stack_count--;
+			pool->tasks_in_progress++;
+			if (pool->stack_count <= 0) {
+				pool->do_work = false;
+			}
+			found = true;
+		}
+		bool drained = !pool->do_work;
+		pthread_mutex_unlock(&pool->work_mutex);
+
+		if (drained) {
+			remove_group_pool(group, i);
+		} else {
+			group->next_pool = i + 1;
+		}
+		if (found) {
+			*source = pool;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void *group_worker_main(void *arg)
+{
+	struct thread_data *data = arg;
+	struct worker_group *group = data->group;
+
+	pthread_mutex_lock(&group->lock);
+	while (!group->stop) {
+		struct task_data task;
+		struct thread_pool *pool = NULL;
+		if (!take_group_task(group, &task, &pool)) {
+			pthread_cond_wait(&group->cond, &group->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&group->lock);
+		/* Compression settings are read from the pool */
+		data->pool = pool;
+		run_task(&task, data);
+
+		pthread_mutex_lock(&pool->work_mutex);
+		uint8_t triv = 0;
+		if (write(pool->selfpipe_w, &triv, 1) == -1) {
+			wp_error("Failed to write to self-pipe");
+		}
+		pool->tasks_in_progress--;
+		/* In case the pool is waiting to be cleaned up */
+		pthread_cond_broadcast(&pool->work_cond);
+		pthread_mutex_unlock(&pool->work_mutex);
+
+		pthread_mutex_lock(&group->lock);
+	}
+	pthread_mutex_unlock(&group->lock);
+	return NULL;
+}
+
 static void *worker_thread_main(void *arg)
 {
 	struct thread_data *data = arg;
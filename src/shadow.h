@@ -58,11 +58,86 @@ struct shadow_fd_link {
 	struct shadow_fd_link *l_prev, *l_next; /* Doubly linked list */
 };
 
+/** Entry in a hash bucket chain; `h_pprev` points to the bucket or to the
+ * `h_next` field of the previous entry, so entries can be removed without
+ * knowing which table they are in. */
+struct shadow_fd_hlink {
+	struct shadow_fd *h_next;
+	struct shadow_fd **h_pprev;
+};
+
 struct fd_translation_map {
 	struct shadow_fd_link link; /* store in first position */
 
+	/* Subsets of the shadow structures, so that per-event work is
+	 * proportional to activity instead of to the size of the map */
+	struct shadow_fd_link dirty; /* may have updates to collect */
+	struct shadow_fd_link pipes; /* all FDC_PIPE shadows */
+	struct shadow_fd_link pending; /* to finish once compute is done */
+
+	/* Hash tables (with `table_size` buckets, a power of two) indexing
+	 * the shadow structures by remote id and by local fd */
+	struct shadow_fd **rid_table;
+	struct shadow_fd **lfd_table;
+	int table_size;
+
 	int max_local_id;
 	int local_sign;
+
+	/* If not null, where files received for immutable protocol objects
+	 * are cached, and from which WMSG_OPEN_BLOB copies are made */
+	struct blob_cache *blob_cache;
+	/* Files that the other side has listed as cached, sorted */
+	struct blob_key *remote_blobs;
+	int nremote_blobs, remote_blobs_size;
+
+	/* The other side runs on the same host, and new files and DMABUFs
+	 * are passed to it as they are, with WMSG_OPEN_LOCAL */
+	bool local_fds;
+	/* File descriptors received from the channel, in order, each for
+	 * the next WMSG_OPEN_LOCAL message */
+	struct int_window passed_fds;
+
+	/* Once the mirrors of all connections in this process use more than
+	 * this many bytes, drop those not used recently; 0 means no limit */
+	size_t mirror_budget;
+	/* When evict_cold_mirrors last looked for mirrors to drop */
+	uint64_t mirror_scan_ms;
+};
+
+#define BLOB_CACHE_MAX_ENTRIES 512
+#define BLOB_CACHE_DATA_SIZE (8u << 20)
+/* Larger files are not cached, to leave space for others */
+#define BLOB_CACHE_MAX_FILE_SIZE (1u << 20)
+
+/** Contents of files which are never changed after being sent, like
+ * keymaps, as received by the connections of one Waypipe instance. This is
+ * placed in memory shared by all connection processes. Entries are only
+ * appended, and never changed once `nentries` includes them. */
+struct blob_cache {
+	pthread_mutex_t lock;
+	int nentries;
+	size_t data_used;
+	struct blob_entry {
+		struct blob_key key;
+		size_t offset;
+	} entries[BLOB_CACHE_MAX_ENTRIES];
+	char data[BLOB_CACHE_DATA_SIZE];
+};
+
+struct thread_data {
+	pthread_t thread;
+	struct thread_pool *pool;
+	/* For the worker threads of a worker_group; `pool` is then set to the
+	 * pool of the task being run */
+	struct worker_group *group;
+	/* Thread local data */
+	struct comp_ctx comp_ctx;
+
+	/* A local temporary buffer, used to e.g. store diff sections before
+	 * compression */
+	void *tmp_buf;
+	int tmp_size;
 };
 
 /** Thread pool and associated global information */
@@ -91,20 +166,43 @@ struct thread_pool {
 
 	// to wake the main loop
 	int selfpipe_r, selfpipe_w;
+
+	/* Thread local data for the thread which receives and applies updates
+	 * from the channel, so it can decompress them while the main thread
+	 * uses threads[0] */
+	struct thread_data recv_thread;
+
+	/* If not null, tasks are run by the workers of this group instead of
+	 * by threads belonging to the pool */
+	struct worker_group *group;
 };
 
-struct thread_data {
-	pthread_t thread;
-	struct thread_pool *pool;
-	/* Thread local data */
-	struct comp_ctx comp_ctx;
+/** Worker threads shared by the thread pools of all connections handled by a
+ * process. Pools with queued tasks are listed in `pools`; workers take one
+ * task at a time from each in turn, so that connections share the workers
+ * fairly. Lock order: `lock` before any pool's `work_mutex`. */
+struct worker_group {
+	enum compression_mode compression;
+	int compression_level;
 
-	/* A local temporary buffer, used to e.g. store diff sections before
-	 * compression */
-	void *tmp_buf;
-	int tmp_size;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Not counting the main thread of each connection, which also runs
+	 * tasks */
+	int nworkers;
+	struct thread_data *workers;
+
+	struct thread_pool **pools;
+	int npools, pools_size;
+	int next_pool;
+	bool stop;
+
+	/* All pools using the group, whether or not they have tasks */
+	struct thread_pool **attached;
+	int nattached, attached_size;
 };
 
+
 enum task_type {
 	TASK_STOP,
 	TASK_COMPRESS_BLOCK,
@@ -122,6 +220,9 @@ struct task_data {
 	struct interval *damage_intervals;
 	int damage_len;
 	bool damaged_end;
+	/* If band_end > band_start, the damage intervals are instead those
+	 * tiles in [band_start, band_end) whose hashes have changed */
+	int band_start, band_end;
 
 	struct thread_msg_recv_buf *msg_queue;
 };
@@ -183,6 +284,11 @@ struct pipe_state {
  */
 struct shadow_fd {
 	struct shadow_fd_link link; /* part of doubly linked list */
+	struct shadow_fd_link dirty_link;   /* in map->dirty, if l_next set */
+	struct shadow_fd_link pipe_link;    /* in map->pipes, if l_next set */
+	struct shadow_fd_link pending_link; /* in map->pending, if l_next set */
+	struct shadow_fd_hlink rid_hlink;
+	struct shadow_fd_hlink lfd_hlink;
 
 	enum fdcat type;
 	int remote_id; // + if created serverside; - if created clientside
@@ -194,9 +300,22 @@ struct shadow_fd {
 	bool has_owner; // Are there protocol handlers which control the
 			// is_dirty flag?
 	bool is_dirty;  // If so, should this file be scanned for updates?
+			// (set with mark_shadow_dirty)
+	/* Set if the damage is only a guess, as after mark_shadow_maybe_dirty
+	 * or a commit without usable damage */
+	bool dirty_unverified;
+	/* For buffers checked with dirty_unverified, hashes of each 64 KiB
+	 * block as of the last check, or zero if unknown */
+	uint64_t *tile_hashes;
 	struct damage damage;
 	/* For worker threads, contains their allocated damage intervals */
 	struct interval *damage_task_interval_store;
+	/* Damage covered by the most recent diff of this buffer; while that
+	 * diff is still queued and unsent, the next update may replace it */
+	struct damage diffed_damage;
+	/* Regions to send whole with the next update, as the remote copy there
+	 * may differ from the mirror */
+	struct damage resend_damage;
 
 	struct refcount refcount;
 
@@ -208,10 +327,27 @@ struct shadow_fd {
 	/* exact mirror of the contents, with proper alignment */
 	char *mem_mirror;
 	void *mem_mirror_handle;
+	/* bytes allocated for mem_mirror and dmabuf_warped */
+	size_t mirror_size;
+	/* when the mirror was last used, in milliseconds */
+	uint64_t mirror_used_ms;
+	/* If the mirror was dropped by evict_cold_mirrors, the hashes of its
+	 * blocks as it was then, and the buffer size at the time */
+	uint64_t *evicted_hashes;
+	size_t evicted_size;
+	/* Set while a fill is being read straight into the mirror */
+	bool fill_in_place;
 
 	// File data
 	size_t remote_bufsize; // used to check for and send file extensions
 	bool file_readonly;
+	/* If set, the other side has cached a copy of this new file, so only
+	 * its key need be sent */
+	bool send_as_blob;
+	struct blob_key blob_key;
+	/* If set, the file or DMABUF is shared with the other side, which
+	 * has the same underlying object; it is neither mirrored nor diffed */
+	bool passthrough;
 
 	// Pipe data
 	struct pipe_state pipe;
@@ -247,11 +383,28 @@ const char *compression_mode_to_str(enum compression_mode mode);
 
 void setup_translation_map(struct fd_translation_map *map, bool display_side);
 void cleanup_translation_map(struct fd_translation_map *map);
+/** Remove the oldest file descriptor from `map->passed_fds` and return it, or
+ * -1 if there is none */
+int take_passed_fd(struct fd_translation_map *map);
 
 int setup_thread_pool(struct thread_pool *pool,
 		enum compression_mode compression, int compression_level,
 		int n_threads);
 void cleanup_thread_pool(struct thread_pool *pool);
+/** Create a worker group with n_threads threads in total, counting the main
+ * thread of a connection; n_threads <= 0 picks a default as for
+ * setup_thread_pool */
+int setup_worker_group(struct worker_group *group,
+		enum compression_mode compression, int compression_level,
+		int n_threads);
+void cleanup_worker_group(struct worker_group *group);
+/** Like setup_thread_pool, but running tasks on the workers of `group`;
+ * call cleanup_thread_pool before cleanup_worker_group */
+int setup_shared_thread_pool(
+		struct thread_pool *pool, struct worker_group *group);
+/** Write to the self-pipe of every pool using the group, so that the
+ * connections owning them notice a change like `shutdown_flag` being set */
+void wake_shared_thread_pools(struct worker_group *group);
 
 /** Given a file descriptor, return which type code would be applied to its
  * shadow entry. (For example, FDC_PIPE_IR for a pipe-like object that can only
@@ -274,10 +427,69 @@ struct shadow_fd *translate_fd(struct fd_translation_map *map,
  * transfer messages. All pointers will be to existing memory. */
 void collect_update(struct thread_pool *threads, struct shadow_fd *cur,
 		struct transfer_queue *transfers, bool use_old_dmavid_req);
+/** Call collect_update on every shadow structure that is dirty or a pipe, and
+ * garbage collect them afterwards. Structures with compute tasks are added to
+ * the `pending` list, for finish_pending_updates. */
+void collect_dirty_updates(struct fd_translation_map *map,
+		struct thread_pool *threads, struct transfer_queue *transfers,
+		bool use_old_dmavid_req);
+/** For each dirty buffer whose last diff is still queued in `transfers` and
+ * was never written, remove that diff and fold its damage into the next
+ * update, if resending the region costs little more than the diff did.
+ * The later messages in the queue are renumbered; returns the number of
+ * messages removed. */
+int supersede_unsent_diffs(struct fd_translation_map *map,
+		struct thread_pool *threads, struct transfer_queue *transfers);
 /** After all thread pool tasks have completed, reduce refcounts and clean up
  * related data. The caller should then invoke destroy_shadow_if_unreferenced.
  */
 void finish_update(struct shadow_fd *sfd);
+/** Run finish_update and destroy_shadow_if_unreferenced on all shadow
+ * structures in the `pending` list */
+void finish_pending_updates(struct fd_translation_map *map);
+/** If the mirrors of this process use more than `map->mirror_budget` bytes,
+ * drop the least recently used mirrors of the map that have been idle for a
+ * while. Hashes of their contents are kept, so that a mirror can be rebuilt
+ * from the local copy when next needed, and only the blocks which changed
+ * meanwhile need be sent again. Call only while no tasks are running. */
+void evict_cold_mirrors(struct fd_translation_map *map);
+/** Set sfd->is_dirty, and queue the structure for collect_dirty_updates */
+void mark_shadow_dirty(struct fd_translation_map *map, struct shadow_fd *sfd);
+/** Mark a shadow structure as possibly changed, without any specific
+ * evidence, such as after a message from an unknown protocol. Instead of
+ * diffing the entire buffer, the next update will hash it in blocks, and
+ * only diff the blocks that changed since the last check. */
+void mark_shadow_maybe_dirty(
+		struct fd_translation_map *map, struct shadow_fd *sfd);
+/** Create a WMSG_BUFFER_HASHES message with hashes of the mirror of a file,
+ * setting `*size` to its length. Returns NULL on allocation failure. */
+void *make_buffer_hashes(const struct shadow_fd *sfd, size_t *size);
+/** Compare the hashes in a WMSG_BUFFER_HASHES message with the local copy of
+ * the file. If any blocks differ, `reply` is set to a newly allocated
+ * WMSG_BUFFER_RESEND message requesting them. Returns 0 or an error code. */
+int check_buffer_hashes(struct fd_translation_map *map,
+		const struct bytebuf *msg, struct bytebuf *reply);
+/** Handle a WMSG_BUFFER_RESEND message, making the next update of the file
+ * send the requested regions in full. Returns 0 or an error code. */
+int resend_buffer_regions(struct fd_translation_map *map,
+		struct thread_pool *threads, const struct bytebuf *msg);
+
+/** Create a blob cache in memory that forked processes share; returns NULL
+ * on failure */
+struct blob_cache *create_blob_cache(void);
+void destroy_blob_cache(struct blob_cache *cache);
+/** Create a WMSG_BLOB_HASHES message listing the files in the cache, which
+ * may be NULL, and set `*size` to its length. Returns NULL on allocation
+ * failure. */
+void *make_blob_list(struct blob_cache *cache, size_t *size);
+/** Record the files listed in a WMSG_BLOB_HASHES message from the other
+ * side. Returns 0 or an error code. */
+int add_remote_blobs(struct fd_translation_map *map, const struct bytebuf *msg);
+/** For a file whose contents never change once sent: if it is about to be
+ * sent and the other side has a copy, only send its key; if it was
+ * received, add it to the blob cache. */
+void share_immutable_file(
+		struct fd_translation_map *map, struct shadow_fd *sfd);
 /** Apply a data update message to an element in the translation map, creating
  * an entry when there is none.
  *
@@ -287,6 +499,38 @@ void finish_update(struct shadow_fd *sfd);
 int apply_update(struct fd_translation_map *map, struct thread_pool *threads,
 		struct render_data *render, enum wmsg_type type, int remote_id,
 		const struct bytebuf *msg);
+/** For WMSG_BUFFER_FILL and WMSG_BUFFER_DIFF messages, decompress the payload
+ * into the temporary buffer of `local` (or point to it, if uncompressed). This
+ * does not access any shadow_fd, so it may run concurrently with other
+ * operations on the translation map. On failure, or for other message types,
+ * `payload->data` is set to NULL. */
+void decompress_update(struct thread_pool *threads, struct thread_data *local,
+		enum wmsg_type type, const struct bytebuf *msg,
+		struct bytebuf *payload);
+/** Like apply_update, but using a payload produced by decompress_update.
+ * This writes to the shadow_fd, and must run under the same lock as the
+ * other operations on the translation map. */
+int apply_decompressed_update(struct fd_translation_map *map,
+		struct thread_pool *threads, struct render_data *render,
+		enum wmsg_type type, int remote_id, const struct bytebuf *msg,
+		const struct bytebuf *payload);
+/** If the data of a WMSG_BUFFER_FILL, whose header is given, can be written
+ * straight into the mirror of its file or DMABUF, return where it goes.
+ * Otherwise return NULL, and apply the message with apply_update. */
+char *begin_fill_in_place(struct fd_translation_map *map,
+		const struct wmsg_buffer_fill *header);
+/** Once all data for a fill has been written where begin_fill_in_place said,
+ * copy it to the local file or DMABUF */
+void finish_fill_in_place(struct fd_translation_map *map,
+		const struct wmsg_buffer_fill *header);
+/** Decompress a compressed WMSG_BUFFER_FILL straight into the mirror of its
+ * file or DMABUF, and apply it, if the compression mode is fast enough to do
+ * so while holding the lock on the map. Returns 1 if done, 0 if the message
+ * should be handled by decompress_update and apply_decompressed_update
+ * instead, or an error code. */
+int decompress_fill_in_place(struct fd_translation_map *map,
+		struct thread_pool *threads, struct thread_data *local,
+		const struct bytebuf *msg);
 /** Get the shadow structure associated to a remote id, or NULL if it dne */
 struct shadow_fd *get_shadow_for_rid(struct fd_translation_map *map, int rid);
 /** Get shadow structure for a local file descriptor, or NULL if it dne */
@@ -324,7 +568,9 @@ bool shadow_decref_transfer(struct shadow_fd *);
 struct shadow_fd *shadow_incref_protocol(struct shadow_fd *);
 struct shadow_fd *shadow_incref_transfer(struct shadow_fd *);
 /** If the shadow structure has no references, destroy it and remove it from the
- * map */
+ * map. There is no sweep over the whole map, so this must be called whenever
+ * a reference is dropped: shadow_decref_* and finish_pending_updates do so,
+ * and pipes, whose state also decides this, are checked every cycle */
 bool destroy_shadow_if_unreferenced(struct shadow_fd *sfd);
 /** Decrease reference count for all objects in the given list, deleting
  * iff they are owned by protocol objects and have refcount zero */
@@ -335,7 +581,8 @@ void decref_transferred_rids(
 
 /** If sfd->type == FDC_FILE, increase the size of the backing data to support
  * at least new_size, and mark the new part of underlying file as dirty */
-void extend_shm_shadow(struct thread_pool *threads, struct shadow_fd *sfd,
+void extend_shm_shadow(struct fd_translation_map *map,
+		struct thread_pool *threads, struct shadow_fd *sfd,
 		size_t new_size);
 
 /** Notify the threads so that they can start working on the tasks in the pool,
@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -172,6 +173,89 @@ bool is_utf8(const char *str)
 	return true;
 }
 
+static const uint32_t sha256_k[64] = {0x428a2f98, 0x71374491, 0xb5c0fbcf,
+		0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74,
+		0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+		0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc,
+		0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+		0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85,
+		0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb,
+		0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70,
+		0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3,
+		0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f,
+		0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+		0xc67178f2};
+
+static inline uint32_t rotr32(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+static void sha256_block(uint32_t state[static 8], const uint8_t *block)
+{
+	uint32_t w[64];
+	for (int i = 0; i < 16; i++) {
+		w[i] = (uint32_t)block[4 * i] << 24 |
+		       (uint32_t)block[4 * i + 1] << 16 |
+		       (uint32_t)block[4 * i + 2] << 8 |
+		       (uint32_t)block[4 * i + 3];
+	}
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^
+			      (w[i - 15] >> 3);
+		uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^
+			      (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	uint32_t v[8];
+	memcpy(v, state, sizeof(v));
+	for (int i = 0; i < 64; i++) {
+		uint32_t s1 = rotr32(v[4], 6) ^ rotr32(v[4], 11) ^
+			      rotr32(v[4], 25);
+		uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+		uint32_t t1 = v[7] + s1 + ch + sha256_k[i] + w[i];
+		uint32_t s0 = rotr32(v[0], 2) ^ rotr32(v[0], 13) ^
+			      rotr32(v[0], 22);
+		uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+		memmove(v + 1, v, 7 * sizeof(uint32_t));
+		v[4] += t1;
+		v[0] = t1 + s0 + maj;
+	}
+	for (int i = 0; i < 8; i++) {
+		state[i] += v[i];
+	}
+}
+void sha256(const void *data, size_t len, uint8_t digest[static 32])
+{
+	uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+			0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+	const uint8_t *src = data;
+	size_t pos = 0;
+	for (; pos + 64 <= len; pos += 64) {
+		sha256_block(state, src + pos);
+	}
+	/* The tail, a 1 bit, zeros, and the length in bits */
+	uint8_t last[128];
+	memset(last, 0, sizeof(last));
+	memcpy(last, src + pos, len - pos);
+	last[len - pos] = 0x80;
+	size_t nlast = (len - pos) + 9 > 64 ? 128 : 64;
+	uint64_t bits = (uint64_t)len * 8;
+	for (int i = 0; i < 8; i++) {
+		last[nlast - 1 - i] = (uint8_t)(bits >> (8 * i));
+	}
+	for (size_t off = 0; off < nlast; off += 64) {
+		sha256_block(state, last + off);
+	}
+	for (int i = 0; i < 8; i++) {
+		digest[4 * i] = (uint8_t)(state[i] >> 24);
+		digest[4 * i + 1] = (uint8_t)(state[i] >> 16);
+		digest[4 * i + 2] = (uint8_t)(state[i] >> 8);
+		digest[4 * i + 3] = (uint8_t)state[i];
+	}
+}
+
 bool shutdown_flag = false;
 uint64_t inherited_fds[4] = {0, 0, 0, 0};
 void handle_sigint(int sig)
@@ -541,6 +625,41 @@ int send_one_fd(int socket, int fd)
 	return (int)sendmsg(socket, &msg, 0);
 }
 
+int recv_one_fd(int socket)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} uc;
+	memset(uc.buf, 0, sizeof(uc.buf));
+
+	struct iovec the_iovec;
+	uint8_t dummy_data = 0;
+	the_iovec.iov_len = 1;
+	the_iovec.iov_base = &dummy_data;
+	struct msghdr msg;
+	msg.msg_name = NULL;
+	msg.msg_namelen = 0;
+	msg.msg_iov = &the_iovec;
+	msg.msg_iovlen = 1;
+	msg.msg_flags = 0;
+	msg.msg_control = uc.buf;
+	msg.msg_controllen = sizeof(uc.buf);
+
+	ssize_t ret = recvmsg(socket, &msg, 0);
+	if (ret == -1) {
+		return -1;
+	}
+	int fd = -2;
+	struct cmsghdr *header = CMSG_FIRSTHDR(&msg);
+	if (ret == 1 && header && header->cmsg_level == SOL_SOCKET &&
+			header->cmsg_type == SCM_RIGHTS &&
+			header->cmsg_len == CMSG_LEN(sizeof(int))) {
+		memcpy(&fd, CMSG_DATA(header), sizeof(int));
+	}
+	return fd;
+}
+
 bool wait_for_pid_and_clean(pid_t *target_pid, int *status, int options,
 		struct conn_map *map)
 {
@@ -581,6 +700,27 @@ bool wait_for_pid_and_clean(pid_t *target_pid, int *status, int options,
 	}
 }
 
+void clean_ended_threads(struct conn_map *map)
+{
+	int iw = 0;
+	for (int ir = 0; ir < map->count; ir++) {
+		map->data[iw] = map->data[ir];
+		bool ended = false;
+		if (map->data[ir].pid == 0) {
+			struct pollfd pfd = {.fd = map->data[ir].linkfd,
+					.events = 0};
+			ended = poll(&pfd, 1, 0) > 0 &&
+				(pfd.revents & (POLLHUP | POLLERR));
+		}
+		if (ended) {
+			checked_close(map->data[ir].linkfd);
+		} else {
+			iw++;
+		}
+	}
+	map->count = iw;
+}
+
 int buf_ensure_size(int count, size_t obj_size, int *space, void **data)
 {
 	int x = *space;
@@ -605,6 +745,90 @@ int buf_ensure_size(int count, size_t obj_size, int *space, void **data)
 	return 0;
 }
 
+/* Map the file `fd` of length `size` twice in a row, returning the start of
+ * the first copy, or NULL on failure */
+static char *map_ring(int fd, size_t size)
+{
+	/* Reserve space for both copies, so they end up adjacent */
+	char *base = mmap(NULL, 2 * size, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+	for (int i = 0; i < 2; i++) {
+		if (mmap(base + (size_t)i * size, size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_FIXED, fd,
+				    0) == MAP_FAILED) {
+			munmap(base, 2 * size);
+			return NULL;
+		}
+	}
+	return base;
+}
+
+int ring_init(struct mirrored_ring *ring, size_t min_size)
+{
+	memset(ring, 0, sizeof(*ring));
+	return ring_reserve(ring, min_size);
+}
+void ring_cleanup(struct mirrored_ring *ring)
+{
+	if (ring->data) {
+		munmap(ring->data, 2 * ring->size);
+	}
+	memset(ring, 0, sizeof(*ring));
+}
+int ring_reserve(struct mirrored_ring *ring, size_t min_size)
+{
+	if (min_size <= ring->size) {
+		return 0;
+	}
+	if (min_size > SIZE_MAX / 8) {
+		wp_error("Ring buffer size %zu is too large", min_size);
+		return -1;
+	}
+	size_t size = ring->size;
+	if (size == 0) {
+		size = (size_t)sysconf(_SC_PAGESIZE);
+	}
+	while (size < min_size) {
+		size *= 2;
+	}
+	int fd = create_anon_file();
+	if (fd == -1) {
+		wp_error("Failed to create file for ring buffer: %s",
+				strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, (off_t)size) == -1) {
+		wp_error("Failed to resize ring buffer file to %zu bytes: %s",
+				size, strerror(errno));
+		checked_close(fd);
+		return -1;
+	}
+	char *data = map_ring(fd, size);
+	if (!data) {
+		wp_error("Failed to map ring buffer of %zu bytes: %s", size,
+				strerror(errno));
+		checked_close(fd);
+		return -1;
+	}
+	checked_close(fd);
+	if (ring->data) {
+		memcpy(data, ring_head(ring), ring->len);
+		munmap(ring->data, 2 * ring->size);
+	}
+	ring->data = data;
+	ring->size = size;
+	ring->start = 0;
+	return 0;
+}
+void ring_consume(struct mirrored_ring *ring, size_t n)
+{
+	ring->len -= n;
+	ring->start = ring->len ? (ring->start + n) % ring->size : 0;
+}
+
 static const char *const wmsg_types[] = {
 		"WMSG_PROTOCOL",
 		"WMSG_INJECT_RIDS",
@@ -627,6 +851,14 @@ static const char *const wmsg_types[] = {
 		"WMSG_CLOSE",
 		"WMSG_OPEN_DMAVID_SRC_V2",
 		"WMSG_OPEN_DMAVID_DST_V2",
+		"WMSG_BUFFER_HASHES",
+		"WMSG_BUFFER_RESEND",
+		"WMSG_STREAM_DATA",
+		"WMSG_STREAM_CLOSE",
+		"WMSG_BLOB_HASHES",
+		"WMSG_OPEN_BLOB",
+		"WMSG_OPEN_LOCAL",
+		"WMSG_STREAM_ACK",
 };
 const char *wmsg_type_to_str(enum wmsg_type tp)
 {
@@ -669,8 +901,28 @@ int transfer_add(struct transfer_queue *w, size_t size, void *data)
 	w->vecs[w->end].iov_base = data;
 	w->meta[w->end].msgno = w->last_msgno;
 	w->meta[w->end].static_alloc = false;
+	w->meta[w->end].zerocopy_pending = 0;
+	w->meta[w->end].zerocopy_first = 0;
+	w->meta[w->end].zerocopy_sent = 0;
+	w->meta[w->end].spilled = false;
+	w->meta[w->end].spill_offset = 0;
+	w->meta[w->end].passed_fd = -1;
 	w->end++;
 	w->last_msgno++;
+	w->queued_bytes += size;
+	if (w->queued_bytes > w->peak_queued_bytes) {
+		w->peak_queued_bytes = w->queued_bytes;
+	}
+	return 0;
+}
+
+int transfer_add_fd(struct transfer_queue *w, size_t size, void *data, int fd)
+{
+	if (size == 0 || transfer_add(w, size, data) == -1) {
+		checked_close(fd);
+		return -1;
+	}
+	w->meta[w->end - 1].passed_fd = fd;
 	return 0;
 }
 
@@ -722,6 +974,9 @@ void cleanup_transfer_queue(struct transfer_queue *td)
 		if (!td->meta[i].static_alloc) {
 			free(td->vecs[i].iov_base);
 		}
+		if (td->meta[i].passed_fd != -1) {
+			checked_close(td->meta[i].passed_fd);
+		}
 	}
 	free(td->vecs);
 	free(td->meta);
@@ -85,6 +85,9 @@ size_t multi_strcat(char *dest, size_t dest_space, ...);
 /** Is the string a well-formed UTF-8 code point sequence, per Unicode 15.0? */
 bool is_utf8(const char *str);
 
+/** Compute the SHA-256 digest of the data */
+void sha256(const void *data, size_t len, uint8_t digest[static 32]);
+
 /** Make the file underlying this file descriptor nonblocking.
  * Silently return -1 on failure. */
 int set_nonblocking(int fd);
@@ -190,6 +193,28 @@ size_t print_wrapped_error(char *dest, size_t dest_space, const char *message);
  * depending on its flags and local capabilities. */
 #define CONN_NO_DMABUF_SUPPORT (0x1u << 2)
 
+/** The waypipe-server sends this if it can handle WMSG_BUFFER_HASHES and
+ * WMSG_BUFFER_RESEND messages, so that the waypipe-client need not keep the
+ * buffer updates it has sent for replay after a reconnection. */
+#define CONN_RESYNC_BIT (0x1u << 3)
+
+/** The waypipe-server sets this on a connection which carries the messages of
+ * many application connections, each framed as WMSG_STREAM_DATA messages; the
+ * stream's own connection token is the start of its data. */
+#define CONN_MUX_BIT (0x1u << 4)
+
+/** The waypipe-server sends this if it can handle WMSG_BLOB_HASHES and
+ * WMSG_OPEN_BLOB messages; the waypipe-client then lists the files it has
+ * cached, and the server replies with its own list. */
+#define CONN_BLOBS_BIT (0x1u << 5)
+
+/** The waypipe-server sends this if it can handle WMSG_OPEN_LOCAL messages.
+ * If the channel is a Unix socket, the waypipe-client then sends an empty
+ * WMSG_OPEN_LOCAL with a file descriptor attached; if that arrives, both
+ * sides run on the same host, and pass files and DMABUFs to each other
+ * directly instead of replicating them. */
+#define CONN_LOCAL_BIT (0x1u << 6)
+
 /** Indicate which compression format the waypipe-server can accept. For
  * backwards compatibility, if none of these flags is set, assume the server and
  * client match. */
@@ -231,6 +256,9 @@ struct conn_map {
 int buf_ensure_size(int count, size_t obj_size, int *space, void **data);
 /** sendmsg a file descriptor over socket */
 int send_one_fd(int socket, int fd);
+/** recvmsg a file descriptor sent by send_one_fd. Returns -1 on failure,
+ * and -2 if the socket was closed or the message carried no fd */
+int recv_one_fd(int socket);
 
 enum log_level { WP_DEBUG = 0, WP_ERROR = 1 };
 typedef void (*log_handler_func_t)(const char *file, int line,
@@ -266,6 +294,9 @@ extern log_handler_func_t log_funcs[2];
  */
 bool wait_for_pid_and_clean(pid_t *target_pid, int *status, int options,
 		struct conn_map *map);
+/** Remove the entries in the connection map which belong to threads of this
+ * process (pid 0) that have ended, as seen by their link having hung up */
+void clean_ended_threads(struct conn_map *map);
 
 /** An unrecoverable error-- say, running out of file descriptors */
 #define ERR_FATAL -1
@@ -294,6 +325,34 @@ struct int_window {
 	int zone_start;
 	int zone_end;
 };
+/** A ring buffer whose memory is mapped twice in a row, so that the `len`
+ * bytes in use from `start`, and the free space after them, are always
+ * contiguous; `size` is a multiple of the page size */
+struct mirrored_ring {
+	char *data; /* `2 * size` bytes of address space */
+	size_t size;
+	size_t start;
+	size_t len;
+};
+/** Set up an empty ring that holds at least `min_size` bytes; returns -1 on
+ * failure */
+int ring_init(struct mirrored_ring *ring, size_t min_size);
+void ring_cleanup(struct mirrored_ring *ring);
+/** Grow the ring, if needed, to hold at least `min_size` bytes, keeping the
+ * data in use; returns -1 on failure */
+int ring_reserve(struct mirrored_ring *ring, size_t min_size);
+/** Mark the first `n` bytes in use as free */
+void ring_consume(struct mirrored_ring *ring, size_t n);
+static inline char *ring_head(const struct mirrored_ring *ring)
+{
+	return ring->data + ring->start;
+}
+/** Where the next data goes, followed by `ring->size - ring->len` bytes of
+ * free space */
+static inline char *ring_tail(const struct mirrored_ring *ring)
+{
+	return ring->data + ring->start + ring->len;
+}
 
 /**
  * @brief Wire format message types
@@ -356,6 +415,41 @@ enum wmsg_type {
 	 * to produce/consume video frames. Format: \ref wmsg_open_dmavid */
 	WMSG_OPEN_DMAVID_SRC_V2,
 	WMSG_OPEN_DMAVID_DST_V2,
+	/** After a reconnection, provide hashes of the contents that the
+	 * receiver's copy of a file should have, so that it can request the
+	 * blocks that differ. With no hashes, this does nothing; such messages
+	 * replace buffer data that was released instead of being kept for
+	 * replay, and announce that the sender supports this message.
+	 * Format: \ref wmsg_buffer_hashes */
+	WMSG_BUFFER_HASHES,
+	/** Request that the given regions of a file be sent again, in reply to
+	 * WMSG_BUFFER_HASHES. Format: \ref wmsg_basic, followed by pairs of
+	 * uint32_t [start, end) byte offsets */
+	WMSG_BUFFER_RESEND,
+	/** On a multiplexed connection, carry the next bytes of the connection
+	 * with the given stream id. The first message for a new id opens the
+	 * stream. Format: \ref wmsg_stream, followed by the data */
+	WMSG_STREAM_DATA,
+	/** On a multiplexed connection, indicate that the stream with the given
+	 * id was closed. Format: \ref wmsg_stream */
+	WMSG_STREAM_CLOSE,
+	/** List the files that the sender has cached, which the receiver may
+	 * then create copies of with WMSG_OPEN_BLOB instead of sending them.
+	 * Format: uint32_t header, then \ref blob_key entries */
+	WMSG_BLOB_HASHES,
+	/** Create a file with the contents of a cached file that the receiver
+	 * listed in its WMSG_BLOB_HASHES message.
+	 * Format: \ref wmsg_open_blob */
+	WMSG_OPEN_BLOB,
+	/** Create a file or DMABUF from the file descriptor passed with
+	 * SCM_RIGHTS along with this message; if the remote id is zero, the
+	 * descriptor only checks that they can be passed at all.
+	 * Format: \ref wmsg_open_local */
+	WMSG_OPEN_LOCAL,
+	/** On a multiplexed connection, indicate that more of the data sent for
+	 * the stream with the given id was written to its connection, so that
+	 * as much more may be sent. Format: \ref wmsg_stream_ack */
+	WMSG_STREAM_ACK,
 };
 const char *wmsg_type_to_str(enum wmsg_type tp);
 bool wmsg_type_is_known(enum wmsg_type tp);
@@ -412,6 +506,36 @@ struct wmsg_basic {
 	int32_t remote_id;
 };
 static_assert(sizeof(struct wmsg_basic) == 8, "size check");
+struct wmsg_buffer_hashes {
+	uint32_t size_and_type;
+	int32_t remote_id;
+	uint32_t tile_size;   /**< bytes covered by each hash */
+	uint32_t buffer_size; /**< in bytes; the last tile may be partial */
+	/* following this, ceil(buffer_size / tile_size) uint64_t hashes */
+};
+static_assert(sizeof(struct wmsg_buffer_hashes) == 16, "size check");
+/** Identifies the contents of a file which is never changed after being
+ * sent, such as a keymap: its SHA-256 digest, with the length. Files from
+ * different applications share a cache, so the hash must resist collisions
+ * that one of them might craft. */
+struct blob_key {
+	uint32_t size;
+	uint8_t hash[32];
+};
+static_assert(sizeof(struct blob_key) == 36, "size check");
+struct wmsg_open_blob {
+	uint32_t size_and_type;
+	int32_t remote_id;
+	struct blob_key key;
+};
+static_assert(sizeof(struct wmsg_open_blob) == 44, "size check");
+struct wmsg_open_local {
+	uint32_t size_and_type;
+	int32_t remote_id;
+	uint32_t fd_type; /**< FDC_FILE or FDC_DMABUF */
+	uint32_t file_size;
+};
+static_assert(sizeof(struct wmsg_open_local) == 16, "size check");
 struct wmsg_ack {
 	uint32_t size_and_type;
 	uint32_t messages_received;
@@ -422,6 +546,17 @@ struct wmsg_restart {
 	uint32_t last_ack_received;
 };
 static_assert(sizeof(struct wmsg_restart) == 8, "size check");
+struct wmsg_stream {
+	uint32_t size_and_type;
+	uint32_t stream_id;
+};
+static_assert(sizeof(struct wmsg_stream) == 8, "size check");
+struct wmsg_stream_ack {
+	uint32_t size_and_type;
+	uint32_t stream_id;
+	uint32_t bytes_written;
+};
+static_assert(sizeof(struct wmsg_stream_ack) == 12, "size check");
 
 /** size: the number of bytes in the message, /excluding/ trailing padding. */
 static inline uint32_t transfer_header(size_t size, enum wmsg_type type)
@@ -459,6 +594,21 @@ struct transfer_block_meta {
 	uint32_t msgno;
 	/** If true, data is not heap allocated */
 	bool static_alloc;
+	/** Number of MSG_ZEROCOPY sends covering this block, whose completion
+	 * the kernel has not yet reported. The block may not be freed or
+	 * modified until this reaches zero. */
+	uint32_t zerocopy_pending;
+	/** The zerocopy sends of this block used the notification ids
+	 * [zerocopy_first, zerocopy_first + zerocopy_sent) */
+	uint32_t zerocopy_first;
+	uint32_t zerocopy_sent;
+	/** If true, the block was written and its data then moved to the
+	 * replay spill file at offset `spill_offset`; `iov_base` is NULL */
+	bool spilled;
+	size_t spill_offset;
+	/** If not -1, a file descriptor to pass with SCM_RIGHTS when the first
+	 * byte of this block is written; it is closed once sent */
+	int passed_fd;
 };
 
 /** A queue of data blocks to be written to the channel. This should only
@@ -478,6 +628,12 @@ struct transfer_queue {
 	/** The most recent message number, to be incremented after almost all
 	 * message types */
 	uint32_t last_msgno;
+	/** Blocks with this message number or later have never been written
+	 * to the channel, not even partially */
+	uint32_t sent_msgno;
+	/** Total size of the blocks added with transfer_add which have not
+	 * yet been freed, and the largest value this has reached */
+	size_t queued_bytes, peak_queued_bytes;
 	/** Messages added from a worker thread are introduced here, and should
 	 * be periodically copied onto the main queue */
 	struct thread_msg_recv_buf async_recv_queue;
@@ -489,6 +645,10 @@ int transfer_ensure_size(struct transfer_queue *transfers, int count);
  * This increments the last_msgno, and thus should not be used
  * for WMSG_ACK_NBLOCKS messages. */
 int transfer_add(struct transfer_queue *transfers, size_t size, void *data);
+/** Like transfer_add, but also pass `fd` along with the message; the queue
+ * takes ownership of `fd`, even on failure */
+int transfer_add_fd(struct transfer_queue *transfers, size_t size, void *data,
+		int fd);
 /** Destroy the transfer queue, deallocating all attached buffers */
 void cleanup_transfer_queue(struct transfer_queue *transfers);
 /** Move any asynchronously loaded messages to the queue */
@@ -498,10 +658,25 @@ void transfer_async_add(struct thread_msg_recv_buf *q, void *data, size_t sz);
 
 /* Functions that are unsually platform specific */
 int create_anon_file(void);
+/** Create an unlinked file in $XDG_RUNTIME_DIR, to hold data that need not
+ * stay in memory; returns -1 on failure */
+int create_spill_file(void);
 int get_hardware_thread_count(void);
 int get_iov_max(void);
+/** Map `size` bytes of zeroed memory, which stays shared with processes that
+ * are forked later; returns NULL on failure */
+void *create_shared_memory(size_t size);
+void destroy_shared_memory(void *mem, size_t size);
+/** Initialize a mutex in shared memory that forked processes can use, and
+ * which stays usable if its owner dies; returns -1 on failure */
+int init_shared_mutex(pthread_mutex_t *mutex);
+/** Lock a mutex made by init_shared_mutex. Returns true if its last owner
+ * died while holding it, so the data it protects may be inconsistent */
+bool lock_shared_mutex(pthread_mutex_t *mutex);
 /** For large allocations only; functions providing aligned-and-zeroed
- * allocations. They return NULL on allocation failure.*/
+ * allocations. They return NULL on allocation failure. Memory is only
+ * populated where it is written to, and resizing does not copy the data
+ * where the system can move the pages instead (mremap).*/
 void *zeroed_aligned_alloc(size_t bytes, size_t alignment, void **handle);
 void *zeroed_aligned_realloc(size_t old_size_bytes, size_t new_size_bytes,
 		size_t alignment, void *data, void **handle);
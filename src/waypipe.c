@@ -85,19 +85,35 @@ static const char usage_string[] =
 		"                         ssh: sets the prefix for the socket path\n"
 		"                         vsock: [[s]CID:]port\n"
 		"      --version        print waypipe version and exit\n"
+		"      --ack-bytes K    acknowledge once K KiB were received, default=256\n"
+		"      --ack-delay MS   delay acknowledgements at most MS ms, default=10\n"
 		"      --allow-tiled    allow gpu buffers (DMABUFs) with format modifiers\n"
+		"      --cache-registry server,ssh: answer applications' first registry\n"
+		"                         listing from globals seen by earlier ones\n"
 		"      --control C      server,ssh: set control pipe to reconnect server\n"
 		"      --display D      server,ssh: the Wayland display name or path\n"
 		"      --drm-node R     set the local render node. default: /dev/dri/renderD128\n"
 		"      --remote-node R  ssh: set the remote render node path\n"
 		"      --remote-bin R   ssh: set the remote waypipe binary. default: waypipe\n"
+		"      --replay-mem M   move sent data awaiting acknowledgement to a file\n"
+		"                         in XDG_RUNTIME_DIR once it exceeds M MiB\n"
 		"      --login-shell    server: if server CMD is empty, run a login shell\n"
+		"      --max-queue M    stop reading from the program while more than M MiB\n"
+		"                         of sent data awaits acknowledgement\n"
+		"      --mirror-mem M   drop copies of idle buffers once all copies\n"
+		"                         take more than M MiB\n"
+		"      --multiplex      server,ssh: send all applications' data over one\n"
+		"                         connection to the client\n"
+		"      --single-process handle all applications in one process, sharing\n"
+		"                         its worker threads\n"
 		"      --threads T      set thread pool size, default=hardware threads/2\n"
 		"      --title-prefix P prepend P to all window titles\n"
 		"      --unlink-socket  server: unlink the socket that waypipe connects to\n"
 		"      --video[=V]      compress certain linear dmabufs only with a video codec\n"
 		"                         V is list of options: sw,hw,bpf=1.2e5,h264,vp9,av1\n"
 		"      --vsock          use vsock instead of unix socket\n"
+		"      --zerocopy[=N]   send messages of >=N bytes without copying them,\n"
+		"                         if the channel supports it. default N: 65536\n"
 		"\n";
 
 static int usage(int retcode)
@@ -406,6 +422,7 @@ static const char *feature_names[] = {
 		"dmabuf",
 		"video",
 		"vaapi",
+		"zerocopy",
 };
 static const bool feature_flags[] = {
 #ifdef HAS_LZ4
@@ -433,6 +450,11 @@ static const bool feature_flags[] = {
 #else
 		false,
 #endif
+#ifdef HAS_ZEROCOPY
+		true,
+#else
+		false,
+#endif
 };
 
 #define ARG_VERSION 1000
@@ -450,6 +472,18 @@ static const bool feature_flags[] = {
 #define ARG_BENCH_TEST_SIZE 1012
 #define ARG_VSOCK 1013
 #define ARG_TITLE_PREFIX 1014
+#define ARG_ZEROCOPY 1015
+#define ARG_MAX_QUEUE 1016
+#define ARG_ACK_DELAY 1017
+#define ARG_ACK_BYTES 1018
+#define ARG_REPLAY_MEM 1019
+#define ARG_MULTIPLEX 1020
+#define ARG_SINGLE_PROCESS 1021
+#define ARG_CACHE_REGISTRY 1022
+#define ARG_MIRROR_MEM 1023
+
+#define DEFAULT_ACK_DELAY_MS 10
+#define DEFAULT_ACK_BYTES (256u << 10)
 
 static const struct option options[] = {
 		{"compress", required_argument, NULL, 'c'},
@@ -473,6 +507,15 @@ static const struct option options[] = {
 		{"test-size", required_argument, NULL, ARG_BENCH_TEST_SIZE},
 		{"vsock", no_argument, NULL, ARG_VSOCK},
 		{"title-prefix", required_argument, NULL, ARG_TITLE_PREFIX},
+		{"zerocopy", optional_argument, NULL, ARG_ZEROCOPY},
+		{"max-queue", required_argument, NULL, ARG_MAX_QUEUE},
+		{"ack-delay", required_argument, NULL, ARG_ACK_DELAY},
+		{"ack-bytes", required_argument, NULL, ARG_ACK_BYTES},
+		{"replay-mem", required_argument, NULL, ARG_REPLAY_MEM},
+		{"multiplex", no_argument, NULL, ARG_MULTIPLEX},
+		{"single-process", no_argument, NULL, ARG_SINGLE_PROCESS},
+		{"cache-registry", no_argument, NULL, ARG_CACHE_REGISTRY},
+		{"mirror-mem", required_argument, NULL, ARG_MIRROR_MEM},
 		{0, 0, NULL, 0}};
 struct arg_permissions {
 	int val;
@@ -498,7 +541,16 @@ static const struct arg_permissions arg_permissions[] = {
 		{ARG_CONTROL, MODE_SSH | MODE_SERVER},
 		{ARG_BENCH_TEST_SIZE, MODE_BENCH},
 		{ARG_VSOCK, MODE_SSH | MODE_CLIENT | MODE_SERVER},
-		{ARG_TITLE_PREFIX, MODE_SSH | MODE_CLIENT | MODE_SERVER}};
+		{ARG_TITLE_PREFIX, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_ZEROCOPY, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_MAX_QUEUE, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_ACK_DELAY, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_ACK_BYTES, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_REPLAY_MEM, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_MULTIPLEX, MODE_SSH | MODE_SERVER},
+		{ARG_SINGLE_PROCESS, MODE_SSH | MODE_CLIENT | MODE_SERVER},
+		{ARG_CACHE_REGISTRY, MODE_SSH | MODE_SERVER},
+		{ARG_MIRROR_MEM, MODE_SSH | MODE_CLIENT | MODE_SERVER}};
 
 /* envp is nonstandard, so use environ */
 extern char **environ;
@@ -541,6 +593,17 @@ int main(int argc, char **argv)
 			.vsock_to_host = false, /* VMADDR_FLAG_TO_HOST */
 			.vsock_port = 0,
 			.title_prefix = NULL,
+			.zerocopy_threshold = 0,
+			.max_queue_bytes = 0,
+			.ack_delay_ms = DEFAULT_ACK_DELAY_MS,
+			.ack_bytes = DEFAULT_ACK_BYTES,
+			.replay_mem_bytes = 0,
+			.mirror_mem_bytes = 0,
+			.multiplex = false,
+			.single_process = false,
+			.shared_workers = NULL,
+			.cache_registry = false,
+			.registry_cache = NULL,
 	};
 
 	/* We do not parse any getopt arguments happening after the mode choice
@@ -724,6 +787,81 @@ int main(int argc, char **argv)
 			}
 			config.title_prefix = optarg;
 			break;
+		case ARG_ZEROCOPY:
+#ifdef HAS_ZEROCOPY
+			config.zerocopy_threshold = 65536;
+			if (optarg) {
+				uint32_t threshold;
+				if (parse_uint32(optarg, &threshold) == -1 ||
+						threshold == 0) {
+					fail = true;
+				} else {
+					config.zerocopy_threshold = threshold;
+				}
+			}
+			break;
+#else
+			fprintf(stderr, "Option --zerocopy not allowed: this copy of Waypipe was not built with support for MSG_ZEROCOPY.\n");
+			return EXIT_FAILURE;
+#endif
+		case ARG_MAX_QUEUE: {
+			uint32_t mib;
+			if (parse_uint32(optarg, &mib) == -1 || mib == 0 ||
+					mib > (1u << 20)) {
+				fprintf(stderr, "Invalid --max-queue argument: %s\n",
+						optarg);
+				return EXIT_FAILURE;
+			}
+			config.max_queue_bytes = (size_t)mib << 20;
+		} break;
+		case ARG_ACK_DELAY: {
+			uint32_t ms;
+			if (parse_uint32(optarg, &ms) == -1 || ms > 10000) {
+				fprintf(stderr, "Invalid --ack-delay argument: %s\n",
+						optarg);
+				return EXIT_FAILURE;
+			}
+			config.ack_delay_ms = ms;
+		} break;
+		case ARG_ACK_BYTES: {
+			uint32_t kib;
+			if (parse_uint32(optarg, &kib) == -1 || kib == 0 ||
+					kib > (1u << 20)) {
+				fprintf(stderr, "Invalid --ack-bytes argument: %s\n",
+						optarg);
+				return EXIT_FAILURE;
+			}
+			config.ack_bytes = (size_t)kib << 10;
+		} break;
+		case ARG_REPLAY_MEM: {
+			uint32_t mib;
+			if (parse_uint32(optarg, &mib) == -1 || mib == 0 ||
+					mib > (1u << 20)) {
+				fprintf(stderr, "Invalid --replay-mem argument: %s\n",
+						optarg);
+				return EXIT_FAILURE;
+			}
+			config.replay_mem_bytes = (size_t)mib << 20;
+		} break;
+		case ARG_MIRROR_MEM: {
+			uint32_t mib;
+			if (parse_uint32(optarg, &mib) == -1 || mib == 0 ||
+					mib > (1u << 20)) {
+				fprintf(stderr, "Invalid --mirror-mem argument: %s\n",
+						optarg);
+				return EXIT_FAILURE;
+			}
+			config.mirror_mem_bytes = (size_t)mib << 20;
+		} break;
+		case ARG_MULTIPLEX:
+			config.multiplex = true;
+			break;
+		case ARG_SINGLE_PROCESS:
+			config.single_process = true;
+			break;
+		case ARG_CACHE_REGISTRY:
+			config.cache_registry = true;
+			break;
 		default:
 			fail = true;
 			break;
@@ -1018,6 +1156,12 @@ int main(int argc, char **argv)
 			char linkage[512];
 			char serversock[256];
 			char video_str[140];
+			char zerocopy_str[40];
+			char max_queue_str[40];
+			char ack_delay_str[40];
+			char ack_bytes_str[40];
+			char replay_mem_str[40];
+			char mirror_mem_str[40];
 			char remote_display[20];
 			if (!config.vsock) {
 				sprintf(serversock, "%s-server-%s.sock",
@@ -1038,6 +1182,14 @@ int main(int argc, char **argv)
 				     2 * (remote_drm_node != NULL) +
 				     2 * (control_path != NULL) +
 				     config.video_if_possible +
+				     (config.zerocopy_threshold != 0) +
+				     (config.max_queue_bytes != 0) +
+				     (config.ack_delay_ms != DEFAULT_ACK_DELAY_MS) +
+				     (config.ack_bytes != DEFAULT_ACK_BYTES) +
+				     (config.replay_mem_bytes != 0) +
+				     (config.mirror_mem_bytes != 0) +
+				     config.multiplex + config.single_process +
+				     config.cache_registry +
 				     !config.only_linear_dmabuf +
 				     2 * needs_login_shell +
 				     2 * (config.n_worker_threads != 0);
@@ -1149,6 +1301,47 @@ int main(int argc, char **argv)
 			if (config.vsock) {
 				arglist[dstidx + 1 + offset++] = "--vsock";
 			}
+			if (config.zerocopy_threshold != 0) {
+				sprintf(zerocopy_str, "--zerocopy=%zu",
+						config.zerocopy_threshold);
+				arglist[dstidx + 1 + offset++] = zerocopy_str;
+			}
+			if (config.max_queue_bytes != 0) {
+				sprintf(max_queue_str, "--max-queue=%zu",
+						config.max_queue_bytes >> 20);
+				arglist[dstidx + 1 + offset++] = max_queue_str;
+			}
+			if (config.ack_delay_ms != DEFAULT_ACK_DELAY_MS) {
+				sprintf(ack_delay_str, "--ack-delay=%u",
+						config.ack_delay_ms);
+				arglist[dstidx + 1 + offset++] = ack_delay_str;
+			}
+			if (config.ack_bytes != DEFAULT_ACK_BYTES) {
+				sprintf(ack_bytes_str, "--ack-bytes=%zu",
+						config.ack_bytes >> 10);
+				arglist[dstidx + 1 + offset++] = ack_bytes_str;
+			}
+			if (config.replay_mem_bytes != 0) {
+				sprintf(replay_mem_str, "--replay-mem=%zu",
+						config.replay_mem_bytes >> 20);
+				arglist[dstidx + 1 + offset++] = replay_mem_str;
+			}
+			if (config.mirror_mem_bytes != 0) {
+				sprintf(mirror_mem_str, "--mirror-mem=%zu",
+						config.mirror_mem_bytes >> 20);
+				arglist[dstidx + 1 + offset++] = mirror_mem_str;
+			}
+			if (config.multiplex) {
+				arglist[dstidx + 1 + offset++] = "--multiplex";
+			}
+			if (config.single_process) {
+				arglist[dstidx + 1 + offset++] =
+						"--single-process";
+			}
+			if (config.cache_registry) {
+				arglist[dstidx + 1 + offset++] =
+						"--cache-registry";
+			}
 			arglist[dstidx + 1 + offset++] = "server";
 			for (int i = dstidx + 1; i < argc; i++) {
 				arglist[offset + i] = argv[i];
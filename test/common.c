@@ -206,6 +206,19 @@ void receive_wire(struct test_state *dst, struct transfer_queue *transfers)
 	for (int i = 0; i < transfers->end; i++) {
 		char *msg = transfers->vecs[i].iov_base;
 		size_t real_sz = transfers->vecs[i].iov_len;
+		if (transfers->meta[i].passed_fd != -1) {
+			/* As if passed over the channel with SCM_RIGHTS */
+			struct int_window *pfds = &dst->glob.map.passed_fds;
+			if (buf_ensure_size(pfds->zone_end + 1, sizeof(int),
+					    &pfds->size,
+					    (void **)&pfds->data) == -1) {
+				wp_error("Failed to allocate passed fd queue");
+				goto cleanup;
+			}
+			pfds->data[pfds->zone_end++] =
+					transfers->meta[i].passed_fd;
+			transfers->meta[i].passed_fd = -1;
+		}
 		uint32_t header = ((uint32_t *)msg)[0];
 		size_t sz = transfer_size(header);
 		if (sz != real_sz) {
@@ -383,6 +396,7 @@ void cleanup_state(struct test_state *s)
 	cleanup_render_data(&s->glob.render);
 	cleanup_hwcontext(&s->glob.render);
 	cleanup_thread_pool(&s->glob.threads);
+	cleanup_registry_shortcut(&s->glob.registry);
 
 	for (int i = 0; i < s->nrcvd; i++) {
 		free(s->rcvd[i].data);
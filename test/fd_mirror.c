@@ -237,6 +237,35 @@ static void wait_for_thread_pool(struct thread_pool *pool)
 	}
 }
 
+/* Apply a message like the channel thread does, writing fills straight into
+ * the mirror of their file or DMABUF when possible */
+static void apply_message(struct fd_translation_map *map,
+		struct thread_pool *pool, struct render_data *render_data,
+		const struct bytebuf *msg)
+{
+	uint32_t hb = ((uint32_t *)msg->data)[0];
+	int32_t xid = ((int32_t *)msg->data)[1];
+	if (transfer_type(hb) == WMSG_BUFFER_FILL) {
+		if (decompress_fill_in_place(map, pool, &pool->threads[0],
+				    msg) == 1) {
+			return;
+		}
+		const struct wmsg_buffer_fill *header =
+				(const struct wmsg_buffer_fill *)msg->data;
+		char *target = NULL;
+		if (pool->compression == COMP_NONE) {
+			target = begin_fill_in_place(map, header);
+		}
+		if (target) {
+			memcpy(target, msg->data + sizeof(*header),
+					header->end - header->start);
+			finish_fill_in_place(map, header);
+			return;
+		}
+	}
+	apply_update(map, pool, render_data, transfer_type(hb), xid, msg);
+}
+
 static bool test_transfer(struct fd_translation_map *src_map,
 		struct fd_translation_map *dst_map,
 		struct thread_pool *src_pool, struct thread_pool *dst_pool,
@@ -280,11 +309,8 @@ static bool test_transfer(struct fd_translation_map *src_map,
 	while (start < res.size) {
 		struct bytebuf tmp;
 		tmp.data = &res.data[start];
-		uint32_t hb = ((uint32_t *)tmp.data)[0];
-		int32_t xid = ((int32_t *)tmp.data)[1];
-		tmp.size = transfer_size(hb);
-		apply_update(dst_map, dst_pool, render_data, transfer_type(hb),
-				xid, &tmp);
+		tmp.size = transfer_size(((uint32_t *)tmp.data)[0]);
+		apply_message(dst_map, dst_pool, render_data, &tmp);
 		start += alignz(tmp.size, 4);
 	}
 	free(res.data);
@@ -297,27 +323,33 @@ static bool test_transfer(struct fd_translation_map *src_map,
 			src_shadow->type, dst_shadow->type);
 }
 
-/* This test closes the provided file fd */
+/* This test closes the provided file fd. If `group` is not null, both sides
+ * share its worker threads, and the thread counts are ignored. */
 static bool test_mirror(int new_file_fd, size_t sz,
 		int (*update)(int fd, struct gbm_bo *bo, size_t sz, int seqno),
 		struct compression_settings comp_mode, int n_src_threads,
 		int n_dst_threads, struct render_data *rd,
-		const struct dmabuf_slice_data *slice_data)
+		const struct dmabuf_slice_data *slice_data,
+		struct worker_group *group)
 {
 	struct fd_translation_map src_map;
 	setup_translation_map(&src_map, false);
 
 	struct thread_pool src_pool;
-	setup_thread_pool(&src_pool, comp_mode.mode, comp_mode.level,
-			n_src_threads);
+	struct thread_pool dst_pool;
+	if (group) {
+		setup_shared_thread_pool(&src_pool, group);
+		setup_shared_thread_pool(&dst_pool, group);
+	} else {
+		setup_thread_pool(&src_pool, comp_mode.mode, comp_mode.level,
+				n_src_threads);
+		setup_thread_pool(&dst_pool, comp_mode.mode, comp_mode.level,
+				n_dst_threads);
+	}
 
 	struct fd_translation_map dst_map;
 	setup_translation_map(&dst_map, true);
 
-	struct thread_pool dst_pool;
-	setup_thread_pool(&dst_pool, comp_mode.mode, comp_mode.level,
-			n_dst_threads);
-
 	size_t fdsz = 0;
 	enum fdcat fdtype;
 	if (slice_data) {
@@ -345,7 +377,8 @@ static bool test_mirror(int new_file_fd, size_t sz,
 				wp_error("failed to resize file");
 				break;
 			}
-			extend_shm_shadow(fwd ? &src_pool : &dst_pool,
+			extend_shm_shadow(fwd ? &src_map : &dst_map,
+					fwd ? &src_pool : &dst_pool,
 					fwd ? src_shadow : dst_shadow, sz);
 			expect_changes = true;
 		}
@@ -384,6 +417,421 @@ static bool test_mirror(int new_file_fd, size_t sz,
 	return pass;
 }
 
+/* The original of a file and its copy, each with its own map and threads */
+struct mirror_pair {
+	struct fd_translation_map src_map, dst_map;
+	struct thread_pool src_pool, dst_pool;
+	struct render_data *rd;
+	struct shadow_fd *src_shadow;
+	int rid;
+};
+
+/* Set up both sides for the file, taking ownership of its fd. If `send`,
+ * the whole file is then copied over; otherwise, as for a new wl_shm_pool,
+ * nothing is sent until parts of it are damaged. Returns false if the
+ * initial copy failed; cleanup_mirror_pair must be called either way */
+static bool setup_mirror_pair(struct mirror_pair *mp, int new_file_fd,
+		struct compression_settings comp_mode, struct render_data *rd,
+		bool send)
+{
+	setup_translation_map(&mp->src_map, false);
+	setup_translation_map(&mp->dst_map, true);
+	setup_thread_pool(&mp->src_pool, comp_mode.mode, comp_mode.level, 1);
+	setup_thread_pool(&mp->dst_pool, comp_mode.mode, comp_mode.level, 1);
+	mp->rd = rd;
+
+	size_t fdsz = 0;
+	enum fdcat fdtype = get_fd_type(new_file_fd, &fdsz);
+	mp->src_shadow = translate_fd(&mp->src_map, rd, NULL, new_file_fd,
+			fdtype, fdsz, NULL, false);
+	mp->rid = mp->src_shadow->remote_id;
+	if (!send) {
+		reset_damage(&mp->src_shadow->damage);
+		return true;
+	}
+	mp->src_shadow->is_dirty = true;
+	damage_everything(&mp->src_shadow->damage);
+	return test_transfer(&mp->src_map, &mp->dst_map, &mp->src_pool,
+			&mp->dst_pool, mp->rid, true, rd);
+}
+static void cleanup_mirror_pair(struct mirror_pair *mp)
+{
+	cleanup_translation_map(&mp->src_map);
+	cleanup_translation_map(&mp->dst_map);
+	cleanup_thread_pool(&mp->src_pool);
+	cleanup_thread_pool(&mp->dst_pool);
+}
+/* Send the damaged parts of the original to the copy, and compare them */
+static bool send_forward(struct mirror_pair *mp)
+{
+	return test_transfer(&mp->src_map, &mp->dst_map, &mp->src_pool,
+			&mp->dst_pool, mp->rid, true, mp->rd);
+}
+
+/* Set [start, end) of the file to `value`, and record it as damaged */
+static bool fill_region(struct shadow_fd *sfd, int alignment_bits,
+		size_t start, size_t end, int value)
+{
+	char *data = mmap(NULL, sfd->buffer_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, sfd->fd_local, 0);
+	if (data == MAP_FAILED) {
+		wp_error("Failed to map RID=%d: %s", sfd->remote_id,
+				strerror(errno));
+		return false;
+	}
+	memset(data + start, value, end - start);
+	munmap(data, sfd->buffer_size);
+	struct ext_interval damage = {.start = (int32_t)start,
+			.width = (int32_t)(end - start),
+			.rep = 1,
+			.stride = 0};
+	merge_damage_records(&sfd->damage, 1, &damage, alignment_bits);
+	return true;
+}
+
+/* A region of a buffer which is set to one value */
+struct region_fill {
+	size_t start, end;
+	int value;
+};
+
+/* Update a file several times without sending the queued diffs in between,
+ * so that newer updates replace older diffs; the copy made from whatever
+ * remains in the queue must still match */
+static bool test_supersede(struct mirror_pair *mp,
+		const struct region_fill *fills, int nfills)
+{
+	struct shadow_fd *src_shadow = mp->src_shadow;
+	struct transfer_queue queue;
+	memset(&queue, 0, sizeof(queue));
+	pthread_mutex_init(&queue.async_recv_queue.lock, NULL);
+	queue.last_msgno = 1;
+	queue.sent_msgno = 1;
+
+	bool pass = true;
+	int nsuperseded = 0;
+	for (int r = 0; pass && r < nfills; r++) {
+		pass = fill_region(src_shadow, mp->src_pool.diff_alignment_bits,
+				fills[r].start, fills[r].end, fills[r].value);
+		if (!pass) {
+			break;
+		}
+		mark_shadow_dirty(&mp->src_map, src_shadow);
+		nsuperseded += supersede_unsent_diffs(
+				&mp->src_map, &mp->src_pool, &queue);
+		collect_dirty_updates(
+				&mp->src_map, &mp->src_pool, &queue, false);
+		start_parallel_work(&mp->src_pool, &queue.async_recv_queue);
+		wait_for_thread_pool(&mp->src_pool);
+		finish_pending_updates(&mp->src_map);
+		transfer_load_async(&queue);
+	}
+	for (int i = queue.start; pass && i < queue.end; i++) {
+		if (queue.meta[i].msgno != (uint32_t)i + 1) {
+			wp_error("Message %d was numbered %u", i,
+					queue.meta[i].msgno);
+			pass = false;
+		}
+	}
+	if (pass && (nsuperseded == 0 ||
+				    queue.last_msgno != (uint32_t)queue.end + 1)) {
+		wp_error("Expected diffs to be superseded, got %d, next msgno %u for %d messages",
+				nsuperseded, queue.last_msgno, queue.end);
+		pass = false;
+	}
+	if (pass) {
+		struct bytebuf res = combine_transfer_blocks(&queue);
+		for (size_t start = 0; start < res.size;) {
+			struct bytebuf tmp;
+			tmp.data = &res.data[start];
+			uint32_t hb = ((uint32_t *)tmp.data)[0];
+			int32_t xid = ((int32_t *)tmp.data)[1];
+			tmp.size = transfer_size(hb);
+			apply_update(&mp->dst_map, &mp->dst_pool, mp->rd,
+					transfer_type(hb), xid, &tmp);
+			start += alignz(tmp.size, 4);
+		}
+		free(res.data);
+		struct shadow_fd *dst_shadow =
+				get_shadow_for_rid(&mp->dst_map, mp->rid);
+		pass = check_match(src_shadow->fd_local, dst_shadow->fd_local,
+				NULL, NULL, src_shadow->type, dst_shadow->type);
+	}
+	cleanup_transfer_queue(&queue);
+	return pass;
+}
+static bool test_supersede_overlaps(struct mirror_pair *mp, size_t sz)
+{
+	const struct region_fill fills[] = {{0, sz / 2, 1},
+			{sz / 4, (3 * sz) / 4, 2}, {sz / 8, sz / 8 + 4096, 3},
+			{0, sz / 2, 4}};
+	return test_supersede(mp, fills, 4);
+}
+/* The second region partly keeps the inverse of the first's value */
+static bool test_supersede_inverses(struct mirror_pair *mp, size_t sz)
+{
+	const struct region_fill fills[] = {
+			{0, sz / 2, 0x11}, {sz / 4, (3 * sz) / 4, 0xee}};
+	return test_supersede(mp, fills, 2);
+}
+
+/* Drop an update to part of a file, as if the connection had been lost, then
+ * check that comparing hashes of the file resends exactly what was lost */
+static bool test_resync(struct mirror_pair *mp, size_t sz)
+{
+	struct shadow_fd *src_shadow = mp->src_shadow;
+
+	/* Lose an update to the middle of the file */
+	size_t lost_start = sz / 3 + 100, lost_end = sz / 3 + 70000;
+	bool pass = fill_region(src_shadow, mp->src_pool.diff_alignment_bits,
+			lost_start, lost_end, 0x55);
+	if (pass) {
+		mark_shadow_dirty(&mp->src_map, src_shadow);
+		struct transfer_queue lost;
+		memset(&lost, 0, sizeof(lost));
+		pthread_mutex_init(&lost.async_recv_queue.lock, NULL);
+		collect_update(&mp->src_pool, src_shadow, &lost, false);
+		start_parallel_work(&mp->src_pool, &lost.async_recv_queue);
+		wait_for_thread_pool(&mp->src_pool);
+		finish_update(src_shadow);
+		transfer_load_async(&lost);
+		pass = lost.end > 0;
+		cleanup_transfer_queue(&lost);
+	}
+
+	size_t hsize = 0;
+	void *hashes = pass ? make_buffer_hashes(src_shadow, &hsize) : NULL;
+	struct bytebuf reply = {.data = NULL, .size = 0};
+	if (hashes) {
+		struct bytebuf msg = {.data = hashes, .size = hsize};
+		pass = check_buffer_hashes(&mp->dst_map, &msg, &reply) == 0 &&
+		       reply.data != NULL;
+		free(hashes);
+	} else {
+		pass = false;
+	}
+	if (pass) {
+		/* Only the blocks overlapping the lost update are requested */
+		const uint32_t *pairs = (const uint32_t *)(reply.data +
+							   sizeof(struct wmsg_basic));
+		size_t nreq = (reply.size - sizeof(struct wmsg_basic)) / 8;
+		if (nreq != 1 || pairs[0] > lost_start ||
+				pairs[1] < lost_end ||
+				pairs[1] - pairs[0] > 3 * 65536) {
+			wp_error("Unexpected resend request, %zu regions, first [%u, %u)",
+					nreq, pairs[0], pairs[1]);
+			pass = false;
+		}
+	}
+	if (pass) {
+		pass = resend_buffer_regions(&mp->src_map, &mp->src_pool,
+				       &reply) == 0 &&
+		       send_forward(mp);
+	}
+	free(reply.data);
+
+	if (pass) {
+		/* Once resent, the copy matches its hashes */
+		hashes = make_buffer_hashes(src_shadow, &hsize);
+		struct bytebuf msg = {.data = hashes, .size = hsize};
+		pass = hashes && check_buffer_hashes(&mp->dst_map, &msg,
+						 &reply) == 0 &&
+		       reply.data == NULL;
+		free(hashes);
+		free(reply.data);
+	}
+	return pass;
+}
+
+/* Make the mirrors of both copies of a file idle, and drop them */
+static bool evict_both(struct fd_translation_map *src_map,
+		struct fd_translation_map *dst_map, int rid)
+{
+	struct fd_translation_map *maps[2] = {src_map, dst_map};
+	for (int i = 0; i < 2; i++) {
+		struct shadow_fd *sfd = get_shadow_for_rid(maps[i], rid);
+		sfd->mirror_used_ms = 0;
+		maps[i]->mirror_budget = 1;
+		maps[i]->mirror_scan_ms = 0;
+		evict_cold_mirrors(maps[i]);
+		if (sfd->mem_mirror || !sfd->evicted_hashes) {
+			wp_error("Mirror of RID=%d was not dropped", rid);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Change part of a file after the mirrors of both copies were dropped, and
+ * check that updates in either direction rebuild them and keep the copies
+ * matching */
+static bool test_evict(struct mirror_pair *mp, size_t sz)
+{
+	int rid = mp->rid;
+	bool pass = true;
+	for (int round = 0; pass && round < 2; round++) {
+		pass = evict_both(&mp->src_map, &mp->dst_map, rid);
+		if (!pass) {
+			break;
+		}
+		/* Send from the original, then back from the copy */
+		struct fd_translation_map *from =
+				round ? &mp->dst_map : &mp->src_map;
+		struct fd_translation_map *to =
+				round ? &mp->src_map : &mp->dst_map;
+		struct thread_pool *from_pool =
+				round ? &mp->dst_pool : &mp->src_pool;
+		struct thread_pool *to_pool =
+				round ? &mp->src_pool : &mp->dst_pool;
+		struct shadow_fd *sfd = get_shadow_for_rid(from, rid);
+
+		size_t start = sz / 3 + 1000 * (size_t)round;
+		pass = fill_region(sfd, from_pool->diff_alignment_bits, start,
+				start + 10000, 0x40 + round);
+		if (!pass) {
+			break;
+		}
+		sfd->is_dirty = true;
+		pass = test_transfer(from, to, from_pool, to_pool, rid, true,
+				mp->rd);
+		if (pass && (!sfd->mem_mirror ||
+					    !get_shadow_for_rid(to, rid)
+							     ->mem_mirror)) {
+			wp_error("Mirrors of RID=%d were not restored", rid);
+			pass = false;
+		}
+	}
+	return pass;
+}
+
+/* Count the bytes of the pages overlapping [mem, mem+len) that are in
+ * memory */
+static size_t resident_bytes(const char *mem, size_t len)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)mem & ~(uintptr_t)(page - 1);
+	size_t npages = ((uintptr_t)mem + len - start + page - 1) / page;
+	unsigned char *vec = malloc(npages);
+	if (!vec || mincore((void *)start, npages * page, vec) == -1) {
+		wp_error("Failed to check residency: %s", strerror(errno));
+		free(vec);
+		return (size_t)-1;
+	}
+	size_t n = 0;
+	for (size_t i = 0; i < npages; i++) {
+		n += vec[i] & 1;
+	}
+	free(vec);
+	return n * page;
+}
+
+/* Write to part of a large pool and send only that part; the mirrors on
+ * both sides should only use memory for what was written, also after the
+ * pool grows */
+static bool test_sparse_pool(struct mirror_pair *mp, size_t sz)
+{
+	struct shadow_fd *src_shadow = mp->src_shadow;
+	const size_t used = 512u << 10;
+	const size_t regions[2] = {8u << 20, 100u << 20};
+
+	bool pass = true;
+	for (int r = 0; pass && r < 2; r++) {
+		if (r == 1) {
+			sz *= 2;
+			if (ftruncate(src_shadow->fd_local, (off_t)sz) == -1) {
+				pass = false;
+				break;
+			}
+			extend_shm_shadow(&mp->src_map, &mp->src_pool,
+					src_shadow, sz);
+		}
+		char *data = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED,
+				src_shadow->fd_local, 0);
+		if (data == MAP_FAILED) {
+			pass = false;
+			break;
+		}
+		for (size_t i = 0; i < used; i++) {
+			data[regions[r] + i] = (char)(i * 7 + 1);
+		}
+		munmap(data, sz);
+		struct ext_interval damage = {.start = (int32_t)regions[r],
+				.width = (int32_t)used,
+				.rep = 1,
+				.stride = 0};
+		src_shadow->is_dirty = true;
+		merge_damage_records(&src_shadow->damage, 1, &damage,
+				mp->src_pool.diff_alignment_bits);
+		pass = send_forward(mp);
+
+		struct shadow_fd *dst_shadow =
+				get_shadow_for_rid(&mp->dst_map, mp->rid);
+		size_t limit = (size_t)(r + 1) * used + (256u << 10);
+		size_t src_rss = resident_bytes(src_shadow->mem_mirror, sz);
+		size_t dst_rss = 0;
+		if (pass) {
+			dst_rss = resident_bytes(dst_shadow->mem_mirror, sz);
+		}
+		if (pass && (src_rss > limit || dst_rss > limit)) {
+			wp_error("Mirrors of a %zu byte pool use %zu and %zu bytes, expected at most %zu",
+					sz, src_rss, dst_rss, limit);
+			pass = false;
+		}
+	}
+	return pass;
+}
+
+/* Cases run on a file shared between two maps, for each compression mode */
+static const struct file_case {
+	const char *name;
+	bool (*run)(struct mirror_pair *mp, size_t sz);
+	/* If nonzero, the file instead has this many zero bytes, and is not
+	 * sent before the case runs */
+	size_t empty_size;
+} file_cases[] = {
+		{"superseded diffs", test_supersede_overlaps, 0},
+		{"superseded inverse diffs", test_supersede_inverses, 0},
+		{"resync by hashes", test_resync, 0},
+		{"dropped mirrors", test_evict, 0},
+		{"sparse pool", test_sparse_pool, 64u << 20},
+};
+
+/* Make a file with the given contents, or of `size` zero bytes if `data` is
+ * null; returns -1 on failure */
+static int make_test_file(const uint8_t *data, size_t size)
+{
+	int fd = create_anon_file();
+	if (fd == -1) {
+		wp_error("Failed to create test file: %s", strerror(errno));
+		return -1;
+	}
+	if (data ? write(fd, data, size) != (ssize_t)size
+		 : ftruncate(fd, (off_t)size) == -1) {
+		wp_error("Failed to fill test file: %s", strerror(errno));
+		checked_close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool run_file_case(const struct file_case *fc,
+		struct compression_settings comp_mode, struct render_data *rd,
+		const uint8_t *pattern, size_t pattern_size)
+{
+	size_t sz = fc->empty_size ? fc->empty_size : pattern_size;
+	int fd = make_test_file(fc->empty_size ? NULL : pattern, sz);
+	if (fd == -1) {
+		return false;
+	}
+	struct mirror_pair mp;
+	bool pass = setup_mirror_pair(&mp, fd, comp_mode, rd, !fc->empty_size);
+	if (pass) {
+		pass = (*fc->run)(&mp, sz);
+	}
+	cleanup_mirror_pair(&mp);
+	return pass;
+}
+
 log_handler_func_t log_funcs[2] = {NULL, test_atomic_log_handler};
 int main(int argc, char **argv)
 {
@@ -431,6 +879,31 @@ int main(int argc, char **argv)
 	srand(0);
 	for (size_t c = 0; c < sizeof(comp_modes) / sizeof(comp_modes[0]);
 			c++) {
+		for (size_t k = 0;
+				k < sizeof(file_cases) / sizeof(file_cases[0]);
+				k++) {
+			bool pass = run_file_case(&file_cases[k], comp_modes[c],
+					rd, test_pattern, test_size);
+			printf("  FILE comp=%d %s, %s\n", (int)c,
+					file_cases[k].name,
+					pass ? "pass" : "FAIL");
+			all_success &= pass;
+		}
+		int file_fd = make_test_file(test_pattern, test_size);
+		struct worker_group group;
+		if (file_fd != -1 &&
+				setup_worker_group(&group, comp_modes[c].mode,
+						comp_modes[c].level, 4) == 0) {
+			bool pass = test_mirror(file_fd, test_size,
+					update_file, comp_modes[c], 0, 0, rd,
+					NULL, &group);
+			cleanup_worker_group(&group);
+			printf("  FILE comp=%d shared workers, %s\n", (int)c,
+					pass ? "pass" : "FAIL");
+			all_success &= pass;
+		} else if (file_fd != -1) {
+			checked_close(file_fd);
+		}
 		for (int gt = 1; gt <= 5; gt++) {
 			for (int rt = 1; rt <= 5; rt++) {
 				int file_fd = create_anon_file();
@@ -449,7 +922,7 @@ int main(int argc, char **argv)
 
 				bool pass = test_mirror(file_fd, test_size,
 						update_file, comp_modes[c], gt,
-						rt, rd, NULL);
+						rt, rd, NULL, NULL);
 
 				printf("  FILE comp=%d src_thread=%d dst_thread=%d, %s\n",
 						(int)c, gt, rt,
@@ -487,7 +960,7 @@ int main(int argc, char **argv)
 							test_size,
 							update_dmabuf,
 							comp_modes[c], gt, rt,
-							rd, &slice_data);
+							rd, &slice_data, NULL);
 
 					printf("DMABUF comp=%d src_thread=%d dst_thread=%d, %s\n",
 							(int)c, gt, rt,
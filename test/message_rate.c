@@ -0,0 +1,305 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+#include "main.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+/* Objects created by the fake application before the timed messages */
+#define REGISTRY_ID 2
+#define COMPOSITOR_ID 3
+#define SURFACE_ID 4
+/* wl_surface.set_buffer_scale */
+#define TIMED_OPCODE 8
+#define TIMED_MSG_WORDS 3
+
+struct loop_setup {
+	int chanfd;
+	int progfd;
+	bool display_side;
+	const struct main_config *config;
+};
+
+struct writer_setup {
+	int fd;
+	int nmsgs;
+	/* Number of messages per write call */
+	int batch;
+};
+
+static void *run_loop(void *data)
+{
+	struct loop_setup *setup = (struct loop_setup *)data;
+	main_interface_loop(setup->chanfd, setup->progfd, -1, setup->config,
+			setup->display_side);
+	return NULL;
+}
+
+static int write_all(int fd, const uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t wc = write(fd, data, len);
+		if (wc == -1 && errno == EINTR) {
+			continue;
+		}
+		if (wc <= 0) {
+			return -1;
+		}
+		data += wc;
+		len -= (size_t)wc;
+	}
+	return 0;
+}
+
+/* Create a wl_surface, and then send many small requests for it */
+static void *run_writer(void *data)
+{
+	struct writer_setup *setup = (struct writer_setup *)data;
+
+	uint32_t setup_msgs[] = {
+			/* wl_display.get_registry */
+			1,
+			(12u << 16) | 1,
+			REGISTRY_ID,
+			/* wl_registry.bind */
+			REGISTRY_ID,
+			(40u << 16) | 0,
+			1,
+			14,
+			0,
+			0,
+			0,
+			0,
+			4,
+			COMPOSITOR_ID,
+			/* wl_compositor.create_surface */
+			COMPOSITOR_ID,
+			(12u << 16) | 0,
+			SURFACE_ID,
+	};
+	memcpy(&setup_msgs[7], "wl_compositor", 14);
+	if (write_all(setup->fd, (const uint8_t *)setup_msgs,
+			    sizeof(setup_msgs)) == -1) {
+		return NULL;
+	}
+
+	uint32_t *batch = calloc((size_t)setup->batch, 4 * TIMED_MSG_WORDS);
+	if (!batch) {
+		return NULL;
+	}
+	for (int i = 0; i < setup->batch; i++) {
+		batch[TIMED_MSG_WORDS * i] = SURFACE_ID;
+		batch[TIMED_MSG_WORDS * i + 1] =
+				((4u * TIMED_MSG_WORDS) << 16) | TIMED_OPCODE;
+		batch[TIMED_MSG_WORDS * i + 2] = 1;
+	}
+	for (int sent = 0; sent < setup->nmsgs;) {
+		int n = setup->nmsgs - sent;
+		if (n > setup->batch) {
+			n = setup->batch;
+		}
+		if (write_all(setup->fd, (const uint8_t *)batch,
+				    (size_t)n * 4 * TIMED_MSG_WORDS) == -1) {
+			break;
+		}
+		sent += n;
+	}
+	free(batch);
+	return NULL;
+}
+
+static double elapsed_sec(const struct timespec *t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (double)(t1.tv_sec - t0->tv_sec) +
+	       1e-9 * (double)(t1.tv_nsec - t0->tv_nsec);
+}
+
+/* Returns the number of timed messages that reached the compositor */
+static int count_received(int fd, int nmsgs)
+{
+	size_t size = 65536;
+	uint8_t *buf = malloc(size);
+	if (!buf) {
+		return 0;
+	}
+	size_t len = 0;
+	int count = 0;
+	while (count < nmsgs) {
+		ssize_t rc = read(fd, buf + len, size - len);
+		if (rc == -1 && errno == EINTR) {
+			continue;
+		}
+		if (rc <= 0) {
+			break;
+		}
+		len += (size_t)rc;
+
+		size_t pos = 0;
+		while (len - pos >= 8) {
+			uint32_t header[2];
+			memcpy(header, buf + pos, 8);
+			size_t msz = header[1] >> 16;
+			if (msz < 8 || msz > size) {
+				wp_error("Invalid message size %zu", msz);
+				free(buf);
+				return count;
+			}
+			if (len - pos < msz) {
+				break;
+			}
+			if (header[0] == SURFACE_ID &&
+					(header[1] & 0xffff) == TIMED_OPCODE) {
+				count++;
+			}
+			pos += msz;
+		}
+		memmove(buf, buf + pos, len - pos);
+		len -= pos;
+	}
+	free(buf);
+	return count;
+}
+
+/* Pass nmsgs small requests from a fake application through both main
+ * loops to a fake compositor, writing `batch` messages at a time */
+static int run_rate_test(const char *name, int nmsgs, int batch)
+{
+	int app_fds[2], comp_fds[2], conn_fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, app_fds) == -1) {
+		wp_error("Socketpair failed");
+		return EXIT_FAILURE;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, comp_fds) == -1) {
+		wp_error("Socketpair failed");
+		checked_close(app_fds[0]);
+		checked_close(app_fds[1]);
+		return EXIT_FAILURE;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, conn_fds) == -1) {
+		wp_error("Socketpair failed");
+		checked_close(app_fds[0]);
+		checked_close(app_fds[1]);
+		checked_close(comp_fds[0]);
+		checked_close(comp_fds[1]);
+		return EXIT_FAILURE;
+	}
+
+	struct main_config config = {
+			.drm_node = NULL,
+			.n_worker_threads = 1,
+			.compression = COMP_NONE,
+			.compression_level = 0,
+			.no_gpu = true,
+			.only_linear_dmabuf = false,
+			.video_if_possible = false,
+			.prefer_hwvideo = false,
+	};
+	struct loop_setup app_side = {.chanfd = conn_fds[0],
+			.progfd = app_fds[1],
+			.display_side = false,
+			.config = &config};
+	struct loop_setup display_side = {.chanfd = conn_fds[1],
+			.progfd = comp_fds[1],
+			.display_side = true,
+			.config = &config};
+	struct writer_setup writer = {
+			.fd = app_fds[0], .nmsgs = nmsgs, .batch = batch};
+
+	struct timespec t0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	pthread_t app_thread, display_thread, writer_thread;
+	if (pthread_create(&app_thread, NULL, run_loop, &app_side) != 0) {
+		wp_error("Thread failed");
+		return EXIT_FAILURE;
+	}
+	if (pthread_create(&display_thread, NULL, run_loop, &display_side) !=
+			0) {
+		wp_error("Thread failed");
+		return EXIT_FAILURE;
+	}
+	if (pthread_create(&writer_thread, NULL, run_writer, &writer) != 0) {
+		wp_error("Thread failed");
+		return EXIT_FAILURE;
+	}
+
+	int count = count_received(comp_fds[0], nmsgs);
+	double elapsed = elapsed_sec(&t0);
+
+	pthread_join(writer_thread, NULL);
+	/* Closing the application's end stops both main loops */
+	checked_close(app_fds[0]);
+	pthread_join(app_thread, NULL);
+	pthread_join(display_thread, NULL);
+	checked_close(comp_fds[0]);
+
+	if (count != nmsgs) {
+		printf("%s: only %d of %d messages arrived\n", name, count,
+				nmsgs);
+		return EXIT_FAILURE;
+	}
+	printf("%s: %d messages in %.3f sec, %.0f messages/sec\n", name, nmsgs,
+			elapsed, (double)nmsgs / elapsed);
+	return EXIT_SUCCESS;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_atomic_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	struct sigaction act;
+	act.sa_handler = SIG_IGN;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	if (sigaction(SIGPIPE, &act, NULL) == -1) {
+		printf("Sigaction failed\n");
+		return EXIT_FAILURE;
+	}
+
+	int ret = EXIT_SUCCESS;
+	/* An application flushing many requests at once */
+	if (run_rate_test("Batched writes", 8000000, 341) != EXIT_SUCCESS) {
+		ret = EXIT_FAILURE;
+	}
+	/* An application flushing after every request */
+	if (run_rate_test("Single writes", 400000, 1) != EXIT_SUCCESS) {
+		ret = EXIT_FAILURE;
+	}
+	return ret;
+}
@@ -0,0 +1,345 @@
+/*
+ * Copyright © 2019 Manuel Stoeckl
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "common.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define NSTREAMS 5
+
+static uint8_t pattern_byte(uint32_t stream, size_t i)
+{
+	return (uint8_t)(i * 131 + stream * 17 + (i >> 9));
+}
+
+static int write_all(int fd, const uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t wc = write(fd, data, len);
+		if (wc <= 0) {
+			return -1;
+		}
+		data += wc;
+		len -= (size_t)wc;
+	}
+	return 0;
+}
+static int read_all(int fd, uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t rc = read(fd, data, len);
+		if (rc <= 0) {
+			return -1;
+		}
+		data += rc;
+		len -= (size_t)rc;
+	}
+	return 0;
+}
+
+static pid_t fork_mux(int chanfd, int linkfd, int parent_fds[static 2],
+		bool display_side)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		checked_close(parent_fds[0]);
+		checked_close(parent_fds[1]);
+		exit(run_channel_mux(chanfd, linkfd, display_side));
+	}
+	checked_close(chanfd);
+	checked_close(linkfd);
+	return pid;
+}
+
+/* Send data of different lengths over several streams at once, check that
+ * each arrives intact on its own socket, and that closing a stream on one
+ * side closes it on the other */
+static bool test_mux_relay(void)
+{
+	int chan[2], app_link[2], disp_link[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, chan) == -1 ||
+			socketpair(AF_UNIX, SOCK_STREAM, 0, app_link) == -1 ||
+			socketpair(AF_UNIX, SOCK_STREAM, 0, disp_link) == -1) {
+		wp_error("Socketpair failed: %s", strerror(errno));
+		return false;
+	}
+	/* Both children first close the ends of the links kept by the test */
+	int parent_fds[2] = {app_link[0], disp_link[0]};
+	pid_t app_pid = fork_mux(chan[0], app_link[1], parent_fds, false);
+	pid_t disp_pid = fork_mux(chan[1], disp_link[1], parent_fds, true);
+
+	bool pass = true;
+	int app_ends[NSTREAMS];
+	int disp_ends[NSTREAMS];
+	for (uint32_t k = 0; k < NSTREAMS; k++) {
+		int sockets[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+			wp_error("Socketpair failed: %s", strerror(errno));
+			return false;
+		}
+		if (send_one_fd(app_link[0], sockets[1]) == -1) {
+			wp_error("Failed to send stream: %s", strerror(errno));
+			return false;
+		}
+		checked_close(sockets[1]);
+		app_ends[k] = sockets[0];
+	}
+
+	/* Each stream carries its index and length, then a pattern long
+	 * enough to be split into several messages */
+	size_t max_len = 300000 + NSTREAMS * 10007;
+	uint8_t *buf = malloc(max_len + 8);
+	for (uint32_t k = 0; k < NSTREAMS; k++) {
+		uint32_t header[2] = {k, (uint32_t)(300000 + k * 10007)};
+		memcpy(buf, header, sizeof(header));
+		for (size_t i = 0; i < header[1]; i++) {
+			buf[8 + i] = pattern_byte(k, i);
+		}
+		if (write_all(app_ends[k], buf, 8 + header[1]) == -1) {
+			wp_error("Failed to write stream %u", k);
+			pass = false;
+		}
+	}
+	bool seen[NSTREAMS] = {false};
+	for (int j = 0; j < NSTREAMS; j++) {
+		int fd = recv_one_fd(disp_link[0]);
+		if (fd < 0) {
+			wp_error("Failed to receive stream %d", j);
+			free(buf);
+			return false;
+		}
+		uint32_t header[2];
+		if (read_all(fd, (uint8_t *)header, sizeof(header)) == -1 ||
+				header[0] >= NSTREAMS || seen[header[0]] ||
+				header[1] != 300000 + header[0] * 10007) {
+			wp_error("Bad stream header");
+			free(buf);
+			return false;
+		}
+		seen[header[0]] = true;
+		disp_ends[header[0]] = fd;
+		if (read_all(fd, buf, header[1]) == -1) {
+			wp_error("Stream %u ended early", header[0]);
+			pass = false;
+			continue;
+		}
+		for (size_t i = 0; i < header[1]; i++) {
+			if (buf[i] != pattern_byte(header[0], i)) {
+				wp_error("Stream %u differs at byte %zu",
+						header[0], i);
+				pass = false;
+				break;
+			}
+		}
+	}
+	free(buf);
+
+	/* Reply in the other direction */
+	for (uint32_t k = 0; k < NSTREAMS; k++) {
+		uint32_t reply = 1000 + k, recvd = 0;
+		if (write_all(disp_ends[k], (uint8_t *)&reply,
+				    sizeof(reply)) == -1 ||
+				read_all(app_ends[k], (uint8_t *)&recvd,
+						sizeof(recvd)) == -1 ||
+				recvd != reply) {
+			wp_error("Reply on stream %u failed", k);
+			pass = false;
+		}
+	}
+
+	/* Close streams from alternating sides */
+	for (uint32_t k = 0; k < NSTREAMS; k++) {
+		int closed = (k % 2) ? disp_ends[k] : app_ends[k];
+		int other = (k % 2) ? app_ends[k] : disp_ends[k];
+		checked_close(closed);
+		uint8_t tmp;
+		if (read(other, &tmp, 1) != 0) {
+			wp_error("Closing stream %u did not close other end",
+					k);
+			pass = false;
+		}
+		checked_close(other);
+	}
+
+	/* Without the link and any streams, the relays exit */
+	checked_close(app_link[0]);
+	checked_close(disp_link[0]);
+	int app_status = 0, disp_status = 0;
+	if (waitpid(app_pid, &app_status, 0) == -1 ||
+			waitpid(disp_pid, &disp_status, 0) == -1) {
+		wp_error("Waitpid failed: %s", strerror(errno));
+		return false;
+	}
+	if (!WIFEXITED(app_status) || WEXITSTATUS(app_status) != 0 ||
+			!WIFEXITED(disp_status) ||
+			WEXITSTATUS(disp_status) != 0) {
+		wp_error("Relay processes did not exit cleanly");
+		pass = false;
+	}
+	return pass;
+}
+
+/* Hand a new stream to the application side relay, returning the end kept */
+static int open_stream(int link)
+{
+	int sockets[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
+		wp_error("Socketpair failed: %s", strerror(errno));
+		return -1;
+	}
+	if (send_one_fd(link, sockets[1]) == -1) {
+		wp_error("Failed to send stream: %s", strerror(errno));
+		checked_close(sockets[0]);
+		checked_close(sockets[1]);
+		return -1;
+	}
+	checked_close(sockets[1]);
+	return sockets[0];
+}
+
+/* Send a stream whose far end is never read as much as the relays will
+ * take, and check that another stream still gets through */
+static bool test_mux_blocked_stream(void)
+{
+	int chan[2], app_link[2], disp_link[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, chan) == -1 ||
+			socketpair(AF_UNIX, SOCK_STREAM, 0, app_link) == -1 ||
+			socketpair(AF_UNIX, SOCK_STREAM, 0, disp_link) == -1) {
+		wp_error("Socketpair failed: %s", strerror(errno));
+		return false;
+	}
+	int parent_fds[2] = {app_link[0], disp_link[0]};
+	pid_t app_pid = fork_mux(chan[0], app_link[1], parent_fds, false);
+	pid_t disp_pid = fork_mux(chan[1], disp_link[1], parent_fds, true);
+
+	bool pass = true;
+	int app_ends[2] = {open_stream(app_link[0]), -1};
+	int disp_ends[2] = {-1, -1};
+	if (app_ends[0] == -1 || set_nonblocking(app_ends[0]) == -1) {
+		pass = false;
+	}
+
+	/* Fill the first stream until the relays stop taking its data */
+	const size_t max_total = 64u << 20;
+	size_t total = 0;
+	uint8_t *buf = calloc(1 << 16, 1);
+	while (pass && total < max_total) {
+		ssize_t wc = write(app_ends[0], buf, 1 << 16);
+		if (wc > 0) {
+			total += (size_t)wc;
+			continue;
+		}
+		struct pollfd pfd = {.fd = app_ends[0], .events = POLLOUT};
+		if (poll(&pfd, 1, 500) <= 0) {
+			break;
+		}
+	}
+	free(buf);
+	if (pass) {
+		disp_ends[0] = recv_one_fd(disp_link[0]);
+		if (total >= max_total || disp_ends[0] < 0) {
+			wp_error("First stream was not held back, %zu bytes taken",
+					total);
+			pass = false;
+		}
+	}
+
+	/* The second stream must still get through */
+	uint32_t msg = 0x12345678, recvd = 0;
+	if (pass) {
+		app_ends[1] = open_stream(app_link[0]);
+		if (app_ends[1] == -1 || write_all(app_ends[1], (uint8_t *)&msg,
+							 sizeof(msg)) == -1) {
+			pass = false;
+		}
+	}
+	if (pass) {
+		struct pollfd pfd = {.fd = disp_link[0], .events = POLLIN};
+		if (poll(&pfd, 1, 5000) == 1) {
+			disp_ends[1] = recv_one_fd(disp_link[0]);
+		}
+		pfd.fd = disp_ends[1];
+		if (disp_ends[1] < 0 || poll(&pfd, 1, 5000) != 1 ||
+				read_all(disp_ends[1], (uint8_t *)&recvd,
+						sizeof(recvd)) == -1 ||
+				recvd != msg) {
+			wp_error("Second stream was held back by the first");
+			pass = false;
+		}
+	}
+
+	for (int k = 0; k < 2; k++) {
+		if (app_ends[k] >= 0) {
+			checked_close(app_ends[k]);
+		}
+		if (disp_ends[k] >= 0) {
+			checked_close(disp_ends[k]);
+		}
+	}
+	checked_close(app_link[0]);
+	checked_close(disp_link[0]);
+	int app_status = 0, disp_status = 0;
+	if (waitpid(app_pid, &app_status, 0) == -1 ||
+			waitpid(disp_pid, &disp_status, 0) == -1) {
+		wp_error("Waitpid failed: %s", strerror(errno));
+		return false;
+	}
+	if (!WIFEXITED(app_status) || WEXITSTATUS(app_status) != 0 ||
+			!WIFEXITED(disp_status) ||
+			WEXITSTATUS(disp_status) != 0) {
+		wp_error("Relay processes did not exit cleanly");
+		pass = false;
+	}
+	return pass;
+}
+
+log_handler_func_t log_funcs[2] = {NULL, test_log_handler};
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	struct sigaction act;
+	act.sa_handler = SIG_IGN;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	if (sigaction(SIGPIPE, &act, NULL) == -1) {
+		printf("Sigaction failed\n");
+		return EXIT_SUCCESS;
+	}
+
+	bool pass = test_mux_relay();
+	pass &= test_mux_blocked_stream();
+	printf("\nSuccess: %c\n", pass ? 'Y' : 'n');
+	return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
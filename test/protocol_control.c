@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 struct msgtransfer {
@@ -130,6 +131,11 @@ static int get_fd_from_nth_to_last_msg(const struct test_state *s, int nth)
 	return m->fds[0];
 }
 
+static int last_msg_length(const struct test_state *s)
+{
+	return s->nrcvd > 0 ? s->rcvd[s->nrcvd - 1].len : -1;
+}
+
 static void msg_send_handler(struct transfer_states *ts, struct test_state *src,
 		struct test_state *dst)
 {
@@ -236,6 +242,84 @@ end:
 	return pass;
 }
 
+/* When both sides share a host, the shm pool file is passed on as it is */
+static bool test_local_shm_passthrough(void)
+{
+	fprintf(stdout, "\n  Local shm_pool passthrough test\n");
+
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	T.comp->glob.map.local_fds = true;
+	T.app->glob.map.local_fds = true;
+	bool pass = true;
+
+	char *testpat = make_filled_pattern(16384, 0x2468ACE0);
+	int fd = make_filled_file(16384, testpat);
+	int ret_fd = -1;
+
+	struct wp_objid display = {0x1}, registry = {0x2}, shm = {0x3},
+			compositor = {0x4}, pool = {0x5}, buffer = {0x6},
+			surface = {0x7};
+
+	send_wl_display_req_get_registry(&T, display, registry);
+	send_wl_registry_evt_global(&T, registry, 1, "wl_shm", 1);
+	send_wl_registry_evt_global(&T, registry, 2, "wl_compositor", 1);
+	send_wl_registry_req_bind(&T, registry, 1, "wl_shm", 1, shm);
+	send_wl_registry_req_bind(
+			&T, registry, 2, "wl_compositor", 1, compositor);
+	send_wl_shm_req_create_pool(&T, shm, pool, fd, 16384);
+	ret_fd = get_only_fd_from_msg(T.comp);
+	send_wl_shm_pool_req_create_buffer(
+			&T, pool, buffer, 0, 64, 64, 256, 0x30334258);
+	send_wl_compositor_req_create_surface(&T, compositor, surface);
+	send_wl_surface_req_attach(&T, surface, buffer, 0, 0);
+	send_wl_surface_req_damage(&T, surface, 0, 0, 64, 64);
+	send_wl_surface_req_commit(&T, surface);
+
+	struct stat orig, recvd;
+	if (ret_fd == -1 || fstat(fd, &orig) == -1 ||
+			fstat(ret_fd, &recvd) == -1 ||
+			orig.st_ino != recvd.st_ino ||
+			orig.st_dev != recvd.st_dev) {
+		wp_error("The pool file was not passed on directly");
+		pass = false;
+		goto end;
+	}
+
+	/* Both sides follow a resize, without any copy of the file */
+	if (ftruncate(fd, 32768) == -1) {
+		wp_error("Failed to resize pool file");
+		pass = false;
+		goto end;
+	}
+	send_wl_shm_pool_req_resize(&T, pool, 32768);
+	for (int k = 0; k < 2; k++) {
+		struct test_state *side = k ? T.app : T.comp;
+		struct shadow_fd_link *lnk = side->glob.map.link.l_next;
+		if (lnk == &side->glob.map.link) {
+			wp_error("Missing shadow for the pool");
+			pass = false;
+			break;
+		}
+		struct shadow_fd *cur = (struct shadow_fd *)lnk;
+		if (!cur->passthrough || cur->mem_mirror ||
+				cur->buffer_size != 32768) {
+			wp_error("Pool shadow was mirrored or not resized");
+			pass = false;
+		}
+	}
+end:
+	free(testpat);
+	checked_close(fd);
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+
 static bool test_fixed_shm_screencopy_copy(void)
 {
 	fprintf(stdout, "\n screencopy test\n");
@@ -917,6 +1001,309 @@ end:
 	return pass;
 }
 
+/* Check that frame callbacks are only held back on the application side
+ * while the frame committed to their surface is still waiting to be sent,
+ * and that the events after them are held back too */
+static bool test_frame_callback_pacing(void)
+{
+	fprintf(stdout, "\n  Frame callback pacing test\n");
+	struct transfer_states T;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	bool pass = true;
+
+	char *testpat = make_filled_pattern(16384, 0xFEDCBA98);
+	int fd = make_filled_file(16384, testpat);
+
+	struct wp_objid display = {0x1}, registry = {0x2}, shm = {0x3},
+			compositor = {0x4}, pool = {0x5}, buffer = {0x6},
+			surface = {0x7}, frame_cb = {0x8}, sync_cb = {0x9},
+			late_cb = {0xa};
+	struct frame_pacing *pacing = &T.app->glob.pacing;
+
+	send_wl_display_req_get_registry(&T, display, registry);
+	send_wl_registry_evt_global(&T, registry, 1, "wl_shm", 1);
+	send_wl_registry_evt_global(&T, registry, 2, "wl_compositor", 1);
+	send_wl_registry_req_bind(&T, registry, 1, "wl_shm", 1, shm);
+	send_wl_registry_req_bind(
+			&T, registry, 2, "wl_compositor", 1, compositor);
+	send_wl_shm_req_create_pool(&T, shm, pool, fd, 16384);
+	send_wl_shm_pool_req_create_buffer(
+			&T, pool, buffer, 0, 64, 64, 256, 0x30334258);
+	send_wl_compositor_req_create_surface(&T, compositor, surface);
+
+	/* Pretend the commit was read in a cycle that is not yet written */
+	pacing->cycles_read = 1;
+	send_wl_surface_req_attach(&T, surface, buffer, 0, 0);
+	send_wl_surface_req_frame(&T, surface, frame_cb);
+	send_wl_surface_req_commit(&T, surface);
+	send_wl_display_req_sync(&T, display, sync_cb);
+
+	send_wl_callback_evt_done(&T, frame_cb, 1);
+	if (last_msg_length(T.app) != 0 || !pacing->holding) {
+		wp_error("Frame callback was not held");
+		pass = false;
+		goto end;
+	}
+
+	/* The events after the held one, here the deletion of the callback
+	 * and the end of a roundtrip, may not overtake it */
+	uint32_t batch[9] = {frame_cb.id, (12u << 16) | 0, 1, display.id,
+			(12u << 16) | 1, frame_cb.id, sync_cb.id,
+			(12u << 16) | 0, 2};
+	char out[1024];
+	int fd_data[1];
+	for (int written = 0; written < 2; written++) {
+		pacing->cycles_written = (uint32_t)written;
+		struct char_window src = {.data = (char *)batch,
+				.size = sizeof(batch),
+				.zone_start = 0,
+				.zone_end = sizeof(batch)};
+		struct char_window dst = {.data = out,
+				.size = sizeof(out),
+				.zone_start = 0,
+				.zone_end = 0};
+		struct int_window fds = {.data = fd_data,
+				.size = 1,
+				.zone_start = 0,
+				.zone_end = 0};
+		parse_and_prune_messages(&T.app->glob, false, false, &src,
+				&dst, &fds);
+		int expected = written ? (int)sizeof(batch) : 0;
+		if (dst.zone_end != expected ||
+				src.zone_start != expected ||
+				pacing->holding == (bool)written) {
+			wp_error("Expected %d bytes of events to pass, got %d, parsed %d",
+					expected, dst.zone_end, src.zone_start);
+			pass = false;
+			goto end;
+		}
+	}
+
+	/* Once the frame has been written, callbacks pass through */
+	send_wl_surface_req_frame(&T, surface, late_cb);
+	send_wl_callback_evt_done(&T, late_cb, 3);
+	if (last_msg_length(T.app) == 0 || pacing->holding) {
+		wp_error("Frame callback for written frame was held");
+		pass = false;
+		goto end;
+	}
+end:
+	free(testpat);
+	checked_close(fd);
+	cleanup_tstate(&T);
+
+	print_pass(pass);
+	return pass;
+}
+
+static bool test_registry_cache(void)
+{
+	fprintf(stdout, "\n  Registry cache test\n");
+	struct registry_cache *cache = create_registry_cache();
+	if (!cache) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	struct transfer_states T, U;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		destroy_registry_cache(cache);
+		return true;
+	}
+	if (setup_tstate(&U) == -1) {
+		wp_error("Test setup failed");
+		cleanup_tstate(&T);
+		destroy_registry_cache(cache);
+		return true;
+	}
+	bool pass = true;
+	struct registry_shortcut *first = &T.app->glob.registry;
+	struct registry_shortcut *second = &U.app->glob.registry;
+	setup_registry_shortcut(first, cache);
+	setup_registry_shortcut(second, cache);
+
+	struct wp_objid display = {0x1}, registry = {0x2}, sync_cb = {0x3};
+
+	/* The first connection fills the cache */
+	send_wl_display_req_get_registry(&T, display, registry);
+	send_wl_display_req_sync(&T, display, sync_cb);
+	send_wl_registry_evt_global(&T, registry, 1, "wl_shm", 1);
+	send_wl_registry_evt_global(&T, registry, 2, "wl_compositor", 4);
+	send_wl_registry_evt_global(&T, registry, 3, "wl_output", 2);
+	send_wl_callback_evt_done(&T, sync_cb, 7);
+	if (first->answered || last_msg_length(T.app) == 0 ||
+			!cache->valid || cache->nglobals != 3 ||
+			cache->subscribers != 1) {
+		wp_error("Registry cache was not filled");
+		pass = false;
+		goto end;
+	}
+
+	/* The second is answered from it, and then corrected */
+	send_wl_display_req_get_registry(&U, display, registry);
+	send_wl_display_req_sync(&U, display, sync_cb);
+	if (!second->answered || !second->sync_answered ||
+			second->replies_len == 0) {
+		wp_error("Registry was not answered from the cache");
+		pass = false;
+		goto end;
+	}
+	send_wl_registry_evt_global(&U, registry, 1, "wl_shm", 1);
+	if (last_msg_length(U.app) != 0) {
+		wp_error("Cached global was sent twice");
+		pass = false;
+		goto end;
+	}
+	send_wl_registry_evt_global(&U, registry, 2, "wl_compositor", 5);
+	if (last_msg_length(U.app) != 12 + 36) {
+		wp_error("Changed global was not replaced");
+		pass = false;
+		goto end;
+	}
+	send_wl_callback_evt_done(&U, sync_cb, 8);
+	const uint32_t *tail = (const uint32_t *)(second->replies +
+						  second->replies_len - 12);
+	if (last_msg_length(U.app) != 0 || !second->subscribed ||
+			tail[1] != message_header_2(12, 1) || tail[2] != 3) {
+		wp_error("Missing global was not removed");
+		pass = false;
+		goto end;
+	}
+
+	/* Subscribed connections keep the cache current */
+	send_wl_registry_evt_global_remove(&U, registry, 1);
+	if (cache->nglobals != 2 || cache->subscribers != 2) {
+		wp_error("Removed global was kept in the cache");
+		pass = false;
+		goto end;
+	}
+end:
+	cleanup_tstate(&U);
+	cleanup_tstate(&T);
+	if (pass && cache->subscribers != 0) {
+		wp_error("Registry cache subscriptions were not released");
+		pass = false;
+	}
+	destroy_registry_cache(cache);
+
+	print_pass(pass);
+	return pass;
+}
+
+/* A keymap received by one connection is cached; a second connection, told
+ * the key of the cached copy, receives the same contents */
+static bool test_blob_cache(void)
+{
+	fprintf(stdout, "\n  Blob cache test\n");
+	struct blob_cache *cache = create_blob_cache();
+	if (!cache) {
+		wp_error("Test setup failed");
+		return true;
+	}
+	struct transfer_states T, U;
+	if (setup_tstate(&T) == -1) {
+		wp_error("Test setup failed");
+		destroy_blob_cache(cache);
+		return true;
+	}
+	if (setup_tstate(&U) == -1) {
+		wp_error("Test setup failed");
+		cleanup_tstate(&T);
+		destroy_blob_cache(cache);
+		return true;
+	}
+	T.app->glob.map.blob_cache = cache;
+	U.app->glob.map.blob_cache = cache;
+	bool pass = true;
+
+	/* Cached files are identified by their SHA-256 digests */
+	const char *const sha_inputs[3] = {"", "abc",
+			"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"};
+	const char *const sha_digests[3] = {
+			"e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+			"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+			"248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"};
+	for (int i = 0; i < 3; i++) {
+		uint8_t digest[32];
+		char hex[65];
+		sha256(sha_inputs[i], strlen(sha_inputs[i]), digest);
+		for (int k = 0; k < 32; k++) {
+			sprintf(hex + 2 * k, "%02x", digest[k]);
+		}
+		if (strcmp(hex, sha_digests[i])) {
+			wp_error("SHA-256 of \"%s\" was %s", sha_inputs[i],
+					hex);
+			pass = false;
+		}
+	}
+
+	char *testpat = make_filled_pattern(16384, 0x13579BDF);
+	int fd = make_filled_file(16384, testpat);
+	int ret_fd = -1;
+	void *list = NULL;
+
+	struct wp_objid display = {0x1}, registry = {0x2}, seat = {0x3},
+			keyboard = {0x4};
+
+	send_wl_display_req_get_registry(&T, display, registry);
+	send_wl_registry_evt_global(&T, registry, 1, "wl_seat", 7);
+	send_wl_registry_req_bind(&T, registry, 1, "wl_seat", 7, seat);
+	send_wl_seat_evt_capabilities(&T, seat, 3);
+	send_wl_seat_req_get_keyboard(&T, seat, keyboard);
+	send_wl_keyboard_evt_keymap(&T, keyboard, 1, fd, 16384);
+	ret_fd = get_only_fd_from_msg(T.app);
+	if (ret_fd == -1 || !check_file_contents(ret_fd, 16384, testpat)) {
+		wp_error("Failed to transfer keymap");
+		pass = false;
+		goto end;
+	}
+	if (cache->nentries != 1) {
+		wp_error("Keymap was not cached");
+		pass = false;
+		goto end;
+	}
+
+	struct bytebuf msg = {.size = 0};
+	list = make_blob_list(cache, &msg.size);
+	msg.data = list;
+	if (!list || add_remote_blobs(&U.comp->glob.map, &msg) < 0 ||
+			U.comp->glob.map.nremote_blobs != 1) {
+		wp_error("Failed to exchange cached keys");
+		pass = false;
+		goto end;
+	}
+
+	send_wl_display_req_get_registry(&U, display, registry);
+	send_wl_registry_evt_global(&U, registry, 1, "wl_seat", 7);
+	send_wl_registry_req_bind(&U, registry, 1, "wl_seat", 7, seat);
+	send_wl_seat_evt_capabilities(&U, seat, 3);
+	send_wl_seat_req_get_keyboard(&U, seat, keyboard);
+	send_wl_keyboard_evt_keymap(&U, keyboard, 1, fd, 16384);
+	ret_fd = get_only_fd_from_msg(U.app);
+	if (ret_fd == -1 || !check_file_contents(ret_fd, 16384, testpat)) {
+		wp_error("Failed to transfer cached keymap");
+		pass = false;
+	}
+	if (cache->nentries != 1) {
+		wp_error("Cached keymap was stored twice");
+		pass = false;
+	}
+
+end:
+	free(list);
+	free(testpat);
+	checked_close(fd);
+	cleanup_tstate(&U);
+	cleanup_tstate(&T);
+	destroy_blob_cache(cache);
+
+	print_pass(pass);
+	return pass;
+}
+
 /* Check whether the video encoding feature can replicate a uniform
  * color image */
 static bool test_fixed_video_color_copy(enum video_coding_fmt fmt, bool hw)
@@ -935,9 +1322,10 @@ int main(int argc, char **argv)
 
 	set_initial_fds();
 
-	int ntest = 21;
+	int ntest = 25;
 	int nsuccess = 0;
 	nsuccess += test_fixed_shm_buffer_copy();
+	nsuccess += test_local_shm_passthrough();
 	nsuccess += test_fixed_shm_screencopy_copy();
 	nsuccess += test_fixed_keymap_copy();
 	nsuccess += test_fixed_dmabuf_copy(COPY_LINUX_DMABUF);
@@ -954,6 +1342,9 @@ int main(int argc, char **argv)
 	nsuccess += test_data_source(DDT_WLR);
 	nsuccess += test_gamma_control();
 	nsuccess += test_presentation_time();
+	nsuccess += test_frame_callback_pacing();
+	nsuccess += test_registry_cache();
+	nsuccess += test_blob_cache();
 	nsuccess += test_fixed_video_color_copy(VIDEO_H264, false);
 	nsuccess += test_fixed_video_color_copy(VIDEO_H264, true);
 	nsuccess += test_fixed_video_color_copy(VIDEO_VP9, false);
@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "protocol-test-proto.h"
 
@@ -51,8 +52,13 @@ void do_xtype_req_blue(struct context *ctx, const char *interface,
 			strcmp(buf, "babacba 4441 992 7771 3331 4442 991 (null) 4443") !=
 			0;
 }
+static bool benchmark_mode = false;
+
 void do_xtype_evt_yellow(struct context *ctx, uint32_t c)
 {
+	if (benchmark_mode) {
+		return;
+	}
 	char buf[256];
 	sprintf(buf, "%u", c);
 	printf("%s\n", buf);
@@ -112,11 +118,268 @@ static inline uint32_t pack_u32(uint8_t a0, uint8_t a1, uint8_t a2, uint8_t a3)
 	return u.v;
 }
 
+/* Measure how quickly a stream of small events, addressed to many client
+ * and server allocated objects in a scattered order, can be parsed */
+static int run_parse_benchmark(void)
+{
+	benchmark_mode = true;
+
+	struct globals g;
+	memset(&g, 0, sizeof(g));
+	setup_translation_map(&g.map, true);
+	if (init_message_tracker(&g.tracker) == -1) {
+		return EXIT_FAILURE;
+	}
+
+	const int nobjs = 4096;
+	const int nmsgs = 65536;
+	const int nrounds = 64;
+	struct wp_object *objs = calloc((size_t)nobjs, sizeof(*objs));
+	uint32_t *words = calloc((size_t)nmsgs * 3, sizeof(uint32_t));
+	char *dest = calloc((size_t)nmsgs * 3, sizeof(uint32_t));
+	if (!objs || !words || !dest) {
+		free(objs);
+		free(words);
+		free(dest);
+		cleanup_message_tracker(&g.tracker);
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < nobjs; i++) {
+		objs[i].type = &intf_xtype;
+		objs[i].obj_id = (i % 2) ? 0xff000000u + (uint32_t)i
+					 : 2 + (uint32_t)i;
+		tracker_insert(&g.tracker, &objs[i]);
+	}
+	for (int i = 0; i < nmsgs; i++) {
+		uint32_t k = ((uint32_t)i * 2654435761u) % (uint32_t)nobjs;
+		words[3 * i] = objs[k].obj_id;
+		words[3 * i + 1] = message_header_2(12, 0);
+		words[3 * i + 2] = (uint32_t)i;
+	}
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int r = 0; r < nrounds; r++) {
+		struct char_window src = {.data = (char *)words,
+				.size = nmsgs * 12,
+				.zone_start = 0,
+				.zone_end = nmsgs * 12};
+		struct char_window dst = {.data = dest,
+				.size = nmsgs * 12,
+				.zone_start = 0,
+				.zone_end = 0};
+		struct int_window fds = {.data = NULL,
+				.size = 0,
+				.zone_start = 0,
+				.zone_end = 0};
+		parse_and_prune_messages(&g, true, false, &src, &dst, &fds);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double elapsed = (double)(t1.tv_sec - t0.tv_sec) +
+			 1e-9 * (double)(t1.tv_nsec - t0.tv_nsec);
+	printf("Parsed %d messages for %d objects in %.3f s: %.2f million messages/s\n",
+			nmsgs * nrounds, nobjs, elapsed,
+			1e-6 * nmsgs * nrounds / elapsed);
+
+	/* The same stream, parsed within the read buffer */
+	struct char_window scratch = {
+			.data = NULL, .size = 0, .zone_start = 0, .zone_end = 0};
+	bool same_output = true;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int r = 0; r < nrounds; r++) {
+		struct char_window src = {.data = (char *)words,
+				.size = nmsgs * 12,
+				.zone_start = 0,
+				.zone_end = nmsgs * 12};
+		struct int_window fds = {.data = NULL,
+				.size = 0,
+				.zone_start = 0,
+				.zone_end = 0};
+		int end = parse_messages_in_place(
+				&g, true, false, &src, &scratch, &fds);
+		words = (uint32_t *)src.data;
+		if (end != nmsgs * 12 || src.zone_start != src.zone_end) {
+			same_output = false;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	elapsed = (double)(t1.tv_sec - t0.tv_sec) +
+		  1e-9 * (double)(t1.tv_nsec - t0.tv_nsec);
+	printf("Parsed %d messages in place in %.3f s: %.2f million messages/s\n",
+			nmsgs * nrounds, elapsed,
+			1e-6 * nmsgs * nrounds / elapsed);
+	free(scratch.data);
+	if (!same_output || memcmp(words, dest, (size_t)nmsgs * 12)) {
+		printf("In-place parsing output differs from copied output\n");
+		same_output = false;
+	}
+
+	for (int i = 0; i < nobjs; i++) {
+		tracker_remove(&g.tracker, &objs[i]);
+	}
+	cleanup_message_tracker(&g.tracker);
+	cleanup_translation_map(&g.map);
+	free(objs);
+	free(words);
+	free(dest);
+	return same_output ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* from protocols.c */
+extern const struct wp_interface intf_wl_surface;
+extern const struct wp_interface intf_wl_pointer;
+extern const struct wp_interface intf_xdg_toplevel;
+
+static int put_title(uint32_t *w, uint32_t obj, const char *title)
+{
+	uint32_t len = (uint32_t)strlen(title) + 1;
+	int words = 3 + (int)((len + 3) / 4);
+	w[0] = obj;
+	w[1] = message_header_2(4 * (uint32_t)words, 2);
+	w[2] = len;
+	memset(&w[3], 0, 4 * (size_t)(words - 3));
+	memcpy(&w[3], title, len);
+	return words;
+}
+
+/* Measure parsing speed for the kind of message mix that a chatty client
+ * produces: pointer motion, frame callbacks, and damage/commit cycles, as
+ * seen on the display side */
+static int run_mix_benchmark(void)
+{
+	struct globals g;
+	memset(&g, 0, sizeof(g));
+	struct main_config config = {.title_prefix = NULL};
+	g.config = &config;
+	setup_translation_map(&g.map, true);
+	if (init_message_tracker(&g.tracker) == -1) {
+		return EXIT_FAILURE;
+	}
+	const uint32_t surface = 3, pointer = 4, toplevel = 5;
+	struct wp_object *surf_obj = create_wp_object(surface, &intf_wl_surface);
+	struct wp_object *ptr_obj = create_wp_object(pointer, &intf_wl_pointer);
+	struct wp_object *top_obj =
+			create_wp_object(toplevel, &intf_xdg_toplevel);
+	if (!surf_obj || !ptr_obj || !top_obj ||
+			tracker_insert(&g.tracker, surf_obj) == -1 ||
+			tracker_insert(&g.tracker, ptr_obj) == -1 ||
+			tracker_insert(&g.tracker, top_obj) == -1) {
+		return EXIT_FAILURE;
+	}
+
+	const int nframes = 256;
+	const int nrounds = 2048;
+	const int motions_per_frame = 6;
+	size_t space = (size_t)nframes * 128;
+	uint32_t *reqs = calloc(space, sizeof(uint32_t));
+	uint32_t *evts = calloc(space, sizeof(uint32_t));
+	char *dest = calloc(space, sizeof(uint32_t));
+	if (!reqs || !evts || !dest) {
+		free(reqs);
+		free(evts);
+		free(dest);
+		return EXIT_FAILURE;
+	}
+	int nreq = 0, nevt = 0, msgs_per_round = 0;
+	for (int f = 0; f < nframes; f++) {
+		uint32_t callback = 100 + (uint32_t)f;
+		/* wl_surface.frame, damage_buffer, commit */
+		uint32_t *w = &reqs[nreq];
+		w[0] = surface;
+		w[1] = message_header_2(12, 3);
+		w[2] = callback;
+		w[3] = surface;
+		w[4] = message_header_2(24, 9);
+		w[5] = (uint32_t)(f % 64);
+		w[6] = 0;
+		w[7] = 64;
+		w[8] = 64;
+		w[9] = surface;
+		w[10] = message_header_2(8, 6);
+		nreq += 11;
+		msgs_per_round += 3;
+		if (f % 16 == 0) {
+			nreq += put_title(&reqs[nreq], toplevel, "~/src: make -j8");
+			msgs_per_round++;
+		}
+
+		/* wl_pointer.motion, wl_pointer.frame */
+		for (int m = 0; m < motions_per_frame; m++) {
+			w = &evts[nevt];
+			w[0] = pointer;
+			w[1] = message_header_2(20, 2);
+			w[2] = (uint32_t)(f * motions_per_frame + m);
+			w[3] = (uint32_t)(f * 256);
+			w[4] = (uint32_t)(m * 256);
+			w[5] = pointer;
+			w[6] = message_header_2(8, 5);
+			nevt += 7;
+			msgs_per_round += 2;
+		}
+		/* wl_callback.done, then wl_display.delete_id */
+		w = &evts[nevt];
+		w[0] = callback;
+		w[1] = message_header_2(12, 0);
+		w[2] = (uint32_t)f;
+		w[3] = 1;
+		w[4] = message_header_2(12, 1);
+		w[5] = callback;
+		nevt += 6;
+		msgs_per_round += 2;
+	}
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	bool complete = true;
+	for (int r = 0; r < nrounds; r++) {
+		uint32_t *streams[2] = {reqs, evts};
+		int lengths[2] = {nreq * 4, nevt * 4};
+		for (int k = 0; k < 2; k++) {
+			struct char_window src = {.data = (char *)streams[k],
+					.size = lengths[k],
+					.zone_start = 0,
+					.zone_end = lengths[k]};
+			struct char_window dst = {.data = dest,
+					.size = (int)(space * sizeof(uint32_t)),
+					.zone_start = 0,
+					.zone_end = 0};
+			struct int_window fds = {.data = NULL,
+					.size = 0,
+					.zone_start = 0,
+					.zone_end = 0};
+			parse_and_prune_messages(
+					&g, true, k == 0, &src, &dst, &fds);
+			complete &= dst.zone_end == lengths[k];
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double elapsed = (double)(t1.tv_sec - t0.tv_sec) +
+			 1e-9 * (double)(t1.tv_nsec - t0.tv_nsec);
+	printf("Parsed %d messages of a client mix in %.3f s: %.2f million messages/s\n",
+			msgs_per_round * nrounds, elapsed,
+			1e-6 * msgs_per_round * nrounds / elapsed);
+	if (!complete) {
+		printf("Client mix messages were unexpectedly dropped or edited\n");
+	}
+
+	cleanup_message_tracker(&g.tracker);
+	cleanup_translation_map(&g.map);
+	free(reqs);
+	free(evts);
+	free(dest);
+	return complete ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 log_handler_func_t log_funcs[2] = {test_log_handler, test_log_handler};
 int main(int argc, char **argv)
 {
-	(void)argc;
-	(void)argv;
+	if (argc > 1 && !strcmp(argv[1], "--bench")) {
+		int ret = run_parse_benchmark();
+		if (run_mix_benchmark() != EXIT_SUCCESS) {
+			ret = EXIT_FAILURE;
+		}
+		return ret;
+	}
 
 	struct message_tracker mt;
 	init_message_tracker(&mt);